@@ -0,0 +1,276 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+/**
+ * NOTES: benchmark of libpsp, checking the generated payloads of a pilot in
+ * batches using psp_verify_many(). Reports throughput, the duplicates found
+ * within the batches and the verdict cache statistics of the context, and
+ * checks that exactly the valid payloads are accepted. With -f, the pilot is
+ * written to a temporary file and given by path, after loading it once using
+ * psp_load_pilot() like an event-loop host would. With -W and -B the
+ * throughput is recorded in or compared with a baseline file, see
+ * psp_bench_baseline.h.
+ * Usage: lib_bench [options] */
+
+/* needed for clock_gettime */
+#define _XOPEN_SOURCE	600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "psp.h"
+#include "lcmaps_pilot_sub_proxy_pem.h"
+#include "psp_bench_gen.h"
+#include "psp_bench_baseline.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+#define DEFAULT_ITERATIONS  20000
+#define DEFAULT_PAYLOADS    100
+#define DEFAULT_DEPTH	    1
+#define DEFAULT_BATCH	    256
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Writes the PEM data pem to a new temporary file, its path going into path.
+ * \return 0 on success, -1 on error */
+static int write_pilot(const char *pem, char *path);
+
+/* Callback of psp_load_pilot(), setting the int arg to 1 on success, -1
+ * otherwise */
+static void loaded(void *arg, psp_status_t status, STACK_OF(X509) *chain);
+
+/* Prints the usage */
+static void usage(const char *prog);
+
+
+/************************************************************************
+ * Main
+ ************************************************************************/
+
+int main(int argc, char *argv[])    {
+    psp_bench_key_t key_type=PSP_BENCH_RSA2048;
+    psp_bench_pilot_t pilot;
+    psp_config_t cfg;
+    psp_ctx_t *ctx=NULL;
+    psp_stats_t stats;
+    psp_pair_t *pairs=NULL;
+    psp_result_t *results=NULL;
+    STACK_OF(X509) *pilot_chain=NULL;
+    long iterations=DEFAULT_ITERATIONS, done, i, idx, mismatches=0;
+    int depth=DEFAULT_DEPTH, npayloads=DEFAULT_PAYLOADS, batch=DEFAULT_BATCH;
+    char pilot_path[]="/tmp/lib_bench.XXXXXX";
+    int opt, n, use_file=0, have_file=0, load_done=0, write_baseline=0, rc=1;
+    double invalid=0.0, elapsed, tolerance=PSP_BENCH_TOLERANCE;
+    const char *baseline=NULL;
+    char metric[128];
+    struct timespec start, end, pause={0, 1000000};
+
+    memset(&pilot, 0, sizeof(pilot));
+    psp_config_init(&cfg);
+    while ( (opt=getopt(argc, argv, "k:d:i:u:n:b:t:fB:W:T:h"))!=-1 )    {
+	switch (opt)	{
+	    case 'k':
+		if (psp_bench_key_type(optarg, &key_type))  {
+		    usage(argv[0]);
+		    return 1;
+		}
+		break;
+	    case 'd': depth=atoi(optarg); break;
+	    case 'i': invalid=atof(optarg); break;
+	    case 'u': npayloads=atoi(optarg); break;
+	    case 'n': iterations=atol(optarg); break;
+	    case 'b': batch=atoi(optarg); break;
+	    case 't': cfg.nthreads=atoi(optarg); break;
+	    case 'f': use_file=1; break;
+	    case 'B': baseline=optarg; write_baseline=0; break;
+	    case 'W': baseline=optarg; write_baseline=1; break;
+	    case 'T': tolerance=atof(optarg); break;
+	    default:
+		usage(argv[0]);
+		return opt=='h' ? 0 : 1;
+	}
+    }
+    if (depth<1 || invalid<0.0 || invalid>1.0 || npayloads<1 ||
+	iterations<1 || batch<1 || cfg.nthreads<1)	{
+	usage(argv[0]);
+	return 1;
+    }
+
+    /* Generate the proxies, the pilot is parsed once like a gateway would */
+    if (psp_bench_gen_pilot(&pilot, key_type, depth, npayloads, invalid) ||
+	psp_pem_to_chain(pilot.proxy_pem, strlen(pilot.proxy_pem),
+			 &pilot_chain))	{
+	fprintf(stderr, "Cannot generate proxies\n");
+	goto end;
+    }
+    if ( (ctx=psp_ctx_new(&cfg))==NULL )    {
+	fprintf(stderr, "Cannot create context\n");
+	goto end;
+    }
+    if ( (pairs=calloc((size_t)batch, sizeof(psp_pair_t)))==NULL ||
+	 (results=calloc((size_t)batch, sizeof(psp_result_t)))==NULL )
+	goto end;
+
+    /* Load the pilot file without blocking, waiting here for the callback */
+    if (use_file)   {
+	if (write_pilot(pilot.proxy_pem, pilot_path))	{
+	    fprintf(stderr, "Cannot write pilot proxy\n");
+	    goto end;
+	}
+	have_file=1;
+	if (psp_load_pilot(ctx, pilot_path, loaded, &load_done)<0)
+	    goto end;
+	while (__atomic_load_n(&load_done, __ATOMIC_ACQUIRE)==0)
+	    nanosleep(&pause, NULL);
+	if (load_done<0)    {
+	    fprintf(stderr, "Cannot load pilot proxy\n");
+	    goto end;
+	}
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (done=0; done<iterations; done+=n)  {
+	n=(iterations-done<batch ? (int)(iterations-done) : batch);
+	for (i=0; i<n; i++) {
+	    idx=(done+i)%pilot.npayloads;
+	    pairs[i].payload_pem=pilot.payload_pem[idx];
+	    pairs[i].payload_pem_len=strlen(pilot.payload_pem[idx]);
+	    if (use_file)
+		pairs[i].pilot_path=pilot_path;
+	    else
+		pairs[i].pilot_chain=pilot_chain;
+	}
+	psp_verify_many(ctx, pairs, (size_t)n, results);
+	for (i=0; i<n; i++) {
+	    idx=(done+i)%pilot.npayloads;
+	    if ((results[i].status==PSP_OK)!=(pilot.payload_valid[idx]!=0))
+		mismatches++;
+	    psp_result_cleanup(&(results[i]));
+	}
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed=(double)(end.tv_sec-start.tv_sec) +
+	    (double)(end.tv_nsec-start.tv_nsec)/1e9;
+    psp_ctx_stats(ctx, &stats);
+
+    printf("%-8s %5s %7s %8s %6s %7s %10s %9s %9s %9s %6s %10s\n",
+	   "key", "depth", "invalid", "pairs", "batch", "threads", "pairs/s",
+	   "dups", "hits", "misses", "loads", "mismatches");
+    printf("%-8s %5d %7.2f %8ld %6d %7d %10.0f %9lu %9lu %9lu %6lu %10ld\n",
+	   psp_bench_key_name(key_type), depth, invalid, iterations, batch,
+	   cfg.nthreads, (double)iterations/elapsed, stats.batch_duplicates,
+	   stats.verdict_cache_hit, stats.verdict_cache_miss, stats.pilot_loads,
+	   mismatches);
+
+    rc=(mismatches==0 ? 0 : 1);
+
+    /* Record or compare with the baseline */
+    if (baseline)	{
+	snprintf(metric, sizeof(metric),
+		 "lib %s depth=%d invalid=%.2f batch=%d threads=%d%s pairs/s",
+		 psp_bench_key_name(key_type), depth, invalid, batch,
+		 cfg.nthreads, use_file ? " file" : "");
+	if (psp_bench_baseline(baseline, write_baseline, metric,
+			       (double)iterations/elapsed, 1, tolerance)!=0)
+	    rc=1;
+    }
+
+end:
+    psp_ctx_free(ctx);
+    if (have_file)
+	unlink(pilot_path);
+    free(pairs);
+    free(results);
+    sk_X509_pop_free(pilot_chain, X509_free);
+    psp_bench_pilot_free(&pilot);
+
+    return rc;
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Writes the PEM data pem to a new temporary file, only readable by the user,
+ * its path going into path, which is a mkstemp() template.
+ * \return 0 on success, -1 on error
+ */
+static int write_pilot(const char *pem, char *path)	{
+    size_t len=strlen(pem);
+    int fd;
+
+    if ( (fd=mkstemp(path))==-1 )
+	return -1;
+    if (write(fd, pem, len)!=(ssize_t)len)	{
+	close(fd);
+	unlink(path);
+	return -1;
+    }
+
+    return close(fd);
+}
+
+/**
+ * Callback of psp_load_pilot(), setting the int arg to 1 on success, -1
+ * otherwise
+ */
+static void loaded(void *arg, psp_status_t status, STACK_OF(X509) *chain)  {
+    sk_X509_pop_free(chain, X509_free);
+    __atomic_store_n((int *)arg, status==PSP_OK ? 1 : -1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Prints the usage
+ */
+static void usage(const char *prog)	{
+    fprintf(stderr,
+	"Usage: %s [options]\n"
+	"  -k type      key type: rsa1024, rsa2048 (default), rsa4096, ec256,\n"
+	"               ed25519\n"
+	"  -d depth     number of proxies in the pilot chain (default %d)\n"
+	"  -i fraction  fraction of invalid payloads (default 0)\n"
+	"  -u n         number of different payloads (default %d)\n"
+	"  -n pairs     number of pairs to check (default %d)\n"
+	"  -b n         pairs per psp_verify_many() call (default %d)\n"
+	"  -t threads   threads of the context (default 1)\n"
+	"  -f           give the pilot as file, see psp_load_pilot()\n"
+	"  -B file      compare with the baseline in file, failing on a regression\n"
+	"  -W file      record the results as baseline in file\n"
+	"  -T percent   tolerance of the baseline comparison (default %.0f)\n",
+	prog, DEFAULT_DEPTH, DEFAULT_PAYLOADS, DEFAULT_ITERATIONS,
+	DEFAULT_BATCH, PSP_BENCH_TOLERANCE);
+}
@@ -0,0 +1,211 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+/**
+ * NOTES: micro-benchmark of the conversion of pilot proxy files into a chain,
+ * comparing PEM_X509_INFO_read_bio(), as was used before, with the
+ * certificate-only scanner psp_pem_to_chain().
+ * Usage: pem_bench [iterations] */
+
+/* needed for clock_gettime */
+#define _XOPEN_SOURCE	600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+
+#include "lcmaps_pilot_sub_proxy_pem.h"
+#include "psp_bench_gen.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+#define DEFAULT_ITERATIONS  2000
+#define KEY_BITS	    2048
+#define MIN_CERTS	    3
+#define MAX_CERTS	    5
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Converts pem using PEM_X509_INFO_read_bio(), which also decodes the key.
+ * \return 0 on success or -1 on error */
+static int info_to_chain(const char *pem, STACK_OF(X509) **certstack);
+
+/* Converts pem using psp_pem_to_chain().
+ * \return 0 on success or -1 on error */
+static int scan_to_chain(const char *pem, STACK_OF(X509) **certstack);
+
+/* Runs conv iterations times on pem.
+ * \return nanoseconds per conversion or -1.0 on error */
+static double time_conv(int (*conv)(const char *, STACK_OF(X509) **),
+			const char *pem, long iterations);
+
+/* Checks both conversions produce the same chain.
+ * \return 0 when they do, -1 otherwise */
+static int compare_conv(const char *pem);
+
+
+/************************************************************************
+ * Main
+ ************************************************************************/
+
+int main(int argc, char *argv[])    {
+    long iterations=DEFAULT_ITERATIONS;
+    double t_info, t_scan;
+    char *pem;
+    int ncerts, rc=0;
+
+    if (argc>1 && (iterations=strtol(argv[1], NULL, 10))<=0)	{
+	fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+	return 1;
+    }
+
+    printf("%-6s %8s %14s %14s %8s\n",
+	   "certs", "bytes", "X509_INFO ns", "scanner ns", "speedup");
+    for (ncerts=MIN_CERTS; ncerts<=MAX_CERTS; ncerts++)	{
+	if ( (pem=psp_bench_gen_proxy(ncerts, KEY_BITS))==NULL )	{
+	    fprintf(stderr, "Cannot generate proxy of %d certs\n", ncerts);
+	    return 1;
+	}
+	if (compare_conv(pem)!=0)   {
+	    fprintf(stderr, "Conversions differ for %d certs\n", ncerts);
+	    free(pem);
+	    return 1;
+	}
+	t_info=time_conv(info_to_chain, pem, iterations);
+	t_scan=time_conv(scan_to_chain, pem, iterations);
+	if (t_info<0.0 || t_scan<0.0)
+	    rc=1;
+	else
+	    printf("%-6d %8lu %14.0f %14.0f %7.2fx\n", ncerts,
+		   (unsigned long)strlen(pem), t_info, t_scan, t_info/t_scan);
+	free(pem);
+    }
+
+    return rc;
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Converts pem using PEM_X509_INFO_read_bio(), which also decodes the key.
+ * \return 0 on success or -1 on error
+ */
+static int info_to_chain(const char *pem, STACK_OF(X509) **certstack)	{
+    STACK_OF(X509) *mystack;
+    STACK_OF(X509_INFO) *sk;
+    X509_INFO *xi;
+    BIO *bio;
+
+    if ( (mystack=sk_X509_new_null())==NULL )
+	return -1;
+    if ( (bio=BIO_new_mem_buf((void *)pem, -1))==NULL )   {
+	sk_X509_free(mystack);
+	return -1;
+    }
+    sk=PEM_X509_INFO_read_bio(bio, NULL, NULL, NULL);
+    BIO_free(bio);
+    if (sk==NULL)   {
+	sk_X509_free(mystack);
+	return -1;
+    }
+    while (sk_X509_INFO_num(sk))    {
+	xi=sk_X509_INFO_shift(sk);
+	if (xi->x509 != NULL)	{
+	    sk_X509_push(mystack, xi->x509);
+	    xi->x509=NULL;
+	}
+	X509_INFO_free(xi);
+    }
+    sk_X509_INFO_free(sk);
+
+    *certstack=mystack;
+    return 0;
+}
+
+/**
+ * Converts pem using psp_pem_to_chain().
+ * \return 0 on success or -1 on error
+ */
+static int scan_to_chain(const char *pem, STACK_OF(X509) **certstack)	{
+    return psp_pem_to_chain(pem, strlen(pem), certstack)==0 ? 0 : -1;
+}
+
+/**
+ * Runs conv iterations times on pem.
+ * \return nanoseconds per conversion or -1.0 on error
+ */
+static double time_conv(int (*conv)(const char *, STACK_OF(X509) **),
+			const char *pem, long iterations)	{
+    struct timespec start, end;
+    STACK_OF(X509) *chain;
+    long i;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &start)==-1)
+	return -1.0;
+    for (i=0; i<iterations; i++)    {
+	if (conv(pem, &chain)!=0)
+	    return -1.0;
+	sk_X509_pop_free(chain, X509_free);
+    }
+    if (clock_gettime(CLOCK_MONOTONIC, &end)==-1)
+	return -1.0;
+
+    return ((double)(end.tv_sec-start.tv_sec)*1e9 +
+	    (double)(end.tv_nsec-start.tv_nsec)) / (double)iterations;
+}
+
+/**
+ * Checks both conversions produce the same chain.
+ * \return 0 when they do, -1 otherwise
+ */
+static int compare_conv(const char *pem)    {
+    STACK_OF(X509) *c1=NULL, *c2=NULL;
+    int i, rc=-1;
+
+    if (info_to_chain(pem, &c1)==0 && scan_to_chain(pem, &c2)==0 &&
+	sk_X509_num(c1)==sk_X509_num(c2))   {
+	rc=0;
+	for (i=0; i<sk_X509_num(c1); i++)
+	    if (X509_cmp(sk_X509_value(c1, i), sk_X509_value(c2, i))!=0)
+		rc=-1;
+    }
+    sk_X509_pop_free(c1, X509_free);
+    sk_X509_pop_free(c2, X509_free);
+
+    return rc;
+}
@@ -0,0 +1,441 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+
+/**
+ * NOTES: benchmark of the complete plugin, loaded like LCMAPS does using
+ * dlopen(), on top of the stub LCMAPS framework in psp_bench_stub.c. The
+ * pilot and payload proxies are generated in-process, see usage() for the
+ * parameters. Reports throughput, median and 99th percentile latency and the
+ * number of memory allocations per call, and checks that exactly the valid
+ * payloads are accepted. With -W the throughput and allocations are recorded
+ * in a baseline file, with -B they are compared with it, see
+ * psp_bench_baseline.h.
+ * Usage: plugin_bench [options] [-- plugin arguments] */
+
+/* needed for clock_gettime, mkstemp and setenv */
+#define _XOPEN_SOURCE	600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <syslog.h>
+
+#include "psp_bench_gen.h"
+#include "psp_bench_stub.h"
+#include "psp_bench_baseline.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+#define DEFAULT_PLUGIN	    "../src/.libs/liblcmaps_pilot_sub_proxy.so"
+#define DEFAULT_ITERATIONS  20000
+#define DEFAULT_PAYLOADS    100
+#define DEFAULT_DEPTH	    1
+#define DEFAULT_FQANS	    2
+#define MAX_THREADS	    64
+#define MAX_PLUGIN_ARGS	    64
+
+/** Return value of the plugin functions on success (LCMAPS_MOD_SUCCESS) */
+#define MOD_SUCCESS	    0
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+typedef int (*init_fn_t)(int argc, char **argv);
+typedef int (*introspect_fn_t)(int *argc, psp_bench_argument_t **argv);
+typedef int (*run_fn_t)(int argc, psp_bench_argument_t *argv);
+typedef int (*term_fn_t)(void);
+
+/** Work and results of one benchmark thread */
+typedef struct bench_thread_s	{
+    long first;			/* index of first call */
+    long ncalls;		/* number of calls */
+    long *latencies;		/* latency of each call in ns */
+    long mismatches;		/* calls with an unexpected result */
+} bench_thread_t;
+
+
+/************************************************************************
+ * Global variables
+ ************************************************************************/
+
+static run_fn_t plugin_run;
+static psp_bench_argument_t *arg_list;
+static int arg_count;
+static psp_bench_pilot_t pilot;
+static int nfqans;
+static char **fqans;
+static char *user_dn="/O=Bench/CN=Bench Pilot";
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Prints the usage */
+static void usage(const char *prog);
+
+/* Creates the FQAN list of n FQANs, the first being the pilot role.
+ * \return 0 on success, -1 on error */
+static int make_fqans(int n);
+
+/* Writes pem into a new temporary file readable only by the owner.
+ * \return malloc-ed path of the file or NULL on error */
+static char *write_proxy(const char *pem);
+
+/* Runs the plugin for the calls of the bench_thread_t arg */
+static void *run_calls(void *arg);
+
+/* Compares two latencies for qsort() */
+static int cmp_long(const void *a, const void *b);
+
+
+/************************************************************************
+ * Main
+ ************************************************************************/
+
+int main(int argc, char *argv[])    {
+    const char *plugin_path=DEFAULT_PLUGIN;
+    char *plugin_argv[MAX_PLUGIN_ARGS+2];
+    psp_bench_key_t key_type=PSP_BENCH_RSA2048;
+    long iterations=DEFAULT_ITERATIONS, i, allocs, mismatches=0, *all=NULL;
+    int depth=DEFAULT_DEPTH, npayloads=DEFAULT_PAYLOADS, nthreads=1;
+    int plugin_argc=1, opt, write_baseline=0, rc=1;
+    double invalid=0.0, elapsed, tolerance=PSP_BENCH_TOLERANCE;
+    const char *baseline=NULL;
+    char params[128], metric[160];
+    char *proxy_path=NULL;
+    void *handle=NULL;
+    init_fn_t plugin_initialize;
+    introspect_fn_t plugin_introspect;
+    term_fn_t plugin_terminate=NULL;
+    bench_thread_t threads[MAX_THREADS];
+    pthread_t tids[MAX_THREADS];
+    struct timespec start, end;
+
+    nfqans=DEFAULT_FQANS;
+    while ( (opt=getopt(argc, argv, "p:k:d:f:i:u:n:t:B:W:T:vh"))!=-1 )    {
+	switch (opt)	{
+	    case 'p': plugin_path=optarg; break;
+	    case 'k':
+		if (psp_bench_key_type(optarg, &key_type))  {
+		    usage(argv[0]);
+		    return 1;
+		}
+		break;
+	    case 'd': depth=atoi(optarg); break;
+	    case 'f': nfqans=atoi(optarg); break;
+	    case 'i': invalid=atof(optarg); break;
+	    case 'u': npayloads=atoi(optarg); break;
+	    case 'n': iterations=atol(optarg); break;
+	    case 't': nthreads=atoi(optarg); break;
+	    case 'B': baseline=optarg; write_baseline=0; break;
+	    case 'W': baseline=optarg; write_baseline=1; break;
+	    case 'T': tolerance=atof(optarg); break;
+	    case 'v': psp_bench_set_log_level(LOG_DEBUG); break;
+	    default:
+		usage(argv[0]);
+		return opt=='h' ? 0 : 1;
+	}
+    }
+    if (depth<1 || nfqans<0 || invalid<0.0 || invalid>1.0 || npayloads<1 ||
+	iterations<1 || nthreads<1 || nthreads>MAX_THREADS ||
+	argc-optind>MAX_PLUGIN_ARGS)    {
+	usage(argv[0]);
+	return 1;
+    }
+
+    /* Plugin arguments, argv[0] being the plugin name as for LCMAPS */
+    plugin_argv[0]="lcmaps_pilot_sub_proxy.mod";
+    while (optind<argc)
+	plugin_argv[plugin_argc++]=argv[optind++];
+    plugin_argv[plugin_argc]=NULL;
+
+    /* Generate the proxies and put the pilot in place */
+    if (psp_bench_gen_pilot(&pilot, key_type, depth, npayloads, invalid) ||
+	make_fqans(nfqans))	{
+	fprintf(stderr, "Cannot generate proxies\n");
+	goto end;
+    }
+    if ( (proxy_path=write_proxy(pilot.proxy_pem))==NULL ||
+	 setenv("X509_USER_PROXY", proxy_path, 1)!=0 )
+	goto end;
+
+    /* Load the plugin like LCMAPS does */
+    if ( (handle=dlopen(plugin_path, RTLD_NOW | RTLD_LOCAL))==NULL ) {
+	fprintf(stderr, "Cannot load plugin: %s\n", dlerror());
+	goto end;
+    }
+    plugin_initialize=(init_fn_t)dlsym(handle, "plugin_initialize");
+    plugin_introspect=(introspect_fn_t)dlsym(handle, "plugin_introspect");
+    plugin_run=(run_fn_t)dlsym(handle, "plugin_run");
+    plugin_terminate=(term_fn_t)dlsym(handle, "plugin_terminate");
+    if (!plugin_initialize || !plugin_introspect || !plugin_run ||
+	!plugin_terminate)  {
+	fprintf(stderr, "Plugin lacks the plugin functions\n");
+	plugin_terminate=NULL;
+	goto end;
+    }
+    if (plugin_initialize(plugin_argc, plugin_argv)!=MOD_SUCCESS ||
+	plugin_introspect(&arg_count, &arg_list)!=MOD_SUCCESS)	{
+	fprintf(stderr, "Cannot initialize plugin\n");
+	goto end;
+    }
+
+    /* Divide the calls over the threads */
+    for (i=0; i<nthreads; i++)	{
+	threads[i].first=iterations*i/nthreads;
+	threads[i].ncalls=iterations*(i+1)/nthreads-threads[i].first;
+	threads[i].mismatches=0;
+    }
+    if ( (all=malloc((size_t)iterations*sizeof(long)))==NULL )
+	goto end;
+    for (i=0; i<nthreads; i++)
+	threads[i].latencies=all+threads[i].first;
+
+    allocs=psp_bench_allocs();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (nthreads==1)
+	run_calls(&(threads[0]));
+    else    {
+	for (i=0; i<nthreads; i++)
+	    if (pthread_create(&(tids[i]), NULL, run_calls, &(threads[i])))  {
+		fprintf(stderr, "Cannot create thread\n");
+		exit(1);
+	    }
+	for (i=0; i<nthreads; i++)
+	    pthread_join(tids[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (allocs>=0)
+	allocs=psp_bench_allocs()-allocs;
+    elapsed=(double)(end.tv_sec-start.tv_sec) +
+	    (double)(end.tv_nsec-start.tv_nsec)/1e9;
+
+    for (i=0; i<nthreads; i++)
+	mismatches+=threads[i].mismatches;
+    qsort(all, (size_t)iterations, sizeof(long), cmp_long);
+
+    printf("%-8s %5s %5s %7s %8s %7s %10s %9s %9s %11s %10s\n",
+	   "key", "depth", "fqans", "invalid", "calls", "threads", "calls/s",
+	   "p50 us", "p99 us", "allocs/call", "mismatches");
+    printf("%-8s %5d %5d %7.2f %8ld %7d %10.0f %9.1f %9.1f ",
+	   psp_bench_key_name(key_type), depth, nfqans, invalid, iterations,
+	   nthreads, (double)iterations/elapsed,
+	   (double)all[iterations/2]/1e3,
+	   (double)all[(iterations*99)/100]/1e3);
+    if (allocs>=0)
+	printf("%11.1f", (double)allocs/(double)iterations);
+    else
+	printf("%11s", "n/a");
+    printf(" %10ld\n", mismatches);
+
+    rc=(mismatches==0 ? 0 : 1);
+
+    /* Record or compare with the baseline */
+    if (baseline)	{
+	snprintf(params, sizeof(params),
+		 "plugin %s depth=%d fqans=%d invalid=%.2f threads=%d",
+		 psp_bench_key_name(key_type), depth, nfqans, invalid, nthreads);
+	snprintf(metric, sizeof(metric), "%s calls/s", params);
+	if (psp_bench_baseline(baseline, write_baseline, metric,
+			       (double)iterations/elapsed, 1, tolerance)!=0)
+	    rc=1;
+	if (allocs>=0)	{
+	    snprintf(metric, sizeof(metric), "%s allocs/call", params);
+	    if (psp_bench_baseline(baseline, write_baseline, metric,
+				   (double)allocs/(double)iterations, 0,
+				   tolerance)!=0)
+		rc=1;
+	}
+    }
+
+end:
+    if (plugin_terminate)
+	plugin_terminate();
+    if (handle)
+	dlclose(handle);
+    if (proxy_path)
+	unlink(proxy_path);
+    free(proxy_path);
+    free(all);
+    if (fqans)	{
+	for (i=0; i<nfqans; i++)
+	    free(fqans[i]);
+	free(fqans);
+    }
+    psp_bench_pilot_free(&pilot);
+
+    return rc;
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Prints the usage
+ */
+static void usage(const char *prog)	{
+    fprintf(stderr,
+	"Usage: %s [options] [-- plugin arguments]\n"
+	"  -p plugin    plugin to load (default %s)\n"
+	"  -k type      key type: rsa1024, rsa2048 (default), rsa4096, ec256,\n"
+	"               ed25519\n"
+	"  -d depth     number of proxies in the pilot chain (default %d)\n"
+	"  -f n         number of FQANs (default %d)\n"
+	"  -i fraction  fraction of invalid payloads (default 0)\n"
+	"  -u n         number of different payloads (default %d)\n"
+	"  -n calls     number of plugin_run() calls (default %d)\n"
+	"  -t threads   number of threads calling the plugin (default 1)\n"
+	"  -B file      compare with the baseline in file, failing on a regression\n"
+	"  -W file      record the results as baseline in file\n"
+	"  -T percent   tolerance of the baseline comparison (default %.0f)\n"
+	"  -v           show the plugin log messages\n",
+	prog, DEFAULT_PLUGIN, DEFAULT_DEPTH, DEFAULT_FQANS, DEFAULT_PAYLOADS,
+	DEFAULT_ITERATIONS, PSP_BENCH_TOLERANCE);
+}
+
+/**
+ * Creates the FQAN list of n FQANs, the first being the pilot role.
+ * \return 0 on success, -1 on error
+ */
+static int make_fqans(int n)	{
+    char buf[64];
+    int i;
+
+    if (n==0)
+	return 0;
+    if ( (fqans=calloc((size_t)n, sizeof(char *)))==NULL )
+	return -1;
+    for (i=0; i<n; i++)	{
+	if (i==0)
+	    snprintf(buf, sizeof(buf), "/bench/Role=pilot/Capability=NULL");
+	else
+	    snprintf(buf, sizeof(buf), "/bench/group%d/Role=NULL/Capability=NULL",
+		     i);
+	if ( (fqans[i]=strdup(buf))==NULL )
+	    return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes pem into a new temporary file readable only by the owner.
+ * \return malloc-ed path of the file or NULL on error
+ */
+static char *write_proxy(const char *pem)   {
+    const char *tmpdir=getenv("TMPDIR");
+    size_t len=strlen(pem);
+    char *path;
+    int fd;
+
+    if (tmpdir==NULL || tmpdir[0]=='\0')
+	tmpdir="/tmp";
+    if ( (path=malloc(strlen(tmpdir)+sizeof("/psp_bench.XXXXXX")))==NULL )
+	return NULL;
+    sprintf(path, "%s/psp_bench.XXXXXX", tmpdir);
+
+    /* mkstemp() creates the file with mode 0600 */
+    if ( (fd=mkstemp(path))<0 )	{
+	fprintf(stderr, "Cannot create %s\n", path);
+	free(path);
+	return NULL;
+    }
+    if (write(fd, pem, len)!=(ssize_t)len || close(fd)!=0)  {
+	fprintf(stderr, "Cannot write %s\n", path);
+	unlink(path);
+	free(path);
+	return NULL;
+    }
+
+    return path;
+}
+
+/**
+ * Runs the plugin for the calls of the bench_thread_t arg, each with its own
+ * copy of the introspected argument list
+ */
+static void *run_calls(void *arg)   {
+    bench_thread_t *thread=(bench_thread_t *)arg;
+    psp_bench_argument_t args[16];
+    struct timespec start, end;
+    void *chain=NULL;
+    char *pem=NULL;
+    long i, idx;
+    int j, n=(arg_count<16 ? arg_count : 16), rc;
+
+    /* Point the arguments to the request data */
+    for (j=0; j<n; j++)	{
+	args[j]=arg_list[j];
+	if (strcmp(args[j].argName, "user_dn")==0)
+	    args[j].value=&user_dn;
+	else if (strcmp(args[j].argName, "nfqan")==0)
+	    args[j].value=&nfqans;
+	else if (strcmp(args[j].argName, "fqan_list")==0)
+	    args[j].value=&fqans;
+	else if (strcmp(args[j].argName, "px509_chain")==0)
+	    args[j].value=&chain;
+	else if (strcmp(args[j].argName, "pem_string")==0)
+	    args[j].value=&pem;
+	else
+	    args[j].value=NULL;
+    }
+
+    for (i=0; i<thread->ncalls; i++)	{
+	idx=(thread->first+i)%pilot.npayloads;
+	pem=pilot.payload_pem[idx];
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc=plugin_run(n, args);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	thread->latencies[i]=(long)(end.tv_sec-start.tv_sec)*1000000000L +
+			     (end.tv_nsec-start.tv_nsec);
+	if ((rc==MOD_SUCCESS)!=(pilot.payload_valid[idx]!=0))
+	    thread->mismatches++;
+    }
+
+    return NULL;
+}
+
+/**
+ * Compares two latencies for qsort()
+ * \return -1, 0 or 1 when a is smaller, equal or larger than b
+ */
+static int cmp_long(const void *a, const void *b)   {
+    long la=*(const long *)a, lb=*(const long *)b;
+
+    return (la<lb ? -1 : la>lb ? 1 : 0);
+}
@@ -0,0 +1,163 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+/**
+ * NOTES: baseline files for the benchmarks, such that a run can be compared
+ * with an earlier one on the same machine. A baseline file has one metric per
+ * line: its value followed by its name, which describes the benchmark
+ * parameters, e.g. "1342 plugin rsa2048 depth=1 ... calls/s". */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "psp_bench_baseline.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/** Maximum number of metrics in a baseline file */
+#define MAX_METRICS	256
+
+/** Maximum length of a line in a baseline file */
+#define MAX_LINE	256
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+typedef struct metric_s	{
+    double value;
+    char name[MAX_LINE];
+} metric_t;
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Reads at most max metrics from path into metrics.
+ * \return number of metrics, 0 when path does not exist, -1 on error */
+static int read_metrics(const char *path, metric_t *metrics, int max);
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * With write set, records value as the baseline of the metric name in the
+ * file path, replacing an earlier value for name. Otherwise compares value
+ * with the baseline of name in path: with higher_is_better, a value more than
+ * tolerance percent below the baseline is a regression, without, a value
+ * more than tolerance percent above it. The comparison is printed. A metric
+ * missing from the baseline fails the comparison, such that a missing or
+ * outdated baseline file is noticed.
+ * \return 0 when recorded or within tolerance, 1 on a regression or without
+ * a baseline for name, -1 when path cannot be read or written
+ */
+int psp_bench_baseline(const char *path, int write, const char *name,
+		       double value, int higher_is_better, double tolerance)  {
+    static metric_t metrics[MAX_METRICS];
+    double change;
+    FILE *f;
+    int n, i, regression;
+
+    if ( (n=read_metrics(path, metrics, MAX_METRICS))<0 )	{
+	fprintf(stderr, "Cannot read baseline %s\n", path);
+	return -1;
+    }
+    for (i=0; i<n; i++)
+	if (strcmp(metrics[i].name, name)==0)
+	    break;
+
+    if (write)	{
+	if (i==n && n==MAX_METRICS) {
+	    fprintf(stderr, "Too many metrics in baseline %s\n", path);
+	    return -1;
+	}
+	if (i==n)
+	    n++;
+	metrics[i].value=value;
+	snprintf(metrics[i].name, sizeof(metrics[i].name), "%s", name);
+	if ( (f=fopen(path, "w"))==NULL )   {
+	    fprintf(stderr, "Cannot write baseline %s\n", path);
+	    return -1;
+	}
+	for (i=0; i<n; i++)
+	    fprintf(f, "%.6g %s\n", metrics[i].value, metrics[i].name);
+	return (fclose(f)==0 ? 0 : -1);
+    }
+
+    if (i==n)	{
+	printf("baseline: %s has no value for %s, see make bench-baseline\n",
+	       path, name);
+	return 1;
+    }
+    change=(metrics[i].value!=0.0 ?
+	    100.0*(value-metrics[i].value)/metrics[i].value : 0.0);
+    regression=(higher_is_better ? change < -tolerance : change > tolerance);
+    printf("baseline: %s %.6g -> %.6g (%+.1f%%)%s\n", name, metrics[i].value,
+	   value, change, regression ? " REGRESSION" : "");
+
+    return regression;
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Reads at most max metrics from path into metrics, skipping lines that are
+ * not of the form "value name".
+ * \return number of metrics, 0 when path does not exist, -1 on error
+ */
+static int read_metrics(const char *path, metric_t *metrics, int max)	{
+    char line[MAX_LINE], *end;
+    size_t len;
+    FILE *f;
+    int n=0;
+
+    if ( (f=fopen(path, "r"))==NULL )
+	return (errno==ENOENT ? 0 : -1);
+
+    while (n<max && fgets(line, sizeof(line), f))	{
+	if ( (len=strlen(line))>0 && line[len-1]=='\n' )
+	    line[--len]='\0';
+	metrics[n].value=strtod(line, &end);
+	if (end==line || *end!=' ')
+	    continue;
+	snprintf(metrics[n].name, sizeof(metrics[n].name), "%s", end+1);
+	n++;
+    }
+    fclose(f);
+
+    return n;
+}
@@ -0,0 +1,56 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+#ifndef PSP_BENCH_BASELINE_H
+#define PSP_BENCH_BASELINE_H
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/** Default tolerance in percent for psp_bench_baseline() */
+#define PSP_BENCH_TOLERANCE	20.0
+
+
+/************************************************************************
+ * Function prototypes
+ ************************************************************************/
+
+/**
+ * With write set, records value as the baseline of the metric name in the
+ * file path, replacing an earlier value for name. Otherwise compares value
+ * with the baseline of name in path: with higher_is_better, a value more than
+ * tolerance percent below the baseline is a regression, without, a value
+ * more than tolerance percent above it. The comparison is printed. A metric
+ * missing from the baseline fails the comparison, such that a missing or
+ * outdated baseline file is noticed.
+ * \return 0 when recorded or within tolerance, 1 on a regression or without
+ * a baseline for name, -1 when path cannot be read or written
+ */
+int psp_bench_baseline(const char *path, int write, const char *name,
+		       double value, int higher_is_better, double tolerance);
+
+#endif /* PSP_BENCH_BASELINE_H */
@@ -0,0 +1,446 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+/**
+ * NOTES: in-process generator of pilot-like proxy files and payload proxies,
+ * such that the benchmarks do not depend on external tools or files. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <openssl/pem.h>
+#include <openssl/conf.h>
+#include <openssl/ec.h>
+
+#include "lcmaps_pilot_sub_proxy_mint.h"
+#include "psp_bench_gen.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/** Policy language of limited proxies */
+#define LIMITED_PROXY_EXT   "critical,language:1.3.6.1.4.1.3536.1.1.1.9"
+
+/* Without Ed25519 support (before OpenSSL 1.1.1) generating such keys fails */
+#ifndef EVP_PKEY_ED25519
+#   define EVP_PKEY_ED25519 NID_undef
+#endif
+
+
+/************************************************************************
+ * Global variables
+ ************************************************************************/
+
+/** Names of the key types */
+static const char *key_names[PSP_BENCH_NKEYS] = {
+    "rsa1024", "rsa2048", "rsa4096", "ec256", "ed25519"
+};
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Generates an RSA key of given number of bits.
+ * \return key or NULL on error */
+static EVP_PKEY *gen_key(int bits);
+
+/* Generates a key of given type.
+ * \return key or NULL on error */
+static EVP_PKEY *gen_typed_key(psp_bench_key_t type);
+
+/* Creates a certificate with given subject and key, signed by issuer using
+ * issuer_key (self-signed when issuer is NULL), containing the extension nid
+ * with value ext.
+ * \return certificate or NULL on error */
+static X509 *gen_cert(X509_NAME *subject, X509 *issuer, EVP_PKEY *issuer_key,
+		      EVP_PKEY *key, long serial, int nid, const char *ext);
+
+/* Creates a name consisting of the subject of base (an empty name when base
+ * is NULL) with O=Bench when base is NULL, followed by CN=cn.
+ * \return name or NULL on error */
+static X509_NAME *gen_name(X509 *base, const char *cn);
+
+/* Converts the certificates certs[first] down to certs[last] into PEM, with
+ * the private key after the first one unless key is NULL.
+ * \return malloc-ed '\0' terminated PEM string or NULL on error */
+static char *certs_to_pem(X509 **certs, int first, int last, EVP_PKEY *key);
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * Generates a proxy file in PEM format containing ncerts certificates: the
+ * leaf proxy, its private key, the other proxies and the end-entity
+ * certificate, issued by a throw-away CA. All certificates share a single
+ * RSA key of given number of bits, since only the layout matters here.
+ * \return malloc-ed '\0' terminated PEM string or NULL on error
+ */
+char *psp_bench_gen_proxy(int ncerts, int key_bits)	{
+    EVP_PKEY *key=NULL;
+    X509 **certs=NULL;
+    X509_NAME *name=NULL;
+    char cn[32], *pem=NULL;
+    int i, ok=0;
+
+    if (ncerts<1 || (certs=calloc((size_t)ncerts+1, sizeof(X509 *)))==NULL)
+	return NULL;
+
+    if ( (key=gen_key(key_bits))==NULL )
+	goto end;
+
+    /* certs[0] is the CA, certs[1] the end-entity, the rest proxies */
+    for (i=0; i<=ncerts; i++)	{
+	if (i<2)
+	    snprintf(cn, sizeof(cn), i==0 ? "Bench CA" : "Bench User");
+	else
+	    snprintf(cn, sizeof(cn), "%d", i);
+	/* Proxies extend the subject of their issuer */
+	X509_NAME_free(name);
+	if ( (name=gen_name(i<2 ? NULL : certs[i-1], cn))==NULL )
+	    goto end;
+	certs[i]=gen_cert(name, i==0 ? NULL : certs[i-1], key, key, (long)i+1,
+			  i<2 ? NID_basic_constraints : NID_proxyCertInfo,
+			  i==0 ? "critical,CA:TRUE" :
+			  i==1 ? "critical,CA:FALSE" :
+			  "critical,language:id-ppl-inheritAll");
+	if (certs[i]==NULL)
+	    goto end;
+    }
+
+    /* Proxy file layout: leaf, key, rest of the chain without the CA */
+    ok=( (pem=certs_to_pem(certs, ncerts, 1, key))!=NULL );
+
+end:
+    for (i=0; i<=ncerts; i++)
+	X509_free(certs[i]);
+    free(certs);
+    X509_NAME_free(name);
+    EVP_PKEY_free(key);
+
+    return ok ? pem : NULL;
+}
+
+/**
+ * Parses a key type name: rsa1024, rsa2048, rsa4096, ec256 or ed25519.
+ * \return 0 on success, -1 for unknown names
+ */
+int psp_bench_key_type(const char *name, psp_bench_key_t *type)	{
+    int i;
+
+    for (i=0; i<PSP_BENCH_NKEYS; i++)	{
+	if (strcmp(name, key_names[i])==0)  {
+	    *type=(psp_bench_key_t)i;
+	    return 0;
+	}
+    }
+
+    return -1;
+}
+
+/**
+ * Obtains the name of a key type
+ * \return name, "unknown" for invalid types
+ */
+const char *psp_bench_key_name(psp_bench_key_t type)   {
+    return (type>=0 && type<PSP_BENCH_NKEYS ? key_names[type] : "unknown");
+}
+
+/**
+ * Generates a pilot proxy file consisting of depth limited proxies on top of
+ * an end-entity certificate issued by a throw-away CA, and npayloads limited
+ * payload proxies, each with its own "CN=User:..." subject. Of these, the
+ * given fraction is invalid: signed by another key than that of the pilot.
+ * All keys are of the given type, the payloads share a key.
+ * \return 0 on success, -1 on error
+ */
+int psp_bench_gen_pilot(psp_bench_pilot_t *pilot, psp_bench_key_t key_type,
+			int depth, int npayloads, double invalid_fraction)  {
+    EVP_PKEY *ca_key=NULL, *pilot_key=NULL, *payload_key=NULL, *rogue_key=NULL;
+    psp_mint_issuer_t issuer={NULL, NULL}, rogue;
+    X509 **certs=NULL;
+    X509_NAME *name=NULL;
+    char cn[32];
+    int i, n=depth+2, rc=-1;
+
+    memset(pilot, 0, sizeof(psp_bench_pilot_t));
+    if (depth<1 || npayloads<1 ||
+	(certs=calloc((size_t)n+1, sizeof(X509 *)))==NULL ||
+	(pilot->payload_pem=calloc((size_t)npayloads, sizeof(char *)))==NULL ||
+	(pilot->payload_valid=calloc((size_t)npayloads, sizeof(int)))==NULL)
+	goto end;
+    pilot->npayloads=npayloads;
+
+    if ( (ca_key=gen_typed_key(key_type))==NULL ||
+	 (pilot_key=gen_typed_key(key_type))==NULL ||
+	 (payload_key=gen_typed_key(key_type))==NULL ||
+	 (rogue_key=gen_typed_key(key_type))==NULL )
+	goto end;
+
+    /* certs[0] is the CA, certs[1] the end-entity, then the pilot proxies,
+     * all but the CA sharing the key of the pilot */
+    for (i=0; i<n; i++)	{
+	if (i<2)
+	    snprintf(cn, sizeof(cn), i==0 ? "Bench CA" : "Bench Pilot");
+	else
+	    snprintf(cn, sizeof(cn), "%d", 1000+i);
+	X509_NAME_free(name);
+	if ( (name=gen_name(i<2 ? NULL : certs[i-1], cn))==NULL ||
+	     (certs[i]=gen_cert(name, i==0 ? NULL : certs[i-1],
+				i<2 ? ca_key : pilot_key,
+				i==0 ? ca_key : pilot_key, (long)i+1,
+				i<2 ? NID_basic_constraints : NID_proxyCertInfo,
+				i==0 ? "critical,CA:TRUE" :
+				i==1 ? "critical,CA:FALSE" :
+				LIMITED_PROXY_EXT))==NULL )
+	    goto end;
+    }
+    if ( (pilot->proxy_pem=certs_to_pem(certs, n-1, 1, pilot_key))==NULL )
+	goto end;
+
+    /* Payloads, minted as on the pilot side, where the invalid ones use the
+     * pilot chain with another key. Spread the invalid ones evenly. */
+    if ( (issuer.chain=sk_X509_new_null())==NULL ||
+	 !sk_X509_push(issuer.chain, certs[n-1]) )
+	goto end;
+    issuer.key=pilot_key;
+    rogue.chain=issuer.chain;
+    rogue.key=rogue_key;
+    for (i=0; i<npayloads; i++)	{
+	pilot->payload_valid[i]=
+	    ((int)((double)(i+1)*invalid_fraction)==
+	     (int)((double)i*invalid_fraction));
+	snprintf(cn, sizeof(cn), "User:bench%d", i);
+	X509_free(certs[n]);
+	certs[n]=NULL;
+	if (psp_mint_subproxy(pilot->payload_valid[i] ? &issuer : &rogue, cn,
+			      payload_key, 86400L, &(certs[n])) ||
+	    (pilot->payload_pem[i]=certs_to_pem(certs, n, 1, NULL))==NULL )
+	    goto end;
+    }
+    rc=0;
+
+end:
+    sk_X509_free(issuer.chain);
+    if (certs)	{
+	for (i=0; i<=n; i++)
+	    X509_free(certs[i]);
+	free(certs);
+    }
+    X509_NAME_free(name);
+    EVP_PKEY_free(ca_key);
+    EVP_PKEY_free(pilot_key);
+    EVP_PKEY_free(payload_key);
+    EVP_PKEY_free(rogue_key);
+    if (rc!=0)
+	psp_bench_pilot_free(pilot);
+
+    return rc;
+}
+
+/**
+ * Frees the contents of pilot
+ */
+void psp_bench_pilot_free(psp_bench_pilot_t *pilot)	{
+    int i;
+
+    free(pilot->proxy_pem);
+    if (pilot->payload_pem)	{
+	for (i=0; i<pilot->npayloads; i++)
+	    free(pilot->payload_pem[i]);
+	free(pilot->payload_pem);
+    }
+    free(pilot->payload_valid);
+    memset(pilot, 0, sizeof(psp_bench_pilot_t));
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Generates an RSA key of given number of bits.
+ * \return key or NULL on error
+ */
+static EVP_PKEY *gen_key(int bits)  {
+    EVP_PKEY_CTX *ctx;
+    EVP_PKEY *key=NULL;
+
+    if ( (ctx=EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL))==NULL )
+	return NULL;
+    if (EVP_PKEY_keygen_init(ctx)<=0 ||
+	EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, bits)<=0 ||
+	EVP_PKEY_keygen(ctx, &key)<=0)
+	key=NULL;
+    EVP_PKEY_CTX_free(ctx);
+
+    return key;
+}
+
+/**
+ * Generates a key of given type.
+ * \return key or NULL on error
+ */
+static EVP_PKEY *gen_typed_key(psp_bench_key_t type)	{
+    EVP_PKEY_CTX *ctx;
+    EVP_PKEY *key=NULL;
+
+    switch (type)   {
+	case PSP_BENCH_RSA1024:	return gen_key(1024);
+	case PSP_BENCH_RSA2048:	return gen_key(2048);
+	case PSP_BENCH_RSA4096:	return gen_key(4096);
+	case PSP_BENCH_EC256:	break;
+	case PSP_BENCH_ED25519:	break;
+	default:		return NULL;
+    }
+
+    if ( (ctx=EVP_PKEY_CTX_new_id(type==PSP_BENCH_EC256 ? EVP_PKEY_EC
+							 : EVP_PKEY_ED25519,
+				  NULL))==NULL )
+	return NULL;
+    if (EVP_PKEY_keygen_init(ctx)<=0 ||
+	(type==PSP_BENCH_EC256 &&
+	 EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx,
+						NID_X9_62_prime256v1)<=0) ||
+	EVP_PKEY_keygen(ctx, &key)<=0)
+	key=NULL;
+    EVP_PKEY_CTX_free(ctx);
+
+    return key;
+}
+
+/**
+ * Creates a certificate with given subject and key, signed by issuer using
+ * issuer_key (self-signed when issuer is NULL), containing the extension nid
+ * with value ext.
+ * \return certificate or NULL on error
+ */
+static X509 *gen_cert(X509_NAME *subject, X509 *issuer, EVP_PKEY *issuer_key,
+		      EVP_PKEY *key, long serial, int nid, const char *ext)	{
+    X509V3_CTX v3ctx;
+    X509_EXTENSION *ex=NULL;
+    CONF *conf=NULL;
+    X509 *cert;
+
+    if ( (cert=X509_new())==NULL )
+	return NULL;
+
+    if (!X509_set_version(cert, 2) ||
+	!ASN1_INTEGER_set(X509_get_serialNumber(cert), serial) ||
+	!X509_set_subject_name(cert, subject) ||
+	!X509_set_issuer_name(cert,
+		issuer ? X509_get_subject_name(issuer) : subject) ||
+	!X509_gmtime_adj(X509_get_notBefore(cert), -300) ||
+	!X509_gmtime_adj(X509_get_notAfter(cert), 86400L) ||
+	!X509_set_pubkey(cert, key))
+	goto err;
+
+    /* proxyCertInfo can only be parsed with a (here empty) config */
+    X509V3_set_ctx(&v3ctx, issuer ? issuer : cert, cert, NULL, NULL, 0);
+    if ( (conf=NCONF_new(NULL))==NULL )
+	goto err;
+    X509V3_set_nconf(&v3ctx, conf);
+    if ( (ex=X509V3_EXT_nconf_nid(conf, &v3ctx, nid, ext))==NULL ||
+	 !X509_add_ext(cert, ex, -1) )
+	goto err;
+    X509_EXTENSION_free(ex);
+    NCONF_free(conf);
+
+    /* EdDSA signs without separate digest */
+    if (!X509_sign(cert, issuer_key,
+		   EVP_PKEY_base_id(issuer_key)==EVP_PKEY_ED25519 ?
+		   NULL : EVP_sha256()))
+	goto err;
+
+    return cert;
+
+err:
+    X509_EXTENSION_free(ex);
+    NCONF_free(conf);
+    X509_free(cert);
+    return NULL;
+}
+
+/**
+ * Creates a name consisting of the subject of base (an empty name when base
+ * is NULL) with O=Bench when base is NULL, followed by CN=cn.
+ * \return name or NULL on error
+ */
+static X509_NAME *gen_name(X509 *base, const char *cn)	{
+    X509_NAME *name;
+
+    name=(base ? X509_NAME_dup(X509_get_subject_name(base)) : X509_NAME_new());
+    if (name==NULL ||
+	(base==NULL && !X509_NAME_add_entry_by_txt(name, "O", MBSTRING_ASC,
+			(const unsigned char *)"Bench", -1, -1, 0)) ||
+	!X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+			(const unsigned char *)cn, -1, -1, 0))	{
+	X509_NAME_free(name);
+	return NULL;
+    }
+
+    return name;
+}
+
+/**
+ * Converts the certificates certs[first] down to certs[last] into PEM, with
+ * the private key after the first one unless key is NULL.
+ * \return malloc-ed '\0' terminated PEM string or NULL on error
+ */
+static char *certs_to_pem(X509 **certs, int first, int last, EVP_PKEY *key) {
+    BIO *bio;
+    char *data, *pem=NULL;
+    long len;
+    int i;
+
+    if ( (bio=BIO_new(BIO_s_mem()))==NULL )
+	return NULL;
+    for (i=first; i>=last; i--)	{
+	if (!PEM_write_bio_X509(bio, certs[i]) ||
+	    (i==first && key &&
+	     !PEM_write_bio_PrivateKey(bio, key, NULL, NULL, 0, NULL, NULL)))
+	    goto end;
+    }
+
+    if ( (len=BIO_get_mem_data(bio, &data))>0 &&
+	 (pem=malloc((size_t)len+1))!=NULL )	{
+	memcpy(pem, data, (size_t)len);
+	pem[len]='\0';
+    }
+
+end:
+    BIO_free(bio);
+    return pem;
+}
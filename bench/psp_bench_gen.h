@@ -0,0 +1,94 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+#ifndef PSP_BENCH_GEN_H
+#define PSP_BENCH_GEN_H
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Key types for psp_bench_gen_pilot() */
+typedef enum psp_bench_key_e	{
+    PSP_BENCH_RSA1024 = 0,
+    PSP_BENCH_RSA2048,
+    PSP_BENCH_RSA4096,
+    PSP_BENCH_EC256,		/* ECDSA on P-256 */
+    PSP_BENCH_ED25519,		/* Ed25519, needs OpenSSL 1.1.1 */
+    PSP_BENCH_NKEYS
+} psp_bench_key_t;
+
+/** Pilot proxy file with payload proxies delegated from it */
+typedef struct psp_bench_pilot_s    {
+    char *proxy_pem;		/* contents of the X509_USER_PROXY */
+    int npayloads;		/* number of payloads */
+    char **payload_pem;		/* payload chains: payload proxy, followed
+				   by the chain of the pilot */
+    int *payload_valid;		/* whether payload is signed by the pilot */
+} psp_bench_pilot_t;
+
+
+/************************************************************************
+ * Function prototypes
+ ************************************************************************/
+
+/**
+ * Generates a proxy file in PEM format containing ncerts certificates: the
+ * leaf proxy, its private key, the other proxies and the end-entity
+ * certificate, issued by a throw-away CA. All certificates share a single
+ * RSA key of given number of bits, since only the layout matters here.
+ * \return malloc-ed '\0' terminated PEM string or NULL on error
+ */
+char *psp_bench_gen_proxy(int ncerts, int key_bits);
+
+/**
+ * Parses a key type name: rsa1024, rsa2048, rsa4096, ec256 or ed25519.
+ * \return 0 on success, -1 for unknown names
+ */
+int psp_bench_key_type(const char *name, psp_bench_key_t *type);
+
+/**
+ * Obtains the name of a key type
+ * \return name, "unknown" for invalid types
+ */
+const char *psp_bench_key_name(psp_bench_key_t type);
+
+/**
+ * Generates a pilot proxy file consisting of depth limited proxies on top of
+ * an end-entity certificate issued by a throw-away CA, and npayloads limited
+ * payload proxies, each with its own "CN=User:..." subject. Of these, the
+ * given fraction is invalid: signed by another key than that of the pilot.
+ * All keys are of the given type, the payloads share a key.
+ * \return 0 on success, -1 on error
+ */
+int psp_bench_gen_pilot(psp_bench_pilot_t *pilot, psp_bench_key_t key_type,
+			int depth, int npayloads, double invalid_fraction);
+
+/**
+ * Frees the contents of pilot
+ */
+void psp_bench_pilot_free(psp_bench_pilot_t *pilot);
+
+#endif /* PSP_BENCH_GEN_H */
@@ -0,0 +1,178 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+
+/**
+ * NOTES: stand-in for the parts of the LCMAPS framework used by the plugin,
+ * such that the benchmark can load it without LCMAPS. The LCMAPS headers are
+ * deliberately not included: the prototypes differ in constness between
+ * LCMAPS versions, only the layout of the structures matters. Memory
+ * allocations are counted by wrapping the glibc allocator. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "psp_bench_stub.h"
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Same layout as lcmaps_vo_data_t */
+typedef struct stub_vo_data_s	{
+    char *vo;
+    char *group;
+    char *subgroup;
+    char *role;
+    char *capability;
+} stub_vo_data_t;
+
+
+/************************************************************************
+ * Global variables
+ ************************************************************************/
+
+static int log_level=LOG_ERR;
+static long nallocs=0;
+static long ncredentials=0;
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * Sets the highest syslog priority logged by the stub lcmaps_log(), default
+ * LOG_ERR.
+ */
+void psp_bench_set_log_level(int level)	{
+    log_level=level;
+}
+
+/**
+ * Obtains the number of memory allocations in this process so far.
+ * \return number of allocations, -1 when they are not counted
+ */
+long psp_bench_allocs(void)	{
+#ifdef __GLIBC__
+    return __atomic_load_n(&nallocs, __ATOMIC_RELAXED);
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Obtains the number of credentials stored using the stub
+ * addCredentialData() so far.
+ * \return number of credentials
+ */
+long psp_bench_credentials(void)    {
+    return __atomic_load_n(&ncredentials, __ATOMIC_RELAXED);
+}
+
+
+/************************************************************************
+ * LCMAPS framework functions
+ ************************************************************************/
+
+int lcmaps_log(int prty, const char *fmt, ...)	{
+    va_list ap;
+
+    if (prty>log_level)
+	return 0;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    return 0;
+}
+
+void *lcmaps_getArgValue(const char *argName, const char *argType,
+			 int argcx, psp_bench_argument_t *argvx)	{
+    int i;
+
+    for (i=0; i<argcx; i++)
+	if (strcmp(argvx[i].argName, argName)==0 &&
+	    strcmp(argvx[i].argType, argType)==0)
+	    return argvx[i].value;
+
+    return NULL;
+}
+
+int lcmaps_cntArgs(psp_bench_argument_t *argvx)  {
+    int i=0;
+
+    while (argvx[i].argName)
+	i++;
+
+    return i;
+}
+
+int addCredentialData(int datatype, void *data)	{
+    __atomic_fetch_add(&ncredentials, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+stub_vo_data_t *lcmaps_createVoData(const char *vo, const char *group,
+				    const char *subgroup, const char *role,
+				    const char *capability)	{
+    return calloc(1, sizeof(stub_vo_data_t));
+}
+
+int lcmaps_deleteVoData(stub_vo_data_t **vo_data)	{
+    free(*vo_data);
+    *vo_data=NULL;
+    return 0;
+}
+
+
+/************************************************************************
+ * Counting allocator
+ ************************************************************************/
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)   {
+    __atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)	{
+    __atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)	{
+    __atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+#endif
@@ -0,0 +1,66 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+#ifndef PSP_BENCH_STUB_H
+#define PSP_BENCH_STUB_H
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Same layout as lcmaps_argument_t */
+typedef struct psp_bench_argument_s {
+    const char *argName;
+    const char *argType;
+    int argInOut;
+    void *value;
+} psp_bench_argument_t;
+
+
+/************************************************************************
+ * Function prototypes
+ ************************************************************************/
+
+/**
+ * Sets the highest syslog priority logged by the stub lcmaps_log(), default
+ * LOG_ERR.
+ */
+void psp_bench_set_log_level(int level);
+
+/**
+ * Obtains the number of memory allocations in this process so far.
+ * \return number of allocations, -1 when they are not counted
+ */
+long psp_bench_allocs(void);
+
+/**
+ * Obtains the number of credentials stored using the stub
+ * addCredentialData() so far.
+ * \return number of credentials
+ */
+long psp_bench_credentials(void);
+
+#endif /* PSP_BENCH_STUB_H */
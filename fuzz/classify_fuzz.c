@@ -0,0 +1,76 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+
+/**
+ * NOTES: fuzz target for the classification of a proxy certificate and the
+ * limited proxy check based on it: the input is a single DER certificate,
+ * given to psp_core_classify(). Its results must be consistent: a limited
+ * proxy is an RFC proxy, and a certificate that is not has neither a path
+ * length nor a policy language, while a path length is never below -1.
+ * Built with -fsanitize=fuzzer when available, otherwise with
+ * psp_fuzz_replay.c, see Makefile.am. */
+
+#include <stdlib.h>
+
+#include <openssl/x509.h>
+#include <openssl/objects.h> /* NID_undef */
+
+#include "lcmaps_pilot_sub_proxy_core.h"
+#include "psp_fuzz.h"
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * Decodes data of length size as certificate and classifies it, aborting
+ * when the result is inconsistent.
+ * \return 0
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)	{
+    const unsigned char *p=data;
+    psp_proxy_info_t info;
+    X509 *cert;
+
+    if ( (cert=d2i_X509(NULL, &p, (long)size))==NULL )
+	return 0;
+
+    if (psp_core_classify(cert, &info)==0)	{
+	if (info.is_limited && !info.is_rfc)
+	    abort();
+	if (!info.is_rfc && (info.path_len!=-1 ||
+			     info.policy_lang_nid!=NID_undef))
+	    abort();
+	if (info.path_len<-1)
+	    abort();
+    }
+    psp_core_check_subject(cert);
+
+    X509_free(cert);
+
+    return 0;
+}
@@ -0,0 +1,224 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+
+/**
+ * NOTES: writes the seed corpus of the fuzz targets, using the proxy
+ * generator of the benchmarks: pilot proxy files and payload chains of each
+ * key type and several depths into dir/pem for pem_fuzz, and each of their
+ * certificates in DER form into dir/der for classify_fuzz.
+ * Usage: fuzz_seeds dir */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <openssl/x509.h>
+
+#include "lcmaps_pilot_sub_proxy_pem.h"
+#include "psp_bench_gen.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+#define KEY_BITS	    1024    /* for psp_bench_gen_proxy() */
+#define MIN_CERTS	    2
+#define MAX_CERTS	    5
+#define MAX_DEPTH	    3	    /* for psp_bench_gen_pilot() */
+#define NPAYLOADS	    2
+#define INVALID_FRACTION    0.5
+
+#define MAX_PATH	    1024
+
+
+/************************************************************************
+ * Global variables
+ ************************************************************************/
+
+/** Key types of the pilots, larger RSA keys only take longer to generate */
+static const char *key_names[]={ "rsa1024", "ec256", "ed25519", NULL };
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Writes pem as dir/pem/name.pem and its certificates as dir/der/name-N.der.
+ * \return 0 on success, -1 on error */
+static int write_seed(const char *dir, const char *name, const char *pem);
+
+/* Writes len bytes of data to path.
+ * \return 0 on success, -1 on error */
+static int write_file(const char *path, const void *data, size_t len);
+
+/* Creates directory path unless it exists.
+ * \return 0 on success, -1 on error */
+static int make_dir(const char *path);
+
+
+/************************************************************************
+ * Main program
+ ************************************************************************/
+
+int main(int argc, char *argv[])    {
+    psp_bench_pilot_t pilot;
+    psp_bench_key_t key_type;
+    char path[MAX_PATH], name[MAX_PATH];
+    char *pem;
+    int ncerts, k, depth, i, rc=0;
+
+    if (argc!=2)    {
+	fprintf(stderr, "Usage: %s dir\n", argv[0]);
+	return 1;
+    }
+    snprintf(path, sizeof(path), "%s/pem", argv[1]);
+    if (make_dir(argv[1]) || make_dir(path))
+	return 1;
+    snprintf(path, sizeof(path), "%s/der", argv[1]);
+    if (make_dir(path))
+	return 1;
+
+    /* Proxy files with their private key and end-entity certificate */
+    for (ncerts=MIN_CERTS; ncerts<=MAX_CERTS; ncerts++)	{
+	if ( (pem=psp_bench_gen_proxy(ncerts, KEY_BITS))==NULL )	{
+	    fprintf(stderr, "Cannot generate proxy of %d certs\n", ncerts);
+	    return 1;
+	}
+	snprintf(name, sizeof(name), "proxy-%d", ncerts);
+	if (write_seed(argv[1], name, pem))
+	    rc=1;
+	free(pem);
+    }
+
+    /* Pilots and their valid and invalid payloads, for each key type that
+     * the OpenSSL version supports */
+    for (k=0; key_names[k]; k++)    {
+	if (psp_bench_key_type(key_names[k], &key_type))
+	    return 1;
+	for (depth=1; depth<=MAX_DEPTH; depth++)    {
+	    if (psp_bench_gen_pilot(&pilot, key_type, depth, NPAYLOADS,
+				    INVALID_FRACTION))	{
+		fprintf(stderr, "Skipping %s pilots\n",
+			psp_bench_key_name(key_type));
+		break;
+	    }
+	    snprintf(name, sizeof(name), "pilot-%s-%d",
+		     psp_bench_key_name(key_type), depth);
+	    if (write_seed(argv[1], name, pilot.proxy_pem))
+		rc=1;
+	    for (i=0; i<pilot.npayloads; i++)	{
+		snprintf(name, sizeof(name), "payload-%s-%d-%d",
+			 psp_bench_key_name(key_type), depth, i);
+		if (write_seed(argv[1], name, pilot.payload_pem[i]))
+		    rc=1;
+	    }
+	    psp_bench_pilot_free(&pilot);
+	}
+    }
+
+    return rc;
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Writes pem as dir/pem/name.pem and its certificates as dir/der/name-N.der,
+ * N counting from the leaf.
+ * \return 0 on success, -1 on error
+ */
+static int write_seed(const char *dir, const char *name, const char *pem)  {
+    STACK_OF(X509) *chain=NULL;
+    char path[MAX_PATH];
+    unsigned char *der;
+    int i, len, rc=0;
+
+    snprintf(path, sizeof(path), "%s/pem/%s.pem", dir, name);
+    if (write_file(path, pem, strlen(pem)))
+	return -1;
+
+    if (psp_pem_to_chain(pem, strlen(pem), &chain)!=0)	{
+	fprintf(stderr, "Cannot parse %s\n", path);
+	return -1;
+    }
+    for (i=0; i<sk_X509_num(chain) && rc==0; i++)	{
+	der=NULL;
+	if ( (len=i2d_X509(sk_X509_value(chain, i), &der))<=0 )	{
+	    fprintf(stderr, "Cannot encode certificate %d of %s\n", i, path);
+	    rc=-1;
+	    break;
+	}
+	snprintf(path, sizeof(path), "%s/der/%s-%d.der", dir, name, i);
+	rc=write_file(path, der, (size_t)len);
+	OPENSSL_free(der);
+    }
+    sk_X509_pop_free(chain, X509_free);
+
+    return rc;
+}
+
+/**
+ * Writes len bytes of data to path, replacing an existing file.
+ * \return 0 on success, -1 on error
+ */
+static int write_file(const char *path, const void *data, size_t len)	{
+    FILE *f;
+
+    if ( (f=fopen(path, "wb"))==NULL )	{
+	fprintf(stderr, "Cannot write %s\n", path);
+	return -1;
+    }
+    if (fwrite(data, 1, len, f)!=len)	{
+	fclose(f);
+	fprintf(stderr, "Cannot write %s\n", path);
+	return -1;
+    }
+    if (fclose(f)!=0)	{
+	fprintf(stderr, "Cannot write %s\n", path);
+	return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Creates directory path unless it exists.
+ * \return 0 on success, -1 on error
+ */
+static int make_dir(const char *path)	{
+    if (mkdir(path, 0755)!=0 && errno!=EEXIST)	{
+	fprintf(stderr, "Cannot create %s\n", path);
+	return -1;
+    }
+
+    return 0;
+}
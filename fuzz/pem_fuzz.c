@@ -0,0 +1,80 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+
+/**
+ * NOTES: fuzz target for psp_pem_to_chain(), which parses the payload chain
+ * presented by the pilot job. Every certificate it returns is also run
+ * through the checks of the plugin and libpsp that do not need a pilot:
+ * psp_core_classify(), psp_core_check_subject() and the path length check of
+ * psp_core_chain_allows_proxy(). Built with -fsanitize=fuzzer when available,
+ * otherwise with psp_fuzz_replay.c, see Makefile.am. */
+
+#include <stdlib.h>
+
+#include <openssl/x509.h>
+
+#include "lcmaps_pilot_sub_proxy_pem.h"
+#include "lcmaps_pilot_sub_proxy_core.h"
+#include "psp_fuzz.h"
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * Converts data of length size into a chain and checks its certificates,
+ * aborting when a result is inconsistent.
+ * \return 0
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)	{
+    STACK_OF(X509) *chain=NULL;
+    psp_proxy_info_t info;
+    int i, n;
+
+    if (psp_pem_to_chain((const char *)data, size, &chain)!=0)	{
+	if (chain!=NULL)
+	    abort();
+	return 0;
+    }
+
+    n=sk_X509_num(chain);
+    if (n<1 || n>PSP_PEM_MAX_CERTS)
+	abort();
+    for (i=0; i<n; i++)	{
+	if (sk_X509_value(chain, i)==NULL)
+	    abort();
+	if (psp_core_classify(sk_X509_value(chain, i), &info)==0 &&
+	    info.is_limited && !info.is_rfc)
+	    abort();
+	psp_core_check_subject(sk_X509_value(chain, i));
+    }
+    psp_core_chain_allows_proxy(chain);
+
+    sk_X509_pop_free(chain, X509_free);
+
+    return 0;
+}
@@ -0,0 +1,45 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+#ifndef PSP_FUZZ_H
+#define PSP_FUZZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/************************************************************************
+ * Function prototypes
+ ************************************************************************/
+
+/**
+ * Runs the fuzz target on the input data of length size, as called by
+ * libFuzzer or by the replay driver in psp_fuzz_replay.c. Aborts when the
+ * code under test misbehaves.
+ * \return 0
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+#endif /* PSP_FUZZ_H */
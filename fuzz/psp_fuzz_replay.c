@@ -0,0 +1,118 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+
+/**
+ * NOTES: replay driver for the fuzz targets when the compiler lacks
+ * libFuzzer: runs LLVMFuzzerTestOneInput() once on the contents of each file
+ * given as argument, as libFuzzer itself does for file arguments. Crashes
+ * and aborts of the target thus show up as failure of the program.
+ * Usage: <target> file... */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "psp_fuzz.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/** Maximum size of an input, beyond that of any proxy file */
+#define MAX_INPUT	(1024*1024)
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Reads the file path into a new buffer, setting len to its size.
+ * \return new buffer or NULL on error */
+static uint8_t *read_input(const char *path, size_t *len);
+
+
+/************************************************************************
+ * Main program
+ ************************************************************************/
+
+int main(int argc, char *argv[])    {
+    uint8_t *data;
+    size_t len;
+    int i;
+
+    if (argc<2)	{
+	fprintf(stderr, "Usage: %s file...\n", argv[0]);
+	return 1;
+    }
+
+    for (i=1; i<argc; i++)  {
+	if ( (data=read_input(argv[i], &len))==NULL )	{
+	    fprintf(stderr, "Cannot read %s\n", argv[i]);
+	    return 1;
+	}
+	LLVMFuzzerTestOneInput(data, len);
+	free(data);
+    }
+    printf("%s: replayed %d inputs\n", argv[0], argc-1);
+
+    return 0;
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Reads the file path, of at most MAX_INPUT bytes, into a new buffer of
+ * exactly its size, such that reads beyond the input are caught by
+ * AddressSanitizer or valgrind.
+ * \return new buffer or NULL on error
+ */
+static uint8_t *read_input(const char *path, size_t *len)   {
+    uint8_t *data;
+    FILE *f;
+    long size;
+
+    if ( (f=fopen(path, "rb"))==NULL )
+	return NULL;
+    if (fseek(f, 0, SEEK_END)!=0 || (size=ftell(f))<0 || size>MAX_INPUT ||
+	fseek(f, 0, SEEK_SET)!=0 ||
+	(data=(uint8_t *)malloc(size>0 ? (size_t)size : 1))==NULL)	{
+	fclose(f);
+	return NULL;
+    }
+    if (fread(data, 1, (size_t)size, f)!=(size_t)size)	{
+	free(data);
+	fclose(f);
+	return NULL;
+    }
+    fclose(f);
+    *len=(size_t)size;
+
+    return data;
+}
@@ -0,0 +1,183 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+
+/**
+ * NOTES: fuzz target for the verification of the signature of a payload by
+ * its pilot, as done by the plugin and libpsp with X509_verify(). The input
+ * is PEM data as for pem_fuzz, of which the first certificate is taken as the
+ * payload and the second as its pilot. When the signature of the payload is
+ * valid, a copy with one bit of the signature flipped and a copy of which
+ * the BIT STRING of the signature claims unused bits must both be rejected.
+ * Built with -fsanitize=fuzzer when available, otherwise with
+ * psp_fuzz_replay.c, see Makefile.am. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+
+#include "lcmaps_pilot_sub_proxy_pem.h"
+#include "psp_fuzz.h"
+
+
+/************************************************************************
+ * Function prototypes
+ ************************************************************************/
+
+/* Parses the DER header at der[*pos], of at most end, into its tag and the
+ * length of its contents, advancing *pos to the contents.
+ * \return 0 on success, -1 when invalid */
+static int der_header(const unsigned char *der, long end, long *pos,
+		      int *tag, long *len);
+
+/* Verifies the certificate in der of length len with key, as the plugin and
+ * libpsp verify a payload.
+ * \return 1 when valid, 0 when invalid or when der is not a certificate */
+static int verify_der(const unsigned char *der, long len, EVP_PKEY *key);
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * Converts data of length size into a chain and, when its leaf is validly
+ * signed by the next certificate, verifies the tampered and padded copies of
+ * the leaf, aborting when one is accepted.
+ * \return 0
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)	{
+    STACK_OF(X509) *chain=NULL;
+    X509 *payload;
+    EVP_PKEY *key;
+    unsigned char *der=NULL, *p;
+    long len, pos=0, sig_pos, content_len;
+    int tag, n;
+
+    if (psp_pem_to_chain((const char *)data, size, &chain)!=0)
+	return 0;
+    if (sk_X509_num(chain)<2)
+	goto end;
+    payload=sk_X509_value(chain, 0);
+    if ( (key=X509_get0_pubkey(sk_X509_value(chain, 1)))==NULL ||
+	 X509_verify(payload, key)!=1 )
+	goto end;
+
+    if ( (n=i2d_X509(payload, NULL))<=0 ||
+	 (der=(unsigned char *)malloc((size_t)n))==NULL )
+	goto end;
+    p=der;
+    len=(long)i2d_X509(payload, &p);
+
+    /* The untampered encoding verifies as the certificate did */
+    if (verify_der(der, len, key)!=1)
+	abort();
+
+    /* SEQUENCE of the tbsCertificate, the signatureAlgorithm and the
+     * signatureValue BIT STRING, with its unused bits octet first */
+    if (der_header(der, len, &pos, &tag, &content_len) || tag!=0x30 ||
+	der_header(der, len, &pos, &tag, &content_len) || tag!=0x30 ||
+	(pos+=content_len)>len ||
+	der_header(der, len, &pos, &tag, &content_len) || tag!=0x30 ||
+	(pos+=content_len)>len ||
+	der_header(der, len, &pos, &tag, &content_len) || tag!=0x03 ||
+	content_len<2 || pos+content_len!=len || der[pos]!=0 )
+	abort();
+    sig_pos=pos;
+
+    /* A flipped bit in the signature */
+    der[len-1]^=0x01;
+    if (verify_der(der, len, key)!=0)
+	abort();
+    der[len-1]^=0x01;
+
+    /* Padding in the signature: the last octet then is only partially used,
+     * which is only valid when its unused bits are zero */
+    der[sig_pos]=0x01;
+    der[len-1]&=0xfe;
+    if (verify_der(der, len, key)!=0)
+	abort();
+
+end:
+    free(der);
+    sk_X509_pop_free(chain, X509_free);
+
+    return 0;
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Parses the DER header at der[*pos], of at most end, into its tag and the
+ * length of its contents, advancing *pos to the contents. Only the short and
+ * the long form with up to four length octets are supported.
+ * \return 0 on success, -1 when invalid
+ */
+static int der_header(const unsigned char *der, long end, long *pos,
+		      int *tag, long *len)  {
+    long p=*pos;
+    int i, n;
+
+    if (p+2>end)
+	return -1;
+    *tag=der[p++];
+    if (der[p]<0x80)
+	*len=der[p++];
+    else    {
+	n=der[p++]&0x7f;
+	if (n<1 || n>4 || p+n>end)
+	    return -1;
+	for (*len=0, i=0; i<n; i++)
+	    *len=(*len<<8) | der[p++];
+    }
+    if (*len > end-p)
+	return -1;
+    *pos=p;
+
+    return 0;
+}
+
+/**
+ * Verifies the certificate in der of length len with key, as the plugin and
+ * libpsp verify a payload.
+ * \return 1 when valid, 0 when invalid or when der is not a certificate
+ */
+static int verify_der(const unsigned char *der, long len, EVP_PKEY *key) {
+    const unsigned char *p=der;
+    X509 *cert;
+    int rc;
+
+    if ( (cert=d2i_X509(NULL, &p, len))==NULL )
+	return 0;
+    rc=(X509_verify(cert, key)==1);
+    X509_free(cert);
+
+    return rc;
+}
@@ -27,10 +27,21 @@
  * pilot also checked. Only check whether is indeed only one longer. So check
  * cert by cert until bottom of stack. Probably don't need to rebase on a CA.
  * Still need external check that pilot may do this: on GUMS can check pilot DN
- * is allowed to make pilot proxies (has role pilot) */
+ * is allowed to make pilot proxies (has role pilot)
+ * With --certdir (integrated mode) the plugin does this itself: the cached
+ * pilot chain is validated once and only the new link is checked, such that
+ * lcmaps-verify-proxy isn't needed.
+ * With --shared-cache, verdicts are also shared between processes, which are
+ * looked up before the X509_USER_PROXY is read.
+ * Messages are only formatted when their priority is logged, and warnings
+ * about requests are rate limited per pilot, see
+ * lcmaps_pilot_sub_proxy_log.h. */
 
 #include <openssl/x509.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
 
 #include "lcmaps_plugins_pilot_sub_proxy_config.h"
 
@@ -45,6 +56,12 @@
 #endif
 
 #include "lcmaps_pilot_sub_proxy_utils.h"
+#include "lcmaps_pilot_sub_proxy_watch.h"
+#include "lcmaps_pilot_sub_proxy_fqan.h"
+#include "lcmaps_pilot_sub_proxy_shm.h"
+#include "lcmaps_pilot_sub_proxy_stats.h"
+#include "lcmaps_pilot_sub_proxy_pilotdir.h"
+#include "lcmaps_pilot_sub_proxy_log.h"
 
 
 /************************************************************************
@@ -56,22 +73,72 @@
 #define PLUGIN_RUN	0   /* full run mode */
 #define PLUGIN_VERIFY	1   /* verify-only mode */
 
+/* Flags for the checks done on the pilot, part of the shared cache key */
+#define POLICY_LIMITED	    (1<<0)  /* pilot must be limited */
+#define POLICY_CERTDIR	    (1<<1)  /* pilot chain validated */
+/* The key policy occupies the higher bits of the shared cache key */
+#define POLICY_KEY_TYPES_SHIFT	2   /* allowed key types (PSP_KEY_*) */
+#define POLICY_RSA_BITS_SHIFT	8   /* minimum RSA key size */
+
+/** Largest accepted value of --min-rsa-bits, such that it fits the policy */
+#define MAX_MIN_RSA_BITS	65535
+
 
 /************************************************************************
  * global variables
  ************************************************************************/
 
-/** Whether to only register DN or also FQANs, default yes */
-static int add_pilot_fqans=1;
-
-/** Whether to require proxies are limited, default yes */
-static int require_limited=1;
+/** Plugin configuration, set by plugin_initialize() and read-only afterwards,
+ * such that concurrent runs only share immutable state */
+typedef struct plugin_config_s	{
+    int add_pilot_fqans;	/* also register FQANs, default yes */
+    int add_vo_data;		/* also register FQANs as parsed VO data,
+				   default no */
+    int require_limited;	/* require limited proxies, default yes */
+    psp_fqan_matcher_t *fqan_matcher; /* when set, the FQANs must match one
+					 of its allow and none of its deny
+					 patterns */
+    lock_type_t lock_type;	/* lock type for reading X509_USER_PROXY */
+    read_method_t read_method;	/* how to read X509_USER_PROXY */
+    int pilot_from_payload_chain; /* use cached pilot chain when the payload
+				     chain extends it, default no */
+    int watch_proxy;		/* watch X509_USER_PROXY, default no */
+    X509_STORE *cert_store;	/* when set, validate the pilot chain and the
+				   payload link (integrated mode) */
+    psp_shm_t *shared_cache;	/* when set, verdict cache shared between
+				   processes */
+    int preload;		/* read X509_USER_PROXY during initialization,
+				   default no */
+    unsigned int key_types;	/* allowed public key types (PSP_KEY_*),
+				   default all */
+    int min_rsa_bits;		/* minimum size of RSA keys, default 0 */
+    int pilot_dir;		/* look up the pilot proxies in a directory
+				   instead of X509_USER_PROXY, default no */
+    int log_requests;		/* log one line per request, default no */
+} plugin_config_t;
 
-/** When set, the FQAN pattern must match one of the FQANs */
-static char *fqan_pattern=NULL;
+static plugin_config_t config = {
+    1,			/* add_pilot_fqans */
+    0,			/* add_vo_data */
+    1,			/* require_limited */
+    NULL,		/* fqan_matcher */
+    LOCK_NOLOCK,	/* lock_type */
+    READ_METHOD_READ,	/* read_method */
+    0,			/* pilot_from_payload_chain */
+    0,			/* watch_proxy */
+    NULL,		/* cert_store */
+    NULL,		/* shared_cache */
+    0,			/* preload */
+    PSP_KEY_ALL,	/* key_types */
+    0,			/* min_rsa_bits */
+    0,			/* pilot_dir */
+    0			/* log_requests */
+};
 
-/** Lock type to use for reading the X509_USER_PROXY */
-static lock_type_t lock_type=LOCK_NOLOCK;
+/* Requests currently reading their pilot proxy, and whether --read-method
+ * mmap was given up because such requests overlapped, see check_pilot() */
+static int pilot_readers = 0;
+static int mmap_disabled = 0;
 
 
 /************************************************************************
@@ -82,6 +149,35 @@ static lock_type_t lock_type=LOCK_NOLOCK;
 static int plugin_run_or_verify(int argc, lcmaps_argument_t *argv,
 				int lcmaps_mode);
 
+/* Parses the comma separated list of key types in str into a bitmask of
+ * PSP_KEY_* values.
+ * \return 0 on success, -1 when str contains an unknown type */
+static int parse_key_types(const char *str, unsigned int *key_types);
+
+/* Checks whether the current time is within the validity of a proxy.
+ * \return 1 when valid, 0 when not */
+static int proxy_valid_now(const psp_proxy_info_t *info);
+
+/* Reads the X509_USER_PROXY, or the pilot proxy directory, into the pilot
+ * cache */
+static void preload_pilot(const char *logstr);
+
+/* Obtains the X509_USER_PROXY and verifies it issued the payload proxy. On
+ * failure, reason is set to the failure counter.
+ * \return 0 on success, -1 on failure */
+static int check_pilot(const plugin_config_t *cfg, psp_request_t *req,
+		       unsigned int policy, const char *logstr,
+		       psp_counter_t *reason);
+
+/* Logs one line describing the request: pilot, payload DN, verdict and the
+ * durations of its stages */
+static void log_request(const psp_request_t *req, const char *logstr,
+			psp_counter_t verdict, uint64_t start);
+
+/* Releases everything set up by plugin_initialize() once the configuration
+ * is in place, for plugin_terminate() and for failures during initialization */
+static void cleanup_plugin(void);
+
 
 /************************************************************************
  * public functions
@@ -92,12 +188,19 @@ static int plugin_run_or_verify(int argc, lcmaps_argument_t *argv,
  */
 int plugin_initialize(int argc, char **argv) {
     const char * logstr = PLUGIN_PREFIX"-plugin_initialize()";
+    plugin_config_t cfg=config;
+    const char *stats_file=NULL, *pilot_dir=NULL;
+    struct timespec start, end;
+    int log_level=-1, log_rate_limit=PSP_LOG_RATE_LIMIT;
     int i;
 
+    /* Log level from the environment, until --log-level is parsed */
+    psp_log_init();
+
     /* Log commandline parameters on debug */
-    lcmaps_log(LOG_DEBUG,"%s: passed arguments:\n",logstr);
+    psp_log(LOG_DEBUG,"%s: passed arguments:\n",logstr);
     for (i=0; i < argc; i++)
-	lcmaps_log(LOG_DEBUG,"%s: arg %d is %s\n", logstr, i, argv[i]);
+	psp_log(LOG_DEBUG,"%s: arg %d is %s\n", logstr, i, argv[i]);
 
     /* Parse arguments, argv[0] = name of plugin, so start with i = 1 */
     for (i = 1; i < argc; i++) {
@@ -107,21 +210,45 @@ int plugin_initialize(int argc, char **argv) {
 		lcmaps_log(LOG_ERR,
 		    "%s: option %s needs to be followed by 'yes' or 'no'\n",
 		    logstr, argv[i]);
-		return LCMAPS_MOD_FAIL;
+		goto fail_init;
 	    }
 	    if (strcmp(argv[i+1],"yes") == 0)  {
-		lcmaps_log(LOG_DEBUG,
+		psp_log(LOG_DEBUG,
 		    "%s: will add FQANs from pilot when available\n", logstr);
-		add_pilot_fqans=1;
+		cfg.add_pilot_fqans=1;
 	    } else if (strcmp(argv[i+1],"no") == 0)  {
-		lcmaps_log(LOG_DEBUG,
+		psp_log(LOG_DEBUG,
 		    "%s: will NOT add FQANs from pilot\n", logstr);
-		add_pilot_fqans=0;
+		cfg.add_pilot_fqans=0;
+	    } else {
+		lcmaps_log(LOG_ERR,
+		    "%s: option %s should have value 'yes' or 'no', not '%s'\n",
+		    logstr, argv[i], argv[i+1]);
+		goto fail_init;
+	    }
+	    i++;
+	}
+	else if (strcmp(argv[i], "--add-vo-data") == 0)
+	{
+	    if (argv[i + 1] == NULL)	{
+		lcmaps_log(LOG_ERR,
+		    "%s: option %s needs to be followed by 'yes' or 'no'\n",
+		    logstr, argv[i]);
+		goto fail_init;
+	    }
+	    if (strcmp(argv[i+1],"yes") == 0)  {
+		psp_log(LOG_DEBUG,
+		    "%s: will also add FQANs as parsed VO data\n", logstr);
+		cfg.add_vo_data=1;
+	    } else if (strcmp(argv[i+1],"no") == 0)  {
+		psp_log(LOG_DEBUG,
+		    "%s: will NOT add FQANs as parsed VO data\n", logstr);
+		cfg.add_vo_data=0;
 	    } else {
 		lcmaps_log(LOG_ERR,
 		    "%s: option %s should have value 'yes' or 'no', not '%s'\n",
-		    logstr, argv[i], argv[i]);
-		return LCMAPS_MOD_FAIL;
+		    logstr, argv[i], argv[i+1]);
+		goto fail_init;
 	    }
 	    i++;
 	}
@@ -131,34 +258,245 @@ int plugin_initialize(int argc, char **argv) {
 		lcmaps_log(LOG_ERR,
 		    "%s: option %s needs to be followed by 'yes' or 'no'\n",
 		    logstr, argv[i]);
-		return LCMAPS_MOD_FAIL;
+		goto fail_init;
 	    }
 	    if (strcmp(argv[i+1],"yes") == 0)  {
-		lcmaps_log(LOG_DEBUG,
+		psp_log(LOG_DEBUG,
 		    "%s: require proxies to be limited\n", logstr);
-		require_limited=1;
+		cfg.require_limited=1;
 	    } else if (strcmp(argv[i+1],"no") == 0)  {
-		lcmaps_log(LOG_DEBUG,
+		psp_log(LOG_DEBUG,
 		    "%s: do NOT require proxies to be limited\n", logstr);
-		require_limited=0;
+		cfg.require_limited=0;
 	    } else {
 		lcmaps_log(LOG_ERR,
 		    "%s: option %s should have value 'yes' or 'no', not '%s'\n",
-		    logstr, argv[i], argv[i]);
-		return LCMAPS_MOD_FAIL;
+		    logstr, argv[i], argv[i+1]);
+		goto fail_init;
 	    }
 	    i++;
 	}
-	else if (strcmp(argv[i], "--match-fqan") == 0)
+	else if (strcmp(argv[i], "--match-fqan") == 0 ||
+		 strcmp(argv[i], "--deny-fqan") == 0)
 	{
 	    if (argv[i + 1] == NULL)	{
 		lcmaps_log(LOG_ERR,
 		    "%s: option %s needs to be followed by FQAN pattern\n",
 		    logstr, argv[i]);
-		return LCMAPS_MOD_FAIL;
+		goto fail_init;
+	    }
+	    /* Patterns are compiled into one matcher, empty ones are ignored */
+	    if (argv[i + 1][0]!='\0')	{
+		if ( (cfg.fqan_matcher==NULL &&
+		      (cfg.fqan_matcher=psp_fqan_matcher_new())==NULL) ||
+		     psp_fqan_matcher_add(cfg.fqan_matcher, argv[i + 1],
+					  argv[i][2]=='d') )	{
+		    lcmaps_log(LOG_ERR,
+			"%s: out of memory adding FQAN pattern %s\n",
+			logstr, argv[i + 1]);
+		    goto fail_init;
+		}
+		psp_log(LOG_DEBUG, "%s: added %s FQAN pattern %s\n",
+			logstr, argv[i][2]=='d' ? "deny" : "allow", argv[i + 1]);
+	    }
+	    i++;
+	}
+	else if (strcmp(argv[i], "--pilot-from-payload-chain") == 0)
+	{
+	    if (argv[i + 1] == NULL)	{
+		lcmaps_log(LOG_ERR,
+		    "%s: option %s needs to be followed by 'yes' or 'no'\n",
+		    logstr, argv[i]);
+		goto fail_init;
+	    }
+	    if (strcmp(argv[i+1],"yes") == 0)  {
+		psp_log(LOG_DEBUG,
+		    "%s: will use cached pilot chain found in payload chain\n",
+		    logstr);
+		cfg.pilot_from_payload_chain=1;
+	    } else if (strcmp(argv[i+1],"no") == 0)  {
+		psp_log(LOG_DEBUG,
+		    "%s: will always check X509_USER_PROXY\n", logstr);
+		cfg.pilot_from_payload_chain=0;
+	    } else {
+		lcmaps_log(LOG_ERR,
+		    "%s: option %s should have value 'yes' or 'no', not '%s'\n",
+		    logstr, argv[i], argv[i+1]);
+		goto fail_init;
+	    }
+	    i++;
+	}
+	else if (strcmp(argv[i], "--watch-proxy") == 0)
+	{
+	    if (argv[i + 1] == NULL)	{
+		lcmaps_log(LOG_ERR,
+		    "%s: option %s needs to be followed by 'yes' or 'no'\n",
+		    logstr, argv[i]);
+		goto fail_init;
+	    }
+	    if (strcmp(argv[i+1],"yes") == 0)  {
+		psp_log(LOG_DEBUG,
+		    "%s: will watch X509_USER_PROXY for changes\n", logstr);
+		cfg.watch_proxy=1;
+	    } else if (strcmp(argv[i+1],"no") == 0)  {
+		psp_log(LOG_DEBUG,
+		    "%s: will NOT watch X509_USER_PROXY for changes\n", logstr);
+		cfg.watch_proxy=0;
+	    } else {
+		lcmaps_log(LOG_ERR,
+		    "%s: option %s should have value 'yes' or 'no', not '%s'\n",
+		    logstr, argv[i], argv[i+1]);
+		goto fail_init;
+	    }
+	    i++;
+	}
+	else if (strcmp(argv[i], "--stats-file") == 0)
+	{
+	    if (argv[i + 1] == NULL || argv[i + 1][0]=='\0')	{
+		lcmaps_log(LOG_ERR,
+		    "%s: option %s needs to be followed by file name\n",
+		    logstr, argv[i]);
+		goto fail_init;
+	    }
+	    stats_file=argv[i + 1];
+	    psp_log(LOG_DEBUG, "%s: writing statistics to %s\n",
+		logstr, stats_file);
+	    i++;
+	}
+	else if (strcmp(argv[i], "--preload") == 0)
+	{
+	    if (argv[i + 1] == NULL)	{
+		lcmaps_log(LOG_ERR,
+		    "%s: option %s needs to be followed by 'yes' or 'no'\n",
+		    logstr, argv[i]);
+		goto fail_init;
+	    }
+	    if (strcmp(argv[i+1],"yes") == 0)  {
+		psp_log(LOG_DEBUG,
+		    "%s: will read X509_USER_PROXY during initialization\n",
+		    logstr);
+		cfg.preload=1;
+	    } else if (strcmp(argv[i+1],"no") == 0)  {
+		psp_log(LOG_DEBUG,
+		    "%s: will read X509_USER_PROXY when first needed\n",
+		    logstr);
+		cfg.preload=0;
+	    } else {
+		lcmaps_log(LOG_ERR,
+		    "%s: option %s should have value 'yes' or 'no', not '%s'\n",
+		    logstr, argv[i], argv[i+1]);
+		goto fail_init;
+	    }
+	    i++;
+	}
+	else if (strcmp(argv[i], "--certdir") == 0)
+	{
+	    if (argv[i + 1] == NULL || argv[i + 1][0]=='\0')	{
+		lcmaps_log(LOG_ERR,
+		    "%s: option %s needs to be followed by CA directory\n",
+		    logstr, argv[i]);
+		goto fail_init;
+	    }
+	    X509_STORE_free(cfg.cert_store);
+	    if ( (cfg.cert_store=psp_cert_store_new(argv[i + 1]))==NULL )
+		goto fail_init;
+	    psp_log(LOG_DEBUG,
+		"%s: validating full chains using CA directory %s\n",
+		logstr, argv[i + 1]);
+	    i++;
+	}
+	else if (strcmp(argv[i], "--shared-cache") == 0)
+	{
+	    if (argv[i + 1] == NULL || argv[i + 1][0]=='\0')	{
+		lcmaps_log(LOG_ERR,
+		    "%s: option %s needs to be followed by cache directory\n",
+		    logstr, argv[i]);
+		goto fail_init;
+	    }
+	    psp_shm_close(cfg.shared_cache);
+	    if ( (cfg.shared_cache=psp_shm_open(argv[i + 1]))==NULL )
+		goto fail_init;
+	    psp_log(LOG_DEBUG,
+		"%s: sharing verification results via directory %s\n",
+		logstr, argv[i + 1]);
+	    i++;
+	}
+	else if (strcmp(argv[i], "--pilot-proxy-dir") == 0)
+	{
+	    if (argv[i + 1] == NULL || argv[i + 1][0]=='\0')	{
+		lcmaps_log(LOG_ERR,
+		    "%s: option %s needs to be followed by directory\n",
+		    logstr, argv[i]);
+		goto fail_init;
+	    }
+	    pilot_dir=argv[i + 1];
+	    cfg.pilot_dir=1;
+	    psp_log(LOG_DEBUG,
+		"%s: looking up pilot proxies in directory %s\n",
+		logstr, pilot_dir);
+	    i++;
+	}
+	else if (strcmp(argv[i], "--allowed-key-types") == 0)
+	{
+	    if (argv[i + 1] == NULL)	{
+		lcmaps_log(LOG_ERR,
+		    "%s: option %s needs to be followed by list of key types\n",
+		    logstr, argv[i]);
+		goto fail_init;
+	    }
+	    if (parse_key_types(argv[i + 1], &cfg.key_types))	{
+		lcmaps_log(LOG_ERR, "%s: invalid list of key types \"%s\"\n",
+			logstr, argv[i + 1]);
+		goto fail_init;
+	    }
+	    psp_log(LOG_DEBUG, "%s: allowing public keys of type %s\n",
+		    logstr, argv[i + 1]);
+	    i++;
+	}
+	else if (strcmp(argv[i], "--min-rsa-bits") == 0)
+	{
+	    char *end;
+	    long bits;
+
+	    if (argv[i + 1] == NULL)	{
+		lcmaps_log(LOG_ERR,
+		    "%s: option %s needs to be followed by number of bits\n",
+		    logstr, argv[i]);
+		goto fail_init;
+	    }
+	    bits=strtol(argv[i + 1], &end, 10);
+	    if (argv[i + 1][0]=='\0' || *end!='\0' ||
+		bits<0 || bits>MAX_MIN_RSA_BITS)	{
+		lcmaps_log(LOG_ERR, "%s: invalid number of bits \"%s\"\n",
+			logstr, argv[i + 1]);
+		goto fail_init;
+	    }
+	    cfg.min_rsa_bits=(int)bits;
+	    psp_log(LOG_DEBUG, "%s: requiring RSA keys of at least %d bits\n",
+		    logstr, cfg.min_rsa_bits);
+	    i++;
+	}
+	else if (strcmp(argv[i], "--read-method") == 0)
+	{
+	    if (argv[i + 1] == NULL)	{
+		lcmaps_log(LOG_ERR,
+		    "%s: option %s needs to be followed by 'read' or 'mmap'\n",
+		    logstr, argv[i]);
+		goto fail_init;
+	    }
+	    if (strcmp(argv[i+1], "read") == 0)	{
+		psp_log(LOG_DEBUG,
+			"%s: reading X509_USER_PROXY into a buffer\n", logstr);
+		cfg.read_method=READ_METHOD_READ;
+	    } else if (strcmp(argv[i+1], "mmap") == 0) {
+		psp_log(LOG_DEBUG,
+			"%s: mapping X509_USER_PROXY into memory\n", logstr);
+		cfg.read_method=READ_METHOD_MMAP;
+	    } else    {
+		lcmaps_log(LOG_ERR, "%s: unknown read method \"%s\"\n",
+			logstr, argv[i+1]);
+		goto fail_init;
 	    }
-	    if (argv[i + 1][0]!='\0')
-		fqan_pattern=argv[i + 1];
 	    i++;
 	}
 	else if (strcmp(argv[i], "--lock-type") == 0)
@@ -167,40 +505,165 @@ int plugin_initialize(int argc, char **argv) {
 		lcmaps_log(LOG_ERR,
 		    "%s: option %s needs to be followed by valid lock type\n",
 		    logstr, argv[i]);
-		return LCMAPS_MOD_FAIL;
+		goto fail_init;
 	    }
 	    if (strcmp(argv[i+1], "none") == 0)	{
-		lcmaps_log(LOG_INFO,
+		psp_log(LOG_INFO,
 			"%s: not using locking for reading X509_USER_PROXY\n",
 			logstr);
-		lock_type=LOCK_NOLOCK;
+		cfg.lock_type=LOCK_NOLOCK;
 	    } else if (strcmp(argv[i+1], "fcntl") == 0) {
-		lcmaps_log(LOG_INFO,
+		psp_log(LOG_INFO,
 			"%s: using fcntl locking for reading X509_USER_PROXY\n",
 			logstr);
-		lock_type=LOCK_FCNTL;
+		cfg.lock_type=LOCK_FCNTL;
 	    } else if (strcmp(argv[i+1], "flock") == 0)	{
-		lcmaps_log(LOG_INFO,
+		psp_log(LOG_INFO,
 			"%s: using flock locking for reading X509_USER_PROXY\n",
 			logstr);
-		lock_type=LOCK_FLOCK;
+		cfg.lock_type=LOCK_FLOCK;
+	    } else if (strcmp(argv[i+1], "seqlock") == 0)	{
+		psp_log(LOG_INFO,
+			"%s: not locking X509_USER_PROXY, expecting it to be "
+			"replaced atomically\n", logstr);
+		cfg.lock_type=LOCK_SEQLOCK;
 	    } else    {
 		lcmaps_log(LOG_ERR, "%s: unknown lock_type \"%s\"\n",
 			logstr, argv[i+1]);
-		return LCMAPS_MOD_FAIL;
+		goto fail_init;
+	    }
+	    i++;
+	}
+	else if (strcmp(argv[i], "--log-level") == 0)
+	{
+	    if (argv[i + 1] == NULL)	{
+		lcmaps_log(LOG_ERR,
+		    "%s: option %s needs to be followed by syslog priority\n",
+		    logstr, argv[i]);
+		goto fail_init;
+	    }
+	    if ( (log_level=psp_log_parse_level(argv[i + 1]))<0 )	{
+		lcmaps_log(LOG_ERR, "%s: unknown log level \"%s\"\n",
+			logstr, argv[i + 1]);
+		goto fail_init;
+	    }
+	    i++;
+	}
+	else if (strcmp(argv[i], "--log-requests") == 0)
+	{
+	    if (argv[i + 1] == NULL)	{
+		lcmaps_log(LOG_ERR,
+		    "%s: option %s needs to be followed by 'yes' or 'no'\n",
+		    logstr, argv[i]);
+		goto fail_init;
+	    }
+	    if (strcmp(argv[i+1],"yes") == 0)  {
+		psp_log(LOG_DEBUG, "%s: will log one line per request\n",
+		    logstr);
+		cfg.log_requests=1;
+	    } else if (strcmp(argv[i+1],"no") == 0)  {
+		psp_log(LOG_DEBUG, "%s: will not log one line per request\n",
+		    logstr);
+		cfg.log_requests=0;
+	    } else {
+		lcmaps_log(LOG_ERR,
+		    "%s: option %s should have value 'yes' or 'no', not '%s'\n",
+		    logstr, argv[i], argv[i+1]);
+		goto fail_init;
 	    }
 	    i++;
 	}
+	else if (strcmp(argv[i], "--log-rate-limit") == 0)
+	{
+	    char *end;
+	    long limit;
+
+	    if (argv[i + 1] == NULL)	{
+		lcmaps_log(LOG_ERR,
+		    "%s: option %s needs to be followed by number of warnings\n",
+		    logstr, argv[i]);
+		goto fail_init;
+	    }
+	    limit=strtol(argv[i + 1], &end, 10);
+	    if (argv[i + 1][0]=='\0' || *end!='\0' || limit<0 || limit>INT_MAX)
+	    {
+		lcmaps_log(LOG_ERR, "%s: invalid number of warnings \"%s\"\n",
+			logstr, argv[i + 1]);
+		goto fail_init;
+	    }
+	    log_rate_limit=(int)limit;
+	    psp_log(LOG_DEBUG,
+		    "%s: logging at most %d warnings per pilot per %d s\n",
+		    logstr, log_rate_limit, PSP_LOG_RATE_INTERVAL);
+	    i++;
+	}
 	else
 	{
             lcmaps_log(LOG_ERR,
 		    "%s: Unknown argument for plugin: %s (failure)\n",
 		    logstr, argv[i]);
-            return LCMAPS_MOD_FAIL;
+            goto fail_init;
         }
     }
 
+    /* A file truncated while mapped kills the process, which a resident
+     * process handling the payloads of many pilots cannot afford */
+    if (pilot_dir && cfg.read_method==READ_METHOD_MMAP)	{
+	lcmaps_log(LOG_ERR,
+	    "%s: --read-method mmap cannot be used with --pilot-proxy-dir\n",
+	    logstr);
+	goto fail_init;
+    }
+
+    /* From here on the configuration is no longer modified */
+    config=cfg;
+    psp_log_configure(log_level, log_rate_limit);
+    psp_stats_request_times(config.log_requests);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Resolve the proxy OIDs once */
+    if (psp_oid_init())	{
+	lcmaps_log(LOG_ERR, "%s: cannot convert proxy OIDs\n", logstr);
+	goto fail_started;
+    }
+
+    /* Start the change detector for X509_USER_PROXY when requested */
+    if (config.watch_proxy && psp_watch_init())
+	goto fail_started;
+
+    /* Enable the timing statistics when requested */
+    if (stats_file && psp_stats_init(stats_file))
+	goto fail_started;
+
+    /* Use the directory of pilot proxies when requested */
+    if (pilot_dir &&
+	psp_pilotdir_init(pilot_dir, config.lock_type, config.read_method))
+	goto fail_started;
+
+    /* Initialize now what the first request would otherwise initialize, such
+     * that it isn't slower and that processes forked afterwards share it */
+    if (psp_warmup())
+	goto fail_started;
+    if (config.preload)
+	preload_pilot(logstr);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    psp_log(LOG_INFO, "%s: warm-up took %ld us\n", logstr,
+	    (long)(end.tv_sec-start.tv_sec)*1000000L+
+	    (end.tv_nsec-start.tv_nsec)/1000L);
+
     return LCMAPS_MOD_SUCCESS;
+
+    /* Once in config, everything is released as by plugin_terminate() */
+fail_started:
+    cleanup_plugin();
+    return LCMAPS_MOD_FAIL;
+
+fail_init:
+    psp_fqan_matcher_free(cfg.fqan_matcher);
+    X509_STORE_free(cfg.cert_store);
+    psp_shm_close(cfg.shared_cache);
+    return LCMAPS_MOD_FAIL;
 }
 
 /**
@@ -218,11 +681,11 @@ int plugin_introspect(int *argc, lcmaps_argument_t **argv) {
 	{NULL         ,NULL              ,-1,NULL}
     };
 
-    lcmaps_log(LOG_DEBUG,"%s: introspecting\n", logstr);
+    psp_log(LOG_DEBUG,"%s: introspecting\n", logstr);
 
     *argv = argList;
     *argc = lcmaps_cntArgs(argList);
-    lcmaps_log(LOG_DEBUG,"%s: address first argument: %p\n",
+    psp_log(LOG_DEBUG,"%s: address first argument: %p\n",
 	    logstr, (void*)argList);
 
     return LCMAPS_MOD_SUCCESS;
@@ -251,7 +714,8 @@ int plugin_verify(int argc, lcmaps_argument_t *argv) {
 int plugin_terminate(void) {
     const char * logstr = PLUGIN_PREFIX"-plugin_terminate()";
 
-    lcmaps_log(LOG_DEBUG,"%s: terminating\n", logstr);
+    psp_log(LOG_DEBUG,"%s: terminating\n", logstr);
+    cleanup_plugin();
 
     return LCMAPS_MOD_SUCCESS;
 }
@@ -269,12 +733,22 @@ int plugin_terminate(void) {
 static int plugin_run_or_verify(int argc, lcmaps_argument_t *argv,
 				int lcmaps_mode) {
     const char *        logstr       = NULL;
-    STACK_OF(X509)*	pilot_chain  = NULL;
-    STACK_OF(X509)*	payload_chain= NULL;
-    X509 *		pilot_cert   = NULL;
-    X509 *		payload_cert = NULL;
-    int                 nfqans       = -1;
-    char **             fqans        = NULL;
+    const plugin_config_t *cfg	     = &config;
+    psp_request_t	req;
+    unsigned int	policy;
+    int			shared;
+    int			rejected, remember_reject = 0;
+    psp_counter_t	reason	     = PSP_COUNT_FAILURE;
+    uint64_t		start, stage_start;
+
+    /* Everything allocated below is owned by the request */
+    psp_stats_request_reset();
+    start=psp_stats_start();
+    psp_request_init(&req);
+    /* Before the payload is parsed, its pilot is the X509_USER_PROXY, unless
+     * it still needs to be found in the directory */
+    if (!cfg->pilot_dir)
+	req.log_pilot=getenv("X509_USER_PROXY");
 
     /* Set suitable logstr */
     if (lcmaps_mode == PLUGIN_RUN)
@@ -287,87 +761,448 @@ static int plugin_run_or_verify(int argc, lcmaps_argument_t *argv,
         goto fail_plugin;
     }
 
-    /* Get X509_USER_PROXY */
-    if (psp_get_pilot_proxy(&pilot_chain, lock_type))
-	goto fail_plugin;
+    /* The checks are ordered by cost: first those on the framework data,
+     * then those on the names and properties of the payload, and only then
+     * those needing the X509_USER_PROXY, ending with the signature. */
 
-    /* Get payload proxy (typically PEM string)	*/
-    if (psp_get_payload_proxy(&payload_chain, argc, argv))
+    /* Get FQANs when needed and check them against all patterns in one
+     * pass, which doesn't even need the payload */
+    stage_start=psp_stats_start();
+    if (cfg->add_pilot_fqans || cfg->fqan_matcher)    {
+	if (psp_get_fqans(&req.nfqans, &req.fqans, argc, argv))
+	    goto fail_plugin;
+    }
+    if (cfg->fqan_matcher &&
+	psp_fqan_match(cfg->fqan_matcher, req.nfqans, req.fqans,
+		       &req.fqan_result)==0)	{
+	if (req.fqan_result.denied>=0)
+	    psp_log_warning_path(req.log_pilot,
+		"%s: proxy contains FQAN %s matching denied pattern %s\n",
+		logstr, req.fqans[req.fqan_result.denied],
+		req.fqan_result.deny_pattern);
+	else
+	    psp_log_warning_path(req.log_pilot,
+		"%s: proxy does not contain required FQAN(-pattern)\n",
+		logstr);
+	reason=PSP_COUNT_FAIL_FQAN;
 	goto fail_plugin;
+    }
+    if (req.fqan_result.allowed>=0)
+	psp_log(LOG_DEBUG, "%s: found FQAN matching %s: %s\n",
+		logstr, req.fqan_result.allow_pattern,
+		req.fqans[req.fqan_result.allowed]);
+    psp_stats_record(PSP_STAGE_FQAN, stage_start);
 
-    /* Get FQANs when needed */
-    if (add_pilot_fqans || fqan_pattern)    {
-	if (psp_get_fqans(&nfqans, &fqans, argc, argv))
-	    goto fail_plugin;
+    /* Get payload proxy (typically PEM string) without converting it, such
+     * that a recently rejected one is rejected again right away */
+    stage_start=psp_stats_start();
+    if (psp_get_payload_input(&req, argc, argv))  {
+	reason=PSP_COUNT_FAIL_PAYLOAD;
+	goto fail_plugin;
     }
+    rejected=psp_reject_cache_lookup(&req, &reason);
+    psp_stats_record(PSP_STAGE_REJECT_LOOKUP, stage_start);
+    psp_stats_count(rejected ? PSP_COUNT_REJECT_CACHE_HIT
+			     : PSP_COUNT_REJECT_CACHE_MISS);
+    if (rejected)   {
+	psp_log_warning_path(req.log_pilot,
+	    "%s: payload proxy was rejected recently\n", logstr);
+	goto fail_plugin;
+    }
+    remember_reject=1;
 
-    /* Get leaf proxies */
-    pilot_cert=sk_X509_value(pilot_chain,0);
-    payload_cert=sk_X509_value(payload_chain,0);
-    if (pilot_cert==NULL || payload_cert==NULL)	{
-	lcmaps_log(LOG_WARNING, "%s: cannot get leaf proxy certs from chains\n",
-		logstr);
+    stage_start=psp_stats_start();
+    if (psp_get_payload_proxy(&req))  {
+	reason=PSP_COUNT_FAIL_PAYLOAD;
 	goto fail_plugin;
     }
+    psp_stats_record(PSP_STAGE_PAYLOAD, stage_start);
 
-    /* Check whether chains are valid RFC proxies */
-    if (psp_proxy_is_rfc(pilot_cert)==0)    {
-	lcmaps_log(LOG_WARNING,
-	    "%s: pilot proxy is not RFC compliant\n", logstr);
+    /* Check the payload first, as that needs neither the X509_USER_PROXY nor
+     * any of the caches */
+    stage_start=psp_stats_start();
+    if (psp_check_payload_subject(&req))	{
+	reason=PSP_COUNT_FAIL_ISSUER;
 	goto fail_plugin;
     }
-    if (psp_proxy_is_rfc(payload_cert)==0)	{
-	lcmaps_log(LOG_WARNING,
+    if (psp_classify_proxy(req.payload_cert, &req.payload_info))	{
+	psp_log_warning(req.payload_cert,
+	    "%s: cannot classify payload proxy cert\n", logstr);
+	reason=PSP_COUNT_FAIL_PAYLOAD;
+	goto fail_plugin;
+    }
+    req.have_payload_info=1;
+    if (req.payload_info.is_rfc==0)	{
+	psp_log_warning(req.payload_cert,
 	    "%s: payload proxy is not RFC compliant\n", logstr);
+	reason=PSP_COUNT_FAIL_NOT_RFC;
 	goto fail_plugin;
     }
-
-    /* Check whether either proxy is not LIMITED */
-    if (require_limited)    {
-	if (psp_proxy_is_limited(pilot_cert)==0)	{
-	    lcmaps_log(LOG_WARNING,
-		"%s: pilot proxy is not a Limited proxy\n", logstr);
-	    goto fail_plugin;
-	}
-	if (psp_proxy_is_limited(payload_cert)==0)	{
-	    lcmaps_log(LOG_WARNING,
-		"%s: payload proxy is not a Limited proxy\n", logstr);
-	    goto fail_plugin;
-	}
+    if (cfg->require_limited && req.payload_info.is_limited==0)	{
+	psp_log_warning(req.payload_cert,
+	    "%s: payload proxy is not a Limited proxy\n", logstr);
+	reason=PSP_COUNT_FAIL_NOT_LIMITED;
+	goto fail_plugin;
+    }
+    if (!proxy_valid_now(&req.payload_info))	{
+	psp_log_warning(req.payload_cert,
+	    "%s: payload proxy is not valid at this time\n", logstr);
+	reason=PSP_COUNT_FAIL_EXPIRED;
+	goto fail_plugin;
+    }
+    if (psp_check_key_policy(req.payload_cert, "payload", cfg->key_types,
+			     cfg->min_rsa_bits))	{
+	reason=PSP_COUNT_FAIL_KEY;
+	goto fail_plugin;
     }
+    psp_stats_record(PSP_STAGE_PAYLOAD_CHECKS, stage_start);
 
-    /* Check pattern */
-    if (fqan_pattern && (psp_match_fqan(nfqans, fqans, fqan_pattern)==0))   {
-	lcmaps_log(LOG_WARNING,
-	    "%s: proxy does not contain required FQAN(-pattern) %s\n",
-	    logstr, fqan_pattern);
+    /* In directory mode, find the pilot that issued the payload. Since the
+     * pilot might still be added, this is not remembered as rejection. */
+    if (cfg->pilot_dir && (req.pilot_path=psp_pilotdir_find(&req))==NULL)  {
+	remember_reject=0;
+	reason=PSP_COUNT_FAIL_PILOT;
 	goto fail_plugin;
     }
 
-    /* Do actual verification */
-    if (psp_verify_proxy_signature(payload_cert, pilot_cert))
+    /* A verdict shared by another process for the X509_USER_PROXY, as it is
+     * now, and this payload chain saves reading and verifying it */
+    policy=(cfg->require_limited ? POLICY_LIMITED : 0) |
+	   (cfg->cert_store ? POLICY_CERTDIR : 0) |
+	   (cfg->key_types << POLICY_KEY_TYPES_SHIFT) |
+	   ((unsigned int)cfg->min_rsa_bits << POLICY_RSA_BITS_SHIFT);
+    shared=0;
+    if (cfg->shared_cache)  {
+	stage_start=psp_stats_start();
+	shared=psp_shm_lookup(cfg->shared_cache, &req, policy);
+	psp_stats_record(PSP_STAGE_SHARED_LOOKUP, stage_start);
+	psp_stats_count(shared!=0 ? PSP_COUNT_SHARED_CACHE_HIT
+				  : PSP_COUNT_SHARED_CACHE_MISS);
+    }
+    if (shared<0)   {
+	/* Already remembered by the shared cache */
+	remember_reject=0;
+	reason=PSP_COUNT_FAIL_SIGNATURE;
 	goto fail_plugin;
-    
-    /* Store the DN of the payload cert as user_dn */
-    if (psp_store_proxy_dn(payload_cert))
+    }
+    if (shared==0 && check_pilot(cfg, &req, policy, logstr, &reason))	{
+	/* Without a (valid) X509_USER_PROXY, the payload is not to blame */
+	if (reason==PSP_COUNT_FAIL_PILOT)
+	    remember_reject=0;
 	goto fail_plugin;
+    }
+    remember_reject=0;
 
-    /* Store the FQANs of the proxy when add_pilot_fqans==1 */
-    if (add_pilot_fqans && psp_store_fqans(nfqans, fqans))
+    /* Store the DN of the payload cert as user_dn and, when
+     * add_pilot_fqans==1, the FQANs of the proxy */
+    stage_start=psp_stats_start();
+    if (psp_store_credentials(&req, cfg->add_pilot_fqans, cfg->add_vo_data))
+    {
+	reason=PSP_COUNT_FAIL_STORE;
 	goto fail_plugin;
-   
-    /* Cleanup chain memory */
-    psp_cleanup_chains(pilot_chain, payload_chain);
+    }
+    psp_stats_record(PSP_STAGE_STORE, stage_start);
+
+    if (cfg->log_requests)
+	log_request(&req, logstr, PSP_COUNT_SUCCESS, start);
+    else
+	psp_log(LOG_INFO,"%s: %s plugin succeeded\n", logstr, PLUGIN_PREFIX);
+
+    /* Cleanup request memory */
+    psp_request_cleanup(&req);
 
-    lcmaps_log(LOG_INFO,"%s: %s plugin succeeded\n", logstr, PLUGIN_PREFIX);
+    psp_stats_record(PSP_STAGE_TOTAL, start);
+    psp_stats_count(PSP_COUNT_SUCCESS);
+    psp_stats_poll();
 
     return LCMAPS_MOD_SUCCESS;
 
 fail_plugin:
-    /* Cleanup chain memory */
-    psp_cleanup_chains(pilot_chain, payload_chain);
+    /* Remember rejections due to the payload, before the request is gone */
+    if (remember_reject)
+	psp_reject_cache_store(&req, reason);
 
-    lcmaps_log(LOG_INFO,"%s: %s plugin failed\n", logstr, PLUGIN_PREFIX);
+    if (cfg->log_requests)
+	log_request(&req, logstr, reason, start);
+    else
+	psp_log(LOG_INFO,"%s: %s plugin failed\n", logstr, PLUGIN_PREFIX);
+
+    /* Cleanup request memory */
+    psp_request_cleanup(&req);
+
+    psp_stats_record(PSP_STAGE_TOTAL, start);
+    psp_stats_count(PSP_COUNT_FAILURE);
+    if (reason!=PSP_COUNT_FAILURE)
+	psp_stats_count(reason);
+    psp_stats_poll();
 
     return LCMAPS_MOD_FAIL;
 }
+
+/**
+ * Parses the comma separated list of key types in str, each of "rsa", "ec"
+ * and "ed25519", into a bitmask of PSP_KEY_* values.
+ * \return 0 on success, -1 when str contains an unknown type or is empty
+ */
+static int parse_key_types(const char *str, unsigned int *key_types)	{
+    static const struct {
+	const char *name;
+	unsigned int type;
+    } names[] = {
+	{"rsa", PSP_KEY_RSA},
+	{"ec", PSP_KEY_EC},
+	{"ed25519", PSP_KEY_ED25519},
+    };
+    unsigned int types=0;
+    const char *end;
+    size_t len, i;
+
+    for (;;)	{
+	end=strchr(str, ',');
+	len=(end ? (size_t)(end-str) : strlen(str));
+	for (i=0; i<sizeof(names)/sizeof(names[0]); i++)    {
+	    if (strlen(names[i].name)==len &&
+		strncmp(names[i].name, str, len)==0)
+		break;
+	}
+	if (i==sizeof(names)/sizeof(names[0]))
+	    return -1;
+	types|=names[i].type;
+	if (end==NULL)
+	    break;
+	str=end+1;
+    }
+
+    *key_types=types;
+    return 0;
+}
+
+/**
+ * Checks whether the current time is within the validity of a proxy, using
+ * the times obtained by psp_classify_proxy().
+ * \return 1 when valid, 0 when not
+ */
+static int proxy_valid_now(const psp_proxy_info_t *info)	{
+    time_t now=time(NULL);
+
+    return (info->not_before <= now && now < info->not_after);
+}
+
+/**
+ * Reads the X509_USER_PROXY into the pilot cache and, in integrated mode,
+ * validates its chain. In directory mode, indexes the directory instead,
+ * which reads all pilot proxies into the cache. Since the proxy might not be
+ * there yet during initialization, failures only result in a warning.
+ */
+static void preload_pilot(const char *logstr)	{
+    psp_request_t req;
+    int n;
+
+    if (config.pilot_dir)   {
+	if ( (n=psp_pilotdir_scan())<0 )
+	    lcmaps_log(LOG_WARNING,
+		"%s: cannot preload pilot proxy directory, "
+		"will retry when needed\n", logstr);
+	else
+	    psp_log(LOG_DEBUG, "%s: preloaded %d pilot proxies\n",
+		logstr, n);
+	return;
+    }
+
+    if (getenv("X509_USER_PROXY")==NULL)    {
+	psp_log(LOG_INFO,
+	    "%s: X509_USER_PROXY unset, nothing to preload\n", logstr);
+	return;
+    }
+
+    psp_request_init(&req);
+    if (psp_get_pilot_proxy(&req, config.lock_type, config.read_method, 0) ||
+	(config.cert_store && psp_verify_pilot_chain(&req, config.cert_store)))
+	lcmaps_log(LOG_WARNING,
+	    "%s: cannot preload X509_USER_PROXY, will retry when needed\n",
+	    logstr);
+    else
+	psp_log(LOG_DEBUG, "%s: preloaded X509_USER_PROXY %s\n",
+	    logstr, getenv("X509_USER_PROXY"));
+    psp_request_cleanup(&req);
+}
+
+/**
+ * Obtains the X509_USER_PROXY and checks it and its relation to the payload
+ * proxy in req. The result of the signature check is stored in the shared
+ * cache, when configured, until the first of the proxies (or the validation
+ * of the pilot chain) expires.
+ * \return 0 on success, -1 on failure
+ */
+static int check_pilot(const plugin_config_t *cfg, psp_request_t *req,
+		       unsigned int policy, const char *logstr,
+		       psp_counter_t *reason)	{
+    read_method_t read_method=cfg->read_method;
+    uint64_t start;
+    time_t expiry;
+    int rc;
+
+    /* A file truncated while mapped kills the process, so a multi-threaded
+     * host, noticed by overlapping requests, reads the files from then on */
+    if (read_method==READ_METHOD_MMAP)	{
+	if (__atomic_add_fetch(&pilot_readers, 1, __ATOMIC_RELAXED)>1 &&
+	    __atomic_exchange_n(&mmap_disabled, 1, __ATOMIC_RELAXED)==0)
+	    lcmaps_log(LOG_WARNING,
+		"%s: concurrent requests, reading instead of mapping "
+		"X509_USER_PROXY\n", logstr);
+	if (__atomic_load_n(&mmap_disabled, __ATOMIC_RELAXED))
+	    read_method=READ_METHOD_READ;
+    }
+
+    /* Get X509_USER_PROXY, possibly the cached chain matching the payload */
+    *reason=PSP_COUNT_FAIL_PILOT;
+    start=psp_stats_start();
+    rc=psp_get_pilot_proxy(req, cfg->lock_type, read_method,
+			   cfg->pilot_from_payload_chain);
+    if (cfg->read_method==READ_METHOD_MMAP)
+	__atomic_sub_fetch(&pilot_readers, 1, __ATOMIC_RELAXED);
+    if (rc)
+	return -1;
+    psp_stats_record(PSP_STAGE_PILOT, start);
+    if (req->pilot_cert==NULL)	{
+	psp_log_warning(req->payload_cert,
+	    "%s: cannot get leaf proxy cert from chain\n", logstr);
+	return -1;
+    }
+
+    /* Get the properties of the pilot, the payload is already done */
+    start=psp_stats_start();
+    if (psp_classify_request(req))  {
+	psp_log_warning(req->payload_cert,
+	    "%s: cannot classify pilot proxy cert\n", logstr);
+	return -1;
+    }
+
+    /* Check whether pilot is a valid RFC proxy */
+    if (req->pilot_info.is_rfc==0)    {
+	psp_log_warning(req->payload_cert,
+	    "%s: pilot proxy is not RFC compliant\n", logstr);
+	*reason=PSP_COUNT_FAIL_NOT_RFC;
+	return -1;
+    }
+    if (cfg->require_limited && req->pilot_info.is_limited==0)	{
+	psp_log_warning(req->payload_cert,
+	    "%s: pilot proxy is not a Limited proxy\n", logstr);
+	*reason=PSP_COUNT_FAIL_NOT_LIMITED;
+	return -1;
+    }
+    if (!proxy_valid_now(&(req->pilot_info)))	{
+	psp_log_warning(req->payload_cert,
+	    "%s: pilot proxy is not valid at this time\n", logstr);
+	*reason=PSP_COUNT_FAIL_EXPIRED;
+	return -1;
+    }
+    if (psp_check_payload_issuer(req))	{
+	*reason=PSP_COUNT_FAIL_ISSUER;
+	return -1;
+    }
+    if (psp_check_key_policy(req->pilot_cert, "pilot", cfg->key_types,
+			     cfg->min_rsa_bits))	{
+	*reason=PSP_COUNT_FAIL_KEY;
+	return -1;
+    }
+
+    /* In integrated mode, check that the payload chain is the pilot chain
+     * plus one proxy and validate the pilot chain, instead of relying on
+     * lcmaps_verify_proxy.mod for the whole payload chain */
+    if (cfg->cert_store &&
+	(psp_verify_payload_link(req) ||
+	 psp_verify_pilot_chain(req, cfg->cert_store)))	{
+	*reason=PSP_COUNT_FAIL_CHAIN;
+	return -1;
+    }
+    psp_stats_record(PSP_STAGE_PILOT_CHECKS, start);
+
+    /* Do actual verification */
+    start=psp_stats_start();
+    rc=psp_verify_proxy_signature(req);
+    psp_stats_record(PSP_STAGE_SIGNATURE, start);
+    if (rc!=0)
+	*reason=PSP_COUNT_FAIL_SIGNATURE;
+
+    if (cfg->shared_cache)  {
+	expiry=(req->payload_info.not_after < req->pilot_info.not_after ?
+		req->payload_info.not_after : req->pilot_info.not_after);
+	if (cfg->cert_store && req->pilot_chain_valid_until < expiry)
+	    expiry=req->pilot_chain_valid_until;
+	psp_shm_store(cfg->shared_cache, req, policy, rc, expiry);
+    }
+
+    return rc;
+}
+
+/**
+ * Logs one line describing the request, for --log-requests: the pilot as
+ * psp_log_pilot_hash(), the payload DN, the verdict, being "ok" for
+ * PSP_COUNT_SUCCESS and otherwise the name of the failure counter, and the
+ * durations in microseconds of the whole request since start and of each
+ * stage it went through.
+ */
+static void log_request(const psp_request_t *req, const char *logstr,
+			psp_counter_t verdict, uint64_t start)	{
+    char dn[256], times[256];
+    const char *payload_dn=req->payload_dn;
+    uint64_t now, ns;
+    size_t len=0;
+    int stage, n;
+
+    if (!psp_log_enabled(LOG_INFO))
+	return;
+
+    if (payload_dn==NULL && req->payload_cert)
+	payload_dn=X509_NAME_oneline(X509_get_subject_name(req->payload_cert),
+				     dn, (int)sizeof(dn));
+
+    times[0]='\0';
+    for (stage=0; stage<PSP_STAGE_TOTAL; stage++)  {
+	if ( (ns=psp_stats_request_time((psp_stage_t)stage))==0 )
+	    continue;
+	n=snprintf(times+len, sizeof(times)-len, " %s=%llu",
+		   psp_stats_stage_name((psp_stage_t)stage),
+		   (unsigned long long)(ns/1000));
+	if (n<0 || (size_t)n>=sizeof(times)-len)
+	    break;
+	len+=(size_t)n;
+    }
+    now=psp_stats_start();
+
+    lcmaps_log(LOG_INFO,
+	"%s: request pilot=%08lx payload=\"%s\" verdict=%s total=%llu%s\n",
+	logstr, psp_log_pilot_hash(req->payload_cert),
+	payload_dn ? payload_dn : "", verdict==PSP_COUNT_SUCCESS ? "ok" :
+	psp_stats_counter_name(verdict),
+	(unsigned long long)(now>start && start!=0 ? (now-start)/1000 : 0),
+	times);
+}
+
+/**
+ * Releases everything set up by plugin_initialize() once the configuration
+ * is in place: the caches, the pilot proxy directory, the proxy OIDs, the
+ * change detector, the statistics and their SIGUSR1 handler, the rate limiter
+ * and the FQAN matcher, certificate store and shared cache of config. Used by
+ * plugin_terminate() and for failures during initialization; calling it
+ * again is harmless.
+ */
+static void cleanup_plugin(void)	{
+    /* Free the cached pilot proxy chains and verification results */
+    psp_cleanup_pilot_cache();
+    psp_cleanup_verdict_cache();
+    psp_cleanup_reject_cache();
+    psp_pilotdir_cleanup();
+    psp_oid_cleanup();
+    psp_watch_cleanup();
+    psp_stats_cleanup();
+    psp_stats_request_times(0);
+    psp_log_cleanup();
+    psp_fqan_matcher_free(config.fqan_matcher);
+    config.fqan_matcher=NULL;
+    X509_STORE_free(config.cert_store);
+    config.cert_store=NULL;
+    psp_shm_close(config.shared_cache);
+    config.shared_cache=NULL;
+}
@@ -0,0 +1,180 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+/**
+ * NOTES: per-request arena. Everything a single run or verify allocates comes
+ * from the arena or is registered with it, such that both the success and
+ * the failure path only need a single psp_arena_reset(). */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lcmaps_pilot_sub_proxy_arena.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/** Alignment of all allocations */
+#define ARENA_ALIGN	    (sizeof(union { long double d; void *p; long l; }))
+
+/** Rounds size up to a multiple of ARENA_ALIGN */
+#define ARENA_ROUND(size)   (((size)+ARENA_ALIGN-1) & ~(ARENA_ALIGN-1))
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Extra memory block, data follows the (aligned) header */
+struct psp_arena_block_s    {
+    psp_arena_block_t *next;	/* previous block */
+    size_t size;		/* usable bytes after the header */
+};
+
+/** Object to be released on reset, allocated from the arena itself */
+struct psp_arena_release_s  {
+    psp_arena_release_t *next;
+    psp_release_fn_t release;
+    void *obj;
+};
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * Initializes an empty arena
+ */
+void psp_arena_init(psp_arena_t *arena) {
+    arena->used=0;
+    arena->blocks=NULL;
+    arena->releases=NULL;
+}
+
+/**
+ * Allocates size bytes from the arena, suitably aligned for any type. The
+ * memory is not initialized.
+ * \return pointer to the memory or NULL when out of memory
+ */
+void *psp_arena_alloc(psp_arena_t *arena, size_t size)	{
+    const size_t header=ARENA_ROUND(sizeof(psp_arena_block_t));
+    psp_arena_block_t *block=arena->blocks;
+    size_t avail, block_size;
+    unsigned char *data;
+
+    if (size==0)
+	size=1;
+    if (size > (size_t)-1 - header - ARENA_ALIGN)
+	return NULL;
+    size=ARENA_ROUND(size);
+
+    /* Try the current block */
+    if (block)	{
+	avail=block->size;
+	data=(unsigned char *)block+header;
+    } else {
+	avail=sizeof(arena->inline_block.data);
+	data=arena->inline_block.data;
+    }
+    if (avail-arena->used >= size)	{
+	data+=arena->used;
+	arena->used+=size;
+	return data;
+    }
+
+    /* Start a new block, large enough for size */
+    block_size=(size > PSP_ARENA_BLOCK_SIZE ? size : PSP_ARENA_BLOCK_SIZE);
+    if ( (block=(psp_arena_block_t *)malloc(header+block_size))==NULL )
+	return NULL;
+    block->next=arena->blocks;
+    block->size=block_size;
+    arena->blocks=block;
+    arena->used=size;
+
+    return (unsigned char *)block+header;
+}
+
+/**
+ * Copies the '\0' terminated string str into the arena.
+ * \return copy of str or NULL when out of memory
+ */
+char *psp_arena_strdup(psp_arena_t *arena, const char *str)  {
+    size_t len=strlen(str)+1;
+    char *copy;
+
+    if ( (copy=(char *)psp_arena_alloc(arena, len)) )
+	memcpy(copy, str, len);
+
+    return copy;
+}
+
+/**
+ * Transfers ownership of obj to the arena: release(obj) will be called upon
+ * psp_arena_reset(), in reverse order of calls to psp_arena_own(). When obj
+ * cannot be registered it is released immediately. NULL obj is ignored.
+ * \return 0 on success, -1 when out of memory
+ */
+int psp_arena_own(psp_arena_t *arena, psp_release_fn_t release, void *obj)  {
+    psp_arena_release_t *rel;
+
+    if (obj==NULL)
+	return 0;
+
+    if ( (rel=(psp_arena_release_t *)
+		psp_arena_alloc(arena, sizeof(psp_arena_release_t)))==NULL )
+    {
+	release(obj);
+	return -1;
+    }
+    rel->release=release;
+    rel->obj=obj;
+    rel->next=arena->releases;
+    arena->releases=rel;
+
+    return 0;
+}
+
+/**
+ * Releases all the objects owned by the arena and gives back all its memory,
+ * after which it can be reused as if just initialized.
+ */
+void psp_arena_reset(psp_arena_t *arena)    {
+    psp_arena_release_t *rel;
+    psp_arena_block_t *block;
+
+    /* Release objects first: the list lives in the blocks */
+    for (rel=arena->releases; rel; rel=rel->next)
+	rel->release(rel->obj);
+    arena->releases=NULL;
+
+    while ( (block=arena->blocks) )	{
+	arena->blocks=block->next;
+	free(block);
+    }
+    arena->used=0;
+}
@@ -0,0 +1,106 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+#ifndef LCMAPS_PILOT_SUB_PROXY_ARENA_H
+#define LCMAPS_PILOT_SUB_PROXY_ARENA_H
+
+#include <stddef.h>
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/** Size of the block inside the arena itself, large enough for a typical
+ * request, including a pilot proxy file */
+#define PSP_ARENA_INLINE_SIZE	16384
+
+/** Minimum size of extra blocks, allocated when the inline block is full */
+#define PSP_ARENA_BLOCK_SIZE	16384
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Function releasing an object owned by the arena */
+typedef void (*psp_release_fn_t)(void *obj);
+
+/** Extra memory block of an arena */
+typedef struct psp_arena_block_s psp_arena_block_t;
+
+/** Object to be released on reset of an arena */
+typedef struct psp_arena_release_s psp_arena_release_t;
+
+/** Per-request bump allocator. Memory is only given back, and owned objects
+ * are only released, by psp_arena_reset() */
+typedef struct psp_arena_s  {
+    union   {
+	unsigned char data[PSP_ARENA_INLINE_SIZE];
+	long double align;	/* alignment of the inline block */
+    } inline_block;
+    size_t used;		/* used bytes in current block */
+    psp_arena_block_t *blocks;	/* extra blocks, most recent first */
+    psp_arena_release_t *releases; /* owned objects, most recent first */
+} psp_arena_t;
+
+
+/************************************************************************
+ * Function prototypes
+ ************************************************************************/
+
+/**
+ * Initializes an empty arena
+ */
+void psp_arena_init(psp_arena_t *arena);
+
+/**
+ * Allocates size bytes from the arena, suitably aligned for any type. The
+ * memory is not initialized.
+ * \return pointer to the memory or NULL when out of memory
+ */
+void *psp_arena_alloc(psp_arena_t *arena, size_t size);
+
+/**
+ * Copies the '\0' terminated string str into the arena.
+ * \return copy of str or NULL when out of memory
+ */
+char *psp_arena_strdup(psp_arena_t *arena, const char *str);
+
+/**
+ * Transfers ownership of obj to the arena: release(obj) will be called upon
+ * psp_arena_reset(), in reverse order of calls to psp_arena_own(). When obj
+ * cannot be registered it is released immediately. NULL obj is ignored.
+ * \return 0 on success, -1 when out of memory
+ */
+int psp_arena_own(psp_arena_t *arena, psp_release_fn_t release, void *obj);
+
+/**
+ * Releases all the objects owned by the arena and gives back all its memory,
+ * after which it can be reused as if just initialized.
+ */
+void psp_arena_reset(psp_arena_t *arena);
+
+#endif /* LCMAPS_PILOT_SUB_PROXY_ARENA_H */
@@ -0,0 +1,668 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+/**
+ * NOTES: the proxy checks shared by the LCMAPS plugin and libpsp. Nothing in
+ * here logs or uses LCMAPS, callers describe failures from the return values.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <openssl/x509.h>
+#include <openssl/x509v3.h> /* proxy info */
+#include <openssl/objects.h>
+#include <openssl/pem.h>
+#include <openssl/err.h>
+
+#include "lcmaps_pilot_sub_proxy_core.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+#define OID_RFC_PROXY       "1.3.6.1.5.5.7.1.14"  /* OID for RFC3820 proxy */
+#define OID_LIMITED_PROXY   "1.3.6.1.4.1.3536.1.1.1.9"  /* OID limited proxy */
+
+/** Maximum length of the path of a CRL file in a certdir */
+#define CRL_PATH_MAX	    4096
+
+/* The CRL lookup callback got const arguments in OpenSSL 3 */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#   define LOOKUP_CONST	    const
+#else
+#   define LOOKUP_CONST
+#endif
+
+
+/************************************************************************
+ * Global variables
+ ************************************************************************/
+
+/** OID registry: objects for the proxy OIDs, resolved by psp_oid_init() */
+static ASN1_OBJECT *rfc_proxy_obj=NULL;
+static ASN1_OBJECT *limited_proxy_obj=NULL;
+
+/** Index of the certdir in the ex_data of a store made by
+ * psp_core_cert_store_new(), set once by certdir_index_init() */
+static int certdir_index=-1;
+static pthread_once_t certdir_index_once=PTHREAD_ONCE_INIT;
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Verification callback for psp_core_verify_chain()
+ * \return 1 when the certificate is acceptable, 0 when not */
+static int verify_callback(int ok, X509_STORE_CTX *ctx);
+
+/* CRL lookup for a store made by psp_core_cert_store_new(): reads the CRLs
+ * for name from its certdir on every call, unlike X509_LOOKUP_hash_dir(),
+ * which never reads a CRL file again once it has been loaded.
+ * \return stack of CRLs, possibly empty, or NULL on memory error */
+static STACK_OF(X509_CRL) *lookup_crls(LOOKUP_CONST X509_STORE_CTX *ctx,
+				       LOOKUP_CONST X509_NAME *name);
+
+/* Gets certdir_index */
+static void certdir_index_init(void);
+
+/* Frees the certdir of a store */
+static void certdir_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+			 int idx, long argl, void *argp);
+
+/* Drops the entries of cache that expired at now */
+static void verdict_cache_expire(psp_verdict_cache_t *cache, time_t now);
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * Resolves the OIDs for RFC and limited proxies once, such that the checks
+ * can compare objects instead of their text representations.
+ * \return 0 on success, -1 on error
+ */
+int psp_oid_init(void)	{
+    if (rfc_proxy_obj==NULL)
+	rfc_proxy_obj=OBJ_txt2obj(OID_RFC_PROXY, 1);
+    if (limited_proxy_obj==NULL)
+	limited_proxy_obj=OBJ_txt2obj(OID_LIMITED_PROXY, 1);
+
+    if (rfc_proxy_obj==NULL || limited_proxy_obj==NULL)	{
+	psp_oid_cleanup();
+	return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Frees the objects created by psp_oid_init()
+ */
+void psp_oid_cleanup(void)	{
+    ASN1_OBJECT_free(rfc_proxy_obj);
+    rfc_proxy_obj=NULL;
+    ASN1_OBJECT_free(limited_proxy_obj);
+    limited_proxy_obj=NULL;
+}
+
+/**
+ * Obtains the ASN.1 object of the RFC proxy OID, set by psp_oid_init()
+ * \return object or NULL when not initialized
+ */
+const ASN1_OBJECT *psp_oid_rfc_proxy(void)  {
+    return rfc_proxy_obj;
+}
+
+/**
+ * Obtains the properties of given proxy certificate in a single pass over its
+ * extensions. A proxy with more than one ProxyCertInfo extension, or with one
+ * that cannot be decoded, is considered neither RFC nor limited. A path
+ * length constraint that is not a valid non-negative number counts as 0.
+ * \return 0 on success, -1 when the OIDs cannot be resolved or the validity
+ * of proxy cannot be parsed
+ */
+int psp_core_classify(X509 *proxy, psp_proxy_info_t *info)	{
+    int ext_count, i, found=0;
+    int64_t path_len;
+    X509_EXTENSION *ex;
+    ASN1_OBJECT *obj;
+    PROXY_CERT_INFO_EXTENSION *pci = NULL;
+    ASN1_OBJECT *policy_lang = NULL;
+
+    memset(info, 0, sizeof(psp_proxy_info_t));
+    info->path_len=-1;
+    info->policy_lang_nid=NID_undef;
+
+    /* Make sure the OID registry is filled */
+    if (rfc_proxy_obj==NULL && psp_oid_init()!=0)
+	return -1;
+
+    /* Validity and subject hash */
+    if (psp_core_asn1_time(X509_get_notBefore(proxy), &(info->not_before)) ||
+	psp_core_asn1_time(X509_get_notAfter(proxy), &(info->not_after)) )
+	return -1;
+    info->subject_hash=X509_NAME_hash(X509_get_subject_name(proxy));
+
+    /* Loop of all certificate extensions */
+    ext_count=X509_get_ext_count(proxy);
+    for (i = 0; i < ext_count; i++) {
+	ex = X509_get_ext(proxy, i);
+	if ( (obj=X509_EXTENSION_get_object(ex))==NULL ||
+	     OBJ_cmp(obj, rfc_proxy_obj)!=0 )
+	    continue;
+
+	/* Found RFC proxy extension, it should appear only once */
+	if (found++)	{
+	    info->is_rfc=0;
+	    info->is_limited=0;
+	    info->path_len=-1;
+	    info->policy_lang_nid=NID_undef;
+	    return 0;
+	}
+
+	/* Get Proxy Certificate Information and its policyLanguage */
+	if ( (pci=X509V3_EXT_d2i(ex))==NULL )
+	    continue;
+	info->is_rfc=1;
+	if (pci->pcPathLengthConstraint &&
+	    (ASN1_INTEGER_get_int64(&path_len, pci->pcPathLengthConstraint)!=1 ||
+	     path_len<0))
+	    info->path_len=0;
+	else if (pci->pcPathLengthConstraint)
+	    info->path_len=(path_len>INT_MAX ? INT_MAX : (long)path_len);
+	if ( pci->proxyPolicy &&
+	     (policy_lang=pci->proxyPolicy->policyLanguage) )	{
+	    info->policy_lang_nid=OBJ_obj2nid(policy_lang);
+	    if (OBJ_cmp(policy_lang, limited_proxy_obj)==0)
+		info->is_limited=1;
+	}
+	/* Free up memory */
+	PROXY_CERT_INFO_EXTENSION_free(pci);
+    }
+
+    return 0;
+}
+
+/**
+ * Converts an ASN1_TIME into a time_t.
+ * \return 0 on success, -1 on error
+ */
+int psp_core_asn1_time(const ASN1_TIME *asn1_time, time_t *t)	{
+    int days, secs;
+
+    /* Difference with respect to the current time */
+    if (asn1_time==NULL || ASN1_TIME_diff(&days, &secs, NULL, asn1_time)!=1)
+	return -1;
+
+    *t=time(NULL) + (time_t)days*86400 + (time_t)secs;
+
+    return 0;
+}
+
+/**
+ * Obtains the PSP_KEY_* type of given public key and, when bits is not NULL,
+ * its size in bits.
+ * \return key type, 0 when it is not one of the supported types
+ */
+int psp_key_type(EVP_PKEY *key, int *bits)	{
+    int type;
+
+    if (key==NULL)
+	return 0;
+
+    switch (EVP_PKEY_base_id(key))  {
+	case EVP_PKEY_RSA:
+#ifdef EVP_PKEY_RSA_PSS
+	case EVP_PKEY_RSA_PSS:
+#endif
+	    type=PSP_KEY_RSA;
+	    break;
+	case EVP_PKEY_EC:
+	    type=PSP_KEY_EC;
+	    break;
+#ifdef EVP_PKEY_ED25519
+	case EVP_PKEY_ED25519:
+	    type=PSP_KEY_ED25519;
+	    break;
+#endif
+	default:
+	    return 0;
+    }
+    if (bits)
+	*bits=EVP_PKEY_bits(key);
+
+    return type;
+}
+
+/**
+ * Checks that the public key of cert is of one of the allowed_types
+ * (bitmask of PSP_KEY_*) and, for RSA, has at least min_rsa_bits bits.
+ * \return 0 when the key is allowed, -1 when cert has no usable public key,
+ * -2 when its type is not allowed, -3 when it is too small
+ */
+int psp_core_check_key(X509 *cert, unsigned int allowed_types,
+		       int min_rsa_bits)	{
+    EVP_PKEY *key;
+    int type, bits=0;
+
+    if ( (key=X509_get0_pubkey(cert))==NULL )
+	return -1;
+
+    type=psp_key_type(key, &bits);
+    if ( (type & allowed_types)==0 )
+	return -2;
+    if (type==PSP_KEY_RSA && bits<min_rsa_bits)
+	return -3;
+
+    return 0;
+}
+
+/**
+ * Checks that the subject of proxy is its issuer plus a CN in a new RDN, as
+ * for every proxy. Only compares the names, hence it is cheap enough to be
+ * done before anything else.
+ * \return 0 when it is, -1 when the subject does not end with a CN, -2 when
+ * it does not extend the issuer, -3 on memory error
+ */
+int psp_core_check_subject(X509 *proxy)	{
+    X509_NAME *subject, *name;
+    X509_NAME_ENTRY *ne;
+    int n, rc;
+
+    subject=X509_get_subject_name(proxy);
+    n=X509_NAME_entry_count(subject);
+    if (n<2 ||
+	(ne=X509_NAME_get_entry(subject, n-1))==NULL ||
+	OBJ_obj2nid(X509_NAME_ENTRY_get_object(ne))!=NID_commonName ||
+	X509_NAME_ENTRY_set(ne)==
+	    X509_NAME_ENTRY_set(X509_NAME_get_entry(subject, n-2)))
+	return -1;
+    if ( (name=X509_NAME_dup(subject))==NULL )
+	return -3;
+    X509_NAME_ENTRY_free(X509_NAME_delete_entry(name, n-1));
+    rc=X509_NAME_cmp(name, X509_get_issuer_name(proxy));
+    X509_NAME_free(name);
+
+    return (rc==0 ? 0 : -2);
+}
+
+/**
+ * Checks whether chain equals the certificates of payload_chain following its
+ * leaf. X509_cmp() compares the cached digests and encodings.
+ * \return 1 when it does, 0 otherwise
+ */
+int psp_core_chain_is_suffix(STACK_OF(X509) *chain,
+			     STACK_OF(X509) *payload_chain)	{
+    int i, n=sk_X509_num(chain);
+
+    if (n<1 || sk_X509_num(payload_chain)!=n+1)
+	return 0;
+
+    for (i=0; i<n; i++)	{
+	if (X509_cmp(sk_X509_value(chain, i),
+		     sk_X509_value(payload_chain, i+1))!=0)
+	    return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Checks that the proxies in chain, with its leaf first, allow one more
+ * proxy below the leaf according to their path length constraints. A
+ * certificate with extensions OpenSSL considers invalid allows nothing.
+ * \return 1 when they do, 0 otherwise
+ */
+int psp_core_chain_allows_proxy(STACK_OF(X509) *chain)	{
+    X509 *cert;
+    long path_len;
+    uint32_t flags;
+    int i;
+
+    for (i=0; i<sk_X509_num(chain); i++)	{
+	cert=sk_X509_value(chain, i);
+	if ( (flags=X509_get_extension_flags(cert)) & EXFLAG_INVALID )
+	    return 0;
+	if ((flags & EXFLAG_PROXY)==0)
+	    continue;
+	path_len=X509_get_proxy_pathlen(cert);
+	if (path_len>=0 && path_len<=i)
+	    return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Computes the SHA-256 digest of the digests of all certs in chain into
+ * fingerprint, using leaf_digest for its leaf when not NULL. Unlike the
+ * digest of the leaf, this identifies the whole chain.
+ * \return 0 on success, -1 on error
+ */
+int psp_core_chain_fingerprint(STACK_OF(X509) *chain,
+			       const unsigned char *leaf_digest,
+			       unsigned char *fingerprint)  {
+    unsigned char digest[PSP_DIGEST_LEN];
+    unsigned int len;
+    EVP_MD_CTX *ctx;
+    int i, rc=-1;
+
+    if (sk_X509_num(chain)<1 || (ctx=EVP_MD_CTX_new())==NULL)
+	return -1;
+    if (EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)!=1)
+	goto end;
+    for (i=0; i<sk_X509_num(chain); i++)    {
+	if (i==0 && leaf_digest)
+	    memcpy(digest, leaf_digest, PSP_DIGEST_LEN);
+	else if (!X509_digest(sk_X509_value(chain, i), EVP_sha256(), digest,
+			      &len) || len!=PSP_DIGEST_LEN)
+	    goto end;
+	if (EVP_DigestUpdate(ctx, digest, PSP_DIGEST_LEN)!=1)
+	    goto end;
+    }
+    if (EVP_DigestFinal_ex(ctx, fingerprint, &len)==1 && len==PSP_DIGEST_LEN)
+	rc=0;
+
+end:
+    EVP_MD_CTX_free(ctx);
+    return rc;
+}
+
+/**
+ * Creates a certificate store for psp_core_verify_chain() for the CA
+ * certificates and CRLs in the hashed directory certdir. CA certificates are
+ * read once, CRLs each time a chain is validated, such that updated CRLs are
+ * used without creating a new store.
+ * \return new store or NULL when certdir is not a usable directory or on
+ * memory error
+ */
+X509_STORE *psp_core_cert_store_new(const char *certdir)	{
+    X509_STORE *store;
+    X509_LOOKUP *lookup;
+    char *certdir_copy;
+    struct stat st;
+
+    if (stat(certdir, &st)!=0 || !S_ISDIR(st.st_mode))
+	return NULL;
+
+    pthread_once(&certdir_index_once, certdir_index_init);
+    if (certdir_index<0)
+	return NULL;
+
+    if ( (store=X509_STORE_new())==NULL ||
+	 (lookup=X509_STORE_add_lookup(store, X509_LOOKUP_hash_dir()))==NULL ||
+	 X509_LOOKUP_add_dir(lookup, certdir, X509_FILETYPE_PEM)!=1 )	{
+	X509_STORE_free(store);
+	return NULL;
+    }
+    /* The store owns the copy once set */
+    if ( (certdir_copy=strdup(certdir))==NULL ||
+	 X509_STORE_set_ex_data(store, certdir_index, certdir_copy)!=1 )	{
+	free(certdir_copy);
+	X509_STORE_free(store);
+	return NULL;
+    }
+    X509_STORE_set_lookup_crls(store, lookup_crls);
+
+    /* Pilot chains contain proxies, CRLs are used when present */
+    X509_STORE_set_flags(store, X509_V_FLAG_ALLOW_PROXY_CERTS |
+				X509_V_FLAG_CRL_CHECK |
+				X509_V_FLAG_CRL_CHECK_ALL);
+    X509_STORE_set_verify_cb(store, verify_callback);
+
+    return store;
+}
+
+/**
+ * Validates chain, with leaf as its first certificate, against the CAs in
+ * store, allowing proxy certificates. On success, valid_until is set to the
+ * first notAfter in the validated chain or nextUpdate of the CRLs for it, but
+ * at most PSP_CHAIN_VERIFY_TTL from now, on failure error to the
+ * X509_V_ERR_* code (0 on memory error).
+ * \return 0 on success, -1 when the chain is invalid, -2 on memory error
+ */
+int psp_core_verify_chain(X509_STORE *store, X509 *leaf,
+			  STACK_OF(X509) *chain, time_t *valid_until,
+			  int *error)	{
+    X509_STORE_CTX *ctx;
+    STACK_OF(X509) *verified;
+    STACK_OF(X509_CRL) *crls;
+    const ASN1_TIME *next_update;
+    X509 *cert;
+    time_t until, not_after;
+    int i, j, rc;
+
+    *error=0;
+    if ( (ctx=X509_STORE_CTX_new())==NULL ||
+	 X509_STORE_CTX_init(ctx, store, leaf, chain)!=1 )	{
+	X509_STORE_CTX_free(ctx);
+	return -2;
+    }
+    if (X509_verify_cert(ctx)!=1)   {
+	*error=X509_STORE_CTX_get_error(ctx);
+	rc=-1;
+    } else {
+	/* The result is valid until the first certificate expires, or a CRL
+	 * that was used is due to be updated. A CRL published meanwhile can
+	 * revoke any of them, hence it is never used longer than
+	 * PSP_CHAIN_VERIFY_TTL */
+	until=time(NULL)+PSP_CHAIN_VERIFY_TTL;
+	verified=X509_STORE_CTX_get0_chain(ctx);
+	for (i=0; i<sk_X509_num(verified); i++) {
+	    cert=sk_X509_value(verified, i);
+	    if (psp_core_asn1_time(X509_get0_notAfter(cert), &not_after)==0 &&
+		not_after<until)
+		until=not_after;
+	    if ( (crls=lookup_crls(ctx, X509_get_issuer_name(cert)))==NULL )
+		continue;
+	    for (j=0; j<sk_X509_CRL_num(crls); j++) {
+		next_update=X509_CRL_get0_nextUpdate(sk_X509_CRL_value(crls, j));
+		if (next_update && psp_core_asn1_time(next_update,
+						      &not_after)==0 &&
+		    not_after<until)
+		    until=not_after;
+	    }
+	    sk_X509_CRL_pop_free(crls, X509_CRL_free);
+	}
+	*valid_until=until;
+	rc=0;
+    }
+
+    X509_STORE_CTX_free(ctx);
+    return rc;
+}
+
+/**
+ * Looks up a valid verdict for given payload and pilot digests in cache,
+ * after dropping the entries that expired at now.
+ * \return cache entry or NULL when not found
+ */
+psp_verdict_t *psp_verdict_cache_find(psp_verdict_cache_t *cache,
+				      const unsigned char *payload_digest,
+				      const unsigned char *pilot_digest,
+				      time_t now)	{
+    psp_verdict_t *entry;
+    int i;
+
+    verdict_cache_expire(cache, now);
+    for (i=0; i<PSP_VERDICT_CACHE_SIZE; i++)	{
+	entry=&(cache->entries[i]);
+	if (entry->expiry > now &&
+	    memcmp(entry->payload_digest, payload_digest, PSP_DIGEST_LEN)==0 &&
+	    memcmp(entry->pilot_digest, pilot_digest, PSP_DIGEST_LEN)==0)
+	{
+	    entry->last_used=++cache->clock;
+	    return entry;
+	}
+    }
+
+    return NULL;
+}
+
+/**
+ * Stores verdict and a copy of the DN for given payload and pilot digests in
+ * cache, valid until expiry, replacing an unused or otherwise the least
+ * recently used entry. Without memory for the DN, it is stored without.
+ */
+void psp_verdict_cache_store(psp_verdict_cache_t *cache,
+			     const unsigned char *payload_digest,
+			     const unsigned char *pilot_digest,
+			     int verdict, const char *payload_dn,
+			     time_t expiry, time_t now)	{
+    psp_verdict_t *entry=&(cache->entries[0]);
+    int i;
+
+    /* After dropping the expired entries, unused ones have expiry 0 */
+    verdict_cache_expire(cache, now);
+    for (i=1; i<PSP_VERDICT_CACHE_SIZE && entry->expiry!=0; i++)	{
+	if (cache->entries[i].expiry==0 ||
+	    cache->entries[i].last_used < entry->last_used)
+	    entry=&(cache->entries[i]);
+    }
+
+    memcpy(entry->payload_digest, payload_digest, PSP_DIGEST_LEN);
+    memcpy(entry->pilot_digest, pilot_digest, PSP_DIGEST_LEN);
+    entry->verdict=verdict;
+    /* Without a copy of the DN, it's formatted again upon use */
+    free(entry->payload_dn);
+    entry->payload_dn=(payload_dn ? strdup(payload_dn) : NULL);
+    entry->expiry=expiry;
+    entry->last_used=++cache->clock;
+    psp_heap_set(&(cache->expiry), (int)(entry-cache->entries), expiry);
+}
+
+/**
+ * Empties cache, after which it is as if all-zero
+ */
+void psp_verdict_cache_clear(psp_verdict_cache_t *cache)	{
+    int i;
+
+    for (i=0; i<PSP_VERDICT_CACHE_SIZE; i++)
+	free(cache->entries[i].payload_dn);
+    memset(cache, 0, sizeof(psp_verdict_cache_t));
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Drops the entries of cache that expired at now, freeing their DN, so that
+ * memory is not held by expired entries until they are replaced
+ */
+static void verdict_cache_expire(psp_verdict_cache_t *cache, time_t now)   {
+    psp_verdict_t *entry;
+    int id;
+
+    while ( (id=psp_heap_pop_expired(&(cache->expiry), now)) >= 0 )	{
+	entry=&(cache->entries[id]);
+	free(entry->payload_dn);
+	memset(entry, 0, sizeof(psp_verdict_t));
+    }
+}
+
+/**
+ * Verification callback for psp_core_verify_chain(): a missing CRL is
+ * accepted, like lcmaps_verify_proxy.mod does.
+ * \return 1 when the certificate is acceptable, 0 when not
+ */
+static int verify_callback(int ok, X509_STORE_CTX *ctx)	{
+    if (!ok && X509_STORE_CTX_get_error(ctx)==X509_V_ERR_UNABLE_TO_GET_CRL)
+	return 1;
+
+    return ok;
+}
+
+/**
+ * CRL lookup for a store made by psp_core_cert_store_new(): reads the CRLs
+ * for name, i.e. <hash>.r0, <hash>.r1, etc., from its certdir on every call,
+ * unlike X509_LOOKUP_hash_dir(), which never reads a CRL file again once it
+ * has been loaded. Unreadable CRL files and CRLs of another issuer with the
+ * same hash are skipped.
+ * \return stack of CRLs, possibly empty, or NULL on memory error
+ */
+static STACK_OF(X509_CRL) *lookup_crls(LOOKUP_CONST X509_STORE_CTX *ctx,
+				       LOOKUP_CONST X509_NAME *name)	{
+    const char *certdir=(const char *)X509_STORE_get_ex_data(
+			    X509_STORE_CTX_get0_store(ctx), certdir_index);
+    char path[CRL_PATH_MAX];
+    STACK_OF(X509_CRL) *crls;
+    X509_CRL *crl;
+    unsigned long hash;
+    FILE *fp;
+    int i;
+
+    if ( (crls=sk_X509_CRL_new_null())==NULL )
+	return NULL;
+    if (certdir==NULL)
+	return crls;
+
+    hash=X509_NAME_hash((X509_NAME *)name);
+    for (i=0; ; i++)	{
+	if (snprintf(path, sizeof(path), "%s/%08lx.r%d", certdir, hash, i) >=
+		(int)sizeof(path) ||
+	    (fp=fopen(path, "r"))==NULL)
+	    break;
+	crl=PEM_read_X509_CRL(fp, NULL, NULL, NULL);
+	fclose(fp);
+	if (crl==NULL)
+	    continue;
+	if (X509_NAME_cmp(X509_CRL_get_issuer(crl), name)!=0 ||
+	    !sk_X509_CRL_push(crls, crl))
+	    X509_CRL_free(crl);
+    }
+    /* The failed reads are not a failure of the lookup */
+    ERR_clear_error();
+
+    return crls;
+}
+
+/**
+ * Gets certdir_index, which stays -1 on error
+ */
+static void certdir_index_init(void)	{
+    certdir_index=X509_STORE_get_ex_new_index(0, NULL, NULL, NULL,
+					      certdir_free);
+}
+
+/**
+ * Frees the certdir of a store
+ */
+static void certdir_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+			 int idx, long argl, void *argp)	{
+    free(ptr);
+}
@@ -0,0 +1,235 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+#ifndef LCMAPS_PILOT_SUB_PROXY_CORE_H
+#define LCMAPS_PILOT_SUB_PROXY_CORE_H
+
+#include <time.h>
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include "psp.h"
+#include "lcmaps_pilot_sub_proxy_heap.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/** Length of the certificate digests (SHA-256) */
+#define PSP_DIGEST_LEN	SHA256_DIGEST_LENGTH
+
+/** Seconds a successful validation of a chain against the CAs and CRLs in a
+ * certdir is used at most, such that a CRL published later, e.g. by
+ * fetch-crl, takes effect without waiting for its nextUpdate */
+#define PSP_CHAIN_VERIFY_TTL	300
+
+/** Number of signature verification results kept in a verdict cache. In
+ * directory mode one process serves the payloads of all pilots on a node,
+ * each pilot with several payloads live at a time, so several hundred
+ * distinct pairs are in use: with fewer entries than that, the least recently
+ * used entry is always the next one needed and nothing is ever found. An
+ * entry is about 100 bytes, its expiry heap sized with it (PSP_HEAP_SIZE)
+ * another 16. */
+#define PSP_VERDICT_CACHE_SIZE	512
+
+#if PSP_VERDICT_CACHE_SIZE > PSP_HEAP_SIZE
+#error "verdict cache does not fit its expiry heap"
+#endif
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Properties of a proxy certificate, as filled in by psp_core_classify() */
+typedef struct psp_proxy_info_s	{
+    int is_rfc;			    /* 1 when RFC3820 compliant proxy */
+    int is_limited;		    /* 1 when RFC3820 limited proxy */
+    long path_len;		    /* pcPathLengthConstraint, -1 when unset */
+    int policy_lang_nid;	    /* NID of policyLanguage, NID_undef when
+				       unknown to OpenSSL (e.g. limited) */
+    time_t not_before;		    /* start of validity */
+    time_t not_after;		    /* end of validity */
+    unsigned long subject_hash;	    /* X509_NAME_hash() of the subject */
+} psp_proxy_info_t;
+
+/** Entry in a verdict cache: result of verifying that a payload proxy is
+ * signed by a pilot proxy, identified by the digests of both */
+typedef struct psp_verdict_s	{
+    unsigned char payload_digest[PSP_DIGEST_LEN];
+    unsigned char pilot_digest[PSP_DIGEST_LEN];
+    int verdict;		/* 0 when valid, otherwise why it is not */
+    char *payload_dn;		/* one-line DN of the payload or NULL */
+    time_t expiry;		/* end of the entry, 0 when unused */
+    unsigned long last_used;	/* value of clock at last use */
+} psp_verdict_t;
+
+/** Cache of signature verification results. An all-zero cache is empty, it
+ * needs to be locked by its user. Entries are dropped once expired. */
+typedef struct psp_verdict_cache_s  {
+    psp_verdict_t entries[PSP_VERDICT_CACHE_SIZE];
+    psp_heap_t expiry;		/* expiry of the used entries */
+    unsigned long clock;	/* for finding the least recently used entry */
+} psp_verdict_cache_t;
+
+
+/************************************************************************
+ * Function prototypes
+ ************************************************************************/
+
+/* The functions below are shared by the LCMAPS plugin and libpsp, hence they
+ * do not log: failures are described by their return values instead. */
+
+/**
+ * Resolves the OIDs for RFC and limited proxies once, such that the checks
+ * can compare objects instead of their text representations.
+ * \return 0 on success, -1 on error
+ */
+int psp_oid_init(void);
+
+/**
+ * Frees the objects created by psp_oid_init()
+ */
+void psp_oid_cleanup(void);
+
+/**
+ * Obtains the ASN.1 object of the RFC proxy OID, set by psp_oid_init()
+ * \return object or NULL when not initialized
+ */
+const ASN1_OBJECT *psp_oid_rfc_proxy(void);
+
+/**
+ * Obtains the properties of given proxy certificate in a single pass over its
+ * extensions. A proxy with more than one ProxyCertInfo extension is
+ * considered neither RFC nor limited.
+ * \return 0 on success, -1 when the OIDs cannot be resolved or the validity
+ * of proxy cannot be parsed
+ */
+int psp_core_classify(X509 *proxy, psp_proxy_info_t *info);
+
+/**
+ * Converts an ASN1_TIME into a time_t.
+ * \return 0 on success, -1 on error
+ */
+int psp_core_asn1_time(const ASN1_TIME *asn1_time, time_t *t);
+
+/**
+ * Obtains the PSP_KEY_* type of given public key and, when bits is not NULL,
+ * its size in bits.
+ * \return key type, 0 when it is not one of the supported types
+ */
+int psp_key_type(EVP_PKEY *key, int *bits);
+
+/**
+ * Checks that the public key of cert is of one of the allowed_types
+ * (bitmask of PSP_KEY_*) and, for RSA, has at least min_rsa_bits bits.
+ * \return 0 when the key is allowed, -1 when cert has no usable public key,
+ * -2 when its type is not allowed, -3 when it is too small
+ */
+int psp_core_check_key(X509 *cert, unsigned int allowed_types,
+		       int min_rsa_bits);
+
+/**
+ * Checks that the subject of proxy is its issuer plus a CN in a new RDN, as
+ * for every proxy.
+ * \return 0 when it is, -1 when the subject does not end with a CN, -2 when
+ * it does not extend the issuer, -3 on memory error
+ */
+int psp_core_check_subject(X509 *proxy);
+
+/**
+ * Checks whether chain equals the certificates of payload_chain following its
+ * leaf. X509_cmp() compares the cached digests and encodings.
+ * \return 1 when it does, 0 otherwise
+ */
+int psp_core_chain_is_suffix(STACK_OF(X509) *chain,
+			     STACK_OF(X509) *payload_chain);
+
+/**
+ * Checks that the proxies in chain, with its leaf first, allow one more
+ * proxy below the leaf according to their path length constraints.
+ * \return 1 when they do, 0 otherwise
+ */
+int psp_core_chain_allows_proxy(STACK_OF(X509) *chain);
+
+/**
+ * Computes the SHA-256 digest of the digests of all certs in chain into
+ * fingerprint, using leaf_digest for its leaf when not NULL. Unlike the
+ * digest of the leaf, this identifies the whole chain.
+ * \return 0 on success, -1 on error
+ */
+int psp_core_chain_fingerprint(STACK_OF(X509) *chain,
+			       const unsigned char *leaf_digest,
+			       unsigned char *fingerprint);
+
+/**
+ * Creates a certificate store for psp_core_verify_chain() for the CA
+ * certificates and CRLs in the hashed directory certdir.
+ * \return new store or NULL when certdir is not a usable directory or on
+ * memory error
+ */
+X509_STORE *psp_core_cert_store_new(const char *certdir);
+
+/**
+ * Validates chain, with leaf as its first certificate, against the CAs in
+ * store, allowing proxy certificates. On success, valid_until is set to the
+ * first notAfter in the validated chain or nextUpdate of the CRLs for it, but
+ * at most PSP_CHAIN_VERIFY_TTL from now, on failure error to the
+ * X509_V_ERR_* code (0 on memory error).
+ * \return 0 on success, -1 when the chain is invalid, -2 on memory error
+ */
+int psp_core_verify_chain(X509_STORE *store, X509 *leaf,
+			  STACK_OF(X509) *chain, time_t *valid_until,
+			  int *error);
+
+/**
+ * Looks up a valid verdict for given payload and pilot digests in cache,
+ * after dropping the entries that expired at now.
+ * \return cache entry or NULL when not found
+ */
+psp_verdict_t *psp_verdict_cache_find(psp_verdict_cache_t *cache,
+				      const unsigned char *payload_digest,
+				      const unsigned char *pilot_digest,
+				      time_t now);
+
+/**
+ * Stores verdict and a copy of the DN for given payload and pilot digests in
+ * cache, valid until expiry, replacing an unused or otherwise the least
+ * recently used entry. Without memory for the DN, it is stored without.
+ */
+void psp_verdict_cache_store(psp_verdict_cache_t *cache,
+			     const unsigned char *payload_digest,
+			     const unsigned char *pilot_digest,
+			     int verdict, const char *payload_dn,
+			     time_t expiry, time_t now);
+
+/**
+ * Empties cache, after which it is as if all-zero
+ */
+void psp_verdict_cache_clear(psp_verdict_cache_t *cache);
+
+#endif /* LCMAPS_PILOT_SUB_PROXY_CORE_H */
@@ -0,0 +1,259 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+/**
+ * NOTES: DN formatter. X509_NAME_oneline() allocates and formats the subject
+ * on every call, and X509_NAME_print_ex() needs a BIO. For the common case of
+ * names consisting of known attributes with plain printable ASCII values, both
+ * forms can be written directly into one arena buffer: the one-line form
+ * front to back, and the RFC 2253 form, which has the RDNs in reverse order,
+ * back to front. */
+
+#include <string.h>
+
+#include <openssl/x509.h>
+#include <openssl/objects.h>
+#include <openssl/bio.h>
+#include <openssl/buffer.h>
+#include <openssl/crypto.h>
+
+#include "lcmaps_pilot_sub_proxy_dn.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/** Longest attribute short name handled directly, names with longer ones are
+ * left to OpenSSL */
+#define MAX_SN_LEN	32
+
+/** Characters escaped anywhere in an RFC 2253 value */
+#define RFC2253_SPECIALS    ",+\"\\<>;"
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Checks whether value can be formatted directly, i.e. is a plain string type
+ * with only printable ASCII characters that need no escaping in the one-line
+ * form.
+ * \return 1 when it can, 0 when not */
+static int plain_value(const ASN1_STRING *value);
+
+/* Obtains the length of the RFC 2253 escaped form of the len bytes in data.
+ * \return length */
+static size_t rfc2253_len(const unsigned char *data, size_t len);
+
+/* Writes the RFC 2253 escaped form of the len bytes in data to p.
+ * \return end of the written data */
+static char *rfc2253_escape(char *p, const unsigned char *data, size_t len);
+
+/* Formats name using the OpenSSL functions into arena.
+ * \return 0 on success, -1 on error */
+static int dn_format_openssl(psp_arena_t *arena, X509_NAME *name,
+			     char **oneline, char **rfc2253);
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * Formats name in the OpenSSL one-line form (as X509_NAME_oneline()) into
+ * oneline and in RFC 2253 form (as X509_NAME_print_ex() with
+ * XN_FLAG_RFC2253) into rfc2253, both from a single walk over the RDNs and
+ * in a single allocation from arena. Either of oneline and rfc2253 may be
+ * NULL. Names with multi-valued RDNs or with values that need escaping or
+ * conversion are formatted using the OpenSSL functions instead, as their
+ * one-line form differs between OpenSSL versions. Does not log.
+ * \return 0 on success, -1 on error
+ */
+int psp_dn_format(psp_arena_t *arena, X509_NAME *name,
+		  char **oneline, char **rfc2253)	{
+    const X509_NAME_ENTRY *ne;
+    const ASN1_STRING *value;
+    const unsigned char *der;
+    const char *sn;
+    char *buf, *op, *rp, *rend;
+    size_t der_len, sn_len, len, elen, size;
+    int i, n, nid, set, prev_set=-1;
+
+    /* The DER encoding bounds the total length of the values */
+    n=X509_NAME_entry_count(name);
+    if (X509_NAME_get0_der(name, &der, &der_len)!=1)
+	return -1;
+    size=(size_t)n*2*(MAX_SN_LEN+2) + 3*der_len + 3;
+    if ( (buf=psp_arena_alloc(arena, size))==NULL )
+	return -1;
+
+    /* One-line form grows from the start, RFC 2253 from the end */
+    op=buf;
+    rend=rp=buf+size-1;
+    *rend='\0';
+
+    for (i=0; i<n; i++)	{
+	ne=X509_NAME_get_entry(name, i);
+	value=X509_NAME_ENTRY_get_data(ne);
+	if ( (nid=OBJ_obj2nid(X509_NAME_ENTRY_get_object(ne)))==NID_undef ||
+	     (sn=OBJ_nid2sn(nid))==NULL ||
+	     (sn_len=strlen(sn))>MAX_SN_LEN || !plain_value(value) ||
+	     (set=X509_NAME_ENTRY_set(ne))==prev_set )
+	    return dn_format_openssl(arena, name, oneline, rfc2253);
+	prev_set=set;
+	len=(size_t)ASN1_STRING_length(value);
+
+	/* One-line form: /sn=value */
+	*(op++)='/';
+	memcpy(op, sn, sn_len);
+	op+=sn_len;
+	*(op++)='=';
+	memcpy(op, ASN1_STRING_get0_data(value), len);
+	op+=len;
+
+	/* RFC 2253 form: sn=value followed by a separator from the previous
+	 * entry */
+	if (i>0)
+	    *(--rp)=',';
+	elen=rfc2253_len(ASN1_STRING_get0_data(value), len);
+	rp-=sn_len+1+elen;
+	memcpy(rp, sn, sn_len);
+	rp[sn_len]='=';
+	rfc2253_escape(rp+sn_len+1, ASN1_STRING_get0_data(value), len);
+    }
+    *op='\0';
+
+    if (oneline)
+	*oneline=buf;
+    if (rfc2253)
+	*rfc2253=rp;
+
+    return 0;
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Checks whether value can be formatted directly, i.e. is a plain string type
+ * with only printable ASCII characters that need no escaping in the one-line
+ * form.
+ * \return 1 when it can, 0 when not
+ */
+static int plain_value(const ASN1_STRING *value)	{
+    const unsigned char *data=ASN1_STRING_get0_data(value);
+    int i, len=ASN1_STRING_length(value);
+
+    switch (ASN1_STRING_type(value))	{
+	case V_ASN1_PRINTABLESTRING:
+	case V_ASN1_IA5STRING:
+	case V_ASN1_UTF8STRING:
+	case V_ASN1_T61STRING:
+	case V_ASN1_VISIBLESTRING:
+	    break;
+	default:
+	    return 0;
+    }
+
+    /* Newer OpenSSL versions escape '/' and '+' in the one-line form */
+    for (i=0; i<len; i++)
+	if (data[i]<' ' || data[i]>'~' || data[i]=='/' || data[i]=='+')
+	    return 0;
+
+    return 1;
+}
+
+/**
+ * Obtains the length of the RFC 2253 escaped form of the len bytes in data.
+ * \return length
+ */
+static size_t rfc2253_len(const unsigned char *data, size_t len)	{
+    size_t i, elen=len;
+
+    for (i=0; i<len; i++)
+	if (strchr(RFC2253_SPECIALS, data[i]) ||
+	    (i==0 && (data[i]=='#' || data[i]==' ')) ||
+	    (i==len-1 && data[i]==' '))
+	    elen++;
+
+    return elen;
+}
+
+/**
+ * Writes the RFC 2253 escaped form of the len bytes in data to p.
+ * \return end of the written data
+ */
+static char *rfc2253_escape(char *p, const unsigned char *data, size_t len)  {
+    size_t i;
+
+    for (i=0; i<len; i++)   {
+	if (strchr(RFC2253_SPECIALS, data[i]) ||
+	    (i==0 && (data[i]=='#' || data[i]==' ')) ||
+	    (i==len-1 && data[i]==' '))
+	    *(p++)='\\';
+	*(p++)=(char)data[i];
+    }
+
+    return p;
+}
+
+/**
+ * Formats name using the OpenSSL functions into arena.
+ * \return 0 on success, -1 on error
+ */
+static int dn_format_openssl(psp_arena_t *arena, X509_NAME *name,
+			     char **oneline, char **rfc2253)	{
+    BIO *bio;
+    BUF_MEM *mem;
+    char *str;
+
+    if (oneline)    {
+	if ( (str=X509_NAME_oneline(name, NULL, 0))==NULL )
+	    return -1;
+	*oneline=psp_arena_strdup(arena, str);
+	OPENSSL_free(str);
+	if (*oneline==NULL)
+	    return -1;
+    }
+
+    if (rfc2253)    {
+	if ( (bio=BIO_new(BIO_s_mem()))==NULL )
+	    return -1;
+	if (X509_NAME_print_ex(bio, name, 0, XN_FLAG_RFC2253)<0 ||
+	    BIO_get_mem_ptr(bio, &mem)!=1 ||
+	    (*rfc2253=psp_arena_alloc(arena, mem->length+1))==NULL)	{
+	    BIO_free(bio);
+	    return -1;
+	}
+	memcpy(*rfc2253, mem->data, mem->length);
+	(*rfc2253)[mem->length]='\0';
+	BIO_free(bio);
+    }
+
+    return 0;
+}
@@ -0,0 +1,51 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+#ifndef LCMAPS_PILOT_SUB_PROXY_DN_H
+#define LCMAPS_PILOT_SUB_PROXY_DN_H
+
+#include <openssl/x509.h>
+
+#include "lcmaps_pilot_sub_proxy_arena.h"
+
+
+/************************************************************************
+ * Function prototypes
+ ************************************************************************/
+
+/**
+ * Formats name in the OpenSSL one-line form (as X509_NAME_oneline()) into
+ * oneline and in RFC 2253 form (as X509_NAME_print_ex() with
+ * XN_FLAG_RFC2253) into rfc2253, both from a single walk over the RDNs and
+ * in a single allocation from arena. Either of oneline and rfc2253 may be
+ * NULL. Names with multi-valued RDNs or with values that need escaping or
+ * conversion are formatted using the OpenSSL functions instead, as their
+ * one-line form differs between OpenSSL versions. Does not log.
+ * \return 0 on success, -1 on error
+ */
+int psp_dn_format(psp_arena_t *arena, X509_NAME *name,
+		  char **oneline, char **rfc2253);
+
+#endif /* LCMAPS_PILOT_SUB_PROXY_DN_H */
@@ -0,0 +1,296 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+/**
+ * NOTES: FQAN pattern matcher. The literal prefixes of the patterns, i.e. up to
+ * their first wildcard character, are put in a trie. An FQAN is matched by
+ * walking the trie along its characters, and only the remaining glob of the
+ * patterns whose prefix it passes is tried on the rest of the FQAN. Hence
+ * patterns for other VOs or groups cost nothing, and each FQAN is visited
+ * once for all patterns. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+
+#include "lcmaps_pilot_sub_proxy_fqan.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/** Characters starting the glob part of a pattern */
+#define GLOB_CHARS	"*?["
+
+/** Initial number of trie nodes */
+#define INITIAL_NODES	16
+
+/** No node or pattern */
+#define NONE		(-1)
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Trie node, the root is node 0 and represents the empty prefix */
+typedef struct trie_node_s  {
+    char c;			/* last character of the prefix */
+    int child;			/* first child node, NONE when leaf */
+    int sibling;		/* next child of the parent, NONE when last */
+    int patterns;		/* first pattern with this literal prefix */
+} trie_node_t;
+
+/** Pattern with its literal prefix in the trie */
+typedef struct pattern_s    {
+    char *pattern;		/* complete pattern */
+    const char *glob;		/* remainder after the literal prefix, NULL
+				   when the pattern is completely literal */
+    int deny;			/* whether it is a deny pattern */
+    int next;			/* next pattern in the same node */
+} pattern_t;
+
+struct psp_fqan_matcher_s   {
+    trie_node_t *nodes;
+    int nnodes, max_nodes;
+    pattern_t *patterns;
+    int npatterns;
+    int nallow;			/* number of allow patterns */
+};
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Finds or adds the child of node for character c.
+ * \return index of the child or NONE when out of memory */
+static int trie_child(psp_fqan_matcher_t *matcher, int node, char c);
+
+/* Tries the patterns of node on the remainder rest of the FQAN with index
+ * idx, updating result. */
+static void node_match(const psp_fqan_matcher_t *matcher, int node,
+		       const char *rest, int idx, psp_fqan_result_t *result);
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * Creates an empty FQAN matcher
+ * \return new matcher or NULL when out of memory
+ */
+psp_fqan_matcher_t *psp_fqan_matcher_new(void)	{
+    psp_fqan_matcher_t *matcher;
+
+    if ( (matcher=calloc(1, sizeof(psp_fqan_matcher_t)))==NULL )
+	return NULL;
+
+    if ( (matcher->nodes=malloc(INITIAL_NODES*sizeof(trie_node_t)))==NULL ) {
+	free(matcher);
+	return NULL;
+    }
+    matcher->max_nodes=INITIAL_NODES;
+    matcher->nnodes=1;
+    matcher->nodes[0].c='\0';
+    matcher->nodes[0].child=NONE;
+    matcher->nodes[0].sibling=NONE;
+    matcher->nodes[0].patterns=NONE;
+
+    return matcher;
+}
+
+/**
+ * Adds the wildcard pattern (as for fnmatch(3) with FNM_NOESCAPE) to the
+ * matcher, as allow pattern or, when deny is set, as deny pattern. The
+ * pattern is copied.
+ * \return 0 on success, -1 when out of memory
+ */
+int psp_fqan_matcher_add(psp_fqan_matcher_t *matcher, const char *pattern,
+			 int deny)  {
+    pattern_t *patterns, *pat;
+    size_t i, prefix_len;
+    int node=0;
+
+    if ( (patterns=realloc(matcher->patterns,
+		    ((size_t)matcher->npatterns+1)*sizeof(pattern_t)))==NULL )
+	return -1;
+    matcher->patterns=patterns;
+    pat=&(patterns[matcher->npatterns]);
+    if ( (pat->pattern=strdup(pattern))==NULL )
+	return -1;
+
+    /* Put the literal prefix in the trie */
+    prefix_len=strcspn(pattern, GLOB_CHARS);
+    for (i=0; i<prefix_len; i++)    {
+	if ( (node=trie_child(matcher, node, pattern[i]))==NONE )  {
+	    free(pat->pattern);
+	    return -1;
+	}
+    }
+    pat->glob=(pattern[prefix_len]=='\0' ? NULL : pat->pattern+prefix_len);
+    pat->deny=deny;
+
+    /* Keeping the patterns in order of addition gives the first match */
+    pat->next=NONE;
+    if (matcher->nodes[node].patterns==NONE)
+	matcher->nodes[node].patterns=matcher->npatterns;
+    else    {
+	for (i=(size_t)matcher->nodes[node].patterns;
+	     patterns[i].next!=NONE; i=(size_t)patterns[i].next)
+	    ;
+	patterns[i].next=matcher->npatterns;
+    }
+    matcher->npatterns++;
+    if (!deny)
+	matcher->nallow++;
+
+    return 0;
+}
+
+/**
+ * Frees the matcher and its patterns
+ */
+void psp_fqan_matcher_free(psp_fqan_matcher_t *matcher)	{
+    int i;
+
+    if (matcher==NULL)
+	return;
+
+    for (i=0; i<matcher->npatterns; i++)
+	free(matcher->patterns[i].pattern);
+    free(matcher->patterns);
+    free(matcher->nodes);
+    free(matcher);
+}
+
+/**
+ * Matches each of the nfqans FQANs once against all the patterns in the
+ * matcher, filling in result. The matcher is not modified, hence can be used
+ * concurrently.
+ * \return 1 when the FQANs are acceptable, i.e. at least one matches an allow
+ * pattern (or there are none) and none matches a deny pattern, 0 otherwise.
+ */
+int psp_fqan_match(const psp_fqan_matcher_t *matcher,
+		   int nfqans, char **fqans, psp_fqan_result_t *result)	{
+    const trie_node_t *nodes=matcher->nodes;
+    const char *p;
+    int i, node;
+
+    result->allowed=NONE;
+    result->allow_pattern=NULL;
+    result->denied=NONE;
+    result->deny_pattern=NULL;
+
+    for (i=0; i<nfqans && result->denied==NONE; i++)	{
+	if (fqans[i]==NULL)
+	    continue;
+	/* Walk down the trie, trying the patterns on the way */
+	node=0;
+	p=fqans[i];
+	for (;;)    {
+	    if (nodes[node].patterns!=NONE)
+		node_match(matcher, node, p, i, result);
+	    if (*p=='\0')
+		break;
+	    for (node=nodes[node].child;
+		 node!=NONE && nodes[node].c!=*p;
+		 node=nodes[node].sibling)
+		;
+	    if (node==NONE)
+		break;
+	    p++;
+	}
+    }
+
+    return (matcher->nallow==0 || result->allowed!=NONE) &&
+	   result->denied==NONE;
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Finds or adds the child of node for character c.
+ * \return index of the child or NONE when out of memory
+ */
+static int trie_child(psp_fqan_matcher_t *matcher, int node, char c)	{
+    trie_node_t *nodes;
+    int child;
+
+    for (child=matcher->nodes[node].child; child!=NONE;
+	 child=matcher->nodes[child].sibling)
+	if (matcher->nodes[child].c==c)
+	    return child;
+
+    if (matcher->nnodes==matcher->max_nodes)	{
+	if ( (nodes=realloc(matcher->nodes,
+		    2*(size_t)matcher->max_nodes*sizeof(trie_node_t)))==NULL )
+	    return NONE;
+	matcher->nodes=nodes;
+	matcher->max_nodes*=2;
+    }
+    child=matcher->nnodes++;
+    matcher->nodes[child].c=c;
+    matcher->nodes[child].child=NONE;
+    matcher->nodes[child].sibling=matcher->nodes[node].child;
+    matcher->nodes[child].patterns=NONE;
+    matcher->nodes[node].child=child;
+
+    return child;
+}
+
+/**
+ * Tries the patterns of node on the remainder rest of the FQAN with index
+ * idx, updating result. Patterns of a kind are skipped once one has matched.
+ */
+static void node_match(const psp_fqan_matcher_t *matcher, int node,
+		       const char *rest, int idx, psp_fqan_result_t *result) {
+    const pattern_t *pat;
+    int i, matched;
+
+    for (i=matcher->nodes[node].patterns; i!=NONE; i=pat->next)	{
+	pat=&(matcher->patterns[i]);
+	if (pat->deny ? result->denied!=NONE : result->allowed!=NONE)
+	    continue;
+	if (pat->glob==NULL)
+	    matched=(*rest=='\0');
+	else
+	    matched=(fnmatch(pat->glob, rest, FNM_NOESCAPE)==0);
+	if (!matched)
+	    continue;
+	if (pat->deny)	{
+	    result->denied=idx;
+	    result->deny_pattern=pat->pattern;
+	} else	{
+	    result->allowed=idx;
+	    result->allow_pattern=pat->pattern;
+	}
+    }
+}
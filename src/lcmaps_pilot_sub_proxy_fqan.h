@@ -0,0 +1,82 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+#ifndef LCMAPS_PILOT_SUB_PROXY_FQAN_H
+#define LCMAPS_PILOT_SUB_PROXY_FQAN_H
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Compiled set of allow and deny FQAN patterns */
+typedef struct psp_fqan_matcher_s psp_fqan_matcher_t;
+
+/** Outcome of psp_fqan_match() */
+typedef struct psp_fqan_result_s    {
+    int allowed;		/* index of the first FQAN matching an allow
+				   pattern, -1 when none */
+    const char *allow_pattern;	/* pattern matched by FQAN allowed */
+    int denied;			/* index of the first FQAN matching a deny
+				   pattern, -1 when none */
+    const char *deny_pattern;	/* pattern matched by FQAN denied */
+} psp_fqan_result_t;
+
+
+/************************************************************************
+ * Function prototypes
+ ************************************************************************/
+
+/**
+ * Creates an empty FQAN matcher
+ * \return new matcher or NULL when out of memory
+ */
+psp_fqan_matcher_t *psp_fqan_matcher_new(void);
+
+/**
+ * Adds the wildcard pattern (as for fnmatch(3) with FNM_NOESCAPE) to the
+ * matcher, as allow pattern or, when deny is set, as deny pattern. The
+ * pattern is copied.
+ * \return 0 on success, -1 when out of memory
+ */
+int psp_fqan_matcher_add(psp_fqan_matcher_t *matcher, const char *pattern,
+			 int deny);
+
+/**
+ * Frees the matcher and its patterns
+ */
+void psp_fqan_matcher_free(psp_fqan_matcher_t *matcher);
+
+/**
+ * Matches each of the nfqans FQANs once against all the patterns in the
+ * matcher, filling in result. The matcher is not modified, hence can be used
+ * concurrently.
+ * \return 1 when the FQANs are acceptable, i.e. at least one matches an allow
+ * pattern (or there are none) and none matches a deny pattern, 0 otherwise.
+ */
+int psp_fqan_match(const psp_fqan_matcher_t *matcher,
+		   int nfqans, char **fqans, psp_fqan_result_t *result);
+
+#endif /* LCMAPS_PILOT_SUB_PROXY_FQAN_H */
@@ -0,0 +1,134 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+/**
+ * NOTES: expiry heap for the fixed-size caches, allowing them to drop their
+ * expired entries in O(log n) upon the next access, instead of keeping them
+ * until they happen to be replaced or having to scan for them. Does not log.
+ */
+
+#include "lcmaps_pilot_sub_proxy_heap.h"
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Puts id at position i of the heap */
+static void place(psp_heap_t *heap, int i, int id);
+
+/* Restores the heap property for the id at position i, moving it up or
+ * down */
+static void sift(psp_heap_t *heap, int i);
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * Sets the expiry of id in heap to expiry, adding it when absent
+ */
+void psp_heap_set(psp_heap_t *heap, int id, time_t expiry)	{
+    if (id<0 || id>=PSP_HEAP_SIZE)
+	return;
+
+    heap->expiry[id]=expiry;
+    if (heap->pos[id]==0)
+	place(heap, heap->n++, id);
+    sift(heap, heap->pos[id]-1);
+}
+
+/**
+ * Removes id from heap, when present, by moving the last id into its place
+ */
+void psp_heap_remove(psp_heap_t *heap, int id)	{
+    int i;
+
+    if (id<0 || id>=PSP_HEAP_SIZE || heap->pos[id]==0)
+	return;
+
+    i=heap->pos[id]-1;
+    heap->pos[id]=0;
+    if (i < --heap->n)	{
+	place(heap, i, heap->ids[heap->n]);
+	sift(heap, i);
+    }
+}
+
+/**
+ * Removes the id with the earliest expiry from heap, when that is at or
+ * before now.
+ * \return the removed id, or -1 when none has expired
+ */
+int psp_heap_pop_expired(psp_heap_t *heap, time_t now)	{
+    int id;
+
+    if (heap->n==0 || heap->expiry[heap->ids[0]] > now)
+	return -1;
+
+    id=heap->ids[0];
+    psp_heap_remove(heap, id);
+
+    return id;
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Puts id at position i of the heap
+ */
+static void place(psp_heap_t *heap, int i, int id)	{
+    heap->ids[i]=id;
+    heap->pos[id]=i+1;
+}
+
+/**
+ * Restores the heap property for the id at position i, moving it up while
+ * it expires before its parent, and otherwise down while a child expires
+ * before it
+ */
+static void sift(psp_heap_t *heap, int i)	{
+    int id=heap->ids[i], parent, child;
+    time_t expiry=heap->expiry[id];
+
+    while (i>0 && expiry < heap->expiry[heap->ids[parent=(i-1)/2]]) {
+	place(heap, i, heap->ids[parent]);
+	i=parent;
+    }
+    while ( (child=2*i+1) < heap->n )	{
+	if (child+1 < heap->n &&
+	    heap->expiry[heap->ids[child+1]] < heap->expiry[heap->ids[child]])
+	    child++;
+	if (heap->expiry[heap->ids[child]] >= expiry)
+	    break;
+	place(heap, i, heap->ids[child]);
+	i=child;
+    }
+    place(heap, i, id);
+}
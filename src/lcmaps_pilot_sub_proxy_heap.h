@@ -0,0 +1,78 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+#ifndef LCMAPS_PILOT_SUB_PROXY_HEAP_H
+#define LCMAPS_PILOT_SUB_PROXY_HEAP_H
+
+#include <time.h>
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/** Maximum number of ids in an expiry heap, ids are 0 to PSP_HEAP_SIZE-1.
+ * Sized for the largest cache using it, the verdict cache, see
+ * PSP_VERDICT_CACHE_SIZE. */
+#define PSP_HEAP_SIZE	512
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Min-heap of the expiry times of the entries of a fixed-size cache, the
+ * entries being identified by their index. An all-zero heap is empty, it
+ * needs to be locked by its user. */
+typedef struct psp_heap_s   {
+    int n;			/* number of ids in the heap */
+    int ids[PSP_HEAP_SIZE];	/* the heap, earliest expiry first */
+    time_t expiry[PSP_HEAP_SIZE]; /* expiry by id */
+    int pos[PSP_HEAP_SIZE];	/* 1 + position of id in ids, 0 when absent */
+} psp_heap_t;
+
+
+/************************************************************************
+ * Function prototypes
+ ************************************************************************/
+
+/**
+ * Sets the expiry of id in heap to expiry, adding it when absent
+ */
+void psp_heap_set(psp_heap_t *heap, int id, time_t expiry);
+
+/**
+ * Removes id from heap, when present
+ */
+void psp_heap_remove(psp_heap_t *heap, int id);
+
+/**
+ * Removes the id with the earliest expiry from heap, when that is at or
+ * before now.
+ * \return the removed id, or -1 when none has expired
+ */
+int psp_heap_pop_expired(psp_heap_t *heap, time_t now);
+
+#endif /* LCMAPS_PILOT_SUB_PROXY_HEAP_H */
@@ -0,0 +1,859 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+/**
+ * NOTES: libpsp, see psp.h. The checks are those of the LCMAPS plugin, in the
+ * same order, using the shared functions in lcmaps_pilot_sub_proxy_core.c.
+ * Pilots given as path are loaded through the pilot cache of the context,
+ * see lcmaps_pilot_sub_proxy_loader.c, which also does psp_load_pilot().
+ * Repeated pairs are recognized by the verdict cache of the context, which
+ * also covers the validation of the pilot chain when using a certdir, keyed
+ * then on the digests of the whole chains instead of their leaves.
+ * psp_verify_many() first removes the duplicates within the batch, and then
+ * divides the remaining pairs over one queue per thread: its calling thread
+ * and the worker pool of the context. A thread that has emptied its own queue
+ * steals from the others.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <openssl/x509.h>
+#include <openssl/x509v3.h> /* X509_check_issued */
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include "psp.h"
+#include "lcmaps_pilot_sub_proxy_core.h"
+#include "lcmaps_pilot_sub_proxy_pem.h"
+#include "lcmaps_pilot_sub_proxy_dn.h"
+#include "lcmaps_pilot_sub_proxy_arena.h"
+#include "lcmaps_pilot_sub_proxy_loader.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/** Maximum number of threads used by psp_verify_many() */
+#define MAX_THREADS	64
+
+/** Minimum number of pairs, after removing duplicates, for waking up the
+ * worker pool */
+#define MIN_POOL_PAIRS	2
+
+/** Relaxed atomic increment of a statistics counter */
+#define COUNT(counter)	__atomic_fetch_add(&(counter), 1, __ATOMIC_RELAXED)
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Queue of a batch_t: a range of its todo list. The owning thread and any
+ * thread stealing from it take pairs from the front. */
+typedef struct queue_s	{
+    size_t next;		/* next entry of todo, taken atomically */
+    size_t end;			/* end of the range in todo */
+} queue_t;
+
+/** Work shared by the threads of psp_verify_many() */
+typedef struct batch_s	{
+    const psp_pair_t *pairs;
+    psp_result_t *results;
+    const size_t *todo;		/* indices of the pairs to check */
+    queue_t queues[MAX_THREADS]; /* one per thread, 0 for the caller */
+    int nqueues;		/* number of queues in use */
+    size_t nok;			/* pairs with PSP_OK, added atomically */
+} batch_t;
+
+/** Key for finding the duplicates in a batch */
+typedef struct dedup_s	{
+    unsigned char fingerprint[PSP_DIGEST_LEN]; /* SHA-256 of the PEM data or
+				   of the payload chain */
+    const void *pilot;		/* pilot chain, or pilot path */
+    size_t index;		/* index of the pair */
+    int valid;			/* whether the key could be obtained */
+} dedup_t;
+
+/** Worker thread of the pool */
+typedef struct worker_s	{
+    psp_ctx_t *ctx;
+    int id;			/* its queue in a batch, >=1 */
+    pthread_t thread;
+} worker_t;
+
+struct psp_ctx_s    {
+    psp_config_t cfg;		/* copy of the configuration, without the
+				   certdir */
+    X509_STORE *store;		/* CAs of the certdir, or NULL */
+    psp_verdict_cache_t verdicts; /* cache of verification results */
+    pthread_mutex_t verdicts_mutex; /* protects verdicts */
+    psp_stats_t stats;		/* statistics, updated atomically */
+    psp_loader_t *loader;	/* pilot cache and loader thread */
+    /* Worker pool, of cfg.nthreads-1 threads when they could be started */
+    worker_t workers[MAX_THREADS-1];
+    int nworkers;		/* number of started workers */
+    pthread_mutex_t pool_mutex;	/* protects the fields below */
+    pthread_cond_t work_cond;	/* signals a new batch or stop */
+    pthread_cond_t done_cond;	/* signals that running dropped to 0 */
+    pthread_mutex_t batch_mutex; /* held by the caller using the pool */
+    batch_t *batch;		/* current batch */
+    unsigned long generation;	/* number of batches so far */
+    int running;		/* workers still working on batch */
+    int stop;			/* set when the workers should exit */
+};
+
+
+/************************************************************************
+ * Global variables
+ ************************************************************************/
+
+/** Resolves the proxy OIDs once for all contexts */
+static pthread_once_t oid_once=PTHREAD_ONCE_INIT;
+
+/** Result of psp_oid_init() by oid_init_once() */
+static int oid_rc=-1;
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Calls psp_oid_init(), for pthread_once() */
+static void oid_init_once(void);
+
+/* Checks pair into result, counting it in the statistics of ctx.
+ * \return result->status */
+static psp_status_t verify_pair(psp_ctx_t *ctx, const psp_pair_t *pair,
+				psp_result_t *result);
+
+/* Does the checks of psp_verify(), setting payload_dn to a new copy of the
+ * DN of the payload when valid.
+ * \return status of the pair */
+static psp_status_t check_pair(psp_ctx_t *ctx, const psp_pair_t *pair,
+			       char **payload_dn);
+
+/* Checks the properties common to the payload and the pilot proxy, in info
+ * as obtained by psp_core_classify(), at time now.
+ * \return PSP_OK, or the status of the first failing check */
+static psp_status_t check_proxy(const psp_ctx_t *ctx, X509 *proxy,
+				const psp_proxy_info_t *info, time_t now);
+
+/* Formats the one-line DN of the subject of cert.
+ * \return new string or NULL on error */
+static char *format_dn(X509 *cert);
+
+/* Finds the duplicates among the n pairs: primary[i] is set to the lowest
+ * index of a pair equal to pair i, and todo to the indices of the pairs for
+ * which that is themselves.
+ * \return number of entries in todo, 0 on memory error */
+static size_t find_duplicates(const psp_pair_t *pairs, size_t n,
+			      size_t *primary, size_t *todo);
+
+/* Compares the keys of two dedup_t, invalid keys being larger than valid
+ * ones and never equal to another key.
+ * \return -1, 0 or 1 when a is smaller, equal or larger than b */
+static int cmp_key(const dedup_t *a, const dedup_t *b);
+
+/* Compares two dedup_t for qsort(): on their key, then on their index
+ * \return -1, 0 or 1 when a is smaller, equal or larger than b */
+static int cmp_dedup(const void *a, const void *b);
+
+/* Checks the pairs in the queues of batch, starting with queue self and then
+ * stealing from the others, until all are empty */
+static void run_queues(psp_ctx_t *ctx, batch_t *batch, int self);
+
+/* Main function of the pool workers, arg being its worker_t
+ * \return NULL */
+static void *worker_main(void *arg);
+
+/* Stops and joins the workers of ctx */
+static void pool_stop(psp_ctx_t *ctx);
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * Sets cfg to the defaults, which match those of the LCMAPS plugin
+ */
+void psp_config_init(psp_config_t *cfg)	{
+    cfg->require_limited=1;
+    cfg->key_types=PSP_KEY_ALL;
+    cfg->min_rsa_bits=0;
+    cfg->certdir=NULL;
+    cfg->nthreads=1;
+}
+
+/**
+ * Creates a context using a copy of cfg, or the defaults when cfg is NULL.
+ * \return new context or NULL when the configuration is invalid (e.g. an
+ * unusable certdir) or on memory error
+ */
+psp_ctx_t *psp_ctx_new(const psp_config_t *cfg)	{
+    psp_ctx_t *ctx;
+    worker_t *worker;
+    int i;
+
+    if (cfg && (cfg->key_types & ~PSP_KEY_ALL || cfg->min_rsa_bits<0))
+	return NULL;
+
+    if (pthread_once(&oid_once, oid_init_once)!=0 || oid_rc!=0)
+	return NULL;
+
+    if ( (ctx=(psp_ctx_t *)calloc(1, sizeof(psp_ctx_t)))==NULL )
+	return NULL;
+    if (cfg)
+	ctx->cfg=*cfg;
+    else
+	psp_config_init(&(ctx->cfg));
+    if (ctx->cfg.nthreads<1)
+	ctx->cfg.nthreads=1;
+    else if (ctx->cfg.nthreads>MAX_THREADS)
+	ctx->cfg.nthreads=MAX_THREADS;
+
+    if (ctx->cfg.certdir &&
+	(ctx->store=psp_core_cert_store_new(ctx->cfg.certdir))==NULL)	{
+	free(ctx);
+	return NULL;
+    }
+    ctx->cfg.certdir=NULL;
+
+    if ( (ctx->loader=psp_loader_new())==NULL )	{
+	X509_STORE_free(ctx->store);
+	free(ctx);
+	return NULL;
+    }
+    if (pthread_mutex_init(&(ctx->verdicts_mutex), NULL)!=0)	{
+	psp_loader_free(ctx->loader);
+	X509_STORE_free(ctx->store);
+	free(ctx);
+	return NULL;
+    }
+    if (pthread_mutex_init(&(ctx->pool_mutex), NULL)!=0)
+	goto fail_pool_mutex;
+    if (pthread_mutex_init(&(ctx->batch_mutex), NULL)!=0)
+	goto fail_batch_mutex;
+    if (pthread_cond_init(&(ctx->work_cond), NULL)!=0)
+	goto fail_work_cond;
+    if (pthread_cond_init(&(ctx->done_cond), NULL)!=0)
+	goto fail_done_cond;
+
+    /* Start the pool, the caller of psp_verify_many() being the last thread.
+     * With fewer workers, batches just take longer. */
+    for (i=0; i<ctx->cfg.nthreads-1; i++)   {
+	worker=&(ctx->workers[ctx->nworkers]);
+	worker->ctx=ctx;
+	worker->id=ctx->nworkers+1;
+	if (pthread_create(&(worker->thread), NULL, worker_main, worker)!=0)
+	    break;
+	ctx->nworkers++;
+    }
+
+    return ctx;
+
+fail_done_cond:
+    pthread_cond_destroy(&(ctx->work_cond));
+fail_work_cond:
+    pthread_mutex_destroy(&(ctx->batch_mutex));
+fail_batch_mutex:
+    pthread_mutex_destroy(&(ctx->pool_mutex));
+fail_pool_mutex:
+    pthread_mutex_destroy(&(ctx->verdicts_mutex));
+    psp_loader_free(ctx->loader);
+    X509_STORE_free(ctx->store);
+    free(ctx);
+    return NULL;
+}
+
+/**
+ * Frees ctx and everything it holds. Callbacks of pilot loads still queued
+ * are called with PSP_ERR_FILE. Must not be called from such a callback.
+ */
+void psp_ctx_free(psp_ctx_t *ctx)	{
+    if (ctx==NULL)
+	return;
+
+    pool_stop(ctx);
+    psp_loader_free(ctx->loader);
+    pthread_cond_destroy(&(ctx->done_cond));
+    pthread_cond_destroy(&(ctx->work_cond));
+    pthread_mutex_destroy(&(ctx->batch_mutex));
+    pthread_mutex_destroy(&(ctx->pool_mutex));
+    psp_verdict_cache_clear(&(ctx->verdicts));
+    pthread_mutex_destroy(&(ctx->verdicts_mutex));
+    X509_STORE_free(ctx->store);
+    free(ctx);
+}
+
+/**
+ * Loads the pilot proxy in path without blocking on file I/O, see
+ * psp_loader_get_async().
+ * \return 0 when cb has been called already, 1 when it will be called by
+ * the loader thread, -1 on error, in which case cb is never called
+ */
+int psp_load_pilot(psp_ctx_t *ctx, const char *path, psp_load_cb_t cb,
+		   void *arg)	{
+    return psp_loader_get_async(ctx->loader, path, cb, arg);
+}
+
+/**
+ * Checks that the payload of pair is a valid sub-proxy of its pilot, like
+ * the LCMAPS plugin does, and fills in result. Signature verification
+ * results are cached in ctx until the first of the two proxies expires.
+ * \return result->status
+ */
+psp_status_t psp_verify(psp_ctx_t *ctx, const psp_pair_t *pair,
+			psp_result_t *result)	{
+    return verify_pair(ctx, pair, result);
+}
+
+/**
+ * Checks the n pairs as psp_verify() does, into the corresponding results.
+ * Pairs equal to an earlier one in the batch, i.e. with the same payload and
+ * the same pilot, are only checked once. The others are spread over the
+ * calling thread and the worker pool of ctx, which serves one batch at a
+ * time: a concurrent batch is checked by its calling thread alone.
+ * \return number of pairs with status PSP_OK
+ */
+size_t psp_verify_many(psp_ctx_t *ctx, const psp_pair_t *pairs, size_t n,
+		       psp_result_t *results)	{
+    batch_t batch;
+    size_t *primary=NULL, *todo=NULL, ntodo=0, i, p;
+    int use_pool=0, q;
+
+    if (n==0)
+	return 0;
+
+    /* Remove the duplicates before anything is verified, when there is no
+     * memory for that, every pair is checked */
+    if ( (primary=(size_t *)malloc(n*sizeof(size_t)))==NULL ||
+	 (todo=(size_t *)malloc(n*sizeof(size_t)))==NULL ||
+	 (ntodo=find_duplicates(pairs, n, primary, todo))==0 )	{
+	free(todo);
+	free(primary);
+	for (batch.nok=0, i=0; i<n; i++)
+	    if (verify_pair(ctx, &(pairs[i]), &(results[i]))==PSP_OK)
+		batch.nok++;
+	return batch.nok;
+    }
+
+    batch.pairs=pairs;
+    batch.results=results;
+    batch.todo=todo;
+    batch.nok=0;
+
+    /* Use the pool when it is there and free, dividing the pairs evenly over
+     * the queues */
+    if (ctx->nworkers>0 && ntodo>=MIN_POOL_PAIRS &&
+	pthread_mutex_trylock(&(ctx->batch_mutex))==0)
+	use_pool=1;
+    batch.nqueues=(use_pool ? ctx->nworkers+1 : 1);
+    if ((size_t)batch.nqueues>ntodo)
+	batch.nqueues=(int)ntodo;
+    for (q=0; q<batch.nqueues; q++) {
+	batch.queues[q].next=ntodo*(size_t)q/(size_t)batch.nqueues;
+	batch.queues[q].end=ntodo*(size_t)(q+1)/(size_t)batch.nqueues;
+    }
+
+    if (use_pool)   {
+	pthread_mutex_lock(&(ctx->pool_mutex));
+	ctx->batch=&batch;
+	ctx->running=ctx->nworkers;
+	ctx->generation++;
+	pthread_cond_broadcast(&(ctx->work_cond));
+	pthread_mutex_unlock(&(ctx->pool_mutex));
+    }
+
+    run_queues(ctx, &batch, 0);
+
+    if (use_pool)   {
+	pthread_mutex_lock(&(ctx->pool_mutex));
+	while (ctx->running>0)
+	    pthread_cond_wait(&(ctx->done_cond), &(ctx->pool_mutex));
+	ctx->batch=NULL;
+	pthread_mutex_unlock(&(ctx->pool_mutex));
+	pthread_mutex_unlock(&(ctx->batch_mutex));
+    }
+
+    /* Duplicates get the result of their first occurrence */
+    for (i=0; i<n; i++)	{
+	if ( (p=primary[i])==i )
+	    continue;
+	results[i].status=results[p].status;
+	results[i].payload_dn=NULL;
+	if (results[p].payload_dn &&
+	    (results[i].payload_dn=strdup(results[p].payload_dn))==NULL)
+	    results[i].status=PSP_ERR_MEMORY;
+	COUNT(ctx->stats.checked);
+	COUNT(ctx->stats.status[results[i].status]);
+	COUNT(ctx->stats.batch_duplicates);
+	if (results[i].status==PSP_OK)
+	    batch.nok++;
+    }
+
+    free(todo);
+    free(primary);
+
+    return batch.nok;
+}
+
+/**
+ * Frees what result holds, after which it can be reused
+ */
+void psp_result_cleanup(psp_result_t *result)	{
+    free(result->payload_dn);
+    result->payload_dn=NULL;
+}
+
+/**
+ * Obtains the statistics of ctx into stats
+ */
+void psp_ctx_stats(psp_ctx_t *ctx, psp_stats_t *stats)	{
+    psp_loader_stats_t loader_stats;
+    int i;
+
+    stats->checked=__atomic_load_n(&(ctx->stats.checked), __ATOMIC_RELAXED);
+    for (i=0; i<PSP_NSTATUS; i++)
+	stats->status[i]=__atomic_load_n(&(ctx->stats.status[i]),
+					 __ATOMIC_RELAXED);
+    stats->verdict_cache_hit=__atomic_load_n(&(ctx->stats.verdict_cache_hit),
+					     __ATOMIC_RELAXED);
+    stats->verdict_cache_miss=__atomic_load_n(&(ctx->stats.verdict_cache_miss),
+					      __ATOMIC_RELAXED);
+    stats->batch_duplicates=__atomic_load_n(&(ctx->stats.batch_duplicates),
+					    __ATOMIC_RELAXED);
+    psp_loader_stats(ctx->loader, &loader_stats);
+    stats->pilot_cache_hit=loader_stats.cache_hit;
+    stats->pilot_loads=loader_stats.loads;
+    stats->pilot_coalesced=loader_stats.coalesced;
+}
+
+/**
+ * Describes status
+ * \return static string
+ */
+const char *psp_status_string(psp_status_t status)  {
+    static const char *const strings[PSP_NSTATUS]={
+	"valid sub-proxy",
+	"payload or pilot missing or unparsable",
+	"cannot read pilot proxy file",
+	"out of memory",
+	"payload not issued by the pilot subject",
+	"cannot classify payload proxy",
+	"proxy is not RFC compliant",
+	"proxy is not a limited proxy",
+	"proxy is not valid at this time",
+	"public key not allowed",
+	"cannot classify pilot proxy",
+	"pilot chain or payload link is not valid",
+	"payload is not signed by the pilot"
+    };
+
+    if ((int)status<0 || status>=PSP_NSTATUS)
+	return "unknown status";
+
+    return strings[status];
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Calls psp_oid_init(), for pthread_once()
+ */
+static void oid_init_once(void)	{
+    oid_rc=psp_oid_init();
+}
+
+/**
+ * Checks pair into result, counting it in the statistics of ctx
+ * \return result->status
+ */
+static psp_status_t verify_pair(psp_ctx_t *ctx, const psp_pair_t *pair,
+				psp_result_t *result)	{
+    result->status=check_pair(ctx, pair, &(result->payload_dn));
+
+    COUNT(ctx->stats.checked);
+    COUNT(ctx->stats.status[result->status]);
+
+    return result->status;
+}
+
+/**
+ * Does the checks of psp_verify(): first those of the payload, then those of
+ * the pilot and their relation, and only then, when not cached, the pilot
+ * chain and the signature. payload_dn is set to a new copy of the DN of the
+ * payload when valid.
+ * \return status of the pair
+ */
+static psp_status_t check_pair(psp_ctx_t *ctx, const psp_pair_t *pair,
+			       char **payload_dn)	{
+    STACK_OF(X509) *owned=NULL, *payload_chain;
+    STACK_OF(X509) *owned_pilot=NULL, *pilot_chain;
+    X509 *payload, *pilot;
+    EVP_PKEY *pilot_key;
+    psp_proxy_info_t payload_info, pilot_info;
+    unsigned char payload_digest[PSP_DIGEST_LEN], pilot_digest[PSP_DIGEST_LEN];
+    psp_verdict_t *verdict;
+    time_t now, expiry, valid_until;
+    char *dn=NULL;
+    unsigned int len;
+    int rc, use_cache, found=0, error;
+    psp_status_t status;
+
+    *payload_dn=NULL;
+    if (pair==NULL || (pair->pilot_chain==NULL && pair->pilot_path==NULL) ||
+	(pair->pilot_chain && sk_X509_num(pair->pilot_chain)<1))
+	return PSP_ERR_INPUT;
+
+    /* Payload chain, converted only when given as PEM */
+    if ( (payload_chain=pair->payload_chain)==NULL )	{
+	if (pair->payload_pem==NULL)
+	    return PSP_ERR_INPUT;
+	rc=psp_pem_to_chain(pair->payload_pem, pair->payload_pem_len, &owned);
+	if (rc!=0)
+	    return (rc==-2 ? PSP_ERR_MEMORY : PSP_ERR_INPUT);
+	payload_chain=owned;
+    }
+    if (sk_X509_num(payload_chain)<1)	{
+	status=PSP_ERR_INPUT;
+	goto end;
+    }
+    payload=sk_X509_value(payload_chain, 0);
+    now=time(NULL);
+
+    /* The payload itself */
+    if ( (rc=psp_core_check_subject(payload))!=0 )	{
+	status=(rc==-3 ? PSP_ERR_MEMORY : PSP_ERR_ISSUER);
+	goto end;
+    }
+    if (psp_core_classify(payload, &payload_info))	{
+	status=PSP_ERR_PAYLOAD;
+	goto end;
+    }
+    if ( (status=check_proxy(ctx, payload, &payload_info, now))!=PSP_OK )
+	goto end;
+
+    /* The pilot, loaded only now when given as path, and its relation with
+     * the payload */
+    if ( (pilot_chain=pair->pilot_chain)==NULL )	{
+	if ( (status=psp_loader_get(ctx->loader, pair->pilot_path,
+				    &owned_pilot))!=PSP_OK )
+	    goto end;
+	pilot_chain=owned_pilot;
+    }
+    pilot=sk_X509_value(pilot_chain, 0);
+    if (psp_core_classify(pilot, &pilot_info))	{
+	status=PSP_ERR_PILOT;
+	goto end;
+    }
+    if (X509_NAME_cmp(X509_get_issuer_name(payload),
+		      X509_get_subject_name(pilot))!=0)	{
+	status=PSP_ERR_ISSUER;
+	goto end;
+    }
+    if ( (status=check_proxy(ctx, pilot, &pilot_info, now))!=PSP_OK )
+	goto end;
+
+    /* A cached verdict saves the pilot chain validation and the signature.
+     * With a certdir the verdict depends on both whole chains, so these are
+     * the key, otherwise only the leaves are */
+    if (ctx->store)
+	use_cache=(psp_core_chain_fingerprint(payload_chain, NULL,
+					      payload_digest)==0 &&
+		   psp_core_chain_fingerprint(pilot_chain, NULL,
+					      pilot_digest)==0);
+    else
+	use_cache=(X509_digest(payload, EVP_sha256(), payload_digest,
+			       &len)==1 &&
+		   X509_digest(pilot, EVP_sha256(), pilot_digest, &len)==1);
+    if (use_cache)  {
+	pthread_mutex_lock(&(ctx->verdicts_mutex));
+	if ( (verdict=psp_verdict_cache_find(&(ctx->verdicts), payload_digest,
+					     pilot_digest, now)) )	{
+	    status=(psp_status_t)verdict->verdict;
+	    if (verdict->payload_dn)
+		dn=strdup(verdict->payload_dn);
+	    found=1;
+	}
+	pthread_mutex_unlock(&(ctx->verdicts_mutex));
+	if (found)  {
+	    COUNT(ctx->stats.verdict_cache_hit);
+	    if (status==PSP_OK && dn==NULL && (dn=format_dn(payload))==NULL)
+		status=PSP_ERR_MEMORY;
+	    goto end;
+	}
+    }
+    COUNT(ctx->stats.verdict_cache_miss);
+
+    /* The verdict is valid until the first of the proxies expires */
+    expiry=(payload_info.not_after < pilot_info.not_after ?
+	    payload_info.not_after : pilot_info.not_after);
+
+    /* With a certdir, the payload chain (when given in full) must be the
+     * pilot chain plus one proxy, and the pilot chain must be valid */
+    if (ctx->store) {
+	if ((sk_X509_num(payload_chain)>1 &&
+	     !psp_core_chain_is_suffix(pilot_chain, payload_chain)) ||
+	    X509_check_issued(pilot, payload)!=X509_V_OK ||
+	    !psp_core_chain_allows_proxy(pilot_chain))
+	    status=PSP_ERR_CHAIN;
+	else if ( (rc=psp_core_verify_chain(ctx->store, pilot,
+					    pilot_chain, &valid_until,
+					    &error))!=0 )
+	    status=(rc==-2 ? PSP_ERR_MEMORY : PSP_ERR_CHAIN);
+	else if (valid_until < expiry)
+	    expiry=valid_until;
+    }
+
+    /* The signature */
+    if (status==PSP_OK &&
+	( (pilot_key=X509_get0_pubkey(pilot))==NULL ||
+	  X509_verify(payload, pilot_key)!=1 ))
+	status=PSP_ERR_SIGNATURE;
+    if (status==PSP_OK && (dn=format_dn(payload))==NULL)
+	status=PSP_ERR_MEMORY;
+
+    /* Memory errors are not a property of the pair */
+    if (use_cache && status!=PSP_ERR_MEMORY)	{
+	pthread_mutex_lock(&(ctx->verdicts_mutex));
+	psp_verdict_cache_store(&(ctx->verdicts), payload_digest, pilot_digest,
+				(int)status, dn, expiry, now);
+	pthread_mutex_unlock(&(ctx->verdicts_mutex));
+    }
+
+end:
+    sk_X509_pop_free(owned_pilot, X509_free);
+    sk_X509_pop_free(owned, X509_free);
+    if (status==PSP_OK)
+	*payload_dn=dn;
+    else
+	free(dn);
+
+    return status;
+}
+
+/**
+ * Checks the properties common to the payload and the pilot proxy, in info
+ * as obtained by psp_core_classify(), at time now: being an RFC and, when
+ * required, limited proxy, its validity and its public key.
+ * \return PSP_OK, or the status of the first failing check
+ */
+static psp_status_t check_proxy(const psp_ctx_t *ctx, X509 *proxy,
+				const psp_proxy_info_t *info, time_t now)  {
+    if (info->is_rfc==0)
+	return PSP_ERR_NOT_RFC;
+    if (ctx->cfg.require_limited && info->is_limited==0)
+	return PSP_ERR_NOT_LIMITED;
+    if (now < info->not_before || info->not_after <= now)
+	return PSP_ERR_EXPIRED;
+    if (psp_core_check_key(proxy, ctx->cfg.key_types, ctx->cfg.min_rsa_bits))
+	return PSP_ERR_KEY;
+
+    return PSP_OK;
+}
+
+/**
+ * Formats the one-line DN of the subject of cert, using a temporary arena.
+ * \return new string or NULL on error
+ */
+static char *format_dn(X509 *cert)  {
+    psp_arena_t arena;
+    char *oneline=NULL, *dn=NULL;
+
+    psp_arena_init(&arena);
+    if (psp_dn_format(&arena, X509_get_subject_name(cert), &oneline, NULL)==0)
+	dn=strdup(oneline);
+    psp_arena_reset(&arena);
+
+    return dn;
+}
+
+/**
+ * Finds the duplicates among the n pairs, by sorting them on the SHA-256
+ * digest of their whole payload (of the PEM data or of its chain, see
+ * psp_core_chain_fingerprint()) and the pointer to their pilot chain, or to
+ * their pilot path: primary[i] is set to the lowest index of a pair equal to
+ * pair i, and todo to the indices of the pairs for which that is themselves.
+ * Pairs using different copies of a pilot chain are not recognized, but are
+ * still found in the verdict cache.
+ * \return number of entries in todo, 0 on memory error
+ */
+static size_t find_duplicates(const psp_pair_t *pairs, size_t n,
+			      size_t *primary, size_t *todo)	{
+    dedup_t *keys, *first=NULL;
+    const psp_pair_t *pair;
+    size_t i, ntodo=0;
+
+    if ( (keys=(dedup_t *)malloc(n*sizeof(dedup_t)))==NULL )
+	return 0;
+
+    for (i=0; i<n; i++)	{
+	pair=&(pairs[i]);
+	keys[i].index=i;
+	keys[i].pilot=(pair->pilot_chain ?
+			(const void *)pair->pilot_chain :
+			(const void *)pair->pilot_path);
+	if (pair->payload_chain)
+	    keys[i].valid=(psp_core_chain_fingerprint(pair->payload_chain, NULL,
+						      keys[i].fingerprint)==0);
+	else
+	    keys[i].valid=(pair->payload_pem!=NULL &&
+			   SHA256((const unsigned char *)pair->payload_pem,
+				  pair->payload_pem_len,
+				  keys[i].fingerprint)!=NULL);
+	keys[i].valid=(keys[i].valid && keys[i].pilot!=NULL);
+    }
+    qsort(keys, n, sizeof(dedup_t), cmp_dedup);
+
+    /* Within a group of equal keys, the first has the lowest index */
+    for (i=0; i<n; i++)	{
+	if (i>0 && cmp_key(&(keys[i]), first)==0)
+	    primary[keys[i].index]=first->index;
+	else	{
+	    first=&(keys[i]);
+	    primary[keys[i].index]=keys[i].index;
+	    todo[ntodo++]=keys[i].index;
+	}
+    }
+
+    free(keys);
+    return ntodo;
+}
+
+/**
+ * Compares the keys of two dedup_t: on the payload fingerprint, then on the
+ * pilot. Invalid keys are larger than valid ones and never equal to another
+ * key.
+ * \return -1, 0 or 1 when a is smaller, equal or larger than b
+ */
+static int cmp_key(const dedup_t *a, const dedup_t *b)	{
+    int rc;
+
+    if (!a->valid || !b->valid)
+	return (a->valid ? -1 : 1);
+    if ( (rc=memcmp(a->fingerprint, b->fingerprint, PSP_DIGEST_LEN))!=0 )
+	return (rc<0 ? -1 : 1);
+    if (a->pilot!=b->pilot)
+	return ((size_t)a->pilot < (size_t)b->pilot ? -1 : 1);
+
+    return 0;
+}
+
+/**
+ * Compares two dedup_t for qsort(): on their key, then on their index, such
+ * that the first of equal keys has the lowest index.
+ * \return -1, 0 or 1 when a is smaller, equal or larger than b
+ */
+static int cmp_dedup(const void *a, const void *b)  {
+    const dedup_t *da=(const dedup_t *)a, *db=(const dedup_t *)b;
+    int rc;
+
+    if ( (da->valid || db->valid) && (rc=cmp_key(da, db))!=0 )
+	return rc;
+
+    return (da->index<db->index ? -1 : da->index>db->index ? 1 : 0);
+}
+
+/**
+ * Checks the pairs in the queues of batch, starting with queue self and then
+ * stealing from the others in turn, until all are empty
+ */
+static void run_queues(psp_ctx_t *ctx, batch_t *batch, int self)	{
+    queue_t *queue;
+    size_t i, idx, nok=0;
+    int q;
+
+    for (q=0; q<batch->nqueues; q++) {
+	queue=&(batch->queues[(self+q)%batch->nqueues]);
+	while ( (i=__atomic_fetch_add(&(queue->next), 1, __ATOMIC_RELAXED)) <
+		queue->end )	{
+	    idx=batch->todo[i];
+	    if (verify_pair(ctx, &(batch->pairs[idx]),
+			    &(batch->results[idx]))==PSP_OK)
+		nok++;
+	}
+    }
+    __atomic_fetch_add(&(batch->nok), nok, __ATOMIC_RELAXED);
+}
+
+/**
+ * Main function of the pool workers, arg being its worker_t: waits for a
+ * batch, works on it, and reports when done, until asked to stop
+ * \return NULL
+ */
+static void *worker_main(void *arg)	{
+    worker_t *worker=(worker_t *)arg;
+    psp_ctx_t *ctx=worker->ctx;
+    unsigned long seen=0;
+    batch_t *batch;
+
+    pthread_mutex_lock(&(ctx->pool_mutex));
+    for (;;)	{
+	while (!ctx->stop && ctx->generation==seen)
+	    pthread_cond_wait(&(ctx->work_cond), &(ctx->pool_mutex));
+	if (ctx->stop)
+	    break;
+	seen=ctx->generation;
+	batch=ctx->batch;
+	pthread_mutex_unlock(&(ctx->pool_mutex));
+
+	/* Batches with fewer queues than threads have nothing of their own */
+	if (worker->id < batch->nqueues)
+	    run_queues(ctx, batch, worker->id);
+	else
+	    run_queues(ctx, batch, 0);
+
+	pthread_mutex_lock(&(ctx->pool_mutex));
+	if (--ctx->running==0)
+	    pthread_cond_signal(&(ctx->done_cond));
+    }
+    pthread_mutex_unlock(&(ctx->pool_mutex));
+
+    return NULL;
+}
+
+/**
+ * Stops and joins the workers of ctx
+ */
+static void pool_stop(psp_ctx_t *ctx)	{
+    int i;
+
+    pthread_mutex_lock(&(ctx->pool_mutex));
+    ctx->stop=1;
+    pthread_cond_broadcast(&(ctx->work_cond));
+    pthread_mutex_unlock(&(ctx->pool_mutex));
+
+    for (i=0; i<ctx->nworkers; i++)
+	pthread_join(ctx->workers[i].thread, NULL);
+    ctx->nworkers=0;
+}
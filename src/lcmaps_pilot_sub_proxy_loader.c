@@ -0,0 +1,636 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+/**
+ * NOTES: pilot proxy loader of libpsp. Chains are cached by path, and a
+ * cached chain is used without any I/O when its file was checked less than
+ * LOAD_CHECK_INTERVAL ago, otherwise the file is only read again when its
+ * stat information changed (see same_file()). Asynchronous loads are done by
+ * one loader thread, started by the first of them: a load for a path that is
+ * already queued or being read joins that load instead of reading the file
+ * again. Unlike the plugin, the library runs as the user owning the proxies,
+ * so there is no privilege dropping, and no file locking: a file changing
+ * while being read is read again.
+ */
+
+/* needed for O_NOFOLLOW and O_CLOEXEC */
+#define _XOPEN_SOURCE	700
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <openssl/x509.h>
+#include <openssl/crypto.h> /* OPENSSL_cleanse */
+
+#include "lcmaps_pilot_sub_proxy_loader.h"
+#include "lcmaps_pilot_sub_proxy_pem.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/** Number of pilot chains cached by a loader */
+#define LOAD_CACHE_SIZE		16
+
+/** Seconds during which a cached chain is used without checking its file */
+#define LOAD_CHECK_INTERVAL	1
+
+/** Maximum number of reads of a file that keeps changing */
+#define LOAD_TRIES		10
+
+/** Largest pilot proxy file that is read */
+#define LOAD_MAX_SIZE		(1024*1024)
+
+/** Relaxed atomic increment of a statistics counter */
+#define COUNT(counter)	__atomic_fetch_add(&(counter), 1, __ATOMIC_RELAXED)
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Cached pilot chain */
+typedef struct entry_s	{
+    char *path;			/* path of the file, NULL when unused */
+    struct stat st;		/* stat information when it was read */
+    int st_exact;		/* whether st identifies the contents, see
+				   load_path() */
+    STACK_OF(X509) *chain;	/* the chain */
+    time_t checked;		/* last time st was found unchanged */
+    unsigned long last_used;	/* clock value of the last use */
+} entry_t;
+
+/** Callback waiting for an asynchronous load */
+typedef struct waiter_s	{
+    psp_load_cb_t cb;
+    void *arg;
+    struct waiter_s *next;
+} waiter_t;
+
+/** Asynchronous load of a path, queued or in progress */
+typedef struct load_s	{
+    char *path;
+    waiter_t *waiters;		/* callbacks, in order of arrival */
+    waiter_t **tail;		/* end of waiters, for appending */
+    struct load_s *next;	/* next queued load */
+} load_t;
+
+struct psp_loader_s {
+    pthread_mutex_t mutex;	/* protects everything below */
+    entry_t entries[LOAD_CACHE_SIZE];
+    unsigned long clock;	/* use counter for LRU replacement */
+    load_t *queue;		/* loads, the first one being in progress */
+    load_t **queue_tail;	/* end of queue, for appending */
+    pthread_cond_t queue_cond;	/* signals a new load or stop */
+    pthread_t thread;		/* loader thread, when started */
+    int started;		/* whether thread is running */
+    int stop;			/* set when thread should exit */
+    psp_loader_stats_t stats;	/* statistics, updated atomically */
+};
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Obtains the chain in path into chain as a new reference, through the cache
+ * \return PSP_OK, PSP_ERR_FILE, PSP_ERR_INPUT or PSP_ERR_MEMORY */
+static psp_status_t load_path(psp_loader_t *loader, const char *path,
+			      STACK_OF(X509) **chain);
+
+/* Finds the entry for path, the mutex being held.
+ * \return entry or NULL */
+static entry_t *find_entry(psp_loader_t *loader, const char *path);
+
+/* Stores chain (taking ownership) read from path with stat information st,
+ * the mutex being held.
+ * \return 0 on success, -1 on memory error (chain is freed) */
+static int store_entry(psp_loader_t *loader, const char *path,
+		       const struct stat *st, int st_exact,
+		       STACK_OF(X509) *chain, time_t now);
+
+/* Frees what entry holds, after which it is unused */
+static void clear_entry(entry_t *entry);
+
+/* Makes a new reference to chain into copy.
+ * \return PSP_OK or PSP_ERR_MEMORY */
+static psp_status_t copy_chain(STACK_OF(X509) *chain, STACK_OF(X509) **copy);
+
+/* Reads the pilot chain in path into chain, with st set to its stat
+ * information. When cached_st is not NULL and the file is unchanged with
+ * respect to it, nothing is read.
+ * \return 0 on success, 1 when unchanged, -1 when the file cannot be read or
+ * is unsafe, -2 when it cannot be parsed, -3 on memory error */
+static int read_file(const char *path, const struct stat *cached_st,
+		     STACK_OF(X509) **chain, struct stat *st);
+
+/* Checks whether st1 and st2 refer to the same unmodified file.
+ * \return 1 when they do, 0 otherwise */
+static int same_file(const struct stat *st1, const struct stat *st2);
+
+/* Calls the callbacks in the list waiters with status and chain, and frees the
+ * list */
+static void call_waiters(waiter_t *waiters, psp_status_t status,
+			 STACK_OF(X509) *chain);
+
+/* Main function of the loader thread, arg being the loader
+ * \return NULL */
+static void *loader_main(void *arg);
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * Creates a loader, its thread is only started by the first asynchronous
+ * load. Does not log.
+ * \return new loader or NULL on memory error
+ */
+psp_loader_t *psp_loader_new(void)  {
+    psp_loader_t *loader;
+
+    if ( (loader=(psp_loader_t *)calloc(1, sizeof(psp_loader_t)))==NULL )
+	return NULL;
+    if (pthread_mutex_init(&(loader->mutex), NULL)!=0)	{
+	free(loader);
+	return NULL;
+    }
+    if (pthread_cond_init(&(loader->queue_cond), NULL)!=0)	{
+	pthread_mutex_destroy(&(loader->mutex));
+	free(loader);
+	return NULL;
+    }
+    loader->queue_tail=&(loader->queue);
+
+    return loader;
+}
+
+/**
+ * Stops the thread of loader and frees it. The callbacks of loads that were
+ * still queued are called with PSP_ERR_FILE. Must not be called from such a
+ * callback.
+ */
+void psp_loader_free(psp_loader_t *loader)	{
+    load_t *load;
+    int i;
+
+    if (loader==NULL)
+	return;
+
+    pthread_mutex_lock(&(loader->mutex));
+    loader->stop=1;
+    pthread_cond_signal(&(loader->queue_cond));
+    pthread_mutex_unlock(&(loader->mutex));
+    if (loader->started)
+	pthread_join(loader->thread, NULL);
+
+    while ( (load=loader->queue) )  {
+	loader->queue=load->next;
+	call_waiters(load->waiters, PSP_ERR_FILE, NULL);
+	free(load->path);
+	free(load);
+    }
+    for (i=0; i<LOAD_CACHE_SIZE; i++)
+	clear_entry(&(loader->entries[i]));
+    pthread_cond_destroy(&(loader->queue_cond));
+    pthread_mutex_destroy(&(loader->mutex));
+    free(loader);
+}
+
+/**
+ * Obtains the chain of the pilot proxy in path into chain, as a new
+ * reference. A cached chain is used when its file was checked less than a
+ * second ago, or when the file is unchanged, otherwise it is read on the
+ * calling thread.
+ * \return PSP_OK, PSP_ERR_FILE, PSP_ERR_INPUT or PSP_ERR_MEMORY
+ */
+psp_status_t psp_loader_get(psp_loader_t *loader, const char *path,
+			    STACK_OF(X509) **chain)	{
+    if (path==NULL || chain==NULL)
+	return PSP_ERR_INPUT;
+
+    return load_path(loader, path, chain);
+}
+
+/**
+ * Obtains the chain of the pilot proxy in path without blocking: when cached
+ * and recently checked, cb is called before returning, otherwise the load is
+ * queued for the loader thread, joining a queued load of the same path.
+ * \return 0 when cb was called already, 1 when it will be called by the
+ * loader thread, -1 on error (cb is not called)
+ */
+int psp_loader_get_async(psp_loader_t *loader, const char *path,
+			 psp_load_cb_t cb, void *arg)	{
+    STACK_OF(X509) *chain=NULL;
+    psp_status_t status;
+    entry_t *entry;
+    waiter_t *waiter;
+    load_t *load;
+    time_t now=time(NULL);
+
+    if (path==NULL || cb==NULL)
+	return -1;
+    if ( (waiter=(waiter_t *)malloc(sizeof(waiter_t)))==NULL )
+	return -1;
+    waiter->cb=cb;
+    waiter->arg=arg;
+    waiter->next=NULL;
+
+    pthread_mutex_lock(&(loader->mutex));
+
+    /* Recently checked chains are served right away */
+    if ( (entry=find_entry(loader, path)) &&
+	 now < entry->checked+LOAD_CHECK_INTERVAL )	{
+	entry->last_used=++loader->clock;
+	status=copy_chain(entry->chain, &chain);
+	pthread_mutex_unlock(&(loader->mutex));
+	COUNT(loader->stats.cache_hit);
+	free(waiter);
+	cb(arg, status, chain);
+	return 0;
+    }
+
+    /* Join a load of the same path */
+    for (load=loader->queue; load; load=load->next)
+	if (strcmp(load->path, path)==0)
+	    break;
+    if (load)	{
+	*(load->tail)=waiter;
+	load->tail=&(waiter->next);
+	pthread_mutex_unlock(&(loader->mutex));
+	COUNT(loader->stats.coalesced);
+	return 1;
+    }
+
+    /* Queue a new load, starting the thread when needed */
+    if ( (load=(load_t *)calloc(1, sizeof(load_t)))==NULL ||
+	 (load->path=strdup(path))==NULL ||
+	 (!loader->started &&
+	  pthread_create(&(loader->thread), NULL, loader_main, loader)!=0) )  {
+	pthread_mutex_unlock(&(loader->mutex));
+	if (load)
+	    free(load->path);
+	free(load);
+	free(waiter);
+	return -1;
+    }
+    loader->started=1;
+    load->waiters=waiter;
+    load->tail=&(waiter->next);
+    *(loader->queue_tail)=load;
+    loader->queue_tail=&(load->next);
+    pthread_cond_signal(&(loader->queue_cond));
+    pthread_mutex_unlock(&(loader->mutex));
+
+    return 1;
+}
+
+/**
+ * Obtains the statistics of loader into stats
+ */
+void psp_loader_stats(psp_loader_t *loader, psp_loader_stats_t *stats)   {
+    stats->cache_hit=__atomic_load_n(&(loader->stats.cache_hit),
+				     __ATOMIC_RELAXED);
+    stats->loads=__atomic_load_n(&(loader->stats.loads), __ATOMIC_RELAXED);
+    stats->coalesced=__atomic_load_n(&(loader->stats.coalesced),
+				     __ATOMIC_RELAXED);
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Obtains the chain in path into chain as a new reference, through the cache.
+ * The file is read without holding the mutex, so another thread may have
+ * replaced the entry meanwhile: when the file turns out to be unchanged with
+ * respect to an entry that is no longer there, it is read in full.
+ * Unreadable or unparsable files are removed from the cache.
+ * \return PSP_OK, PSP_ERR_FILE, PSP_ERR_INPUT or PSP_ERR_MEMORY
+ */
+static psp_status_t load_path(psp_loader_t *loader, const char *path,
+			      STACK_OF(X509) **chain)	{
+    STACK_OF(X509) *newchain=NULL;
+    struct stat cached_st, st;
+    entry_t *entry;
+    psp_status_t status;
+    time_t now=time(NULL), read_time;
+    int have_st, rc, tries;
+
+    for (tries=0; tries<2; tries++) {
+	pthread_mutex_lock(&(loader->mutex));
+	have_st=0;
+	if ( (entry=find_entry(loader, path)) && tries==0 )	{
+	    if (now < entry->checked+LOAD_CHECK_INTERVAL)   {
+		entry->last_used=++loader->clock;
+		status=copy_chain(entry->chain, chain);
+		pthread_mutex_unlock(&(loader->mutex));
+		COUNT(loader->stats.cache_hit);
+		return status;
+	    }
+	    /* When the stat does not identify the contents, always read the
+	     * file again */
+	    if (entry->st_exact)    {
+		cached_st=entry->st;
+		have_st=1;
+	    }
+	}
+	pthread_mutex_unlock(&(loader->mutex));
+
+	COUNT(loader->stats.loads);
+	read_time=time(NULL);
+	rc=read_file(path, have_st ? &cached_st : NULL, &newchain, &st);
+
+	pthread_mutex_lock(&(loader->mutex));
+	entry=find_entry(loader, path);
+	switch (rc) {
+	    case 1:
+		if (entry==NULL || !same_file(&(entry->st), &cached_st))
+		    break; /* replaced meanwhile, read it in full */
+		entry->checked=now;
+		entry->last_used=++loader->clock;
+		status=copy_chain(entry->chain, chain);
+		pthread_mutex_unlock(&(loader->mutex));
+		return status;
+	    case 0:
+		/* Since stat times have a resolution of seconds, a change
+		 * within the same second as the read would go unnoticed */
+		if (store_entry(loader, path, &st, st.st_ctime < read_time,
+				newchain, now)!=0)
+		    status=PSP_ERR_MEMORY;
+		else
+		    status=copy_chain(newchain, chain);
+		pthread_mutex_unlock(&(loader->mutex));
+		return status;
+	    default:
+		/* Never serve a chain whose file became unusable */
+		if (entry && rc!=-3)
+		    clear_entry(entry);
+		pthread_mutex_unlock(&(loader->mutex));
+		return (rc==-3 ? PSP_ERR_MEMORY :
+			rc==-2 ? PSP_ERR_INPUT : PSP_ERR_FILE);
+	}
+	pthread_mutex_unlock(&(loader->mutex));
+    }
+
+    return PSP_ERR_FILE;
+}
+
+/**
+ * Finds the entry for path, the mutex being held.
+ * \return entry or NULL
+ */
+static entry_t *find_entry(psp_loader_t *loader, const char *path)	{
+    int i;
+
+    for (i=0; i<LOAD_CACHE_SIZE; i++)
+	if (loader->entries[i].path &&
+	    strcmp(loader->entries[i].path, path)==0)
+	    return &(loader->entries[i]);
+
+    return NULL;
+}
+
+/**
+ * Stores chain (taking ownership) read from path with stat information st,
+ * the mutex being held: in the entry of path, or else in an unused or the
+ * least recently used entry.
+ * \return 0 on success, -1 on memory error (chain is freed)
+ */
+static int store_entry(psp_loader_t *loader, const char *path,
+		       const struct stat *st, int st_exact,
+		       STACK_OF(X509) *chain, time_t now)  {
+    entry_t *entry, *victim=NULL;
+    char *copy;
+    int i;
+
+    if ( (entry=find_entry(loader, path))==NULL )	{
+	for (i=0; i<LOAD_CACHE_SIZE; i++)   {
+	    entry=&(loader->entries[i]);
+	    if (entry->path==NULL)  {
+		victim=entry;
+		break;
+	    }
+	    if (victim==NULL || entry->last_used < victim->last_used)
+		victim=entry;
+	}
+	if ( (copy=strdup(path))==NULL )    {
+	    sk_X509_pop_free(chain, X509_free);
+	    return -1;
+	}
+	entry=victim;
+	clear_entry(entry);
+	entry->path=copy;
+    } else
+	sk_X509_pop_free(entry->chain, X509_free);
+
+    entry->st=*st;
+    entry->st_exact=st_exact;
+    entry->chain=chain;
+    entry->checked=now;
+    entry->last_used=++loader->clock;
+
+    return 0;
+}
+
+/**
+ * Frees what entry holds, after which it is unused
+ */
+static void clear_entry(entry_t *entry)	{
+    free(entry->path);
+    entry->path=NULL;
+    sk_X509_pop_free(entry->chain, X509_free);
+    entry->chain=NULL;
+}
+
+/**
+ * Makes a new reference to chain into copy, sharing its certificates.
+ * \return PSP_OK or PSP_ERR_MEMORY
+ */
+static psp_status_t copy_chain(STACK_OF(X509) *chain, STACK_OF(X509) **copy) {
+    if ( (*copy=X509_chain_up_ref(chain))==NULL )
+	return PSP_ERR_MEMORY;
+
+    return PSP_OK;
+}
+
+/**
+ * Reads the pilot chain in path into chain, with st set to its stat
+ * information. The file must be a regular file owned by the real uid, and
+ * not be readable or writable by anyone else, as the plugin requires. When
+ * cached_st is not NULL and the file is unchanged with respect to it, nothing
+ * is read. A file changing while being read is read again.
+ * \return 0 on success, 1 when unchanged, -1 when the file cannot be read or
+ * is unsafe, -2 when it cannot be parsed, -3 on memory error
+ */
+static int read_file(const char *path, const struct stat *cached_st,
+		     STACK_OF(X509) **chain, struct stat *st)	{
+    struct timespec pause={0, 500000};
+    struct stat st2;
+    char *buf=NULL, *newbuf;
+    size_t buf_len=0;
+    ssize_t size=0;
+    int fd, i, rc=-1;
+
+    if ( (fd=open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC))==-1 )
+	return -1;
+    if (fstat(fd, st)!=0 || !S_ISREG(st->st_mode) || st->st_uid!=getuid() ||
+	st->st_mode & (S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH) ||
+	st->st_size>LOAD_MAX_SIZE)   {
+	close(fd);
+	return -1;
+    }
+    if (cached_st && same_file(st, cached_st))   {
+	close(fd);
+	return 1;
+    }
+
+    /* The buffer holds the private key, so it is cleansed rather than left to
+     * realloc() and free() */
+    for (i=0; i<LOAD_TRIES; i++)    {
+	if ( (newbuf=(char *)malloc((size_t)st->st_size+1))==NULL )   {
+	    rc=-3;
+	    break;
+	}
+	if (buf)    {
+	    OPENSSL_cleanse(buf, buf_len);
+	    free(buf);
+	}
+	buf=newbuf;
+	buf_len=(size_t)st->st_size+1;
+	if (lseek(fd, (off_t)0, SEEK_SET)!=0)
+	    break;
+	size=read(fd, buf, (size_t)st->st_size);
+	if (fstat(fd, &st2)!=0)
+	    break;
+	if (same_file(&st2, st))    {
+	    rc=(size==(ssize_t)st->st_size ? 0 : -1);
+	    break;
+	}
+	/* Changed while reading */
+	if (st2.st_size>LOAD_MAX_SIZE)
+	    break;
+	*st=st2;
+	nanosleep(&pause, NULL);
+    }
+    close(fd);
+
+    if (rc==0)	{
+	rc=psp_pem_to_chain(buf, (size_t)size, chain);
+	rc=(rc==-2 ? -3 : rc==0 ? 0 : -2);
+    }
+    if (buf)	{
+	OPENSSL_cleanse(buf, buf_len);
+	free(buf);
+    }
+
+    return rc;
+}
+
+/**
+ * Checks whether st1 and st2 refer to the same unmodified file, based on
+ * device, inode, size, mtime and ctime.
+ * \return 1 when they do, 0 otherwise
+ */
+static int same_file(const struct stat *st1, const struct stat *st2)	{
+    return ( st1->st_dev  ==st2->st_dev &&
+	     st1->st_ino  ==st2->st_ino &&
+	     st1->st_size ==st2->st_size &&
+	     st1->st_mtime==st2->st_mtime &&
+	     st1->st_ctime==st2->st_ctime );
+}
+
+/**
+ * Calls the callbacks in the list waiters with status and, on success, each
+ * with its own reference to chain, and frees the list
+ */
+static void call_waiters(waiter_t *waiters, psp_status_t status,
+			 STACK_OF(X509) *chain)	{
+    STACK_OF(X509) *copy;
+    psp_status_t mystatus;
+    waiter_t *waiter;
+
+    while ( (waiter=waiters) )	{
+	waiters=waiter->next;
+	copy=NULL;
+	mystatus=(status==PSP_OK ? copy_chain(chain, &copy) : status);
+	waiter->cb(waiter->arg, mystatus, copy);
+	free(waiter);
+    }
+}
+
+/**
+ * Main function of the loader thread, arg being the loader: does the queued
+ * loads in turn. A load stays at the head of the queue while in progress, so
+ * that loads of the same path join it, and its callbacks are called after
+ * removing it, without holding the mutex.
+ * \return NULL
+ */
+static void *loader_main(void *arg)	{
+    psp_loader_t *loader=(psp_loader_t *)arg;
+    STACK_OF(X509) *chain;
+    psp_status_t status;
+    waiter_t *waiters;
+    load_t *load;
+
+    pthread_mutex_lock(&(loader->mutex));
+    for (;;)	{
+	while (!loader->stop && loader->queue==NULL)
+	    pthread_cond_wait(&(loader->queue_cond), &(loader->mutex));
+	if (loader->stop)
+	    break;
+	load=loader->queue;
+	pthread_mutex_unlock(&(loader->mutex));
+
+	chain=NULL;
+	status=load_path(loader, load->path, &chain);
+
+	pthread_mutex_lock(&(loader->mutex));
+	if ( (loader->queue=load->next)==NULL )
+	    loader->queue_tail=&(loader->queue);
+	waiters=load->waiters;
+	pthread_mutex_unlock(&(loader->mutex));
+
+	call_waiters(waiters, status, chain);
+	sk_X509_pop_free(chain, X509_free);
+	free(load->path);
+	free(load);
+
+	pthread_mutex_lock(&(loader->mutex));
+    }
+    pthread_mutex_unlock(&(loader->mutex));
+
+    return NULL;
+}
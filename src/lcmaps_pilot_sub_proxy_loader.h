@@ -0,0 +1,92 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+#ifndef LCMAPS_PILOT_SUB_PROXY_LOADER_H
+#define LCMAPS_PILOT_SUB_PROXY_LOADER_H
+
+#include <openssl/x509.h>
+
+#include "psp.h"
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Pilot proxy loader of libpsp: a cache of pilot chains by path, and a
+ * thread doing the loads for psp_loader_get_async() */
+typedef struct psp_loader_s psp_loader_t;
+
+/** Statistics of a loader */
+typedef struct psp_loader_stats_s   {
+    unsigned long cache_hit;	/* served from the cache without any I/O */
+    unsigned long loads;	/* files opened, to read or revalidate them */
+    unsigned long coalesced;	/* async loads joining one in flight */
+} psp_loader_stats_t;
+
+
+/************************************************************************
+ * Function prototypes
+ ************************************************************************/
+
+/**
+ * Creates a loader, its thread is only started by the first asynchronous
+ * load. Does not log.
+ * \return new loader or NULL on memory error
+ */
+psp_loader_t *psp_loader_new(void);
+
+/**
+ * Stops the thread of loader and frees it. The callbacks of loads that were
+ * still queued are called with PSP_ERR_FILE. Must not be called from such a
+ * callback.
+ */
+void psp_loader_free(psp_loader_t *loader);
+
+/**
+ * Obtains the chain of the pilot proxy in path into chain, as a new
+ * reference. A cached chain is used when its file was checked less than a
+ * second ago, or when the file is unchanged, otherwise it is read on the
+ * calling thread.
+ * \return PSP_OK, PSP_ERR_FILE, PSP_ERR_INPUT or PSP_ERR_MEMORY
+ */
+psp_status_t psp_loader_get(psp_loader_t *loader, const char *path,
+			    STACK_OF(X509) **chain);
+
+/**
+ * Obtains the chain of the pilot proxy in path without blocking, see
+ * psp_load_pilot().
+ * \return 0 when cb was called already, 1 when it will be called by the
+ * loader thread, -1 on error (cb is not called)
+ */
+int psp_loader_get_async(psp_loader_t *loader, const char *path,
+			 psp_load_cb_t cb, void *arg);
+
+/**
+ * Obtains the statistics of loader into stats
+ */
+void psp_loader_stats(psp_loader_t *loader, psp_loader_stats_t *stats);
+
+#endif /* LCMAPS_PILOT_SUB_PROXY_LOADER_H */
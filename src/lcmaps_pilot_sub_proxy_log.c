@@ -0,0 +1,359 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+/**
+ * NOTES: log level checks and rate limiting for the plugin. LCMAPS filters
+ * messages only after formatting them, so the plugin keeps the level itself
+ * and checks it before evaluating any arguments. Warnings about requests are
+ * limited per pilot, such that a flood of bad payloads for one pilot does not
+ * hide the messages about other pilots, with a small table of pilots being
+ * tracked in which the least recently started interval is replaced. Warnings
+ * for which the pilot is not known, e.g. in directory mode before the payload
+ * is parsed, share one more slot with a limit of its own. */
+
+#include "lcmaps_plugins_pilot_sub_proxy_config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <openssl/x509.h>
+#include <lcmaps/lcmaps_log.h>
+
+#include "lcmaps_pilot_sub_proxy_log.h"
+#include "lcmaps_pilot_sub_proxy_stats.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/** Number of pilots tracked by the rate limiter */
+#define RATE_SLOTS	64
+
+/** Priority used in the absence of LCMAPS_DEBUG_LEVEL, LCMAPS' default */
+#define DEFAULT_LEVEL	LOG_INFO
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Warnings of one pilot in the current interval */
+typedef struct rate_slot_s  {
+    unsigned long pilot;	/* psp_log_pilot_hash() of the pilot */
+    time_t start;		/* start of the interval, 0 when unused */
+    unsigned int count;		/* warnings logged in the interval */
+    unsigned long suppressed;	/* warnings suppressed in the interval */
+} rate_slot_t;
+
+
+/************************************************************************
+ * Global variables
+ ************************************************************************/
+
+/** Least important priority that is logged, only set during initialization */
+int psp_log_level=LOG_DEBUG;
+
+/** Maximum number of warnings per pilot per interval, 0 for no limit */
+static unsigned int rate_limit=PSP_LOG_RATE_LIMIT;
+
+/** Maximum number of warnings per interval for all unknown pilots together,
+ * 0 for no limit */
+static unsigned int unknown_rate_limit=PSP_LOG_UNKNOWN_RATE_LIMIT;
+
+static pthread_mutex_t rate_lock=PTHREAD_MUTEX_INITIALIZER;
+static rate_slot_t rate_slots[RATE_SLOTS];
+static rate_slot_t unknown_slot;	/* shared by the unknown pilots */
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Counts a warning for pilot.
+ * \return 1 when the warning is to be logged, 0 when it is suppressed */
+static int rate_allow(unsigned long pilot);
+
+/* Counts a warning for an unknown pilot.
+ * \return 1 when the warning is to be logged, 0 when it is suppressed */
+static int unknown_allow(void);
+
+/* Counts a warning in slot for pilot, limited to limit per interval, starting
+ * a new interval when needed. Needs rate_lock.
+ * \return 1 when the warning is to be logged, 0 when it is suppressed */
+static int slot_allow(rate_slot_t *slot, unsigned long pilot,
+		      unsigned int limit, time_t now, rate_slot_t *old);
+
+/* Hashes the path of a pilot proxy file
+ * \return hash of path */
+static unsigned long path_hash(const char *path);
+
+/* Logs the number of suppressed warnings of slot, which is for the unknown
+ * pilots when unknown is set, when there are any */
+static void report_suppressed(const rate_slot_t *slot, int unknown,
+			      time_t now);
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * Sets the log level from the LCMAPS_DEBUG_LEVEL environment variable, as
+ * used by LCMAPS itself, and the default rate limit. Only to be called during
+ * initialization.
+ */
+void psp_log_init(void)	{
+    const char *str=getenv("LCMAPS_DEBUG_LEVEL");
+    char *end;
+    long level;
+
+    /* Levels 1 to 5 are LOG_ERR to LOG_DEBUG, 0 leaves only worse than that */
+    psp_log_level=DEFAULT_LEVEL;
+    if (str && str[0]!='\0')	{
+	level=strtol(str, &end, 10);
+	if (*end=='\0' && level>=0 && level<=5)
+	    psp_log_level=LOG_ERR-1+(int)level;
+    }
+    rate_limit=PSP_LOG_RATE_LIMIT;
+    unknown_rate_limit=PSP_LOG_UNKNOWN_RATE_LIMIT;
+}
+
+/**
+ * Overrides the log level when level>=0 and sets the rate limit to at most
+ * limit warnings per pilot per PSP_LOG_RATE_INTERVAL, 0 meaning no limit,
+ * also not for the unknown pilots. Only to be called during initialization.
+ */
+void psp_log_configure(int level, int limit)	{
+    if (level>=0)
+	psp_log_level=level;
+    rate_limit=(limit>0 ? (unsigned int)limit : 0);
+    unknown_rate_limit=(limit>0 ? PSP_LOG_UNKNOWN_RATE_LIMIT : 0);
+}
+
+/**
+ * Reports the warnings that were suppressed and clears the rate limiter
+ */
+void psp_log_cleanup(void)  {
+    time_t now=time(NULL);
+    int i;
+
+    pthread_mutex_lock(&rate_lock);
+    for (i=0; i<RATE_SLOTS; i++)
+	report_suppressed(&(rate_slots[i]), 0, now);
+    report_suppressed(&unknown_slot, 1, now);
+    memset(rate_slots, 0, sizeof(rate_slots));
+    memset(&unknown_slot, 0, sizeof(rate_slot_t));
+    pthread_mutex_unlock(&rate_lock);
+}
+
+/**
+ * Parses a syslog priority, by name (e.g. "warning" or "debug") or number.
+ * \return priority or -1 when str is not a priority
+ */
+int psp_log_parse_level(const char *str)    {
+    static const char *names[] = {
+	"emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+    };
+    int i;
+
+    for (i=0; i<(int)(sizeof(names)/sizeof(names[0])); i++)
+	if (strcmp(str, names[i])==0)
+	    return i;
+    if (str[0]>='0' && str[0]<='7' && str[1]=='\0')
+	return str[0]-'0';
+
+    return -1;
+}
+
+/**
+ * Identifies the pilot of a request by the hash of the issuer of its payload
+ * proxy cert, which is the subject of the pilot.
+ * \return X509_NAME_hash() of the issuer, 0 when payload_cert is NULL
+ */
+unsigned long psp_log_pilot_hash(const X509 *payload_cert)	{
+    if (payload_cert==NULL)
+	return 0;
+
+    return X509_NAME_hash(X509_get_issuer_name(payload_cert));
+}
+
+/**
+ * Rate limiter for warnings about requests, per pilot as identified by
+ * psp_log_pilot_hash(payload_cert). Warnings beyond the limit are counted,
+ * and reported as one message once the pilot warns again in a later interval.
+ * Without payload_cert the pilot is unknown, and the warning counts against
+ * the PSP_LOG_UNKNOWN_RATE_LIMIT shared by all such requests.
+ * \return 1 when the warning is to be logged, 0 when it is suppressed
+ */
+int psp_log_allow(const X509 *payload_cert)	{
+    if (payload_cert==NULL)
+	return unknown_allow();
+    if (rate_limit==0)
+	return 1;
+
+    return rate_allow(psp_log_pilot_hash(payload_cert));
+}
+
+/**
+ * Rate limiter like psp_log_allow(), for requests whose payload is not parsed
+ * yet, identifying the pilot by the path of its proxy file instead. Without
+ * pilot_path the warning counts against the limit for the unknown pilots.
+ * \return 1 when the warning is to be logged, 0 when it is suppressed
+ */
+int psp_log_allow_path(const char *pilot_path)	{
+    if (pilot_path==NULL)
+	return unknown_allow();
+    if (rate_limit==0)
+	return 1;
+
+    return rate_allow(path_hash(pilot_path));
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Counts a warning for pilot, as identified by psp_log_pilot_hash() or
+ * path_hash(). Warnings beyond the limit are counted, and reported as one
+ * message once the pilot warns again in a later interval.
+ * \return 1 when the warning is to be logged, 0 when it is suppressed
+ */
+static int rate_allow(unsigned long pilot)	{
+    rate_slot_t *slot=NULL, old;
+    time_t now;
+    int i, allow;
+
+    now=time(NULL);
+    old.suppressed=0;
+
+    pthread_mutex_lock(&rate_lock);
+    /* Find the pilot, otherwise take the oldest slot */
+    for (i=0; i<RATE_SLOTS; i++)    {
+	if (rate_slots[i].start!=0 && rate_slots[i].pilot==pilot)   {
+	    slot=&(rate_slots[i]);
+	    break;
+	}
+	if (slot==NULL || rate_slots[i].start<slot->start)
+	    slot=&(rate_slots[i]);
+    }
+    allow=slot_allow(slot, pilot, rate_limit, now, &old);
+    pthread_mutex_unlock(&rate_lock);
+
+    if (old.suppressed>0)
+	report_suppressed(&old, 0, now);
+    if (!allow)
+	psp_stats_count(PSP_COUNT_LOG_SUPPRESSED);
+
+    return allow;
+}
+
+/**
+ * Counts a warning for an unknown pilot, in the slot shared by all of them
+ * with a limit of its own, as they cannot be told apart.
+ * \return 1 when the warning is to be logged, 0 when it is suppressed
+ */
+static int unknown_allow(void)	{
+    rate_slot_t old;
+    time_t now;
+    int allow;
+
+    if (unknown_rate_limit==0)
+	return 1;
+
+    now=time(NULL);
+    old.suppressed=0;
+
+    pthread_mutex_lock(&rate_lock);
+    allow=slot_allow(&unknown_slot, 0, unknown_rate_limit, now, &old);
+    pthread_mutex_unlock(&rate_lock);
+
+    if (old.suppressed>0)
+	report_suppressed(&old, 1, now);
+    if (!allow)
+	psp_stats_count(PSP_COUNT_LOG_SUPPRESSED);
+
+    return allow;
+}
+
+/**
+ * Counts a warning in slot for pilot, limited to limit per interval. A new
+ * interval is started for a new pilot or when the old one is over, after
+ * copying the state of slot into old. Needs rate_lock.
+ * \return 1 when the warning is to be logged, 0 when it is suppressed
+ */
+static int slot_allow(rate_slot_t *slot, unsigned long pilot,
+		      unsigned int limit, time_t now, rate_slot_t *old)	{
+    if (slot->pilot!=pilot || slot->start==0 ||
+	now-slot->start>=PSP_LOG_RATE_INTERVAL || now<slot->start)	{
+	*old=*slot;
+	slot->pilot=pilot;
+	slot->start=now;
+	slot->count=0;
+	slot->suppressed=0;
+    }
+    if (slot->count<limit)  {
+	slot->count++;
+	return 1;
+    }
+    slot->suppressed++;
+
+    return 0;
+}
+
+/**
+ * Hashes the path of a pilot proxy file, using FNV-1a
+ * \return hash of path
+ */
+static unsigned long path_hash(const char *path)	{
+    unsigned long hash=2166136261UL;
+
+    for (; *path; path++)
+	hash=((hash ^ (unsigned char)*path) * 16777619UL) & 0xffffffffUL;
+
+    return hash;
+}
+
+/**
+ * Logs the number of suppressed warnings of slot, which is for the unknown
+ * pilots when unknown is set, when there are any
+ */
+static void report_suppressed(const rate_slot_t *slot, int unknown,
+			      time_t now)	{
+    if (slot->suppressed>0 && unknown)
+	lcmaps_log(LOG_WARNING,
+	    "%s: suppressed %lu warnings for unknown pilots in the last %ld s\n",
+	    __func__, slot->suppressed,
+	    (long)(now>slot->start ? now-slot->start : 0));
+    else if (slot->suppressed>0)
+	lcmaps_log(LOG_WARNING,
+	    "%s: suppressed %lu warnings for pilot %08lx in the last %ld s\n",
+	    __func__, slot->suppressed, slot->pilot,
+	    (long)(now>slot->start ? now-slot->start : 0));
+}
@@ -0,0 +1,145 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+#ifndef LCMAPS_PILOT_SUB_PROXY_LOG_H
+#define LCMAPS_PILOT_SUB_PROXY_LOG_H
+
+#include <openssl/x509.h>
+#include <lcmaps/lcmaps_log.h>
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/** Default maximum number of warnings per pilot per PSP_LOG_RATE_INTERVAL */
+#define PSP_LOG_RATE_LIMIT	60
+
+/** Maximum number of warnings per PSP_LOG_RATE_INTERVAL for which the pilot
+ * is not known, for all such requests together */
+#define PSP_LOG_UNKNOWN_RATE_LIMIT	120
+
+/** Length in seconds of the interval of the rate limit */
+#define PSP_LOG_RATE_INTERVAL	60
+
+/** Whether messages of priority prty are logged, see psp_log_configure() */
+#define psp_log_enabled(prty)	((prty)<=psp_log_level)
+
+/**
+ * Logs like lcmaps_log(), but only evaluates the arguments and formats the
+ * message when prty is logged
+ */
+#define psp_log(prty, ...)						\
+    do {								\
+	if (psp_log_enabled(prty))					\
+	    lcmaps_log((prty), __VA_ARGS__);				\
+    } while (0)
+
+/**
+ * Logs a warning about a request with payload proxy cert payload_cert (NULL
+ * when not known yet), unless its pilot exceeded the rate limit, see
+ * psp_log_allow()
+ */
+#define psp_log_warning(payload_cert, ...)				\
+    do {								\
+	if (psp_log_enabled(LOG_WARNING) && psp_log_allow(payload_cert))	\
+	    lcmaps_log(LOG_WARNING, __VA_ARGS__);			\
+    } while (0)
+
+/**
+ * Logs a warning about a request whose payload is not parsed yet, for the
+ * pilot proxy file pilot_path (NULL when not known), unless that pilot
+ * exceeded the rate limit, see psp_log_allow_path()
+ */
+#define psp_log_warning_path(pilot_path, ...)				\
+    do {								\
+	if (psp_log_enabled(LOG_WARNING) && psp_log_allow_path(pilot_path))	\
+	    lcmaps_log(LOG_WARNING, __VA_ARGS__);			\
+    } while (0)
+
+
+/************************************************************************
+ * Global variables
+ ************************************************************************/
+
+/** Least important priority that is logged, only set during initialization */
+extern int psp_log_level;
+
+
+/************************************************************************
+ * Function prototypes
+ ************************************************************************/
+
+/**
+ * Sets the log level from the LCMAPS_DEBUG_LEVEL environment variable, as
+ * used by LCMAPS itself, and the default rate limit. Only to be called during
+ * initialization.
+ */
+void psp_log_init(void);
+
+/**
+ * Overrides the log level when level>=0 and sets the rate limit to at most
+ * limit warnings per pilot per PSP_LOG_RATE_INTERVAL, 0 meaning no limit,
+ * also not for the unknown pilots. Only to be called during initialization.
+ */
+void psp_log_configure(int level, int limit);
+
+/**
+ * Reports the warnings that were suppressed and clears the rate limiter
+ */
+void psp_log_cleanup(void);
+
+/**
+ * Parses a syslog priority, by name (e.g. "warning" or "debug") or number.
+ * \return priority or -1 when str is not a priority
+ */
+int psp_log_parse_level(const char *str);
+
+/**
+ * Identifies the pilot of a request by the hash of the issuer of its payload
+ * proxy cert, which is the subject of the pilot.
+ * \return X509_NAME_hash() of the issuer, 0 when payload_cert is NULL
+ */
+unsigned long psp_log_pilot_hash(const X509 *payload_cert);
+
+/**
+ * Rate limiter for warnings about requests, per pilot as identified by
+ * psp_log_pilot_hash(payload_cert). Warnings beyond the limit are counted,
+ * and reported as one message once the pilot warns again in a later interval.
+ * Without payload_cert the pilot is unknown, and the warning counts against
+ * the PSP_LOG_UNKNOWN_RATE_LIMIT shared by all such requests.
+ * \return 1 when the warning is to be logged, 0 when it is suppressed
+ */
+int psp_log_allow(const X509 *payload_cert);
+
+/**
+ * Rate limiter like psp_log_allow(), for requests whose payload is not parsed
+ * yet, identifying the pilot by the path of its proxy file instead. Without
+ * pilot_path the warning counts against the limit for the unknown pilots.
+ * \return 1 when the warning is to be logged, 0 when it is suppressed
+ */
+int psp_log_allow_path(const char *pilot_path);
+
+#endif /* LCMAPS_PILOT_SUB_PROXY_LOG_H */
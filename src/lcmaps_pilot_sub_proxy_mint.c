@@ -0,0 +1,541 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+/**
+ * NOTES: native replacement for tools/create_pilot_subproxy.sh, which spawns
+ * openssl several times and generates a fresh RSA key for every proxy. Here
+ * the proxy is created using libcrypto, optionally with a key taken from a
+ * pool of keys generated in advance, and written under a temporary name that
+ * is renamed into place, such that readers never see a partial file. Does not
+ * use LCMAPS, as it is meant for the pilot side. */
+
+/* needed for mkstemp and fsync */
+#define _XOPEN_SOURCE	600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <openssl/pem.h>
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/rsa.h>
+#include <openssl/err.h>
+
+#include "lcmaps_pilot_sub_proxy_mint.h"
+#include "lcmaps_pilot_sub_proxy_pem.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+#define OID_LIMITED_PROXY   "1.3.6.1.4.1.3536.1.1.1.9"  /* OID limited proxy */
+
+/** Number of random bits in the serial number of a new proxy */
+#define SERIAL_BITS	    64
+
+/** Suffix for mkstemp() */
+#define TEMP_SUFFIX	    ".XXXXXX"
+
+/* Names in a key pool directory: published keys, keys being written and keys
+ * claimed by a process */
+#define POOL_KEY_PREFIX	    "key"
+#define POOL_NEW_PREFIX	    ".new"
+#define POOL_TAKEN_PREFIX   ".taken."
+
+/* EdDSA signs without separate digest */
+#ifdef EVP_PKEY_ED25519
+#   define SIGN_MD(key)	(EVP_PKEY_base_id(key)==EVP_PKEY_ED25519 ? \
+			 NULL : EVP_sha256())
+#else
+#   define SIGN_MD(key)	EVP_sha256()
+#endif
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Passphrase callback refusing encrypted keys instead of prompting.
+ * \return -1 */
+static int no_passphrase(char *buf, int size, int rwflag, void *u);
+
+/* Adds the keyUsage and the proxyCertInfo extension, for a limited proxy
+ * with path length 0, to proxy, whose public key is key.
+ * \return 0 on success, -1 on error */
+static int add_proxy_extensions(X509 *proxy, EVP_PKEY *key);
+
+/* Writes proxy, key and chain (each of them when not NULL) in PEM format to
+ * fd, followed by the checksum trailer line, and syncs fd to disk.
+ * \return 0 on success, -1 on error */
+static int write_pem(int fd, X509 *proxy, EVP_PKEY *key,
+		     STACK_OF(X509) *chain);
+
+/* Writes len bytes of buf to fd, continuing after partial writes.
+ * \return 0 on success, -1 on error */
+static int write_all(int fd, const char *buf, size_t len);
+
+/* Writes the PEM data as write_pem() to a temporary file created from the
+ * mkstemp() template tmp and renames it to path.
+ * \return 0 on success, -1 on error */
+static int write_file(char *tmp, const char *path, X509 *proxy,
+		      EVP_PKEY *key, STACK_OF(X509) *chain);
+
+/* Concatenates dir, "/", prefix and name.
+ * \return malloc-ed path or NULL on memory error */
+static char *pool_path(const char *dir, const char *prefix, const char *name);
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * Reads the certificate chain and the private key of the proxy file path into
+ * issuer, which needs to be cleaned up using psp_mint_issuer_free(). None of
+ * the psp_mint functions log, the OpenSSL error queue describes failures.
+ * \return 0 on success, -1 on error
+ */
+int psp_mint_read_issuer(const char *path, psp_mint_issuer_t *issuer)	{
+    BIO *bio;
+    X509 *cert;
+    int rc=-1;
+
+    issuer->chain=NULL;
+    issuer->key=NULL;
+
+    if ( (bio=BIO_new_file(path, "r"))==NULL )
+	return -1;
+    if ( (issuer->chain=sk_X509_new_null())==NULL )
+	goto end;
+
+    /* All certificates, skipping the key, until the end of the file */
+    while ( (cert=PEM_read_bio_X509(bio, NULL, no_passphrase, NULL)) )   {
+	if (!sk_X509_push(issuer->chain, cert))	{
+	    X509_free(cert);
+	    goto end;
+	}
+    }
+    if (ERR_GET_REASON(ERR_peek_last_error())!=PEM_R_NO_START_LINE)
+	goto end;
+    ERR_clear_error();
+
+    /* The private key, which must belong to the leaf */
+    if (sk_X509_num(issuer->chain)==0 || BIO_reset(bio)!=0 ||
+	(issuer->key=PEM_read_bio_PrivateKey(bio, NULL, no_passphrase,
+					     NULL))==NULL ||
+	X509_check_private_key(sk_X509_value(issuer->chain, 0),
+			       issuer->key)!=1)
+	goto end;
+
+    rc=0;
+
+end:
+    BIO_free(bio);
+    if (rc!=0)
+	psp_mint_issuer_free(issuer);
+
+    return rc;
+}
+
+/**
+ * Frees the contents of issuer
+ */
+void psp_mint_issuer_free(psp_mint_issuer_t *issuer)	{
+    sk_X509_pop_free(issuer->chain, X509_free);
+    issuer->chain=NULL;
+    EVP_PKEY_free(issuer->key);
+    issuer->key=NULL;
+}
+
+/**
+ * Generates a key of given type: "rsa:<bits>", "ec" (P-256), "ec:<curve>",
+ * using either the NIST or the OpenSSL name of the curve, or "ed25519".
+ * \return new key or NULL for unknown types or on error
+ */
+EVP_PKEY *psp_mint_keygen(const char *key_type)	{
+    EVP_PKEY_CTX *ctx;
+    EVP_PKEY *key=NULL;
+    const char *curve="P-256";
+    char *end;
+    long bits=0;
+    int id, nid=NID_undef;
+
+    if (strncmp(key_type, "rsa:", 4)==0)    {
+	bits=strtol(key_type+4, &end, 10);
+	if (key_type[4]=='\0' || *end!='\0' || bits<512 || bits>16384)
+	    return NULL;
+	id=EVP_PKEY_RSA;
+    } else if (strcmp(key_type, "ec")==0 || strncmp(key_type, "ec:", 3)==0)	{
+	if (key_type[2]==':')
+	    curve=key_type+3;
+	if ( (nid=EC_curve_nist2nid(curve))==NID_undef &&
+	     (nid=OBJ_sn2nid(curve))==NID_undef )
+	    return NULL;
+	id=EVP_PKEY_EC;
+#ifdef EVP_PKEY_ED25519
+    } else if (strcmp(key_type, "ed25519")==0)	{
+	id=EVP_PKEY_ED25519;
+#endif
+    } else
+	return NULL;
+
+    if ( (ctx=EVP_PKEY_CTX_new_id(id, NULL))==NULL )
+	return NULL;
+    if (EVP_PKEY_keygen_init(ctx)<=0 ||
+	(id==EVP_PKEY_RSA &&
+	 EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, (int)bits)<=0) ||
+	(id==EVP_PKEY_EC &&
+	 EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, nid)<=0) ||
+	EVP_PKEY_keygen(ctx, &key)<=0)
+	key=NULL;
+    EVP_PKEY_CTX_free(ctx);
+
+    return key;
+}
+
+/**
+ * Creates an RFC3820 limited proxy with path length 0 for key, delegated from
+ * issuer, with subject that of the issuer followed by CN=cn and a random
+ * serial number. The proxy is valid from now for lifetime seconds, but not
+ * beyond the issuer.
+ * \return 0 on success, -1 on error
+ */
+int psp_mint_subproxy(const psp_mint_issuer_t *issuer, const char *cn,
+		      EVP_PKEY *key, long lifetime, X509 **proxy)  {
+    X509 *issuer_cert, *cert=NULL;
+    X509_NAME *name=NULL;
+    BIGNUM *serial=NULL;
+    long remaining;
+    int days, secs, rc=-1;
+
+    issuer_cert=(issuer->chain ? sk_X509_value(issuer->chain, 0) : NULL);
+    if (issuer_cert==NULL || issuer->key==NULL || key==NULL ||
+	cn==NULL || cn[0]=='\0' || lifetime<=0)
+	return -1;
+
+    /* Lifetime is limited by that of the issuer */
+    if (!ASN1_TIME_diff(&days, &secs, NULL, X509_get0_notAfter(issuer_cert)))
+	return -1;
+    remaining=(long)days*86400L+secs;
+    if (remaining<=0)
+	return -1;
+    if (lifetime>remaining)
+	lifetime=remaining;
+
+    if ( (cert=X509_new())==NULL ||
+	 (name=X509_NAME_dup(X509_get_subject_name(issuer_cert)))==NULL ||
+	 (serial=BN_new())==NULL )
+	goto end;
+    if (!X509_NAME_add_entry_by_NID(name, NID_commonName, MBSTRING_UTF8,
+				    (const unsigned char *)cn, -1, -1, 0) ||
+	!X509_set_version(cert, 2) ||
+	!BN_rand(serial, SERIAL_BITS, BN_RAND_TOP_ONE, BN_RAND_BOTTOM_ANY) ||
+	!BN_to_ASN1_INTEGER(serial, X509_get_serialNumber(cert)) ||
+	!X509_set_subject_name(cert, name) ||
+	!X509_set_issuer_name(cert, X509_get_subject_name(issuer_cert)) ||
+	!X509_gmtime_adj(X509_getm_notBefore(cert), 0) ||
+	!X509_gmtime_adj(X509_getm_notAfter(cert), lifetime) ||
+	!X509_set_pubkey(cert, key) ||
+	add_proxy_extensions(cert, key) ||
+	!X509_sign(cert, issuer->key, SIGN_MD(issuer->key)))
+	goto end;
+
+    *proxy=cert;
+    cert=NULL;
+    rc=0;
+
+end:
+    BN_free(serial);
+    X509_NAME_free(name);
+    X509_free(cert);
+
+    return rc;
+}
+
+/**
+ * Writes proxy, its private key and chain (when not NULL) to path in PEM
+ * format, readable by the owner only. The file is written under a temporary
+ * name in the same directory and renamed to path, such that readers see
+ * either the old or the complete new file.
+ * \return 0 on success, -1 on error
+ */
+int psp_mint_write_proxy(const char *path, X509 *proxy, EVP_PKEY *key,
+			 STACK_OF(X509) *chain)	{
+    size_t len=strlen(path);
+    char *tmp;
+    int rc;
+
+    if (proxy==NULL || key==NULL ||
+	(tmp=malloc(len+sizeof(TEMP_SUFFIX)))==NULL)
+	return -1;
+    memcpy(tmp, path, len);
+    memcpy(tmp+len, TEMP_SUFFIX, sizeof(TEMP_SUFFIX));
+
+    rc=write_file(tmp, path, proxy, key, chain);
+    free(tmp);
+
+    return rc;
+}
+
+/**
+ * Adds key to the pool of pre-generated keys in directory dir. An unused name
+ * is reserved by creating an empty file, which is then atomically replaced by
+ * the key, written under a name that is not taken from the pool.
+ * \return 0 on success, -1 on error
+ */
+int psp_mint_pool_add(const char *dir, EVP_PKEY *key)	{
+    char *path=NULL, *tmp=NULL;
+    int fd, rc=-1;
+
+    if ( (path=pool_path(dir, POOL_KEY_PREFIX, TEMP_SUFFIX))==NULL ||
+	 (tmp=pool_path(dir, POOL_NEW_PREFIX, TEMP_SUFFIX))==NULL ||
+	 (fd=mkstemp(path))<0 )	{
+	free(path);
+	free(tmp);
+	return -1;
+    }
+    close(fd);
+
+    if ( (rc=write_file(tmp, path, NULL, key, NULL))!=0 )
+	unlink(path);
+    free(path);
+    free(tmp);
+
+    return rc;
+}
+
+/**
+ * Takes a key from the pool of pre-generated keys in directory dir. A key is
+ * claimed by renaming it, which succeeds for only one of concurrent callers,
+ * and removed after reading. Files that cannot be read, such as reserved
+ * names without key, are removed as well.
+ * \return 0 on success, setting key, 1 when the pool is empty, -1 on error
+ */
+int psp_mint_pool_take(const char *dir, EVP_PKEY **key)	{
+    char prefix[sizeof(POOL_TAKEN_PREFIX)+24];
+    char *path=NULL, *taken=NULL;
+    DIR *dirp;
+    struct dirent *ent;
+    BIO *bio;
+    int rc=1;
+
+    if ( (dirp=opendir(dir))==NULL )
+	return -1;
+    snprintf(prefix, sizeof(prefix), POOL_TAKEN_PREFIX"%ld.", (long)getpid());
+
+    while (rc==1 && (ent=readdir(dirp)))    {
+	if (strncmp(ent->d_name, POOL_KEY_PREFIX".",
+		    sizeof(POOL_KEY_PREFIX))!=0)
+	    continue;
+	free(path);
+	free(taken);
+	if ( (path=pool_path(dir, "", ent->d_name))==NULL ||
+	     (taken=pool_path(dir, prefix, ent->d_name))==NULL )  {
+	    rc=-1;
+	    break;
+	}
+	if (rename(path, taken)!=0)  {
+	    if (errno==ENOENT)	/* taken by someone else */
+		continue;
+	    rc=-1;
+	    break;
+	}
+	if ( (bio=BIO_new_file(taken, "r")) )	{
+	    *key=PEM_read_bio_PrivateKey(bio, NULL, no_passphrase, NULL);
+	    BIO_free(bio);
+	    if (*key)
+		rc=0;
+	}
+	unlink(taken);
+	if (rc!=0)
+	    ERR_clear_error();
+    }
+
+    closedir(dirp);
+    free(path);
+    free(taken);
+
+    return rc;
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Passphrase callback refusing encrypted keys instead of prompting for a
+ * passphrase on the terminal.
+ * \return -1
+ */
+static int no_passphrase(char *buf, int size, int rwflag, void *u)	{
+    return -1;
+}
+
+/**
+ * Adds the keyUsage, as create_pilot_subproxy.sh does, and the proxyCertInfo
+ * extension, for a limited proxy with path length 0, to proxy, whose public
+ * key is key.
+ * \return 0 on success, -1 on error
+ */
+static int add_proxy_extensions(X509 *proxy, EVP_PKEY *key)  {
+    PROXY_CERT_INFO_EXTENSION *pci;
+    X509_EXTENSION *ex;
+    int rc=-1;
+
+    /* keyEncipherment only applies to RSA */
+    if ( (ex=X509V3_EXT_conf_nid(NULL, NULL, NID_key_usage,
+		EVP_PKEY_base_id(key)==EVP_PKEY_RSA ?
+		"critical,digitalSignature,keyEncipherment" :
+		"critical,digitalSignature"))==NULL )
+	return -1;
+    if (!X509_add_ext(proxy, ex, -1))	{
+	X509_EXTENSION_free(ex);
+	return -1;
+    }
+    X509_EXTENSION_free(ex);
+
+    /* Limited policy, no further delegations */
+    if ( (pci=PROXY_CERT_INFO_EXTENSION_new())==NULL )
+	return -1;
+    ASN1_OBJECT_free(pci->proxyPolicy->policyLanguage);
+    if ( (pci->proxyPolicy->policyLanguage=
+	    OBJ_txt2obj(OID_LIMITED_PROXY, 1))!=NULL &&
+	 (pci->pcPathLengthConstraint=ASN1_INTEGER_new())!=NULL &&
+	 ASN1_INTEGER_set(pci->pcPathLengthConstraint, 0) &&
+	 X509_add1_ext_i2d(proxy, NID_proxyCertInfo, pci, 1,
+			   X509V3_ADD_DEFAULT)==1 )
+	rc=0;
+    PROXY_CERT_INFO_EXTENSION_free(pci);
+
+    return rc;
+}
+
+/**
+ * Writes proxy, key and chain (each of them when not NULL) in PEM format to
+ * fd, followed by the checksum trailer line (see psp_pem_checksum_line()), and
+ * syncs fd to disk. The data is assembled in memory first, which is cleansed
+ * afterwards as it holds the private key.
+ * \return 0 on success, -1 on error
+ */
+static int write_pem(int fd, X509 *proxy, EVP_PKEY *key,
+		     STACK_OF(X509) *chain)  {
+    char line[PSP_PEM_CHECKSUM_LINE_LEN+1];
+    BIO *bio;
+    char *data;
+    long len;
+    int i, n=(chain ? sk_X509_num(chain) : 0), rc=-1;
+
+    if ( (bio=BIO_new(BIO_s_secmem()))==NULL )
+	return -1;
+
+    if ((proxy==NULL || PEM_write_bio_X509(bio, proxy)) &&
+	(key==NULL ||
+	 PEM_write_bio_PrivateKey(bio, key, NULL, NULL, 0, NULL, NULL)))  {
+	for (i=0; i<n; i++)   {
+	    if (!PEM_write_bio_X509(bio, sk_X509_value(chain, i)))
+		break;
+	}
+	if (i==n && (len=BIO_get_mem_data(bio, &data))>0)   {
+	    psp_pem_checksum_line(data, (size_t)len, line);
+	    if (write_all(fd, data, (size_t)len)==0 &&
+		write_all(fd, line, PSP_PEM_CHECKSUM_LINE_LEN)==0 &&
+		fsync(fd)==0)
+		rc=0;
+	}
+    }
+    /* A secure memory BIO cleanses its data when freed */
+    BIO_free(bio);
+
+    return rc;
+}
+
+/**
+ * Writes len bytes of buf to fd, continuing after partial writes.
+ * \return 0 on success, -1 on error
+ */
+static int write_all(int fd, const char *buf, size_t len)  {
+    ssize_t n;
+
+    while (len>0)   {
+	if ( (n=write(fd, buf, len))<0 )	{
+	    if (errno==EINTR)
+		continue;
+	    return -1;
+	}
+	buf+=n;
+	len-=(size_t)n;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes the PEM data as write_pem() to a temporary file created from the
+ * mkstemp() template tmp, readable by the owner only, and renames it to path.
+ * \return 0 on success, -1 on error
+ */
+static int write_file(char *tmp, const char *path, X509 *proxy,
+		      EVP_PKEY *key, STACK_OF(X509) *chain)  {
+    int fd, rc;
+
+    if ( (fd=mkstemp(tmp))<0 )
+	return -1;
+
+    rc=write_pem(fd, proxy, key, chain);
+    if (close(fd)!=0 || (rc==0 && rename(tmp, path)!=0))
+	rc=-1;
+    if (rc!=0)
+	unlink(tmp);
+
+    return rc;
+}
+
+/**
+ * Concatenates dir, "/", prefix and name.
+ * \return malloc-ed path or NULL on memory error
+ */
+static char *pool_path(const char *dir, const char *prefix, const char *name)
+{
+    size_t dir_len=strlen(dir), prefix_len=strlen(prefix);
+    size_t name_len=strlen(name);
+    char *path;
+
+    if ( (path=malloc(dir_len+prefix_len+name_len+2))==NULL )
+	return NULL;
+    memcpy(path, dir, dir_len);
+    path[dir_len]='/';
+    memcpy(path+dir_len+1, prefix, prefix_len);
+    memcpy(path+dir_len+1+prefix_len, name, name_len+1);
+
+    return path;
+}
@@ -0,0 +1,102 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+#ifndef LCMAPS_PILOT_SUB_PROXY_MINT_H
+#define LCMAPS_PILOT_SUB_PROXY_MINT_H
+
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Proxy to delegate from, as read by psp_mint_read_issuer() */
+typedef struct psp_mint_issuer_s    {
+    STACK_OF(X509) *chain;	/* certificate chain, leaf proxy first */
+    EVP_PKEY *key;		/* private key of the leaf proxy */
+} psp_mint_issuer_t;
+
+
+/************************************************************************
+ * Function prototypes
+ ************************************************************************/
+
+/**
+ * Reads the certificate chain and the private key of the proxy file path into
+ * issuer, which needs to be cleaned up using psp_mint_issuer_free(). None of
+ * the psp_mint functions log, the OpenSSL error queue describes failures.
+ * \return 0 on success, -1 on error
+ */
+int psp_mint_read_issuer(const char *path, psp_mint_issuer_t *issuer);
+
+/**
+ * Frees the contents of issuer
+ */
+void psp_mint_issuer_free(psp_mint_issuer_t *issuer);
+
+/**
+ * Generates a key of given type: "rsa:<bits>", "ec" (P-256), "ec:<curve>" or
+ * "ed25519".
+ * \return new key or NULL for unknown types or on error
+ */
+EVP_PKEY *psp_mint_keygen(const char *key_type);
+
+/**
+ * Creates an RFC3820 limited proxy with path length 0 for key, delegated from
+ * issuer, with subject that of the issuer followed by CN=cn. The proxy is
+ * valid from now for lifetime seconds, but not beyond the issuer.
+ * \return 0 on success, -1 on error
+ */
+int psp_mint_subproxy(const psp_mint_issuer_t *issuer, const char *cn,
+		      EVP_PKEY *key, long lifetime, X509 **proxy);
+
+/**
+ * Writes proxy, its private key and chain (when not NULL) to path in PEM
+ * format, readable by the owner only. The file is written under a temporary
+ * name in the same directory and renamed to path, such that readers see
+ * either the old or the complete new file. The file ends with a checksum
+ * trailer line (see PSP_PEM_CHECKSUM_TAG), by which readers using
+ * --lock-type seqlock recognise its contents.
+ * \return 0 on success, -1 on error
+ */
+int psp_mint_write_proxy(const char *path, X509 *proxy, EVP_PKEY *key,
+			 STACK_OF(X509) *chain);
+
+/**
+ * Adds key to the pool of pre-generated keys in directory dir.
+ * \return 0 on success, -1 on error
+ */
+int psp_mint_pool_add(const char *dir, EVP_PKEY *key);
+
+/**
+ * Takes a key from the pool of pre-generated keys in directory dir, each key
+ * being handed out only once, also to concurrent callers.
+ * \return 0 on success, setting key, 1 when the pool is empty, -1 on error
+ */
+int psp_mint_pool_take(const char *dir, EVP_PKEY **key);
+
+#endif /* LCMAPS_PILOT_SUB_PROXY_MINT_H */
@@ -0,0 +1,386 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+/**
+ * NOTES: certificate-only PEM scanner. PEM_X509_INFO_read_bio() decodes every
+ * block it finds, including the private key of a proxy file, which is then
+ * thrown away. Here only the certificate blocks are base64 decoded (into a
+ * stack buffer when possible) and converted using d2i_X509(). */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/x509.h>
+#include <openssl/sha.h>
+#include <openssl/crypto.h>
+
+#include "lcmaps_pilot_sub_proxy_pem.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+#define PEM_BEGIN	"-----BEGIN "
+#define PEM_END		"-----END "
+#define PEM_DASHES	"-----"
+
+/** Size of the on-stack buffer for decoded certificates, larger ones are
+ * decoded into a malloc-ed buffer */
+#define DER_BUF_SIZE	8192
+
+/** Value in b64_table for characters that are not base64 */
+#define B64_INVALID	0xFF
+/** Value in b64_table for whitespace, which is skipped */
+#define B64_SPACE	0xFE
+
+
+/************************************************************************
+ * Global variables
+ ************************************************************************/
+
+/** Decoding table: 6-bit value for base64 characters */
+static const unsigned char b64_table[256] = {
+#define I B64_INVALID
+#define S B64_SPACE
+    I, I, I, I, I, I, I, I, I, S, S, I, I, S, I, I,	/* 0x00 */
+    I, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I,	/* 0x10 */
+    S, I, I, I, I, I, I, I, I, I, I,62, I, I, I,63,	/* 0x20 */
+   52,53,54,55,56,57,58,59,60,61, I, I, I, I, I, I,	/* 0x30 */
+    I, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,	/* 0x40 */
+   15,16,17,18,19,20,21,22,23,24,25, I, I, I, I, I,	/* 0x50 */
+    I,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,	/* 0x60 */
+   41,42,43,44,45,46,47,48,49,50,51, I, I, I, I, I,	/* 0x70 */
+    I, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I,	/* 0x80 */
+    I, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I,
+    I, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I,
+    I, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I,
+    I, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I,
+    I, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I,
+    I, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I,
+    I, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I
+#undef I
+#undef S
+};
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Finds string str of length len in [p,end).
+ * \return start of str or NULL when not found */
+static const char *find_str(const char *p, const char *end,
+			    const char *str, size_t len);
+
+/* Finds the next PEM boundary line of type marker (PEM_BEGIN or PEM_END) in
+ * [p,end) at the start of a line.
+ * \return start of the label following marker, label_len is set to its
+ * length and next to the start of the next line, or NULL when not found */
+static const char *find_boundary(const char *p, const char *end,
+				 const char *marker,
+				 size_t *label_len, const char **next);
+
+/* Decodes the base64 data in [p,end) into der, skipping whitespace.
+ * \return length of the decoded data or -1 on error */
+static long b64_decode(const char *p, const char *end, unsigned char *der);
+
+/* Decodes the 2*len hexadecimal digits in hex into bin.
+ * \return 0 on success, -1 on error */
+static int hex_decode(const char *hex, unsigned char *bin, size_t len);
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * Converts the certificates in the PEM data buf of length len into a stack of
+ * X509 certificates. Only CERTIFICATE (and X509 CERTIFICATE) blocks are
+ * base64 decoded, all other blocks, such as the private key of a proxy, are
+ * skipped without being decoded. buf does not need to be '\0' terminated.
+ * Does not log, as it is also used outside of the LCMAPS plugin.
+ * At most PSP_PEM_MAX_CERTS certificates are accepted, as the data can come
+ * from anyone presenting a proxy.
+ * Stack needs to be cleaned up afterwards.
+ * \return 0 on success, -1 when a certificate block is invalid or when there
+ * are no or too many certificates, -2 on memory error.
+ */
+int psp_pem_to_chain(const char *buf, size_t len, STACK_OF(X509) **certstack)
+{
+    unsigned char stack_buf[DER_BUF_SIZE];
+    unsigned char *der;
+    const unsigned char *derptr;
+    const char *p, *end, *label, *end_label, *body, *body_end;
+    size_t label_len, end_label_len, max_len;
+    long der_len;
+    STACK_OF(X509) *mystack=NULL;
+    X509 *cert;
+    int rc=-1;
+
+    if (buf==NULL || certstack==NULL)
+	return -1;
+
+    if ( (mystack=sk_X509_new_null())==NULL )
+	return -2;
+
+    p=buf;
+    end=buf+len;
+    while ( (label=find_boundary(p, end, PEM_BEGIN, &label_len, &body)) )  {
+	/* Find matching end line */
+	end_label=find_boundary(body, end, PEM_END, &end_label_len, &p);
+	if (end_label==NULL)
+	    break; /* unterminated block */
+	body_end=end_label-(sizeof(PEM_END)-1);
+
+	/* Skip anything that isn't a certificate, without decoding */
+	if ( !((label_len==sizeof("CERTIFICATE")-1 &&
+		memcmp(label, "CERTIFICATE", label_len)==0) ||
+	       (label_len==sizeof("X509 CERTIFICATE")-1 &&
+		memcmp(label, "X509 CERTIFICATE", label_len)==0)) )
+	    continue;
+	if (sk_X509_num(mystack)>=PSP_PEM_MAX_CERTS)
+	    goto end;
+
+	/* Labels of begin and end should match */
+	if (end_label_len!=label_len || memcmp(end_label, label, label_len)!=0)
+	    goto end;
+
+	/* Decode, on the stack when it fits */
+	max_len=((size_t)(body_end-body)/4)*3+3;
+	if (max_len<=sizeof(stack_buf))
+	    der=stack_buf;
+	else if ( (der=(unsigned char *)malloc(max_len))==NULL )   {
+	    rc=-2;
+	    goto end;
+	}
+	der_len=b64_decode(body, body_end, der);
+	derptr=der;
+	cert=(der_len>0 ? d2i_X509(NULL, &derptr, der_len) : NULL);
+	if (der!=stack_buf)
+	    free(der);
+	if (cert==NULL)
+	    goto end;
+	if (!sk_X509_push(mystack, cert))	{
+	    X509_free(cert);
+	    rc=-2;
+	    goto end;
+	}
+    }
+
+    /* Check there is at least one certificate */
+    if (sk_X509_num(mystack)>0)	{
+	*certstack=mystack;
+	return 0;
+    }
+
+end:
+    sk_X509_pop_free(mystack, X509_free);
+    return rc;
+}
+
+/**
+ * Formats the checksum trailer line for the PEM data buf of length len into
+ * line, which must have room for PSP_PEM_CHECKSUM_LINE_LEN+1 characters.
+ */
+void psp_pem_checksum_line(const char *buf, size_t len, char *line)	{
+    static const char hex[]="0123456789abcdef";
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    char *p=line;
+    size_t i;
+
+    SHA256((const unsigned char *)buf, len, digest);
+
+    memcpy(p, PSP_PEM_CHECKSUM_TAG, sizeof(PSP_PEM_CHECKSUM_TAG)-1);
+    p+=sizeof(PSP_PEM_CHECKSUM_TAG)-1;
+    for (i=0; i<SHA256_DIGEST_LENGTH; i++)	{
+	*p++=hex[digest[i]>>4];
+	*p++=hex[digest[i]&0xF];
+    }
+    *p++='\n';
+    *p='\0';
+}
+
+/**
+ * Gets the digest from the checksum trailer line ending the data buf of
+ * length len into digest, without checking it against the data. buf may be
+ * just the end of the data, as long as it starts with the newline before
+ * the trailer.
+ * \return 0 on success, -1 when buf does not end with a trailer
+ */
+int psp_pem_checksum_get(const char *buf, size_t len, unsigned char *digest)
+{
+    const char *line;
+    size_t tag_len=sizeof(PSP_PEM_CHECKSUM_TAG)-1;
+
+    if (buf==NULL || len<PSP_PEM_CHECKSUM_LINE_LEN)
+	return -1;
+
+    /* The trailer is a line of its own */
+    line=buf+len-PSP_PEM_CHECKSUM_LINE_LEN;
+    if ( (line!=buf && line[-1]!='\n') ||
+	 memcmp(line, PSP_PEM_CHECKSUM_TAG, tag_len)!=0 ||
+	 buf[len-1]!='\n' ||
+	 hex_decode(line+tag_len, digest, SHA256_DIGEST_LENGTH) )
+	return -1;
+
+    return 0;
+}
+
+/**
+ * Checks the checksum trailer line ending the data buf of length len against
+ * the data before it, and sets digest to the checksum when there is one.
+ * \return 0 when it matches, 1 when there is no trailer, -1 when it does not
+ * match
+ */
+int psp_pem_checksum_verify(const char *buf, size_t len,
+			    unsigned char *digest)	{
+    unsigned char actual[SHA256_DIGEST_LENGTH];
+
+    if (psp_pem_checksum_get(buf, len, digest))
+	return 1;
+
+    SHA256((const unsigned char *)buf, len-PSP_PEM_CHECKSUM_LINE_LEN, actual);
+
+    return (CRYPTO_memcmp(actual, digest, SHA256_DIGEST_LENGTH)==0 ? 0 : -1);
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Finds string str of length len in [p,end).
+ * \return start of str or NULL when not found
+ */
+static const char *find_str(const char *p, const char *end,
+			    const char *str, size_t len)	{
+    while ((size_t)(end-p)>=len)    {
+	if ( (p=(const char *)memchr(p, str[0], (size_t)(end-p)-len+1))==NULL )
+	    return NULL;
+	if (memcmp(p, str, len)==0)
+	    return p;
+	p++;
+    }
+
+    return NULL;
+}
+
+/**
+ * Finds the next PEM boundary line of type marker (PEM_BEGIN or PEM_END) in
+ * [p,end) at the start of a line, e.g. "-----BEGIN CERTIFICATE-----".
+ * \return start of the label following marker, label_len is set to its
+ * length and next to the start of the next line, or NULL when not found
+ */
+static const char *find_boundary(const char *p, const char *end,
+				 const char *marker,
+				 size_t *label_len, const char **next)	{
+    const char *start=p, *label, *dashes, *nl;
+    size_t marker_len=strlen(marker);
+
+    while ( (p=find_str(p, end, marker, marker_len)) )	{
+	label=p+marker_len;
+	/* Must be at the start of a line */
+	if (p!=start && p[-1]!='\n')	{
+	    p=label;
+	    continue;
+	}
+	/* Label ends with dashes on the same line */
+	nl=(const char *)memchr(label, '\n', (size_t)(end-label));
+	dashes=find_str(label, nl ? nl : end, PEM_DASHES, sizeof(PEM_DASHES)-1);
+	if (dashes==NULL)   {
+	    p=label;
+	    continue;
+	}
+	*label_len=(size_t)(dashes-label);
+	*next=(nl ? nl+1 : end);
+	return label;
+    }
+
+    return NULL;
+}
+
+/**
+ * Decodes the base64 data in [p,end) into der, skipping whitespace. Padding
+ * is only allowed at the end.
+ * \return length of the decoded data or -1 on error
+ */
+static long b64_decode(const char *p, const char *end, unsigned char *der)  {
+    unsigned long acc=0;
+    unsigned char v;
+    long len=0;
+    int nbits=0, npad=0;
+
+    for (; p<end; p++)	{
+	v=b64_table[(unsigned char)*p];
+	if (v==B64_SPACE)
+	    continue;
+	if (*p=='=')	{
+	    npad++;
+	    continue;
+	}
+	if (v==B64_INVALID || npad>0)
+	    return -1;
+	acc=(acc<<6) | v;
+	nbits+=6;
+	if (nbits>=8)	{
+	    nbits-=8;
+	    der[len++]=(unsigned char)((acc>>nbits) & 0xFF);
+	}
+    }
+
+    /* Leftover bits must match the (optional) padding */
+    if (nbits==6 || (nbits==0 && npad!=0) ||
+	(nbits==4 && npad!=0 && npad!=2) || (nbits==2 && npad!=0 && npad!=1))
+	return -1;
+
+    return len;
+}
+
+/**
+ * Decodes the 2*len hexadecimal digits in hex into bin.
+ * \return 0 on success, -1 on error
+ */
+static int hex_decode(const char *hex, unsigned char *bin, size_t len)	{
+    size_t i;
+    int j, v;
+    char c;
+
+    for (i=0; i<len; i++)   {
+	v=0;
+	for (j=0; j<2; j++) {
+	    c=hex[2*i+(size_t)j];
+	    if (c>='0' && c<='9')
+		v=(v<<4) | (c-'0');
+	    else if (c>='a' && c<='f')
+		v=(v<<4) | (c-'a'+10);
+	    else
+		return -1;
+	}
+	bin[i]=(unsigned char)v;
+    }
+
+    return 0;
+}
@@ -0,0 +1,93 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+#ifndef LCMAPS_PILOT_SUB_PROXY_PEM_H
+#define LCMAPS_PILOT_SUB_PROXY_PEM_H
+
+#include <stddef.h>
+#include <openssl/x509.h>
+#include <openssl/sha.h>
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/** Maximum number of certificates in a chain, far beyond any real proxy
+ * chain */
+#define PSP_PEM_MAX_CERTS	32
+
+/** Start of the trailer line that psp_mint_write_proxy() appends to a proxy
+ * file, followed by the hexadecimal SHA-256 digest of everything before the
+ * line and a newline. PEM readers skip it like any text outside a block. */
+#define PSP_PEM_CHECKSUM_TAG	"psp-sha256: "
+
+/** Length of the checksum trailer line, including its newline */
+#define PSP_PEM_CHECKSUM_LINE_LEN   \
+    (sizeof(PSP_PEM_CHECKSUM_TAG)-1+2*SHA256_DIGEST_LENGTH+1)
+
+
+/************************************************************************
+ * Function prototypes
+ ************************************************************************/
+
+/**
+ * Converts the certificates in the PEM data buf of length len into a stack of
+ * X509 certificates. Only CERTIFICATE (and X509 CERTIFICATE) blocks are
+ * base64 decoded, all other blocks, such as the private key of a proxy, are
+ * skipped without being decoded. buf does not need to be '\0' terminated.
+ * Does not log, as it is also used outside of the LCMAPS plugin.
+ * At most PSP_PEM_MAX_CERTS certificates are accepted, as the data can come
+ * from anyone presenting a proxy.
+ * Stack needs to be cleaned up afterwards.
+ * \return 0 on success, -1 when a certificate block is invalid or when there
+ * are no or too many certificates, -2 on memory error.
+ */
+int psp_pem_to_chain(const char *buf, size_t len, STACK_OF(X509) **certstack);
+
+/**
+ * Formats the checksum trailer line for the PEM data buf of length len into
+ * line, which must have room for PSP_PEM_CHECKSUM_LINE_LEN+1 characters.
+ */
+void psp_pem_checksum_line(const char *buf, size_t len, char *line);
+
+/**
+ * Gets the digest from the checksum trailer line ending the data buf of
+ * length len into digest, without checking it against the data. buf may be
+ * just the end of the data, as long as it starts with the newline before
+ * the trailer.
+ * \return 0 on success, -1 when buf does not end with a trailer
+ */
+int psp_pem_checksum_get(const char *buf, size_t len, unsigned char *digest);
+
+/**
+ * Checks the checksum trailer line ending the data buf of length len against
+ * the data before it, and sets digest to the checksum when there is one.
+ * \return 0 when it matches, 1 when there is no trailer, -1 when it does not
+ * match
+ */
+int psp_pem_checksum_verify(const char *buf, size_t len,
+			    unsigned char *digest);
+
+#endif /* LCMAPS_PILOT_SUB_PROXY_PEM_H */
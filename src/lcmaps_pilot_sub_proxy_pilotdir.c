@@ -0,0 +1,576 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+/**
+ * NOTES: directory mode, for node-level services handling the payloads of
+ * many pilots. The files in the directory are indexed by the subject name
+ * hash of the pilot proxy they contain, such that the pilot that issued a
+ * payload is found by a hash table lookup on its issuer, instead of trying
+ * every file. The chains themselves are kept in the pilot cache, keyed by
+ * path. The index is rebuilt when the directory changes, i.e. when a file is
+ * added, removed or renamed into place, or when a file in it changed, as
+ * noticed by the inotify watch on the directory or otherwise by stat. Lookups
+ * only take a read lock on the index: the directory is scanned by one thread
+ * at a time without holding it, after which the new index replaces the old
+ * one. A payload for which no pilot is found does not cause a scan. */
+
+#include "lcmaps_plugins_pilot_sub_proxy_config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <openssl/sha.h>
+
+#include <lcmaps/lcmaps_log.h>
+
+#include "lcmaps_pilot_sub_proxy_pilotdir.h"
+#include "lcmaps_pilot_sub_proxy_watch.h"
+#include "lcmaps_pilot_sub_proxy_log.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/** Length of the key identifiers kept for the pilots, which are normally
+ * SHA-1 digests of the public key */
+#define KEY_ID_MAX	SHA_DIGEST_LENGTH
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Indexed pilot proxy file */
+typedef struct pilot_file_s	{
+    char *path;			/* path of the file */
+    struct stat st;		/* stat of the file when indexed */
+    unsigned long subject_hash;	/* X509_NAME_hash() of the leaf subject */
+    unsigned char key_id[KEY_ID_MAX]; /* subject key identifier of the leaf */
+    size_t key_id_len;		/* length of key_id */
+    int next;			/* next file in the same bucket, -1 at end */
+} pilot_file_t;
+
+/** Index of the directory: files and hash table of indices into it */
+typedef struct pilot_index_s	{
+    pilot_file_t *files;
+    int nfiles;
+    int *buckets;
+    unsigned int nbuckets;	/* power of two, 0 when not indexed */
+    struct stat dir_st;		/* stat of the directory when indexed */
+    unsigned long generation;	/* change counter of the watch then, 0 when
+				   not watched */
+    time_t scan_time;		/* time of the indexing */
+    int exact;			/* 1 when the directory and the files did not
+				   change in the second of the indexing, such
+				   that their stat tells whether they changed
+				   since */
+} pilot_index_t;
+
+
+/************************************************************************
+ * Global variables
+ ************************************************************************/
+
+/** Directory holding the pilot proxies, NULL when not in directory mode */
+static char *pilot_dir=NULL;
+
+/** How the files are read */
+static lock_type_t pilot_lock_type=LOCK_NOLOCK;
+static read_method_t pilot_read_method=READ_METHOD_READ;
+
+/** inotify watch on the directory, -1 when not watched */
+static int pilot_watch_id=-1;
+
+/** The index, and the number of times it was replaced, protected by
+ * index_lock */
+static pilot_index_t pilot_index;
+static unsigned long index_version=0;
+
+/** Protects pilot_index and, together with scan_mutex, the settings above:
+ * changing either needs both */
+static pthread_rwlock_t index_lock=PTHREAD_RWLOCK_INITIALIZER;
+
+/** Held while scanning the directory, such that one thread at a time does */
+static pthread_mutex_t scan_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Indexes the directory into index, needs scan_mutex.
+ * \return number of pilot proxies found, -1 on error */
+static int scan_dir(pilot_index_t *index);
+
+/* Replaces the index by a new scan of the directory, unless another thread
+ * did so since it was at given version. Needs scan_mutex.
+ * \return number of pilot proxies found, 0 when already replaced, -1 on
+ * error */
+static int rebuild_index(unsigned long version);
+
+/* Copies the path of the file for given issuer name hash and authority key
+ * identifier keyid into the arena of req. Needs index_lock.
+ * \return path, NULL when not found or on error */
+static const char *find_path(psp_request_t *req, unsigned long hash,
+			     const ASN1_OCTET_STRING *keyid);
+
+/* Checks whether the index no longer matches the directory, of which the
+ * watch has change counter generation. Needs index_lock.
+ * \return 1 when it is stale, 0 otherwise */
+static int index_stale(unsigned long generation);
+
+/* Frees index, after which it is as if all-zero */
+static void free_index(pilot_index_t *index);
+
+/* Obtains the key identifier of cert: its subject key identifier or,
+ * without one, the SHA-1 digest of its public key as OpenSSL would put in
+ * that extension.
+ * \return length of the identifier, 0 on error */
+static size_t get_key_id(X509 *cert, unsigned char *key_id);
+
+/* Finds the file for given issuer name hash and, when not NULL, authority
+ * key identifier keyid. Needs index_lock.
+ * \return the file, or NULL when not found */
+static pilot_file_t *index_find(unsigned long hash,
+				const ASN1_OCTET_STRING *keyid);
+
+/* Checks whether the stat information st1 and st2 are for the same
+ * unmodified file or directory.
+ * \return 1 when they are, 0 otherwise */
+static int same_stat(const struct stat *st1, const struct stat *st2);
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * Enables the directory mode: pilot proxies are looked up in the files in
+ * dir, read using lock_type and read_method, instead of the X509_USER_PROXY.
+ * The directory is indexed when first needed. When psp_watch_init() was
+ * called, changes are noticed using a watch on dir.
+ * \return 0 on success, -1 on error
+ */
+int psp_pilotdir_init(const char *dir, lock_type_t lock_type,
+		      read_method_t read_method)    {
+    pilot_index_t old;
+    char *copy;
+
+    if ( (copy=strdup(dir))==NULL )	{
+	lcmaps_log(LOG_ERR, "%s: out of memory\n", __func__);
+	return -1;
+    }
+
+    pthread_mutex_lock(&scan_mutex);
+    pthread_rwlock_wrlock(&index_lock);
+    free(pilot_dir);
+    pilot_dir=copy;
+    pilot_lock_type=lock_type;
+    pilot_read_method=read_method;
+    /* Only watched when the change detector is running */
+    pilot_watch_id=psp_watch_add_dir(dir);
+    old=pilot_index;
+    memset(&pilot_index, 0, sizeof(pilot_index_t));
+    index_version++;
+    pthread_rwlock_unlock(&index_lock);
+    pthread_mutex_unlock(&scan_mutex);
+    free_index(&old);
+
+    return 0;
+}
+
+/**
+ * Frees the index and disables the directory mode
+ */
+void psp_pilotdir_cleanup(void)	{
+    pthread_mutex_lock(&scan_mutex);
+    pthread_rwlock_wrlock(&index_lock);
+    free_index(&pilot_index);
+    free(pilot_dir);
+    pilot_dir=NULL;
+    pilot_watch_id=-1;
+    pthread_rwlock_unlock(&index_lock);
+    pthread_mutex_unlock(&scan_mutex);
+}
+
+/**
+ * Indexes the pilot proxies in the directory, reading all of them into the
+ * pilot cache.
+ * \return number of pilot proxies found, -1 on error
+ */
+int psp_pilotdir_scan(void)	{
+    int rc;
+
+    pthread_mutex_lock(&scan_mutex);
+    rc=rebuild_index(index_version);
+    pthread_mutex_unlock(&scan_mutex);
+
+    return rc;
+}
+
+/**
+ * Finds the file in the directory holding the pilot proxy that issued
+ * req->payload_cert, by its issuer and authority key identifier, under a read
+ * lock on the index. When the index is stale, it is rebuilt first by the
+ * first thread noticing, while concurrent requests use the old index: only
+ * the first indexing is waited for. A payload issuer that is not found does
+ * not cause a rebuild.
+ * \return path owned by the request arena, NULL when not found or on error
+ */
+const char *psp_pilotdir_find(psp_request_t *req)   {
+    const ASN1_OCTET_STRING *keyid;
+    unsigned long hash, generation, version;
+    pilot_file_t *file;
+    struct stat st;
+    const char *path=NULL;
+    int stale, indexed;
+
+    if (req->payload_cert==NULL)
+	return NULL;
+    hash=X509_NAME_hash(X509_get_issuer_name(req->payload_cert));
+    keyid=X509_get0_authority_key_id(req->payload_cert);
+
+    pthread_rwlock_rdlock(&index_lock);
+    if (pilot_dir==NULL)    {
+	pthread_rwlock_unlock(&index_lock);
+	return NULL;
+    }
+    generation=psp_watch_generation(pilot_watch_id);
+    /* A file changed in place might hold another pilot by now, which the
+     * watch would have noticed */
+    if ( (stale=index_stale(generation))==0 && generation==0 &&
+	 (file=index_find(hash, keyid)) &&
+	 (stat(file->path, &st)!=0 || !same_stat(&st, &(file->st))) )
+	stale=1;
+    if (!stale)	{
+	path=find_path(req, hash, keyid);
+	pthread_rwlock_unlock(&index_lock);
+	return path;
+    }
+    indexed=(pilot_index.nbuckets>0);
+    version=index_version;
+    pthread_rwlock_unlock(&index_lock);
+
+    /* Rebuild without holding the index lock. Without an index there is
+     * nothing to use meanwhile, hence wait for another thread scanning. */
+    if (!indexed)
+	pthread_mutex_lock(&scan_mutex);
+    if (!indexed || pthread_mutex_trylock(&scan_mutex)==0)	{
+	rebuild_index(version);
+	pthread_mutex_unlock(&scan_mutex);
+    }
+
+    pthread_rwlock_rdlock(&index_lock);
+    if (pilot_dir)
+	path=find_path(req, hash, keyid);
+    pthread_rwlock_unlock(&index_lock);
+
+    return path;
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Indexes the directory into index: reads every regular file not starting
+ * with a dot as pilot proxy, using the pilot cache, and builds a hash table
+ * on the subject name hashes of the leaf proxies. Files that cannot be read
+ * as proxy are skipped. Needs scan_mutex, but not index_lock.
+ * \return number of pilot proxies found, -1 on error
+ */
+static int scan_dir(pilot_index_t *index)   {
+    DIR *dirp;
+    struct dirent *de;
+    struct stat st;
+    psp_request_t req;
+    pilot_file_t *new_files=NULL, *tmp;
+    int *new_buckets;
+    int n=0, size=0, i, exact;
+    unsigned int nb, idx;
+    unsigned long generation;
+    time_t now;
+    size_t len;
+    char *path;
+
+    /* Stat and obtain the change counter before reading, such that later
+     * changes are noticed */
+    now=time(NULL);
+    generation=psp_watch_generation(pilot_watch_id);
+    if (stat(pilot_dir, &st)!=0 || (dirp=opendir(pilot_dir))==NULL)    {
+	lcmaps_log(LOG_WARNING, "%s: cannot read pilot proxy directory %s: %s\n",
+		__func__, pilot_dir, strerror(errno));
+	return -1;
+    }
+    exact=(st.st_mtime < now && st.st_ctime < now);
+
+    while ( (de=readdir(dirp)) )	{
+	if (de->d_name[0]=='.')
+	    continue;
+	len=strlen(pilot_dir)+strlen(de->d_name)+2;
+	if ( (path=(char *)malloc(len))==NULL )
+	    goto nomem;
+	snprintf(path, len, "%s/%s", pilot_dir, de->d_name);
+
+	/* Read it into the pilot cache, which checks ownership and mode */
+	psp_request_init(&req);
+	req.pilot_path=path;
+	if (psp_get_pilot_proxy(&req, pilot_lock_type, pilot_read_method, 0) ||
+	    req.pilot_cert==NULL)   {
+	    psp_log(LOG_DEBUG, "%s: skipping %s\n", __func__, path);
+	    psp_request_cleanup(&req);
+	    free(path);
+	    continue;
+	}
+	if (n==size)	{
+	    size=(size ? 2*size : 16);
+	    if ( (tmp=(pilot_file_t *)realloc(new_files,
+					(size_t)size*sizeof(pilot_file_t)))==NULL)
+	    {
+		psp_request_cleanup(&req);
+		free(path);
+		goto nomem;
+	    }
+	    new_files=tmp;
+	}
+	new_files[n].path=path;
+	new_files[n].st=req.pilot_st;
+	new_files[n].subject_hash=
+	    X509_NAME_hash(X509_get_subject_name(req.pilot_cert));
+	new_files[n].key_id_len=get_key_id(req.pilot_cert, new_files[n].key_id);
+	if (req.pilot_st.st_mtime >= now || req.pilot_st.st_ctime >= now)
+	    exact=0;
+	n++;
+	psp_request_cleanup(&req);
+    }
+    closedir(dirp);
+
+    /* Hash table with at least twice as many buckets as files */
+    for (nb=16; nb<2*(unsigned int)n; nb*=2)
+	;
+    if ( (new_buckets=(int *)malloc(nb*sizeof(int)))==NULL )	{
+	dirp=NULL;
+	goto nomem;
+    }
+    for (idx=0; idx<nb; idx++)
+	new_buckets[idx]=-1;
+    for (i=0; i<n; i++)	{
+	idx=(unsigned int)(new_files[i].subject_hash & (nb-1));
+	new_files[i].next=new_buckets[idx];
+	new_buckets[idx]=i;
+    }
+
+    index->files=new_files;
+    index->nfiles=n;
+    index->buckets=new_buckets;
+    index->nbuckets=nb;
+    index->dir_st=st;
+    index->generation=generation;
+    index->scan_time=now;
+    index->exact=exact;
+
+    psp_log(LOG_DEBUG, "%s: indexed %d pilot proxies in %s\n",
+	    __func__, n, pilot_dir);
+    return n;
+
+nomem:
+    lcmaps_log(LOG_ERR, "%s: out of memory\n", __func__);
+    if (dirp)
+	closedir(dirp);
+    for (i=0; i<n; i++)
+	free(new_files[i].path);
+    free(new_files);
+    return -1;
+}
+
+/**
+ * Replaces the index by a new scan of the directory, unless another thread
+ * did so since it was at given version. Only the swap is done under the
+ * write lock, the old index is freed after it. Needs scan_mutex.
+ * \return number of pilot proxies found, 0 when already replaced, -1 on
+ * error
+ */
+static int rebuild_index(unsigned long version)	{
+    pilot_index_t index, old;
+    int rc;
+
+    if (pilot_dir==NULL)
+	return -1;
+    /* Only this thread replaces the index, hence no lock for reading it */
+    if (index_version!=version)
+	return 0;
+    if ( (rc=scan_dir(&index))<0 )
+	return rc;
+
+    pthread_rwlock_wrlock(&index_lock);
+    old=pilot_index;
+    pilot_index=index;
+    index_version++;
+    pthread_rwlock_unlock(&index_lock);
+    free_index(&old);
+
+    return rc;
+}
+
+/**
+ * Checks whether the index no longer matches the directory: when there is no
+ * index, when the change counter generation of the watch differs from the
+ * one at indexing, or without a watch when the stat of the directory
+ * differs, or might not show a change in the second of indexing. Needs
+ * index_lock.
+ * \return 1 when it is stale, 0 otherwise
+ */
+static int index_stale(unsigned long generation)  {
+    struct stat st;
+
+    if (pilot_index.nbuckets==0)
+	return 1;
+    if (generation!=0)
+	return (generation!=pilot_index.generation);
+
+    /* Files added, removed or renamed change the directory */
+    if (stat(pilot_dir, &st)!=0 || !same_stat(&st, &(pilot_index.dir_st)))
+	return 1;
+    /* Changes in the second of indexing don't show in the stat, index once
+     * more afterwards */
+    if (!pilot_index.exact && pilot_index.scan_time < time(NULL))
+	return 1;
+
+    return 0;
+}
+
+/**
+ * Copies the path of the file for given issuer name hash and authority key
+ * identifier keyid into the arena of req, warning when there is none. Needs
+ * index_lock.
+ * \return path, NULL when not found or on error
+ */
+static const char *find_path(psp_request_t *req, unsigned long hash,
+			     const ASN1_OCTET_STRING *keyid)	{
+    pilot_file_t *file;
+    const char *path;
+
+    if ( (file=index_find(hash, keyid))==NULL )	{
+	psp_log_warning(req->payload_cert,
+		"%s: no pilot proxy in %s for the issuer of the payload\n",
+		__func__, pilot_dir);
+	return NULL;
+    }
+    if ( (path=psp_arena_strdup(&(req->arena), file->path))==NULL )
+	lcmaps_log(LOG_ERR, "%s: out of memory\n", __func__);
+
+    return path;
+}
+
+/**
+ * Frees index, after which it is as if all-zero
+ */
+static void free_index(pilot_index_t *index)	{
+    int i;
+
+    for (i=0; i<index->nfiles; i++)
+	free(index->files[i].path);
+    free(index->files);
+    free(index->buckets);
+    memset(index, 0, sizeof(pilot_index_t));
+}
+
+/**
+ * Obtains the key identifier of cert: its subject key identifier or,
+ * without one, the SHA-1 digest of its public key as OpenSSL would put in
+ * that extension.
+ * \return length of the identifier, 0 on error
+ */
+static size_t get_key_id(X509 *cert, unsigned char *key_id)	{
+    const ASN1_OCTET_STRING *skid;
+    unsigned int len;
+
+    if ( (skid=X509_get0_subject_key_id(cert)) )    {
+	if (skid->length<=0 || skid->length>KEY_ID_MAX)
+	    return 0;
+	memcpy(key_id, skid->data, (size_t)skid->length);
+	return (size_t)skid->length;
+    }
+
+    if (!X509_pubkey_digest(cert, EVP_sha1(), key_id, &len))
+	return 0;
+    return (size_t)len;
+}
+
+/**
+ * Finds the file for given issuer name hash and, when not NULL, authority
+ * key identifier keyid. Of several files for the same subject, such as a
+ * pilot proxy and its renewal, the one with the matching key identifier or,
+ * without a match, the most recently modified one is used: the signature of
+ * the payload is verified anyway. Needs index_lock.
+ * \return the file, or NULL when not found
+ */
+static pilot_file_t *index_find(unsigned long hash,
+				const ASN1_OCTET_STRING *keyid)	{
+    pilot_file_t *file, *found=NULL;
+    int i;
+
+    if (pilot_index.nbuckets==0)
+	return NULL;
+
+    for (i=pilot_index.buckets[hash & (pilot_index.nbuckets-1)]; i>=0;
+	 i=file->next)	{
+	file=&(pilot_index.files[i]);
+	if (file->subject_hash!=hash)
+	    continue;
+	if (keyid && (size_t)keyid->length==file->key_id_len &&
+	    memcmp(keyid->data, file->key_id, file->key_id_len)==0)
+	    return file;
+	if (found==NULL || file->st.st_mtime > found->st.st_mtime)
+	    found=file;
+    }
+
+    return found;
+}
+
+/**
+ * Checks whether the stat information st1 and st2 are for the same
+ * unmodified file or directory, based on device, inode, size, mtime and
+ * ctime.
+ * \return 1 when they are, 0 otherwise
+ */
+static int same_stat(const struct stat *st1, const struct stat *st2)	{
+    return ( st1->st_dev  ==st2->st_dev &&
+	     st1->st_ino  ==st2->st_ino &&
+	     st1->st_size ==st2->st_size &&
+	     st1->st_mtime==st2->st_mtime &&
+	     st1->st_ctime==st2->st_ctime );
+}
@@ -0,0 +1,68 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+#ifndef LCMAPS_PILOT_SUB_PROXY_PILOTDIR_H
+#define LCMAPS_PILOT_SUB_PROXY_PILOTDIR_H
+
+#include "lcmaps_pilot_sub_proxy_utils.h"
+
+
+/************************************************************************
+ * Function prototypes
+ ************************************************************************/
+
+/**
+ * Enables the directory mode: pilot proxies are looked up in the files in
+ * dir, read using lock_type and read_method, instead of the X509_USER_PROXY.
+ * The directory is indexed when first needed. When psp_watch_init() was
+ * called, changes are noticed using a watch on dir.
+ * \return 0 on success, -1 on error
+ */
+int psp_pilotdir_init(const char *dir, lock_type_t lock_type,
+		      read_method_t read_method);
+
+/**
+ * Frees the index and disables the directory mode
+ */
+void psp_pilotdir_cleanup(void);
+
+/**
+ * Indexes the pilot proxies in the directory, reading all of them into the
+ * pilot cache.
+ * \return number of pilot proxies found, -1 on error
+ */
+int psp_pilotdir_scan(void);
+
+/**
+ * Finds the file in the directory holding the pilot proxy that issued
+ * req->payload_cert, by its issuer and authority key identifier. The
+ * directory is indexed again when it changed, by one thread while the others
+ * use the old index. A payload issuer that is not found does not cause a new
+ * indexing.
+ * \return path owned by the request arena, NULL when not found or on error
+ */
+const char *psp_pilotdir_find(psp_request_t *req);
+
+#endif /* LCMAPS_PILOT_SUB_PROXY_PILOTDIR_H */
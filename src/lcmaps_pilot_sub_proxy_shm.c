@@ -0,0 +1,574 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+/**
+ * NOTES: verdict cache shared between processes, such as the short-lived
+ * gLExec processes of consecutive jobs, which never hit the in-process caches.
+ * The cache is a file mapped into memory, containing a fixed size table of
+ * slots using open addressing on the payload digest. Slots are updated
+ * without locks: each has a sequence counter that is odd while a writer is
+ * busy, readers copy the slot and retry elsewhere when the counter changed.
+ * Since the file only contains digests, DNs and verdicts, the integrity of
+ * each slot is protected by an HMAC with a host key, next to the file being
+ * accessible by root only. Entries identify the X509_USER_PROXY by its stat
+ * information, such that a lookup does not need to read the file, but it is
+ * still opened as the real uid, with the ownership and permission checks of
+ * reading it, as the stat alone does not show the caller may use it. The
+ * payload is identified by the fingerprint of its whole chain, as a hit skips
+ * all checks of the payload chain. */
+
+#include "lcmaps_plugins_pilot_sub_proxy_config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#include <lcmaps/lcmaps_log.h>
+
+#include "lcmaps_pilot_sub_proxy_shm.h"
+#include "lcmaps_pilot_sub_proxy_log.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/** Names of the cache file and host key in the cache directory */
+#define SHM_FILE	"verdicts"
+#define SHM_KEY_FILE	"hostkey"
+
+/** Identification of the cache file format */
+#define SHM_MAGIC	0x50535056  /* "PSPV" */
+#define SHM_VERSION	2
+
+/** Number of slots in the cache and number of slots tried for each key */
+#define SHM_SLOTS	1024
+#define SHM_PROBE	8
+
+/** Longest DN stored in a slot, including the '\0' */
+#define SHM_DN_MAX	512
+
+/** Length of the host key */
+#define SHM_KEY_LEN	32
+
+/** Offset of the first slot in the file */
+#define SHM_SLOTS_OFFSET    64
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Header at the start of the cache file */
+typedef struct shm_header_s  {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nslots;
+    uint32_t slot_size;
+} shm_header_t;
+
+/** Slot in the cache file. All members are naturally aligned, such that there
+ * is no padding in the part covered by the HMAC. */
+typedef struct shm_slot_s   {
+    uint32_t seq;		/* odd while being written */
+    uint32_t policy;		/* checks done on the pilot */
+    unsigned char payload_fingerprint[PSP_DIGEST_LEN]; /* whole chain */
+    unsigned char pilot_digest[PSP_DIGEST_LEN];
+    uint64_t pilot_uid;		/* owner of X509_USER_PROXY */
+    uint64_t pilot_dev;		/* stat of X509_USER_PROXY when read */
+    uint64_t pilot_ino;
+    int64_t pilot_size;
+    int64_t pilot_mtime;
+    int64_t pilot_ctime;
+    int64_t expiry;		/* end of validity, 0 when unused */
+    int32_t verdict;		/* 0 when verified, -1 when failed */
+    uint32_t dn_len;		/* length of dn, 0 when not stored */
+    char dn[SHM_DN_MAX];	/* one-line DN of the payload */
+    unsigned char hmac[PSP_DIGEST_LEN]; /* HMAC over policy up to hmac */
+} shm_slot_t;
+
+struct psp_shm_s    {
+    void *map;			/* mapped file */
+    size_t map_len;		/* length of map */
+    shm_slot_t *slots;		/* slots in map */
+    unsigned char key[SHM_KEY_LEN]; /* host key */
+};
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Opens path, which must be a regular file (not a symbolic link) owned by root
+ * with no permissions for group and others, with given flags and mode.
+ * \return file descriptor or -1 on error */
+static int open_root_file(const char *path, int flags, mode_t mode);
+
+/* Reads the host key in dir into key, creating it when it doesn't exist.
+ * \return 0 on success, -1 on error */
+static int get_host_key(const char *dir, unsigned char *key);
+
+/* Makes sure the cache file fd contains a valid header and the right number of
+ * slots, initializing it otherwise.
+ * \return 0 on success, -1 on error */
+static int init_file(int fd, const char *path);
+
+/* Fills in the identification of the X509_USER_PROXY in slot from st */
+static void slot_set_pilot(shm_slot_t *slot, const struct stat *st);
+
+/* Computes the HMAC of slot into hmac */
+static void slot_hmac(const psp_shm_t *shm, const shm_slot_t *slot,
+		      unsigned char *hmac);
+
+/* Consistently copies slot into copy.
+ * \return 0 on success, -1 when slot is being written */
+static int slot_read(const shm_slot_t *slot, shm_slot_t *copy);
+
+/* Writes data into slot, unless another writer is busy with it */
+static void slot_write(shm_slot_t *slot, const shm_slot_t *data);
+
+/* Index of the first slot for given payload fingerprint */
+static unsigned int slot_index(const unsigned char *payload_fingerprint);
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * Opens, and when needed creates, the shared verdict cache in directory dir,
+ * which must be owned by root and writable only by root. The cache file and
+ * the host key used for authenticating its entries must be regular files owned
+ * by root, with no permissions for group or others.
+ * \return cache or NULL on error
+ */
+psp_shm_t *psp_shm_open(const char *dir)    {
+    char path[FILENAME_MAX];
+    struct stat st;
+    psp_shm_t *shm;
+    int fd;
+
+    /* Directory must be safe against replacing the files */
+    if (lstat(dir, &st)!=0 || !S_ISDIR(st.st_mode) || st.st_uid!=0 ||
+	st.st_mode & S_IWGRP || st.st_mode & S_IWOTH)	{
+	lcmaps_log(LOG_ERR,
+		"%s: %s is not a directory owned and only writable by root\n",
+		__func__, dir);
+	return NULL;
+    }
+
+    if ( (shm=calloc(1, sizeof(psp_shm_t)))==NULL )	{
+	lcmaps_log(LOG_ERR, "%s: out of memory\n", __func__);
+	return NULL;
+    }
+    if (get_host_key(dir, shm->key))
+	goto fail;
+
+    /* Open and map the cache file */
+    if (snprintf(path, sizeof(path), "%s/%s", dir, SHM_FILE)>=(int)sizeof(path))
+    {
+	lcmaps_log(LOG_ERR, "%s: path of %s too long\n", __func__, dir);
+	goto fail;
+    }
+    if ( (fd=open_root_file(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR))<0 )
+	goto fail;
+    if (init_file(fd, path))	{
+	close(fd);
+	goto fail;
+    }
+    shm->map_len=SHM_SLOTS_OFFSET+SHM_SLOTS*sizeof(shm_slot_t);
+    shm->map=mmap(NULL, shm->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		  fd, 0);
+    close(fd);
+    if (shm->map==MAP_FAILED)	{
+	lcmaps_log(LOG_ERR, "%s: cannot map %s: %s\n",
+		__func__, path, strerror(errno));
+	goto fail;
+    }
+    shm->slots=(shm_slot_t *)((char *)shm->map+SHM_SLOTS_OFFSET);
+
+    return shm;
+
+fail:
+    OPENSSL_cleanse(shm->key, SHM_KEY_LEN);
+    free(shm);
+    return NULL;
+}
+
+/**
+ * Unmaps and closes the shared verdict cache
+ */
+void psp_shm_close(psp_shm_t *shm)  {
+    if (shm==NULL)
+	return;
+
+    munmap(shm->map, shm->map_len);
+    OPENSSL_cleanse(shm->key, SHM_KEY_LEN);
+    free(shm);
+}
+
+/**
+ * Looks up the verdict for the payload chain, as req->payload_fingerprint,
+ * and the pilot proxy file (req->pilot_path, or the X509_USER_PROXY when
+ * NULL) as it is on disk, for given policy (flags identifying the checks done
+ * on the pilot). The pilot proxy file is opened with psp_stat_pilot_proxy(),
+ * such that only its owner can use its entries. On success, sets
+ * req->payload_dn (owned by the request arena).
+ * \return 1 when the payload was verified before, -1 when it failed before,
+ * 0 when not found
+ */
+int psp_shm_lookup(psp_shm_t *shm, psp_request_t *req, unsigned int policy) {
+    const char *proxy=(req->pilot_path ? req->pilot_path
+				       : getenv("X509_USER_PROXY"));
+    shm_slot_t key, copy;
+    unsigned char hmac[PSP_DIGEST_LEN];
+    unsigned int i, idx;
+    struct stat st;
+    time_t now=time(NULL);
+
+    if (!req->have_payload_fingerprint || proxy==NULL ||
+	psp_stat_pilot_proxy(proxy, &st)!=0)
+	return 0;
+    memset(&key, 0, sizeof(key));
+    slot_set_pilot(&key, &st);
+
+    idx=slot_index(req->payload_fingerprint);
+    for (i=0; i<SHM_PROBE; i++)	{
+	if (slot_read(&(shm->slots[(idx+i)%SHM_SLOTS]), &copy) ||
+	    copy.expiry<=now || copy.policy!=policy ||
+	    memcmp(copy.payload_fingerprint, req->payload_fingerprint,
+		   PSP_DIGEST_LEN)!=0 ||
+	    copy.pilot_uid!=key.pilot_uid ||
+	    copy.pilot_dev!=key.pilot_dev || copy.pilot_ino!=key.pilot_ino ||
+	    copy.pilot_size!=key.pilot_size ||
+	    copy.pilot_mtime!=key.pilot_mtime ||
+	    copy.pilot_ctime!=key.pilot_ctime)
+	    continue;
+
+	/* Only trust authentic entries */
+	slot_hmac(shm, &copy, hmac);
+	if (CRYPTO_memcmp(hmac, copy.hmac, PSP_DIGEST_LEN)!=0)	{
+	    lcmaps_log(LOG_WARNING,
+		    "%s: ignoring shared cache entry with invalid HMAC\n",
+		    __func__);
+	    continue;
+	}
+
+	if (copy.verdict!=0)	{
+	    lcmaps_log(LOG_WARNING,
+		    "%s: payload cert previously failed for this pilot cert\n",
+		    __func__);
+	    return -1;
+	}
+	if (copy.dn_len>0 && copy.dn_len<SHM_DN_MAX)	{
+	    copy.dn[copy.dn_len]='\0';
+	    req->payload_dn=psp_arena_strdup(&(req->arena), copy.dn);
+	}
+	psp_log(LOG_DEBUG, "%s: using shared verification result\n",
+		__func__);
+	return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Stores the verdict (0 on success, -1 on failure) for the payload chain and
+ * req->pilot_cert for given policy, valid until expiry. Nothing is stored
+ * when the X509_USER_PROXY might have changed while it was read.
+ */
+void psp_shm_store(psp_shm_t *shm, const psp_request_t *req,
+		   unsigned int policy, int verdict, time_t expiry)	{
+    shm_slot_t data, copy;
+    shm_slot_t *slot=NULL;
+    int64_t slot_expiry=0;
+    unsigned int i, idx;
+    size_t dn_len;
+    time_t now=time(NULL);
+
+    /* Since stat times have a resolution of seconds, a change within the
+     * second the file was read would go unnoticed */
+    if (!req->have_payload_fingerprint || !req->have_pilot_digest ||
+	!req->have_pilot_st || !req->pilot_st_exact || expiry<=now)
+	return;
+
+    memset(&data, 0, sizeof(data));
+    data.policy=policy;
+    memcpy(data.payload_fingerprint, req->payload_fingerprint,
+	   PSP_DIGEST_LEN);
+    memcpy(data.pilot_digest, req->pilot_digest, PSP_DIGEST_LEN);
+    slot_set_pilot(&data, &(req->pilot_st));
+    data.expiry=(int64_t)expiry;
+    data.verdict=(verdict==0 ? 0 : -1);
+    if (verdict==0 && req->payload_dn &&
+	(dn_len=strlen(req->payload_dn))<SHM_DN_MAX)    {
+	memcpy(data.dn, req->payload_dn, dn_len);
+	data.dn_len=(uint32_t)dn_len;
+    }
+    slot_hmac(shm, &data, data.hmac);
+
+    /* Replace an entry for the same key, an expired or the soonest expiring
+     * entry */
+    idx=slot_index(req->payload_fingerprint);
+    for (i=0; i<SHM_PROBE; i++)	{
+	if (slot_read(&(shm->slots[(idx+i)%SHM_SLOTS]), &copy))
+	    continue;
+	if (copy.expiry<=now ||
+	    (copy.policy==policy &&
+	     memcmp(copy.payload_fingerprint, data.payload_fingerprint,
+		    PSP_DIGEST_LEN)==0 &&
+	     copy.pilot_dev==data.pilot_dev &&
+	     copy.pilot_ino==data.pilot_ino))	{
+	    slot=&(shm->slots[(idx+i)%SHM_SLOTS]);
+	    break;
+	}
+	if (slot==NULL || copy.expiry<slot_expiry)  {
+	    slot=&(shm->slots[(idx+i)%SHM_SLOTS]);
+	    slot_expiry=copy.expiry;
+	}
+    }
+
+    if (slot)
+	slot_write(slot, &data);
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Opens path, which must be a regular file (not a symbolic link) owned by root
+ * with no permissions for group and others, with given flags and mode.
+ * \return file descriptor or -1 on error
+ */
+static int open_root_file(const char *path, int flags, mode_t mode)	{
+    struct stat st;
+    int fd;
+
+    if ( (fd=open(path, flags | O_NOFOLLOW | O_CLOEXEC, mode))<0 )	{
+	lcmaps_log(LOG_ERR, "%s: cannot open %s: %s\n",
+		__func__, path, strerror(errno));
+	return -1;
+    }
+    if (fstat(fd, &st)!=0 || !S_ISREG(st.st_mode) || st.st_uid!=0 ||
+	st.st_mode & (S_IRWXG | S_IRWXO))	{
+	lcmaps_log(LOG_ERR, "%s: unsafe ownership or permissions on %s\n",
+		__func__, path);
+	close(fd);
+	return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Reads the host key in dir into key, creating it when it doesn't exist. A new
+ * key is written to a temporary file which is then linked into place, such
+ * that concurrent processes all end up with the same complete key.
+ * \return 0 on success, -1 on error
+ */
+static int get_host_key(const char *dir, unsigned char *key)	{
+    char path[FILENAME_MAX], tmp_path[FILENAME_MAX];
+    unsigned char new_key[SHM_KEY_LEN];
+    ssize_t len;
+    int fd, rc=-1;
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, SHM_KEY_FILE)
+	    >=(int)sizeof(path) ||
+	snprintf(tmp_path, sizeof(tmp_path), "%s/%s.%ld", dir, SHM_KEY_FILE,
+		 (long)getpid())>=(int)sizeof(tmp_path))	{
+	lcmaps_log(LOG_ERR, "%s: path of %s too long\n", __func__, dir);
+	return -1;
+    }
+
+    /* Create a new key unless there is one */
+    if (access(path, F_OK)!=0 && errno==ENOENT)	{
+	if (RAND_bytes(new_key, SHM_KEY_LEN)!=1)    {
+	    lcmaps_log(LOG_ERR, "%s: cannot generate host key\n", __func__);
+	    return -1;
+	}
+	unlink(tmp_path);
+	if ( (fd=open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW |
+				O_CLOEXEC, S_IRUSR | S_IWUSR))<0 )	{
+	    lcmaps_log(LOG_ERR, "%s: cannot create %s: %s\n",
+		    __func__, tmp_path, strerror(errno));
+	    OPENSSL_cleanse(new_key, SHM_KEY_LEN);
+	    return -1;
+	}
+	len=write(fd, new_key, SHM_KEY_LEN);
+	OPENSSL_cleanse(new_key, SHM_KEY_LEN);
+	if (close(fd)!=0 || len!=SHM_KEY_LEN)	{
+	    lcmaps_log(LOG_ERR, "%s: cannot write %s\n", __func__, tmp_path);
+	    unlink(tmp_path);
+	    return -1;
+	}
+	/* Fails when another process was first, then use its key */
+	if (link(tmp_path, path)!=0 && errno!=EEXIST)	{
+	    lcmaps_log(LOG_ERR, "%s: cannot create %s: %s\n",
+		    __func__, path, strerror(errno));
+	    unlink(tmp_path);
+	    return -1;
+	}
+	unlink(tmp_path);
+    }
+
+    if ( (fd=open_root_file(path, O_RDONLY, 0))<0 )
+	return -1;
+    if (read(fd, key, SHM_KEY_LEN)==SHM_KEY_LEN)
+	rc=0;
+    else
+	lcmaps_log(LOG_ERR, "%s: cannot read host key %s\n", __func__, path);
+    close(fd);
+
+    return rc;
+}
+
+/**
+ * Makes sure the cache file fd contains a valid header and the right number of
+ * slots, initializing it otherwise. Initialization happens under an exclusive
+ * lock, such that concurrent processes don't wipe out each others slots.
+ * \return 0 on success, -1 on error
+ */
+static int init_file(int fd, const char *path)	{
+    const off_t size=SHM_SLOTS_OFFSET+SHM_SLOTS*sizeof(shm_slot_t);
+    shm_header_t header, wanted;
+    struct stat st;
+    int rc=-1;
+
+    memset(&wanted, 0, sizeof(wanted));
+    wanted.magic=SHM_MAGIC;
+    wanted.version=SHM_VERSION;
+    wanted.nslots=SHM_SLOTS;
+    wanted.slot_size=sizeof(shm_slot_t);
+
+    if (flock(fd, LOCK_EX)!=0)	{
+	lcmaps_log(LOG_ERR, "%s: cannot lock %s: %s\n",
+		__func__, path, strerror(errno));
+	return -1;
+    }
+
+    if (fstat(fd, &st)==0 && st.st_size==size &&
+	pread(fd, &header, sizeof(header), 0)==(ssize_t)sizeof(header) &&
+	memcmp(&header, &wanted, sizeof(header))==0)
+	rc=0;
+    else if (ftruncate(fd, 0)==0 && ftruncate(fd, size)==0 &&
+	     pwrite(fd, &wanted, sizeof(wanted), 0)==(ssize_t)sizeof(wanted))
+    {
+	lcmaps_log(LOG_INFO, "%s: initialized shared cache %s\n",
+		__func__, path);
+	rc=0;
+    } else
+	lcmaps_log(LOG_ERR, "%s: cannot initialize %s: %s\n",
+		__func__, path, strerror(errno));
+
+    flock(fd, LOCK_UN);
+
+    return rc;
+}
+
+/**
+ * Fills in the identification of the X509_USER_PROXY in slot from st
+ */
+static void slot_set_pilot(shm_slot_t *slot, const struct stat *st)	{
+    slot->pilot_uid=(uint64_t)st->st_uid;
+    slot->pilot_dev=(uint64_t)st->st_dev;
+    slot->pilot_ino=(uint64_t)st->st_ino;
+    slot->pilot_size=(int64_t)st->st_size;
+    slot->pilot_mtime=(int64_t)st->st_mtime;
+    slot->pilot_ctime=(int64_t)st->st_ctime;
+}
+
+/**
+ * Computes the HMAC of slot into hmac, covering everything but the sequence
+ * counter and the HMAC itself
+ */
+static void slot_hmac(const psp_shm_t *shm, const shm_slot_t *slot,
+		      unsigned char *hmac)  {
+    unsigned int len=PSP_DIGEST_LEN;
+
+    HMAC(EVP_sha256(), shm->key, SHM_KEY_LEN,
+	 (const unsigned char *)slot+offsetof(shm_slot_t, policy),
+	 offsetof(shm_slot_t, hmac)-offsetof(shm_slot_t, policy),
+	 hmac, &len);
+}
+
+/**
+ * Consistently copies slot into copy.
+ * \return 0 on success, -1 when slot is being written
+ */
+static int slot_read(const shm_slot_t *slot, shm_slot_t *copy)	{
+    uint32_t seq=__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+
+    if (seq & 1)
+	return -1;
+    memcpy(copy, slot, sizeof(shm_slot_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return (__atomic_load_n(&(slot->seq), __ATOMIC_RELAXED)==seq ? 0 : -1);
+}
+
+/**
+ * Writes data into slot, unless another writer is busy with it. A writer that
+ * dies halfway leaves the slot unusable, which only makes the cache smaller.
+ */
+static void slot_write(shm_slot_t *slot, const shm_slot_t *data)	{
+    uint32_t seq=__atomic_load_n(&(slot->seq), __ATOMIC_RELAXED);
+
+    if ((seq & 1) ||
+	!__atomic_compare_exchange_n(&(slot->seq), &seq, seq+1, 0,
+				     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	return;
+
+    memcpy((char *)slot+offsetof(shm_slot_t, policy),
+	   (const char *)data+offsetof(shm_slot_t, policy),
+	   sizeof(shm_slot_t)-offsetof(shm_slot_t, policy));
+
+    __atomic_store_n(&(slot->seq), seq+2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Index of the first slot for given payload digest
+ * \return slot index
+ */
+static unsigned int slot_index(const unsigned char *payload_fingerprint)  {
+    return ((unsigned int)payload_fingerprint[0] |
+	    (unsigned int)payload_fingerprint[1]<<8 |
+	    (unsigned int)payload_fingerprint[2]<<16) % SHM_SLOTS;
+}
@@ -0,0 +1,80 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+#ifndef LCMAPS_PILOT_SUB_PROXY_SHM_H
+#define LCMAPS_PILOT_SUB_PROXY_SHM_H
+
+#include <time.h>
+
+#include "lcmaps_pilot_sub_proxy_utils.h"
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Shared verdict cache, mapped from a file */
+typedef struct psp_shm_s psp_shm_t;
+
+
+/************************************************************************
+ * Function prototypes
+ ************************************************************************/
+
+/**
+ * Opens, and when needed creates, the shared verdict cache in directory dir,
+ * which must be owned by root and writable only by root. The cache file and
+ * the host key used for authenticating its entries must be regular files owned
+ * by root, with no permissions for group or others.
+ * \return cache or NULL on error
+ */
+psp_shm_t *psp_shm_open(const char *dir);
+
+/**
+ * Unmaps and closes the shared verdict cache
+ */
+void psp_shm_close(psp_shm_t *shm);
+
+/**
+ * Looks up the verdict for the payload chain, as req->payload_fingerprint,
+ * and the pilot proxy file (req->pilot_path, or the X509_USER_PROXY when
+ * NULL) as it is on disk, for given policy (flags identifying the checks done
+ * on the pilot). The pilot proxy file is opened with psp_stat_pilot_proxy(),
+ * such that only its owner can use its entries. On success, sets
+ * req->payload_dn (owned by the request arena).
+ * \return 1 when the payload was verified before, -1 when it failed before,
+ * 0 when not found
+ */
+int psp_shm_lookup(psp_shm_t *shm, psp_request_t *req, unsigned int policy);
+
+/**
+ * Stores the verdict (0 on success, -1 on failure) for the payload chain and
+ * req->pilot_cert for given policy, valid until expiry. Nothing is stored
+ * when the X509_USER_PROXY might have changed while it was read.
+ */
+void psp_shm_store(psp_shm_t *shm, const psp_request_t *req,
+		   unsigned int policy, int verdict, time_t expiry);
+
+#endif /* LCMAPS_PILOT_SUB_PROXY_SHM_H */
@@ -0,0 +1,510 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+/**
+ * NOTES: optional timing instrumentation. Each stage has a histogram with
+ * logarithmic buckets that are subdivided linearly (as in HdrHistogram), such
+ * that durations from nanoseconds to minutes are kept with a precision of
+ * 12.5% in a fixed amount of memory. All updates are relaxed atomic additions,
+ * so concurrent requests don't need a lock; a dump is therefore not an exact
+ * snapshot. The SIGUSR1 handler only sets a flag, the dump itself is done by
+ * the next request (or at termination), outside of signal context.
+ * The request times are kept per thread instead, for the request log line of
+ * the plugin. */
+
+/* needed for e.g. strdup, open_memstream and clock_gettime */
+#define _XOPEN_SOURCE	700
+
+#include "lcmaps_plugins_pilot_sub_proxy_config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+#include <lcmaps/lcmaps_log.h>
+
+#include "lcmaps_pilot_sub_proxy_stats.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/** Number of bits used for the linear subdivision of each power of two */
+#define SUB_BITS	3
+#define SUB_BUCKETS	(1<<SUB_BITS)
+
+/** Highest bit of the durations kept separately, longer ones (over 18
+ * minutes) all end up in the last bucket */
+#define MAX_MSB		40
+
+/** Total number of buckets per histogram */
+#define NBUCKETS	((MAX_MSB-SUB_BITS+2)*SUB_BUCKETS)
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Histogram of durations in nanoseconds */
+typedef struct histogram_s  {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[NBUCKETS];
+} histogram_t;
+
+
+/************************************************************************
+ * Global variables
+ ************************************************************************/
+
+/** Names of the stages and counters in the dump */
+static const char *stage_names[PSP_NSTAGES] = {
+    "fqan", "reject_lookup", "payload", "payload_checks", "shared_lookup",
+    "pilot", "pilot_lock", "pilot_read", "pilot_parse", "pilot_checks",
+    "signature", "store", "total"
+};
+static const char *counter_names[PSP_NCOUNTERS] = {
+    "success", "failure", "pilot_cache_hit", "pilot_cache_miss",
+    "pilot_cache_stale", "pilot_load_wait", "verdict_cache_hit",
+    "verdict_cache_miss", "shared_cache_hit", "shared_cache_miss",
+    "reject_cache_hit", "reject_cache_miss",
+    "fail_payload", "fail_pilot", "fail_not_rfc", "fail_not_limited",
+    "fail_expired", "fail_issuer", "fail_fqan", "fail_key", "fail_chain",
+    "fail_signature", "fail_store", "log_suppressed"
+};
+
+/** Whether statistics are enabled, only set during initialization */
+static int stats_enabled=0;
+
+/** File the statistics are appended to */
+static char *stats_path=NULL;
+
+static histogram_t histograms[PSP_NSTAGES];
+
+/** Whether request times are kept, only set during initialization */
+static int request_times_enabled=0;
+
+/** Durations of the stages of the current request of each thread */
+static __thread uint64_t request_times[PSP_NSTAGES];
+static uint64_t counters[PSP_NCOUNTERS];
+
+/** Set by the signal handler when a dump is requested */
+static volatile sig_atomic_t dump_requested=0;
+
+/** Whether the SIGUSR1 handler is installed, and the one it replaced */
+static int handler_installed=0;
+static struct sigaction old_action;
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Signal handler for SIGUSR1 */
+static void request_dump(int signum);
+
+/* Bucket index for given duration
+ * \return index in histogram_t buckets */
+static unsigned int bucket_index(uint64_t value);
+
+/* Largest duration that is kept in given bucket
+ * \return duration in nanoseconds */
+static uint64_t bucket_upper(unsigned int idx);
+
+/* Estimates the duration below which fraction of the values in hist lie.
+ * \return duration in nanoseconds */
+static uint64_t percentile(const histogram_t *hist, uint64_t count,
+			   double fraction);
+
+/* Writes the statistics as JSON to out */
+static void write_json(FILE *out);
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * Enables the statistics, which are appended to path by psp_stats_dump(), at
+ * psp_stats_cleanup() and, when the signal is not in use by the host, after the
+ * first request following a SIGUSR1.
+ * \return 0 on success, -1 on error
+ */
+int psp_stats_init(const char *path)	{
+    struct sigaction action;
+
+    if (stats_enabled)
+	return 0;
+
+    if ( (stats_path=strdup(path))==NULL )    {
+	lcmaps_log(LOG_ERR, "%s: out of memory\n", __func__);
+	return -1;
+    }
+    memset(histograms, 0, sizeof(histograms));
+    memset(counters, 0, sizeof(counters));
+
+    /* Only take SIGUSR1 when nobody else uses it, as its default action is
+     * to terminate the process anyway */
+    if (sigaction(SIGUSR1, NULL, &old_action)==0 &&
+	!(old_action.sa_flags & SA_SIGINFO) &&
+	old_action.sa_handler==SIG_DFL)	{
+	memset(&action, 0, sizeof(action));
+	action.sa_handler=request_dump;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags=SA_RESTART;
+	if (sigaction(SIGUSR1, &action, NULL)==0)
+	    handler_installed=1;
+    }
+    if (!handler_installed)
+	lcmaps_log(LOG_INFO,
+		"%s: SIGUSR1 is in use, statistics are only dumped at exit\n",
+		__func__);
+
+    stats_enabled=1;
+
+    return 0;
+}
+
+/**
+ * Dumps the statistics when enabled and disables them
+ */
+void psp_stats_cleanup(void)	{
+    struct sigaction action;
+
+    if (!stats_enabled)
+	return;
+
+    psp_stats_dump();
+
+    /* Restore the previous handler, unless someone replaced ours */
+    if (handler_installed && sigaction(SIGUSR1, NULL, &action)==0 &&
+	!(action.sa_flags & SA_SIGINFO) && action.sa_handler==request_dump)
+	sigaction(SIGUSR1, &old_action, NULL);
+    handler_installed=0;
+
+    stats_enabled=0;
+    free(stats_path);
+    stats_path=NULL;
+}
+
+/**
+ * Enables (or disables) keeping the durations of the stages of the current
+ * request of each thread, for psp_stats_request_time(), independent of the
+ * statistics. Only to be called during initialization.
+ */
+void psp_stats_request_times(int enable)	{
+    request_times_enabled=(enable!=0);
+}
+
+/**
+ * Obtains the start time for psp_stats_record().
+ * \return monotonic time in nanoseconds, 0 when neither statistics nor
+ * request times are enabled
+ */
+uint64_t psp_stats_start(void)	{
+    struct timespec ts;
+
+    if ((!stats_enabled && !request_times_enabled) || clock_gettime(CLOCK_MONOTONIC, &ts)!=0)
+	return 0;
+
+    /* Never 0, which means disabled */
+    return (uint64_t)ts.tv_sec*1000000000ULL+(uint64_t)ts.tv_nsec+1;
+}
+
+/**
+ * Records the duration since start in the histogram of stage and, when
+ * enabled, in the request times of the calling thread. Does nothing when
+ * start is 0.
+ */
+void psp_stats_record(psp_stage_t stage, uint64_t start)    {
+    histogram_t *hist;
+    uint64_t now, value, old;
+
+    if (start==0 || stage<0 || stage>=PSP_NSTAGES ||
+	(now=psp_stats_start())==0)
+	return;
+
+    value=(now>start ? now-start : 0);
+    if (request_times_enabled)
+	request_times[stage]+=value;
+    if (!stats_enabled)
+	return;
+
+    hist=&(histograms[stage]);
+    __atomic_fetch_add(&(hist->buckets[bucket_index(value)]), 1,
+		       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(hist->sum), value, __ATOMIC_RELAXED);
+
+    /* min is only valid when count>0, then its initial 0 is replaced */
+    if (__atomic_fetch_add(&(hist->count), 1, __ATOMIC_RELAXED)==0)
+	__atomic_store_n(&(hist->min), value, __ATOMIC_RELAXED);
+    old=__atomic_load_n(&(hist->min), __ATOMIC_RELAXED);
+    while (value<old &&
+	   !__atomic_compare_exchange_n(&(hist->min), &old, value, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+    old=__atomic_load_n(&(hist->max), __ATOMIC_RELAXED);
+    while (value>old &&
+	   !__atomic_compare_exchange_n(&(hist->max), &old, value, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+}
+
+/**
+ * Clears the request times of the calling thread, at the start of a request
+ */
+void psp_stats_request_reset(void)	{
+    if (request_times_enabled)
+	memset(request_times, 0, sizeof(request_times));
+}
+
+/**
+ * Obtains the total duration of stage in the current request of the calling
+ * thread.
+ * \return duration in nanoseconds, 0 when not recorded or not enabled
+ */
+uint64_t psp_stats_request_time(psp_stage_t stage)	{
+    if (!request_times_enabled || stage<0 || stage>=PSP_NSTAGES)
+	return 0;
+
+    return request_times[stage];
+}
+
+/**
+ * Obtains the name of stage, as used in the statistics file
+ * \return name, NULL for an invalid stage
+ */
+const char *psp_stats_stage_name(psp_stage_t stage)	{
+    if (stage<0 || stage>=PSP_NSTAGES)
+	return NULL;
+
+    return stage_names[stage];
+}
+
+/**
+ * Obtains the name of counter, as used in the statistics file
+ * \return name, NULL for an invalid counter
+ */
+const char *psp_stats_counter_name(psp_counter_t counter)	{
+    if (counter<0 || counter>=PSP_NCOUNTERS)
+	return NULL;
+
+    return counter_names[counter];
+}
+
+/**
+ * Increases counter, when statistics are enabled
+ */
+void psp_stats_count(psp_counter_t counter)	{
+    if (stats_enabled && counter>=0 && counter<PSP_NCOUNTERS)
+	__atomic_fetch_add(&(counters[counter]), 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Dumps the statistics when requested by a SIGUSR1 since the previous call
+ */
+void psp_stats_poll(void)   {
+    if (stats_enabled && dump_requested)	{
+	dump_requested=0;
+	psp_stats_dump();
+    }
+}
+
+/**
+ * Appends the current statistics as one line of JSON to the statistics file.
+ * The line is written using a single write(), such that dumps of different
+ * processes sharing the file don't get mixed up.
+ * \return 0 on success, -1 on error or when statistics are disabled
+ */
+int psp_stats_dump(void)    {
+    FILE *out;
+    char *buf=NULL;
+    size_t len=0;
+    ssize_t written=-1;
+    int fd;
+
+    if (!stats_enabled)
+	return -1;
+
+    if ( (out=open_memstream(&buf, &len))==NULL )	{
+	lcmaps_log(LOG_ERR, "%s: out of memory\n", __func__);
+	return -1;
+    }
+    write_json(out);
+    if (fclose(out)!=0)	{
+	lcmaps_log(LOG_ERR, "%s: out of memory\n", __func__);
+	free(buf);
+	return -1;
+    }
+
+    if ( (fd=open(stats_path, O_WRONLY | O_CREAT | O_APPEND | O_NOFOLLOW |
+			      O_CLOEXEC, 0644))>=0 )	{
+	written=write(fd, buf, len);
+	close(fd);
+    }
+    free(buf);
+    if (written!=(ssize_t)len)	{
+	lcmaps_log(LOG_WARNING, "%s: cannot write statistics to %s: %s\n",
+		__func__, stats_path, strerror(errno));
+	return -1;
+    }
+
+    return 0;
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Signal handler for SIGUSR1: only flags that a dump is wanted
+ */
+static void request_dump(int signum)	{
+    dump_requested=1;
+}
+
+/**
+ * Bucket index for given duration: values below SUB_BUCKETS have their own
+ * bucket, larger ones are grouped by their highest bit and the SUB_BITS bits
+ * following it.
+ * \return index in histogram_t buckets
+ */
+static unsigned int bucket_index(uint64_t value)    {
+    int msb;
+
+    if (value<SUB_BUCKETS)
+	return (unsigned int)value;
+
+    msb=63-__builtin_clzll(value);
+    if (msb>MAX_MSB)
+	return NBUCKETS-1;
+
+    return (unsigned int)((msb-SUB_BITS+1)*SUB_BUCKETS +
+			  ((value>>(msb-SUB_BITS)) & (SUB_BUCKETS-1)));
+}
+
+/**
+ * Largest duration that is kept in given bucket
+ * \return duration in nanoseconds
+ */
+static uint64_t bucket_upper(unsigned int idx)	{
+    unsigned int shift;
+
+    if (idx<SUB_BUCKETS)
+	return idx;
+    if (idx>=NBUCKETS-1)
+	return UINT64_MAX;
+
+    /* Start of the next bucket minus one */
+    idx++;
+    shift=idx/SUB_BUCKETS-1;
+    return ((uint64_t)(SUB_BUCKETS+idx%SUB_BUCKETS)<<shift)-1;
+}
+
+/**
+ * Estimates the duration below which fraction of the count values in hist
+ * lie, as the upper bound of the bucket containing that value, but at most
+ * the maximum
+ * \return duration in nanoseconds
+ */
+static uint64_t percentile(const histogram_t *hist, uint64_t count,
+			   double fraction)  {
+    uint64_t rank, seen=0, upper, max;
+    unsigned int i;
+
+    max=__atomic_load_n(&(hist->max), __ATOMIC_RELAXED);
+    rank=(uint64_t)(fraction*(double)count+0.5);
+    if (rank<1)
+	rank=1;
+    for (i=0; i<NBUCKETS; i++)	{
+	seen+=__atomic_load_n(&(hist->buckets[i]), __ATOMIC_RELAXED);
+	if (seen>=rank)	{
+	    upper=bucket_upper(i);
+	    return (upper<max ? upper : max);
+	}
+    }
+
+    return max;
+}
+
+/**
+ * Writes the statistics as one line of JSON to out. The non-empty buckets of
+ * each histogram are given as pairs of their upper bound and count.
+ */
+static void write_json(FILE *out)   {
+    const histogram_t *hist;
+    uint64_t count, n;
+    unsigned int i, j;
+    int first;
+
+    fprintf(out, "{\"pid\":%ld,\"time\":%ld,\"unit\":\"ns\",\"stages\":{",
+	    (long)getpid(), (long)time(NULL));
+    for (i=0; i<PSP_NSTAGES; i++)	{
+	hist=&(histograms[i]);
+	count=__atomic_load_n(&(hist->count), __ATOMIC_RELAXED);
+	fprintf(out, "%s\"%s\":{\"count\":%llu", i>0 ? "," : "",
+		stage_names[i], (unsigned long long)count);
+	if (count>0)	{
+	    fprintf(out, ",\"sum\":%llu,\"min\":%llu,\"max\":%llu,"
+		    "\"p50\":%llu,\"p90\":%llu,\"p99\":%llu",
+		    (unsigned long long)__atomic_load_n(&(hist->sum),
+							__ATOMIC_RELAXED),
+		    (unsigned long long)__atomic_load_n(&(hist->min),
+							__ATOMIC_RELAXED),
+		    (unsigned long long)__atomic_load_n(&(hist->max),
+							__ATOMIC_RELAXED),
+		    (unsigned long long)percentile(hist, count, 0.50),
+		    (unsigned long long)percentile(hist, count, 0.90),
+		    (unsigned long long)percentile(hist, count, 0.99));
+	}
+	fputs(",\"buckets\":[", out);
+	for (j=0, first=1; j<NBUCKETS; j++)	{
+	    if ( (n=__atomic_load_n(&(hist->buckets[j]), __ATOMIC_RELAXED)) )
+	    {
+		fprintf(out, "%s[%llu,%llu]", first ? "" : ",",
+			(unsigned long long)bucket_upper(j),
+			(unsigned long long)n);
+		first=0;
+	    }
+	}
+	fputs("]}", out);
+    }
+    fputs("},\"counters\":{", out);
+    for (i=0; i<PSP_NCOUNTERS; i++)
+	fprintf(out, "%s\"%s\":%llu", i>0 ? "," : "", counter_names[i],
+		(unsigned long long)__atomic_load_n(&(counters[i]),
+						    __ATOMIC_RELAXED));
+    fputs("}}\n", out);
+}
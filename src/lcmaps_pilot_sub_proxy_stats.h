@@ -0,0 +1,165 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+#ifndef LCMAPS_PILOT_SUB_PROXY_STATS_H
+#define LCMAPS_PILOT_SUB_PROXY_STATS_H
+
+#include <stdint.h>
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Timed stages of a request */
+typedef enum psp_stage_e    {
+    PSP_STAGE_FQAN = 0,		/* getting and matching the FQANs */
+    PSP_STAGE_REJECT_LOOKUP,	/* psp_get_payload_input() and
+				   psp_reject_cache_lookup() */
+    PSP_STAGE_PAYLOAD,		/* psp_get_payload_proxy() */
+    PSP_STAGE_PAYLOAD_CHECKS,	/* name, RFC/limited, validity and key checks
+				   of payload */
+    PSP_STAGE_SHARED_LOOKUP,	/* psp_shm_lookup() */
+    PSP_STAGE_PILOT,		/* psp_get_pilot_proxy() */
+    PSP_STAGE_PILOT_LOCK,	/* waiting for the lock on X509_USER_PROXY */
+    PSP_STAGE_PILOT_READ,	/* opening, locking and reading (or mapping
+				   and converting) X509_USER_PROXY */
+    PSP_STAGE_PILOT_PARSE,	/* converting it into a chain */
+    PSP_STAGE_PILOT_CHECKS,	/* RFC/limited checks of pilot, chain */
+    PSP_STAGE_SIGNATURE,	/* psp_verify_proxy_signature() */
+    PSP_STAGE_STORE,		/* psp_store_credentials() */
+    PSP_STAGE_TOTAL,		/* whole run or verify call */
+    PSP_NSTAGES
+} psp_stage_t;
+
+/** Event counters */
+typedef enum psp_counter_e  {
+    PSP_COUNT_SUCCESS = 0,	/* successful requests */
+    PSP_COUNT_FAILURE,		/* failed requests */
+    PSP_COUNT_PILOT_CACHE_HIT,	/* pilot chain used from the cache */
+    PSP_COUNT_PILOT_CACHE_MISS,	/* X509_USER_PROXY parsed */
+    PSP_COUNT_PILOT_CACHE_STALE, /* previous chain used during its reload */
+    PSP_COUNT_PILOT_LOAD_WAIT,	/* waited for a concurrent pilot load */
+    PSP_COUNT_VERDICT_CACHE_HIT, /* cached signature verdict used */
+    PSP_COUNT_VERDICT_CACHE_MISS, /* signature verified */
+    PSP_COUNT_SHARED_CACHE_HIT,	/* shared verdict used */
+    PSP_COUNT_SHARED_CACHE_MISS, /* no shared verdict found */
+    PSP_COUNT_REJECT_CACHE_HIT,	/* rejected as recently rejected payload */
+    PSP_COUNT_REJECT_CACHE_MISS, /* payload not recently rejected */
+    PSP_COUNT_FAIL_PAYLOAD,	/* no (valid) payload proxy */
+    PSP_COUNT_FAIL_PILOT,	/* no (valid) X509_USER_PROXY */
+    PSP_COUNT_FAIL_NOT_RFC,	/* proxy not RFC 3820 compliant */
+    PSP_COUNT_FAIL_NOT_LIMITED,	/* proxy not limited */
+    PSP_COUNT_FAIL_EXPIRED,	/* proxy not valid at this time */
+    PSP_COUNT_FAIL_ISSUER,	/* payload subject or issuer name mismatch */
+    PSP_COUNT_FAIL_FQAN,	/* FQANs not allowed */
+    PSP_COUNT_FAIL_KEY,		/* public key type or size not allowed */
+    PSP_COUNT_FAIL_CHAIN,	/* integrated chain validation failed */
+    PSP_COUNT_FAIL_SIGNATURE,	/* payload not signed by pilot */
+    PSP_COUNT_FAIL_STORE,	/* storing the credentials failed */
+    PSP_COUNT_LOG_SUPPRESSED,	/* warnings dropped by the rate limiter */
+    PSP_NCOUNTERS
+} psp_counter_t;
+
+
+/************************************************************************
+ * Function prototypes
+ ************************************************************************/
+
+/**
+ * Enables the statistics, which are appended to path by psp_stats_dump(), at
+ * psp_stats_cleanup() and, when the signal is not in use by the host, after the
+ * first request following a SIGUSR1.
+ * \return 0 on success, -1 on error
+ */
+int psp_stats_init(const char *path);
+
+/**
+ * Dumps the statistics when enabled and disables them
+ */
+void psp_stats_cleanup(void);
+
+/**
+ * Enables (or disables) keeping the durations of the stages of the current
+ * request of each thread, for psp_stats_request_time(), independent of the
+ * statistics. Only to be called during initialization.
+ */
+void psp_stats_request_times(int enable);
+
+/**
+ * Obtains the start time for psp_stats_record().
+ * \return monotonic time in nanoseconds, 0 when neither statistics nor
+ * request times are enabled
+ */
+uint64_t psp_stats_start(void);
+
+/**
+ * Records the duration since start in the histogram of stage and, when
+ * enabled, in the request times of the calling thread. Does nothing when
+ * start is 0.
+ */
+void psp_stats_record(psp_stage_t stage, uint64_t start);
+
+/**
+ * Clears the request times of the calling thread, at the start of a request
+ */
+void psp_stats_request_reset(void);
+
+/**
+ * Obtains the total duration of stage in the current request of the calling
+ * thread.
+ * \return duration in nanoseconds, 0 when not recorded or not enabled
+ */
+uint64_t psp_stats_request_time(psp_stage_t stage);
+
+/**
+ * Obtains the name of stage, as used in the statistics file
+ * \return name, NULL for an invalid stage
+ */
+const char *psp_stats_stage_name(psp_stage_t stage);
+
+/**
+ * Obtains the name of counter, as used in the statistics file
+ * \return name, NULL for an invalid counter
+ */
+const char *psp_stats_counter_name(psp_counter_t counter);
+
+/**
+ * Increases counter, when statistics are enabled
+ */
+void psp_stats_count(psp_counter_t counter);
+
+/**
+ * Dumps the statistics when requested by a SIGUSR1 since the previous call
+ */
+void psp_stats_poll(void);
+
+/**
+ * Appends the current statistics as one line of JSON to the statistics file.
+ * \return 0 on success, -1 on error or when statistics are disabled
+ */
+int psp_stats_dump(void);
+
+#endif /* LCMAPS_PILOT_SUB_PROXY_STATS_H */
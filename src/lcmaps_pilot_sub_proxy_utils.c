@@ -25,35 +25,47 @@
 /* needed for e.g. seteuid, also for usleep */
 #define _XOPEN_SOURCE	600
 
+#include "lcmaps_plugins_pilot_sub_proxy_config.h"
+
 #include <openssl/x509.h>
 #include <openssl/pem.h>
 #include <openssl/x509v3.h> /* proxy info */
+#include <openssl/sha.h>
 
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
-#include <fnmatch.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef HAVE_SYS_FSUID_H
+#   include <sys/fsuid.h>
+#endif
 
 #include <lcmaps/lcmaps_arguments.h>
 #include <lcmaps/lcmaps_cred_data.h>
+#ifdef HAVE_LCMAPS_LCMAPS_VO_DATA_H
+#   include <lcmaps/lcmaps_vo_data.h>
+#endif
 #include <lcmaps/lcmaps_log.h>
 
 #include "lcmaps_pilot_sub_proxy_utils.h"
+#include "lcmaps_pilot_sub_proxy_watch.h"
+#include "lcmaps_pilot_sub_proxy_pem.h"
+#include "lcmaps_pilot_sub_proxy_dn.h"
+#include "lcmaps_pilot_sub_proxy_stats.h"
+#include "lcmaps_pilot_sub_proxy_heap.h"
+#include "lcmaps_pilot_sub_proxy_log.h"
 
 
 /************************************************************************
  * Defines
  ************************************************************************/
 
-#define OBJ_BUF_SIZE        80	/* bufsize for OID text */
-
-#define OID_RFC_PROXY       "1.3.6.1.5.5.7.1.14"  /* OID for RFC3820 proxy */
-#define OID_LIMITED_PROXY   "1.3.6.1.4.1.3536.1.1.1.9"  /* OID limited proxy */
-
 /** Following are locking flags used by filelock() */
 #define LCK_NOLOCK  1<<0    /* no locking */
 #define LCK_FCNTL   1<<1    /* use fcntl() locking */
@@ -62,22 +74,147 @@
 #define LCK_WRITE   1<<1    /* set/unset write lock */
 #define LCK_UNLOCK  1<<2    /* unset lock */
 
+/** Maximum time in ms to wait for a writer when a proxy changes during
+ * reading, when the proxy is watched */
+#define READ_WAIT_MS	    100
+
+/** Largest proxy file that is read: proxies are a few kB, and anything
+ * larger is not a proxy */
+#define PROXY_MAX_SIZE	    (1024*1024)
+
+/** Number of pilot proxy chains kept in the per-process cache, enough for
+ * the pilots on a node in directory mode */
+#define PILOT_CACHE_SIZE    64
+
+#if PILOT_CACHE_SIZE > PSP_HEAP_SIZE
+#error "pilot cache does not fit its expiry heap"
+#endif
+
+/** Number of concurrent loads of different pilot proxies that are tracked
+ * for single-flight loading, further loads just proceed on their own */
+#define PILOT_FLIGHTS	    16
+
+/** Maximum time in s to wait for the load of a pilot proxy by another
+ * request, after which the file is read anyway */
+#define PILOT_FLIGHT_WAIT_S 5
+
+/** Number of rejected payloads kept in the reject cache */
+#define REJECT_CACHE_SIZE   128
+
+/** Seconds a rejection is remembered: long enough to absorb a client
+ * retrying the same payload, short enough not to matter otherwise */
+#define REJECT_CACHE_TTL    60
+
+/** Length of the certificate digests used as cache keys */
+#define CERT_DIGEST_LEN	    PSP_DIGEST_LEN
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Entry in the pilot proxy chain cache: the parsed chain of a proxy file
+ * together with the stat information of the file at the time it was read */
+typedef struct pilot_cache_s	{
+    char *path;			/* path of the proxy file, NULL when unused */
+    struct stat st;		/* stat of the file contents in chain */
+    int st_exact;		/* whether st identifies the contents, see
+				   psp_get_pilot_proxy() */
+    unsigned char checksum[CERT_DIGEST_LEN]; /* checksum trailer of the file,
+						with --lock-type seqlock */
+    int have_checksum;		/* whether checksum is set */
+    unsigned long watch_gen;	/* change counter of the watch when read,
+				   0 when not watched */
+    STACK_OF(X509) *chain;	/* parsed certificate chain */
+    EVP_PKEY *leaf_key;		/* public key of the leaf proxy */
+    psp_proxy_info_t leaf_info;	/* properties of the leaf proxy */
+    int have_info;		/* whether leaf_info is set */
+    unsigned char leaf_digest[CERT_DIGEST_LEN]; /* SHA-256 of leaf proxy */
+    int have_digest;		/* whether leaf_digest is set */
+    time_t chain_valid_until;	/* chain validated until, 0 when not
+				   validated */
+    unsigned long last_used;	/* value of pilot_cache_clock at last use */
+} pilot_cache_t;
+
+/** Load of a pilot proxy in progress, which other requests for the same path
+ * wait for instead of reading the file themselves. A slot is free when path
+ * is NULL and there are no waiters. */
+typedef struct pilot_flight_s	{
+    const char *path;		/* path being loaded, NULL when done */
+    int rc;			/* result of the load, when done */
+    int waiters;		/* requests waiting for the result */
+} pilot_flight_t;
+
+/** Entry in the reject cache: a recently rejected payload, identified by its
+ * fingerprint, and the X509_USER_PROXY it was rejected for, if any */
+typedef struct reject_cache_s	{
+    unsigned char fingerprint[CERT_DIGEST_LEN];
+    psp_counter_t reason;	/* failure counter of the rejection */
+    char *pilot_path;		/* file of the pilot the rejection depends on,
+				   NULL when it does not */
+    struct stat pilot_st;	/* stat of pilot_path when rejected */
+    time_t expiry;		/* end of the entry, 0 when unused */
+    unsigned long last_used;	/* value of reject_cache_clock at last use */
+} reject_cache_t;
+
 /************************************************************************
  * Global variables
  ************************************************************************/
 
-static int payload_chain_needs_cleaning=0;
+/** Cache of parsed pilot proxy chains, owns the chains */
+static pilot_cache_t pilot_cache[PILOT_CACHE_SIZE];
+
+/** Protects pilot_cache and pilot_cache_clock */
+static pthread_mutex_t pilot_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+/** Counter used for finding the least recently used pilot cache entry */
+static unsigned long pilot_cache_clock=0;
+
+/** End of validity of the leaf of the pilot cache entries, protected by
+ * pilot_cache_mutex */
+static psp_heap_t pilot_cache_expiry;
+
+/** Pilot proxy loads in progress, protected by pilot_cache_mutex */
+static pilot_flight_t pilot_flights[PILOT_FLIGHTS];
+
+/** Signals that a flight in pilot_flights is done */
+static pthread_cond_t pilot_flight_cond=PTHREAD_COND_INITIALIZER;
+
+/** Cache of signature verification results */
+static psp_verdict_cache_t verdict_cache;
+
+/** Protects verdict_cache */
+static pthread_mutex_t verdict_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+/** Cache of recently rejected payloads */
+static reject_cache_t reject_cache[REJECT_CACHE_SIZE];
+
+/** Protects reject_cache and reject_cache_clock */
+static pthread_mutex_t reject_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+/** Counter used for finding the least recently used reject cache entry */
+static unsigned long reject_cache_clock=0;
 
 
 /************************************************************************
  * Static prototypes
  ************************************************************************/
 
-/* Convert PEM string to stack of X509 certificates. Stack needs to be cleaned
- * up afterwards.
+/* Convert PEM string to stack of X509 certificates, skipping other PEM blocks
+ * such as private keys. Stack needs to be cleaned up afterwards.
  * \return 0 on success or -1 on error */
 static int pem_string_to_x509_chain(STACK_OF(X509) **certstack, char *certstring);
 
+/* Release functions for objects owned by the request arena */
+static void release_chain(void *chain);
+static void release_pkey(void *pkey);
+
+#if defined(HAVE_SYS_FSUID_H) && defined(HAVE_SETFSUID)
+/* Sets the filesystem uid and gid of the calling thread, without changing
+ * the credentials of the process.
+ * \return 0 on success, -1 when the ids could not be set */
+static int set_fsids(uid_t fsuid, gid_t fsgid);
+#else
 /* Drops privilege to an unprivileged account. Can be raised using \see
  * raise_priv
  * \return 0 when successful, or the return code of set[ug]id() on error. */
@@ -88,12 +225,119 @@ static int priv_drop(uid_t unpriv_uid,gid_t unpriv_gid);
  * \return -1 when fails or impossible (neither euid or real uid is root), 0
  * upon success. */
 static int raise_priv(uid_t euid, gid_t egid);
+#endif
 
 /* Reads proxy from *path . It tries to drop privilege to real-uid/real-gid when
- * euid==0 and uid!=0. Space needed will be malloc-ed.
- * Upon successful completion proxy contains the contents of path.
- * \return 0 on success or value < 0 indicating the type of error. */
-static int read_proxy(const char *path, int lock_type, char **proxy);
+ * euid==0 and uid!=0. Space needed will be allocated from arena. When
+ * cached_st is non-NULL and the file still matches it, and also ends with
+ * checksum trailer cached_sum when that is non-NULL, nothing is read. When
+ * the file changes during reading and watch_id is a valid watch, it waits for
+ * the writer to finish.
+ * Upon successful completion proxy contains the contents of path and st its
+ * stat information.
+ * \return 0 on success, 1 when the file is unchanged w.r.t. cached_st or value
+ * < 0 indicating the type of error. */
+static int read_proxy(psp_arena_t *arena, const char *path, int lock_type,
+		      int watch_id, const struct stat *cached_st,
+		      const unsigned char *cached_sum, char **proxy,
+		      struct stat *st);
+
+/* Maps the proxy at path into memory and converts it into certstack, with
+ * the same checks as read_proxy(). When checksum is non-NULL, it is set to
+ * the checksum trailer of the file, with *checksum_rc as for
+ * psp_pem_checksum_verify().
+ * \return 0 on success, 1 when the file is unchanged w.r.t. cached_st or value
+ * < 0 indicating the type of error. */
+static int map_proxy(const char *path, int lock_type, int watch_id,
+		     const struct stat *cached_st,
+		     const unsigned char *cached_sum,
+		     STACK_OF(X509) **certstack, struct stat *st,
+		     unsigned char *checksum, int *checksum_rc);
+
+/* Checks whether the opened file fd with stat st ends with the checksum
+ * trailer sum, reading only the trailer.
+ * \return 1 when it does, 0 otherwise */
+static int same_checksum(int fd, const struct stat *st,
+			 const unsigned char *sum);
+
+/* Opens the proxy at path as real uid, locks it using lock_type and checks its
+ * ownership, permissions and size, leaving its stat information in st.
+ * \return 0 on success, value < 0 indicating the type of error */
+static int open_proxy(const char *path, int lock_type, int *fd,
+		      struct stat *st);
+
+/* Makes the request use the chain of given pilot cache entry, taking new
+ * references owned by the request. Needs pilot_cache_mutex.
+ * \return 0 on success, -1 on error */
+static int pilot_cache_use(pilot_cache_t *entry, psp_request_t *req);
+
+/* Reads and parses the pilot proxy for psp_get_pilot_proxy(), without
+ * holding pilot_cache_mutex, and stores it in the cache and the request.
+ * With seqlock set its checksum trailer is checked and kept.
+ * \return 0 on success, -1 on error */
+static int load_pilot_proxy(psp_request_t *req,
+			    int lock_flags, int seqlock,
+			    read_method_t read_method,
+			    int watch_id, unsigned long watch_gen,
+			    const struct stat *cached_st,
+			    const unsigned char *cached_sum);
+
+/* Looks up the flight loading path. Needs pilot_cache_mutex.
+ * \return flight or NULL when path is not being loaded */
+static pilot_flight_t *pilot_flight_find(const char *path);
+
+/* Claims a flight for loading path. Needs pilot_cache_mutex.
+ * \return flight or NULL when all are in use */
+static pilot_flight_t *pilot_flight_claim(const char *path);
+
+/* Waits for flight, loading path, to finish, and then makes the request use
+ * its result. Needs pilot_cache_mutex.
+ * \return 0 on success, -1 on error, 1 when the caller should read the file
+ * itself */
+static int pilot_flight_wait(pilot_flight_t *flight, const char *path,
+			     psp_request_t *req);
+
+/* Marks flight as done with result rc and wakes up its waiters. Needs
+ * pilot_cache_mutex. */
+static void pilot_flight_finish(pilot_flight_t *flight, int rc);
+
+/* Stores the FQANs as parsed LCMAPS_VO_CRED credential data, using scratch
+ * memory from arena.
+ * \return 0 on success, -1 on error */
+static int store_vo_data(psp_arena_t *arena, int nfqans, char **fqans);
+
+/* Looks up a valid reject cache entry for given fingerprint. Needs
+ * reject_cache_mutex.
+ * \return reject cache entry or NULL when not found */
+static reject_cache_t *reject_cache_find(const unsigned char *fingerprint,
+					 time_t now);
+
+/* Checks whether stat information st1 refers to the same unmodified file as
+ * st2.
+ * \return 1 when it does, 0 otherwise */
+static int same_file(const struct stat *st1, const struct stat *st2);
+
+/* Looks up the pilot cache entry for given path.
+ * \return cache entry or NULL when not found */
+static pilot_cache_t *pilot_cache_find(const char *path);
+
+/* Drops the pilot cache entries whose leaf expired at now. Needs
+ * pilot_cache_mutex. */
+static void pilot_cache_expire(time_t now);
+
+/* Frees what a pilot cache entry holds, after which it is unused. Needs
+ * pilot_cache_mutex. */
+static void pilot_cache_clear(pilot_cache_t *entry);
+
+/* Stores chain in the pilot cache for given path, stat, whether that stat
+ * identifies the contents, checksum trailer (or NULL) and watch change
+ * counter, replacing an existing entry for path or the least recently used
+ * one. The cache takes ownership of chain, also on error. Needs
+ * pilot_cache_mutex.
+ * \return the cache entry, or NULL on error */
+static pilot_cache_t *pilot_cache_store(const char *path, const struct stat *st,
+			     int st_exact, const unsigned char *checksum,
+			     unsigned long watch_gen, STACK_OF(X509) *chain);
 
 
 /************************************************************************
@@ -101,21 +345,93 @@ static int read_proxy(const char *path, int lock_type, char **proxy);
  ************************************************************************/
 
 /**
- * Retrieves the X509_USER_PROXY certificate stack.
+ * Initializes an empty request context
+ */
+void psp_request_init(psp_request_t *req)   {
+    psp_arena_init(&(req->arena));
+    req->pilot_path=NULL;
+    req->log_pilot=NULL;
+    req->payload_pem=NULL;
+    req->have_payload_fingerprint=0;
+    req->payload_chain=NULL;
+    req->pilot_chain=NULL;
+    req->payload_cert=NULL;
+    req->pilot_cert=NULL;
+    req->pilot_key=NULL;
+    req->have_payload_info=0;
+    req->have_payload_digest=0;
+    req->have_pilot_info=0;
+    req->have_pilot_digest=0;
+    req->pilot_chain_valid_until=0;
+    req->pilot_st_exact=0;
+    req->have_pilot_st=0;
+    req->payload_dn=NULL;
+    req->nfqans=-1;
+    req->fqans=NULL;
+    req->fqan_result.allowed=-1;
+    req->fqan_result.allow_pattern=NULL;
+    req->fqan_result.denied=-1;
+    req->fqan_result.deny_pattern=NULL;
+}
+
+/**
+ * Releases everything owned by the request context, after which it can be
+ * reused as if just initialized.
+ */
+void psp_request_cleanup(psp_request_t *req)	{
+    psp_arena_reset(&(req->arena));
+    psp_request_init(req);
+}
+
+/**
+ * Retrieves the certificate stack of the pilot proxy in req->pilot_path, set
+ * to the X509_USER_PROXY when NULL, into req->pilot_chain, and its leaf into
+ * req->pilot_cert, together with the cached public key, digest and
+ * properties of the leaf. The request holds its own references, such that
+ * the cache can be updated concurrently.
+ * When use_payload_chain is set and req->payload_chain consists of one
+ * certificate followed by the cached chain for X509_USER_PROXY, the cached
+ * chain is used without reading the file, provided the file still passes
+ * the ownership and mode checks and its stat still identifies the cached
+ * contents. read_method specifies how the
+ * file is read, any temporary buffers are allocated from the request arena.
+ * The stat of the file only identifies the contents when it was not changed
+ * within the second it was read (see req->pilot_st_exact), as inodes can be
+ * reused. With LOCK_SEQLOCK the file is not locked, as writers only replace
+ * it, and when it ends with a checksum trailer (see PSP_PEM_CHECKSUM_TAG),
+ * the read contents must match it, and a file with the same stat and
+ * trailer is taken to be unchanged even when its stat alone does not tell.
+ * Concurrent requests needing to read the same file wait for the first one
+ * to do so (single-flight), except when the cache has a previous chain for
+ * it that has not expired yet, which they use meanwhile.
  * \return 0 on success, -1 on error.
  */
-int psp_get_pilot_proxy(STACK_OF(X509) **certstack, lock_type_t lock_type)  {
-    char *proxy=getenv("X509_USER_PROXY");
-    char *pem_buf=NULL;
+int psp_get_pilot_proxy(psp_request_t *req, lock_type_t lock_type,
+			read_method_t read_method, int use_payload_chain)  {
+    const char *proxy;
+    pilot_cache_t *entry;
+    pilot_flight_t *flight;
+    struct stat cached_st;
+    int have_cached_st=0;
+    unsigned char cached_sum[CERT_DIGEST_LEN];
+    int have_cached_sum=0;
     int rc;
     int lock_flags;
-
-    /* Check we have a valid env var */
-    if ( proxy==NULL ) {
+    int watch_id;
+    unsigned long watch_gen;
+    struct stat watch_st;
+    int have_watch_st=0;
+    struct stat payload_st;
+    int have_payload_st=0;
+
+    /* Check we have a valid env var, unless the file is given */
+    if ( req->pilot_path==NULL &&
+	 (req->pilot_path=getenv("X509_USER_PROXY"))==NULL ) {
 	lcmaps_log(LOG_WARNING,
 		"%s: environment variable X509_USER_PROXY unset\n", __func__);
 	return -1;
     }
+    proxy=req->pilot_path;
 
     /* Get internal lock flags based on specified lock type */
     switch (lock_type) {
@@ -125,311 +441,1395 @@ int psp_get_pilot_proxy(STACK_OF(X509) **certstack, lock_type_t lock_type)  {
 	    lock_flags=LCK_FCNTL; break;
 	case LOCK_FLOCK:
 	    lock_flags=LCK_FLOCK; break;
+	case LOCK_SEQLOCK:
+	    lock_flags=LCK_NOLOCK; break;
 	default:
 	    lcmaps_log(LOG_ERR, "%s: unknown lock_type %d\n",
 		    __func__, lock_type);
 	    return -1;
     }
 
-    /* Read in proxy */
-    if (read_proxy(proxy, lock_flags, &pem_buf))
-	return -1;
+    /* When the file is watched for changes, get its current change counter
+     * before reading: a change during the reading will invalidate it */
+    watch_id=psp_watch_add(proxy);
+    watch_gen=psp_watch_generation(watch_id);
+    /* The watch only covers the directory of the file, not a rename of one
+     * of its ancestors or a change behind a symlinked directory, so a cheap
+     * stat of the path must still match */
+    if (watch_gen!=0)
+	have_watch_st=(stat(proxy, &watch_st)==0);
+    /* Using the cached chain for a payload built on it skips reading and
+     * parsing, but not checking the file: it must still be the same one and
+     * still be safe */
+    if (use_payload_chain && req->payload_chain)
+	have_payload_st=(psp_stat_pilot_proxy(proxy, &payload_st)==0);
+
+    pthread_mutex_lock(&pilot_cache_mutex);
+    pilot_cache_expire(time(NULL));
+    if ( (entry=pilot_cache_find(proxy)) )   {
+	if (watch_gen!=0 && entry->watch_gen==watch_gen && have_watch_st &&
+	    same_file(&watch_st, &(entry->st)))	{
+	    psp_log(LOG_DEBUG,
+		    "%s: using cached chain for unmodified proxy %s\n",
+		    __func__, proxy);
+	    rc=pilot_cache_use(entry, req);
+	    pthread_mutex_unlock(&pilot_cache_mutex);
+	    psp_stats_count(PSP_COUNT_PILOT_CACHE_HIT);
+	    return rc;
+	}
 
-    /* Convert PEM buffer to certificate chain */
-    rc= pem_string_to_x509_chain(certstack, pem_buf);
-    free(pem_buf);
+	/* Use cached chain when the payload chain was built on top of it */
+	if (have_payload_st && entry->st_exact &&
+	    same_file(&payload_st, &(entry->st)) &&
+	    psp_core_chain_is_suffix(entry->chain, req->payload_chain))
+	{
+	    psp_log(LOG_DEBUG,
+		    "%s: payload chain extends cached chain for %s\n",
+		    __func__, proxy);
+	    rc=pilot_cache_use(entry, req);
+	    pthread_mutex_unlock(&pilot_cache_mutex);
+	    psp_stats_count(PSP_COUNT_PILOT_CACHE_HIT);
+	    return rc;
+	}
 
-    if (rc!=0)   {
-	lcmaps_log(LOG_WARNING,
-                    "%s: cannot convert pemstring to chain.\n", __func__);
-	return -1;
+	/* When the stat does not identify the contents, read the file again,
+	 * unless its checksum trailer does */
+	if (entry->st_exact)  {
+	    cached_st=entry->st;
+	    have_cached_st=1;
+	} else if (lock_type==LOCK_SEQLOCK && entry->have_checksum)   {
+	    cached_st=entry->st;
+	    have_cached_st=1;
+	    memcpy(cached_sum, entry->checksum, CERT_DIGEST_LEN);
+	    have_cached_sum=1;
+	}
     }
 
+    /* Only one request reads the file, the others use the previous chain
+     * until it expires, or wait for the result */
+    if ( (flight=pilot_flight_find(proxy)) )	{
+	if (entry && X509_cmp_time(X509_get0_notAfter(
+				sk_X509_value(entry->chain, 0)), NULL)>0) {
+	    psp_log(LOG_DEBUG,
+		    "%s: using previous chain for %s while it is reloaded\n",
+		    __func__, proxy);
+	    rc=pilot_cache_use(entry, req);
+	    pthread_mutex_unlock(&pilot_cache_mutex);
+	    psp_stats_count(PSP_COUNT_PILOT_CACHE_STALE);
+	    return rc;
+	}
+	psp_stats_count(PSP_COUNT_PILOT_LOAD_WAIT);
+	if ( (rc=pilot_flight_wait(flight, proxy, req))!=1 ) {
+	    pthread_mutex_unlock(&pilot_cache_mutex);
+	    return rc;
+	}
+	/* Read it ourselves, the entry might be gone by now */
+	flight=NULL;
+	have_cached_st=0;
+	have_cached_sum=0;
+    } else
+	flight=pilot_flight_claim(proxy);
+    pthread_mutex_unlock(&pilot_cache_mutex);
+
+    rc=load_pilot_proxy(req, lock_flags, lock_type==LOCK_SEQLOCK, read_method,
+			watch_id, watch_gen,
+			have_cached_st ? &cached_st : NULL,
+			have_cached_sum ? cached_sum : NULL);
+
+    if (flight)	{
+	pthread_mutex_lock(&pilot_cache_mutex);
+	pilot_flight_finish(flight, rc);
+	pthread_mutex_unlock(&pilot_cache_mutex);
+    }
+
+    return rc;
+}
+
+/**
+ * Opens the pilot proxy file at path like it is done for reading it, i.e. as
+ * the real uid and requiring it to be owned by the real uid and inaccessible
+ * for anyone else, and obtains its stat information into st without reading
+ * it.
+ * \return 0 on success, -1 on error
+ */
+int psp_stat_pilot_proxy(const char *path, struct stat *st)	{
+    int fd;
+
+    if (open_proxy(path, LOCK_NOLOCK, &fd, st))
+	return -1;
+    close(fd);
+
     return 0;
 }
 
 /**
- * Gets payload PEM or cert chain from LCMAPS framework
+ * Gets the payload cert chain, or otherwise the PEM string, from the LCMAPS
+ * framework into req->payload_chain or req->payload_pem, without converting
+ * the PEM string, and sets req->payload_fingerprint for
+ * psp_reject_cache_lookup() and psp_shm_lookup(): the SHA-256 digest of the
+ * PEM string, or of the digests of all certs of the chain, such that it
+ * covers the whole chain. For a chain, the digest of its leaf is also set as
+ * req->payload_digest.
  * \return 0 on success, -1 on error
  */
-int psp_get_payload_proxy(STACK_OF(X509) **certstack,
-		      int argc, lcmaps_argument_t *argv)	{
+int psp_get_payload_input(psp_request_t *req, int argc,
+			  lcmaps_argument_t *argv)	{
     void *value;
-    STACK_OF(X509)*chain=NULL;
-    char *pem=NULL;
+    STACK_OF(X509) *chain;
+    X509 *leaf;
+    unsigned int len;
 
     /* Try to get chain from LCMAPS */
     value=lcmaps_getArgValue("px509_chain", "STACK_OF(X509) *", argc, argv);
-    if (value == NULL || (chain = *(STACK_OF(X509) **)value) == NULL ) {
-        /* No valid chain found in LCMAPS framework, try to obtain from PEM
-         * string */
-        lcmaps_log(LOG_DEBUG, "%s: no X.509 chain is set, trying pem string.\n",
-                __func__);
-        value=lcmaps_getArgValue("pem_string", "char *", argc, argv);
-        if (value==NULL || (pem=*(char**)value) == NULL ) {
-            /* also not found: fatal error */
-            lcmaps_log(LOG_WARNING,
-                    "%s: no chain or pemstring is set.\n", __func__);
-            return -1;
-        }
+    if (value != NULL && (chain = *(STACK_OF(X509) **)value) != NULL ) {
+	/* The digest of the leaf is needed anyway for the verdict cache */
+	if ( (leaf=sk_X509_value(chain, 0))==NULL ||
+	     !X509_digest(leaf, EVP_sha256(), req->payload_digest, &len) ||
+	     len!=CERT_DIGEST_LEN )	{
+	    psp_log_warning_path(req->log_pilot,
+		    "%s: cannot get digest of payload proxy\n", __func__);
+	    return -1;
+	}
+	req->have_payload_digest=1;
+	/* The rest of the chain matters as well, e.g. for integrated mode */
+	if (psp_core_chain_fingerprint(chain, req->payload_digest,
+					 req->payload_fingerprint))	{
+	    psp_log_warning_path(req->log_pilot,
+		    "%s: cannot get digest of payload chain\n", __func__);
+	    return -1;
+	}
+	req->have_payload_fingerprint=1;
+	req->payload_chain=chain;
+	return 0;
+    }
+
+    /* No valid chain found in LCMAPS framework, try to obtain from PEM
+     * string */
+    psp_log(LOG_DEBUG, "%s: no X.509 chain is set, trying pem string.\n",
+	    __func__);
+    value=lcmaps_getArgValue("pem_string", "char *", argc, argv);
+    if (value==NULL || (req->payload_pem=*(char**)value) == NULL ) {
+	/* also not found: fatal error */
+	psp_log_warning_path(req->log_pilot,
+		"%s: no chain or pemstring is set.\n", __func__);
+	return -1;
+    }
+
+    /* Digesting the string is much cheaper than converting it */
+    SHA256((const unsigned char *)req->payload_pem, strlen(req->payload_pem),
+	   req->payload_fingerprint);
+    req->have_payload_fingerprint=1;
+
+    return 0;
+}
+
+/**
+ * Sets req->payload_chain and req->payload_cert, converting the PEM string
+ * obtained by psp_get_payload_input() when there is no chain. A chain
+ * converted from the PEM string is owned by the request, one from the
+ * framework by the framework.
+ * \return 0 on success, -1 on error
+ */
+int psp_get_payload_proxy(psp_request_t *req)	{
+    STACK_OF(X509) *chain=NULL;
+
+    if (req->payload_chain==NULL)	{
+	if (req->payload_pem==NULL)	{
+	    psp_log_warning_path(req->log_pilot,
+		    "%s: no chain or pemstring is set.\n", __func__);
+	    return -1;
+	}
 
         /* Convert pem string to chain */
-        if (pem_string_to_x509_chain(&chain, pem)!=0)   {
-            lcmaps_log(LOG_WARNING,
-                    "%s: cannot convert pemstring to chain.\n", __func__);
-            return -1;
-        }
-	/* Set global variable to keep track of whether we need to clean */
-	payload_chain_needs_cleaning=1;
+	if (pem_string_to_x509_chain(&chain, req->payload_pem)!=0)   {
+	    psp_log_warning_path(req->log_pilot,
+		    "%s: cannot convert pemstring to chain.\n", __func__);
+	    return -1;
+	}
+	/* We own the converted chain */
+	if (psp_arena_own(&(req->arena), release_chain, chain))	{
+	    lcmaps_log(LOG_ERR, "%s: out of memory\n", __func__);
+	    return -1;
+	}
+	req->payload_chain=chain;
+    }
+
+    if ( (req->payload_cert=sk_X509_value(req->payload_chain, 0))==NULL )	{
+	psp_log_warning_path(req->log_pilot,
+		"%s: cannot get leaf proxy cert from chain\n", __func__);
+	return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Obtains the FQANs from the plugin arguments
+ * \return 0 on success, -1 on error
+ */
+int psp_get_fqans(int *nfqans, char ***fqans, int argc, lcmaps_argument_t *argv)
+{
+    void *value;
+
+    /* We could try to obtain this information from the voms_data_list argument
+     * instead, but we only need the FQANs in any case */
+    if ( (value = lcmaps_getArgValue("nfqan", "int", argc, argv) ) )    {
+	*nfqans = *(int *)value;
+	psp_log(LOG_DEBUG, "%s: found nfqan: %d\n", __func__, *nfqans);
+	if (*nfqans>0)   {
+	    psp_log(LOG_DEBUG,
+		    "%s: the list of FQANs should contain %d elements\n",
+		    __func__, *nfqans);
+	    if ( (value = lcmaps_getArgValue("fqan_list", "char **",
+					     argc, argv)) ) {
+		*fqans = *(char ***)value;
+		psp_log(LOG_DEBUG, "%s: found list of FQANs\n", __func__);
+	    }
+	} else {
+	    psp_log(LOG_INFO,
+		    "%s: No VOMS FQANs present in the proxy chain\n", __func__);
+	}
+    } else {
+	/* Do not fail over to using the FQANs directly from the framework. */
+	psp_log(LOG_INFO,
+            "%s: No VOMS AC(s) found by the framework in the proxy chain.\n",
+            __func__);
+    }
+
+    return 0;
+}
+
+/**
+ * Verifies that req->payload_cert is signed by req->pilot_cert. Results are
+ * cached based on the SHA-256 digests of both certificates until the first of
+ * them expires. A public key that is not cached is owned by the request.
+ * For valid proxies, the one-line DN of the payload is cached along with the
+ * result and set in req->payload_dn.
+ * \return 0 on success, -1 on error
+ */
+int psp_verify_proxy_signature(psp_request_t *req)  {
+    X509 *payload=req->payload_cert, *pilot=req->pilot_cert;
+    EVP_PKEY *pilot_key=req->pilot_key;
+    const unsigned char *pilot_digest=NULL;
+    unsigned int len;
+    psp_verdict_t *verdict;
+    time_t now, payload_expiry, pilot_expiry;
+    int result, rc=-1, found=0;
+
+    if (pilot==NULL || payload==NULL)	{
+	psp_log_warning(req->payload_cert,
+		"%s: pilot or payload proxy is unset.\n",
+		__func__);
+	return -1;
+    }
+
+    /* Get digest of the pilot, from the cache when possible */
+    if (req->have_pilot_digest ||
+	X509_digest(pilot, EVP_sha256(), req->pilot_digest, &len)==1)	{
+	pilot_digest=req->pilot_digest;
+	req->have_pilot_digest=1;
+    }
+
+    /* Check for a cached verdict */
+    now=time(NULL);
+    if (pilot_digest && !req->have_payload_digest &&
+	X509_digest(payload, EVP_sha256(), req->payload_digest, &len)==1)
+	req->have_payload_digest=1;
+    if (pilot_digest && req->have_payload_digest)	{
+	pthread_mutex_lock(&verdict_cache_mutex);
+	if ( (verdict=psp_verdict_cache_find(&verdict_cache,
+					     req->payload_digest, pilot_digest,
+					     now)) )
+	{
+	    rc=verdict->verdict;
+	    /* Copying the cached DN is cheaper than formatting it */
+	    if (verdict->payload_dn)
+		req->payload_dn=psp_arena_strdup(&(req->arena),
+						 verdict->payload_dn);
+	    found=1;
+	}
+	pthread_mutex_unlock(&verdict_cache_mutex);
+	if (found)  {
+	    psp_stats_count(PSP_COUNT_VERDICT_CACHE_HIT);
+	    psp_log(LOG_DEBUG, "%s: using cached verification result\n",
+		    __func__);
+	    goto finalize;
+	}
+    } else
+	pilot_digest=NULL; /* can't use the cache */
+
+    /* Get public key from pilot cert */
+    if ( pilot_key==NULL )  {
+	if ( (pilot_key = X509_get_pubkey(pilot)) ==NULL ) {
+	    psp_log_warning(req->payload_cert,
+		    "%s: cannot get public key from pilot cert\n", __func__);
+	    return -1;
+	}
+	if (psp_arena_own(&(req->arena), release_pkey, pilot_key))    {
+	    lcmaps_log(LOG_ERR, "%s: out of memory\n", __func__);
+	    return -1;
+	}
+    }
+
+    /* Check that payload_cert is signed by the pilot */
+    psp_stats_count(PSP_COUNT_VERDICT_CACHE_MISS);
+    result = X509_verify(payload, pilot_key);
+    rc = (result==1 ? 0 : -1);
+
+    /* Cache the result, with the DN when valid, until the first of the two
+     * certs expires */
+    if (rc==0 && req->payload_dn==NULL)
+	psp_dn_format(&(req->arena), X509_get_subject_name(payload),
+		      &(req->payload_dn), NULL);
+    if (pilot_digest &&
+	psp_core_asn1_time(X509_get_notAfter(payload), &payload_expiry)==0 &&
+	psp_core_asn1_time(X509_get_notAfter(pilot), &pilot_expiry)==0)
+    {
+	pthread_mutex_lock(&verdict_cache_mutex);
+	psp_verdict_cache_store(&verdict_cache, req->payload_digest,
+		pilot_digest, rc,
+		req->payload_dn,
+		payload_expiry < pilot_expiry ? payload_expiry : pilot_expiry,
+		now);
+	pthread_mutex_unlock(&verdict_cache_mutex);
+    }
+
+finalize:
+    if (rc!=0)  {
+	psp_log_warning(req->payload_cert,
+		"%s: payload cert is not signed by pilot cert\n",
+		__func__);
+	return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Checks that the public key of cert is of one of the allowed_types
+ * (bitmask of PSP_KEY_*) and, for RSA, has at least min_rsa_bits bits. what
+ * names the certificate in the log message on failure.
+ * \return 0 when the key is allowed, -1 when not
+ */
+int psp_check_key_policy(X509 *cert, const char *what,
+			 unsigned int allowed_types, int min_rsa_bits)	{
+    EVP_PKEY *key=X509_get0_pubkey(cert);
+
+    switch (psp_core_check_key(cert, allowed_types, min_rsa_bits))  {
+	case 0:
+	    return 0;
+	case -1:
+	    lcmaps_log(LOG_WARNING, "%s: cannot get public key from %s cert\n",
+		    __func__, what);
+	    break;
+	case -2:
+	    lcmaps_log(LOG_WARNING,
+		    "%s: %s cert has a public key of disallowed type %s\n",
+		    __func__, what, OBJ_nid2sn(EVP_PKEY_base_id(key)));
+	    break;
+	default:
+	    lcmaps_log(LOG_WARNING,
+		    "%s: %s cert has a %d bits RSA key, at least %d are needed\n",
+		    __func__, what, EVP_PKEY_bits(key), min_rsa_bits);
+	    break;
+    }
+
+    return -1;
+}
+
+/**
+ * Checks that the subject of req->payload_cert is its issuer plus a CN in a
+ * new RDN, as for every proxy. Only compares the names, hence it is cheap
+ * enough to be done before anything else about the payload.
+ * \return 0 on success, -1 on error
+ */
+int psp_check_payload_subject(psp_request_t *req)	{
+    switch (psp_core_check_subject(req->payload_cert))	{
+	case 0:
+	    return 0;
+	case -1:
+	    psp_log_warning(req->payload_cert,
+		    "%s: payload proxy subject does not end with a CN\n",
+		    __func__);
+	    break;
+	case -2:
+	    psp_log_warning(req->payload_cert,
+		    "%s: payload proxy subject does not extend its issuer\n",
+		    __func__);
+	    break;
+	default:
+	    lcmaps_log(LOG_ERR, "%s: out of memory\n", __func__);
+	    break;
+    }
+
+    return -1;
+}
+
+/**
+ * Checks that the issuer of req->payload_cert is the subject of
+ * req->pilot_cert, such that a payload issued by another proxy is rejected
+ * without verifying its signature.
+ * \return 0 on success, -1 on error
+ */
+int psp_check_payload_issuer(psp_request_t *req)	{
+    if (X509_NAME_cmp(X509_get_issuer_name(req->payload_cert),
+		      X509_get_subject_name(req->pilot_cert))!=0)	{
+	psp_log_warning(req->payload_cert,
+		"%s: payload proxy is not issued by the pilot subject\n",
+		__func__);
+	return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Checks that req->payload_chain consists of exactly one new proxy followed
+ * by req->pilot_chain, by comparing the certificates, and that the new proxy
+ * is a valid delegation of the pilot: currently valid, with a subject
+ * extending that of the pilot by one CN, and allowed by the proxy path length
+ * constraints in the pilot chain. Its signature is checked separately by
+ * psp_verify_proxy_signature().
+ * \return 0 on success, -1 on error
+ */
+int psp_verify_payload_link(psp_request_t *req)	{
+    X509 *payload=req->payload_cert, *pilot=req->pilot_cert;
+
+    if (pilot==NULL || payload==NULL)	{
+	psp_log_warning(req->payload_cert,
+		"%s: pilot or payload proxy is unset.\n",
+		__func__);
+	return -1;
+    }
+
+    /* Comparing the certificates only compares their cached digests and
+     * encodings, instead of verifying the whole payload chain */
+    if (!psp_core_chain_is_suffix(req->pilot_chain, req->payload_chain))	{
+	psp_log_warning(req->payload_cert,
+		"%s: payload chain is not the pilot chain plus one proxy\n",
+		__func__);
+	return -1;
+    }
+
+    /* The new proxy itself */
+    if (X509_cmp_current_time(X509_get0_notBefore(payload))>=0 ||
+	X509_cmp_current_time(X509_get0_notAfter(payload))<=0)	{
+	psp_log_warning(req->payload_cert,
+		"%s: payload proxy is not valid at this time\n", __func__);
+	return -1;
+    }
+    if (X509_check_issued(pilot, payload)!=X509_V_OK)	{
+	psp_log_warning(req->payload_cert,
+		"%s: payload proxy is not issued by pilot proxy\n", __func__);
+	return -1;
+    }
+
+    /* Subject of the payload is that of the pilot plus a CN in a new RDN */
+    if (psp_check_payload_subject(req) || psp_check_payload_issuer(req))
+	return -1;
+
+    /* The proxies in the pilot chain must allow one more proxy below them */
+    if (!psp_core_chain_allows_proxy(req->pilot_chain))	{
+	psp_log_warning(req->payload_cert,
+		"%s: proxy path length of pilot chain is exceeded\n",
+		__func__);
+	return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Validates req->pilot_chain against the CAs in store, allowing proxy
+ * certificates. Successful results are cached with the pilot chain until the
+ * first certificate in the validated chain expires, or earlier as the CRLs
+ * need to be read again (see psp_core_verify_chain()).
+ * \return 0 on success, -1 on error
+ */
+int psp_verify_pilot_chain(psp_request_t *req, X509_STORE *store)   {
+    time_t now=time(NULL), valid_until=0;
+    int i, error;
+
+    if (req->pilot_chain==NULL || req->pilot_cert==NULL)    {
+	lcmaps_log(LOG_WARNING, "%s: pilot proxy is unset.\n", __func__);
+	return -1;
+    }
+
+    /* Use the cached result while still valid */
+    if (req->pilot_chain_valid_until > now) {
+	psp_log(LOG_DEBUG, "%s: using cached pilot chain validation\n",
+		__func__);
+	return 0;
+    }
+
+    switch (psp_core_verify_chain(store, req->pilot_cert, req->pilot_chain,
+				  &valid_until, &error))	{
+	case 0:
+	    break;
+	case -1:
+	    lcmaps_log(LOG_WARNING, "%s: pilot proxy chain is not valid: %s\n",
+		    __func__, X509_verify_cert_error_string(error));
+	    return -1;
+	default:
+	    lcmaps_log(LOG_ERR, "%s: out of memory\n", __func__);
+	    return -1;
+    }
+
+    /* The result is valid until the first certificate expires or CRLs are
+     * to be read again (see psp_core_verify_chain()) */
+    req->pilot_chain_valid_until=valid_until;
+
+    /* Cache the result with the pilot chain, when it is still cached */
+    if (req->have_pilot_digest)	{
+	pthread_mutex_lock(&pilot_cache_mutex);
+	for (i=0; i<PILOT_CACHE_SIZE; i++)  {
+	    if (pilot_cache[i].path && pilot_cache[i].have_digest &&
+		memcmp(pilot_cache[i].leaf_digest, req->pilot_digest,
+		       CERT_DIGEST_LEN)==0)
+		pilot_cache[i].chain_valid_until=valid_until;
+	}
+	pthread_mutex_unlock(&pilot_cache_mutex);
+    }
+
+    return 0;
+}
+
+/**
+ * Creates a certificate store for psp_verify_pilot_chain() for the CA
+ * certificates and CRLs in the hashed directory certdir.
+ * \return new store or NULL on error
+ */
+X509_STORE *psp_cert_store_new(const char *certdir)	{
+    X509_STORE *store;
+    struct stat st;
+
+    if (stat(certdir, &st)!=0 || !S_ISDIR(st.st_mode))	{
+	lcmaps_log(LOG_ERR, "%s: %s is not a directory\n", __func__, certdir);
+	return NULL;
+    }
+
+    if ( (store=psp_core_cert_store_new(certdir))==NULL )
+	lcmaps_log(LOG_ERR, "%s: cannot use CA directory %s\n",
+		__func__, certdir);
+
+    return store;
+}
+
+/**
+ * Sets up the OpenSSL state that is otherwise initialized lazily by the first
+ * request: error strings, digest implementations, the ASN.1 method of the
+ * proxyCertInfo extension and the tables used for subject names. Needs
+ * psp_oid_init().
+ * \return 0 on success, -1 on error
+ */
+int psp_warmup(void)	{
+    static const unsigned char data[1]={0};
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned char *der=NULL;
+    const unsigned char *p;
+    PROXY_CERT_INFO_EXTENSION *pci=NULL, *decoded=NULL;
+    X509_NAME *name=NULL;
+    const ASN1_OBJECT *rfc_proxy_obj=psp_oid_rfc_proxy();
+    int len, rc=-1;
+
+    if (rfc_proxy_obj==NULL)	{
+	lcmaps_log(LOG_ERR, "%s: proxy OIDs are not initialized\n", __func__);
+	return -1;
+    }
+
+    /* Error strings and digests */
+    if (OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CRYPTO_STRINGS |
+			    OPENSSL_INIT_ADD_ALL_CIPHERS |
+			    OPENSSL_INIT_ADD_ALL_DIGESTS, NULL)!=1 ||
+	X509V3_EXT_get_nid(NID_proxyCertInfo)==NULL ||
+	EVP_Digest(data, sizeof(data), md, NULL, EVP_sha256(), NULL)!=1)
+	goto end;
+
+    /* Encode and decode a proxyCertInfo extension as found in the proxies */
+    if ( (pci=PROXY_CERT_INFO_EXTENSION_new())==NULL )
+	goto end;
+    ASN1_OBJECT_free(pci->proxyPolicy->policyLanguage);
+    if ( (pci->proxyPolicy->policyLanguage=OBJ_dup(rfc_proxy_obj))==NULL ||
+	 (len=i2d_PROXY_CERT_INFO_EXTENSION(pci, &der))<=0 )
+	goto end;
+    p=der;
+    if ( (decoded=d2i_PROXY_CERT_INFO_EXTENSION(NULL, &p, len))==NULL )
+	goto end;
+
+    /* Subject names, which are hashed (using SHA-1) and compared */
+    if ( (name=X509_NAME_new())==NULL ||
+	 !X509_NAME_add_entry_by_NID(name, NID_commonName, MBSTRING_ASC,
+				     (const unsigned char *)"warmup", -1, -1, 0))
+	goto end;
+    X509_NAME_hash(name);
+
+    rc=0;
+
+end:
+    if (rc!=0)
+	lcmaps_log(LOG_ERR, "%s: cannot initialize OpenSSL\n", __func__);
+    X509_NAME_free(name);
+    PROXY_CERT_INFO_EXTENSION_free(decoded);
+    PROXY_CERT_INFO_EXTENSION_free(pci);
+    OPENSSL_free(der);
+
+    return rc;
+}
+
+/**
+ * Obtains the properties of given proxy certificate, decoding its extensions
+ * only once.
+ * \return 0 on success, -1 on error
+ */
+int psp_classify_proxy(X509 *proxy, psp_proxy_info_t *info)	{
+    if (proxy==NULL || info==NULL)  {
+	lcmaps_log(LOG_ERR, "%s: proxy and/or info is NULL\n", __func__);
+	return -1;
+    }
+
+    if (psp_core_classify(proxy, info))	{
+	lcmaps_log(LOG_WARNING, "%s: cannot parse validity of proxy\n",
+		__func__);
+	return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Obtains the properties of both leaf proxies of the request into
+ * req->pilot_info and req->payload_info, using the cached properties for the
+ * pilot proxy when available.
+ * \return 0 on success, -1 on error
+ */
+int psp_classify_request(psp_request_t *req)	{
+    if ( !req->have_pilot_info )    {
+	if (psp_classify_proxy(req->pilot_cert, &(req->pilot_info)))
+	    return -1;
+	req->have_pilot_info=1;
+    }
+    if ( !req->have_payload_info )  {
+	if (psp_classify_proxy(req->payload_cert, &(req->payload_info)))
+	    return -1;
+	req->have_payload_info=1;
+    }
+
+    return 0;
+}
+
+/**
+ * Checks whether given proxy certificate is an RFC proxy
+ * \return 1 when proxy is RFC compliant, 0 when not
+ */
+int psp_proxy_is_rfc(X509 *proxy)    {
+    psp_proxy_info_t info;
+
+    if (psp_classify_proxy(proxy, &info))
+	return 0;
+
+    return info.is_rfc;
+}
+
+/**
+ * Checks whether given proxy certificate is an RFC Limited proxy
+ * \return 1 when proxy is RFC Limited, 0 when not
+ */
+int psp_proxy_is_limited(X509 *proxy)   {
+    psp_proxy_info_t info;
+
+    if (psp_classify_proxy(proxy, &info))
+	return 0;
+
+    return info.is_limited;
+}
+
+/**
+ * Gets subjectDN of the payload proxy, from req->payload_dn when already set
+ * by psp_verify_proxy_signature(), and stores it into the LCMAPS framework as
+ * the user_dn. The DN string is owned by the request arena.
+ * \return 0 on success, -1 on error
+ */
+int psp_store_proxy_dn(psp_request_t *req)    {
+    X509_NAME *subject=NULL;
+    char *payload_dn=req->payload_dn;
+    int rc;
+
+    if ( payload_dn==NULL &&
+	 ((subject=X509_get_subject_name(req->payload_cert))==NULL ||
+	  psp_dn_format(&(req->arena), subject, &payload_dn, NULL)) )
+    {
+	lcmaps_log(LOG_WARNING, "%s: cannot obtain DN of payload certificate\n",
+		__func__);
+	return -1;
+    }
+    req->payload_dn=payload_dn;
+
+    /* Add data, which is copied by the framework.
+     * Note that the SCAS client should look first at the getCredentialData
+     * (i.e. the 'run-time' data) and only then 'fallback' at the
+     * lcmaps_getArgValue (i.e. the initialize/introspect-time data). */
+    rc=addCredentialData(DN, &payload_dn);
+    if (rc==0)
+	psp_log(LOG_DEBUG,
+		"%s: successfully added DN \"%s\" to credential data\n",
+		__func__, payload_dn);
+    else
+	lcmaps_log(LOG_WARNING,
+		"%s: failed to add DN \"%s\" to credential data\n",
+		__func__, payload_dn);
+
+    return rc;
+}
+
+/**
+ * Stores the FQANs in the 'run-time' credential data, such that they can be
+ * retrieved using getCredentialData
+ * \return 0 on success, -1 on error
+ */
+int psp_store_fqans(int nfqans, char **fqans) {
+    int i;
+
+    /* Store all the FQANs in the framework */
+    for (i=0; i<nfqans; i++)    {
+	if (addCredentialData(LCMAPS_VO_CRED_STRING, &(fqans[i]))) {
+	    lcmaps_log(LOG_WARNING,
+		"%s: failed to add FQAN \"%s\" to credential data\n",
+		__func__, fqans[i]);
+	    return -1;
+	}
+    }
+    psp_log(LOG_DEBUG,
+	    "%s: successfully added %d FQANs to credential data\n",
+	    __func__, nfqans);
+
+    return 0;
+}
+
+/**
+ * Stores all credential data of the request in one step: the DN of the
+ * payload proxy and, when add_fqans is set, the FQANs. When add_vo_data is set
+ * as well, the FQANs are also stored as parsed LCMAPS_VO_CRED structures, such
+ * that downstream plugins do not need to parse the strings again. Scratch
+ * memory is sized from the number of FQANs and owned by the request arena.
+ * The framework only provides addCredentialData() for single items, hence
+ * the items are added one by one.
+ * \return 0 on success, -1 on error
+ */
+int psp_store_credentials(psp_request_t *req, int add_fqans, int add_vo_data)	{
+    /* Store the DN of the payload cert as user_dn */
+    if (psp_store_proxy_dn(req))
+	return -1;
+
+    if (!add_fqans || req->nfqans<=0)
+	return 0;
+
+    /* Store the FQANs as strings and optionally as parsed VO data */
+    if (psp_store_fqans(req->nfqans, req->fqans))
+	return -1;
+    if (add_vo_data && store_vo_data(&(req->arena), req->nfqans, req->fqans))
+	return -1;
+
+    return 0;
+}
+
+/**
+ * Frees all the pilot chains in the pilot cache
+ */
+void psp_cleanup_pilot_cache(void)	{
+    int i;
+
+    pthread_mutex_lock(&pilot_cache_mutex);
+    for (i=0; i<PILOT_CACHE_SIZE; i++)
+	pilot_cache_clear(&(pilot_cache[i]));
+    pilot_cache_clock=0;
+    pthread_mutex_unlock(&pilot_cache_mutex);
+}
+
+/**
+ * Empties the cache of signature verification results
+ */
+void psp_cleanup_verdict_cache(void)	{
+    pthread_mutex_lock(&verdict_cache_mutex);
+    psp_verdict_cache_clear(&verdict_cache);
+    pthread_mutex_unlock(&verdict_cache_mutex);
+}
+
+/**
+ * Looks up req->payload_fingerprint in the cache of recently rejected
+ * payloads. Rejections that depended on the X509_USER_PROXY are only found
+ * while it is the same unchanged file.
+ * \return 1 when found, with reason set to the failure counter of the
+ * rejection, 0 when not found
+ */
+int psp_reject_cache_lookup(psp_request_t *req, psp_counter_t *reason)	{
+    reject_cache_t *entry;
+    char *pilot_path=NULL;
+    struct stat pilot_st, st;
+    psp_counter_t found_reason=PSP_COUNT_FAILURE;
+    int found=0;
+
+    if (!req->have_payload_fingerprint)
+	return 0;
+
+    pthread_mutex_lock(&reject_cache_mutex);
+    if ( (entry=reject_cache_find(req->payload_fingerprint, time(NULL))) )  {
+	found_reason=entry->reason;
+	found=1;
+	/* Without a copy of the path, take it as not found */
+	if (entry->pilot_path &&
+	    (pilot_path=psp_arena_strdup(&(req->arena), entry->pilot_path))
+		==NULL)
+	    found=0;
+	pilot_st=entry->pilot_st;
+    }
+    pthread_mutex_unlock(&reject_cache_mutex);
+    if (!found)
+	return 0;
+
+    /* Only a stat, instead of reading the file, when the pilot mattered */
+    if (pilot_path &&
+	(stat(pilot_path, &st)!=0 || !same_file(&st, &pilot_st)))
+	return 0;
+
+    *reason=found_reason;
+    return 1;
+}
+
+/**
+ * Remembers the rejection of the payload in req for a short while, for
+ * given failure counter. When req->pilot_cert is set, the rejection is taken
+ * to depend on the X509_USER_PROXY and is bound to its stat, and it is not
+ * remembered when that might not match its contents.
+ */
+void psp_reject_cache_store(psp_request_t *req, psp_counter_t reason)	{
+    reject_cache_t *entry=&(reject_cache[0]);
+    time_t now=time(NULL), expiry=now+REJECT_CACHE_TTL;
+    int i;
+
+    /* Same resolution problem as for the pilot cache: a stat from the same
+     * second as the reading does not identify the contents */
+    if (!req->have_payload_fingerprint ||
+	(req->pilot_cert && (!req->have_pilot_st || !req->pilot_st_exact)))
+	return;
+
+    /* A payload that is not yet valid might become acceptable */
+    if (req->have_payload_info && req->payload_info.not_before > now &&
+	req->payload_info.not_before < expiry)
+	expiry=req->payload_info.not_before;
+
+    pthread_mutex_lock(&reject_cache_mutex);
+    /* Replace the entry for the same fingerprint, or otherwise an expired or
+     * the least recently used one. Unused entries have expiry 0. */
+    if ( (entry=reject_cache_find(req->payload_fingerprint, now))==NULL )   {
+	entry=&(reject_cache[0]);
+	for (i=1; i<REJECT_CACHE_SIZE && entry->expiry > now; i++)  {
+	    if (reject_cache[i].expiry <= now ||
+		reject_cache[i].last_used < entry->last_used)
+		entry=&(reject_cache[i]);
+	}
+    }
+    memcpy(entry->fingerprint, req->payload_fingerprint, CERT_DIGEST_LEN);
+    entry->reason=reason;
+    /* Without a copy of the path, the rejection is not bound to the pilot */
+    free(entry->pilot_path);
+    entry->pilot_path=NULL;
+    if (req->pilot_cert &&
+	(entry->pilot_path=strdup(req->pilot_path))==NULL)	{
+	entry->expiry=0;
+	pthread_mutex_unlock(&reject_cache_mutex);
+	return;
+    }
+    entry->pilot_st=req->pilot_st;
+    entry->expiry=expiry;
+    entry->last_used=++reject_cache_clock;
+    pthread_mutex_unlock(&reject_cache_mutex);
+}
+
+/**
+ * Empties the cache of recently rejected payloads
+ */
+void psp_cleanup_reject_cache(void)	{
+    int i;
+
+    pthread_mutex_lock(&reject_cache_mutex);
+    for (i=0; i<REJECT_CACHE_SIZE; i++)
+	free(reject_cache[i].pilot_path);
+    memset(reject_cache, 0, sizeof(reject_cache));
+    reject_cache_clock=0;
+    pthread_mutex_unlock(&reject_cache_mutex);
+}
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Stores the FQANs as parsed LCMAPS_VO_CRED credential data, using scratch
+ * memory from arena. The FQANs have the form
+ * /vo[/group...][/Role=role][/Capability=capability], the group is the full
+ * group path including the VO, as stored by the VOMS plugins.
+ * \return 0 on success, -1 on error
+ */
+static int store_vo_data(psp_arena_t *arena, int nfqans, char **fqans)	{
+#ifdef HAVE_LCMAPS_LCMAPS_VO_DATA_H
+    lcmaps_vo_data_t *vo_data;
+    char *scratch, *vo, *group, *role, *cap, *p;
+    size_t len, total=0;
+    int i, rc;
+
+    /* One scratch buffer for all FQANs: each is copied twice, once for the
+     * VO and once for the group, role and capability */
+    for (i=0; i<nfqans; i++)
+	total+=2*(strlen(fqans[i])+1);
+    if ( (scratch=psp_arena_alloc(arena, total))==NULL )	{
+	lcmaps_log(LOG_ERR, "%s: out of memory\n", __func__);
+	return -1;
+    }
+
+    for (i=0; i<nfqans; i++)	{
+	len=strlen(fqans[i]);
+	vo=scratch;
+	group=scratch+len+1;
+	scratch+=2*(len+1);
+	memcpy(vo, fqans[i], len+1);
+	memcpy(group, fqans[i], len+1);
+
+	/* VO is the first path element */
+	if (vo[0]!='/' || vo[1]=='\0' || vo[1]=='/')	{
+	    lcmaps_log(LOG_WARNING, "%s: cannot parse FQAN \"%s\"\n",
+		    __func__, fqans[i]);
+	    return -1;
+	}
+	vo++;
+	if ( (p=strchr(vo, '/')) )
+	    *p='\0';
+
+	/* Split off role and capability from the group */
+	role=cap=NULL;
+	if ( (p=strstr(group, "/Capability=")) )    {
+	    *p='\0';
+	    cap=p+sizeof("/Capability=")-1;
+	}
+	if ( (p=strstr(group, "/Role=")) )  {
+	    *p='\0';
+	    role=p+sizeof("/Role=")-1;
+	}
+
+	/* The framework copies the data */
+	if ( (vo_data=lcmaps_createVoData(vo, group, NULL, role, cap))==NULL ) {
+	    lcmaps_log(LOG_ERR, "%s: out of memory\n", __func__);
+	    return -1;
+	}
+	rc=addCredentialData(LCMAPS_VO_CRED, vo_data);
+	lcmaps_deleteVoData(&vo_data);
+	if (rc)	{
+	    lcmaps_log(LOG_WARNING,
+		"%s: failed to add VO data of \"%s\" to credential data\n",
+		__func__, fqans[i]);
+	    return -1;
+	}
     }
-
-    *certstack=chain;
+    psp_log(LOG_DEBUG,
+	    "%s: successfully added VO data of %d FQANs to credential data\n",
+	    __func__, nfqans);
+#else
+    psp_log(LOG_DEBUG,
+	    "%s: no VO data support in LCMAPS, only storing FQAN strings\n",
+	    __func__);
+#endif
 
     return 0;
 }
 
 /**
- * Obtains the FQANs from the plugin arguments
+ * Makes the request use the chain of given pilot cache entry, taking new
+ * references to the chain and the public key of its leaf, which are owned by
+ * the request. Needs pilot_cache_mutex.
  * \return 0 on success, -1 on error
  */
-int psp_get_fqans(int *nfqans, char ***fqans, int argc, lcmaps_argument_t *argv)
-{
-    void *value;
+static int pilot_cache_use(pilot_cache_t *entry, psp_request_t *req)	{
+    STACK_OF(X509) *chain;
 
-    /* We could try to obtain this information from the voms_data_list argument
-     * instead, but we only need the FQANs in any case */
-    if ( (value = lcmaps_getArgValue("nfqan", "int", argc, argv) ) )    {
-	*nfqans = *(int *)value;
-	lcmaps_log(LOG_DEBUG, "%s: found nfqan: %d\n", __func__, *nfqans);
-	if (*nfqans>0)   {
-	    lcmaps_log(LOG_DEBUG,
-		    "%s: the list of FQANs should contain %d elements\n",
-		    __func__, *nfqans);
-	    if ( (value = lcmaps_getArgValue("fqan_list", "char **",
-					     argc, argv)) ) {
-		*fqans = *(char ***)value;
-		lcmaps_log(LOG_DEBUG, "%s: found list of FQANs\n", __func__);
-	    }
-	} else {
-	    lcmaps_log(LOG_INFO,
-		    "%s: No VOMS FQANs present in the proxy chain\n", __func__);
+    entry->last_used=++pilot_cache_clock;
+
+    if ( (chain=X509_chain_up_ref(entry->chain))==NULL ||
+	 psp_arena_own(&(req->arena), release_chain, chain) )	{
+	lcmaps_log(LOG_ERR, "%s: out of memory\n", __func__);
+	return -1;
+    }
+    req->pilot_chain=chain;
+    req->pilot_cert=sk_X509_value(chain, 0);
+
+    /* Public key, digest and properties of the leaf */
+    if (entry->leaf_key && EVP_PKEY_up_ref(entry->leaf_key)==1)	{
+	if (psp_arena_own(&(req->arena), release_pkey, entry->leaf_key))  {
+	    lcmaps_log(LOG_ERR, "%s: out of memory\n", __func__);
+	    return -1;
 	}
-    } else {
-	/* Do not fail over to using the FQANs directly from the framework. */
-	lcmaps_log(LOG_INFO,
-            "%s: No VOMS AC(s) found by the framework in the proxy chain.\n",
-            __func__);
+	req->pilot_key=entry->leaf_key;
     }
+    if ( (req->have_pilot_digest=entry->have_digest) )
+	memcpy(req->pilot_digest, entry->leaf_digest, CERT_DIGEST_LEN);
+    if ( (req->have_pilot_info=entry->have_info) )
+	req->pilot_info=entry->leaf_info;
+    req->pilot_chain_valid_until=entry->chain_valid_until;
+    req->pilot_st=entry->st;
+    req->pilot_st_exact=entry->st_exact;
+    req->have_pilot_st=1;
 
     return 0;
 }
 
 /**
- * Verifies that payload proxy is signed by pilot proxy
+ * Reads and parses the pilot proxy in req->pilot_path for
+ * psp_get_pilot_proxy(), unless it is unchanged with respect to cached_st
+ * and cached_sum when not NULL, and stores it in the cache and the request.
+ * With seqlock set, contents ending with a checksum trailer must match it,
+ * and the trailer is kept in the cache. The cache is not locked meanwhile,
+ * so other requests can proceed.
  * \return 0 on success, -1 on error
  */
-int psp_verify_proxy_signature(X509 *payload, X509 *pilot)  {
-    EVP_PKEY *pilot_key=NULL;
-    int result;
+static int load_pilot_proxy(psp_request_t *req,
+			    int lock_flags, int seqlock,
+			    read_method_t read_method,
+			    int watch_id, unsigned long watch_gen,
+			    const struct stat *cached_st,
+			    const unsigned char *cached_sum)	{
+    const char *proxy=req->pilot_path;
+    char *pem_buf=NULL;
+    STACK_OF(X509) *chain=NULL;
+    pilot_cache_t *entry;
+    struct stat st;
+    time_t read_time;
+    int st_exact;
+    unsigned char checksum[CERT_DIGEST_LEN];
+    int checksum_rc=1;
+    uint64_t start;
+    int rc;
 
-    if (pilot==NULL || payload==NULL)	{
-	lcmaps_log(LOG_WARNING,
-		"%s: pilot or payload proxy is unset.\n",
-		__func__);
-	return -1;
+    /* Read in proxy, unless it is unchanged since it was cached */
+    read_time=time(NULL);
+    start=psp_stats_start();
+    if (read_method==READ_METHOD_MMAP)
+	rc=map_proxy(proxy, lock_flags, watch_id, cached_st, cached_sum,
+		     &chain, &st, seqlock ? checksum : NULL, &checksum_rc);
+    else
+	rc=read_proxy(&(req->arena), proxy, lock_flags, watch_id,
+		      cached_st, cached_sum, &pem_buf, &st);
+    psp_stats_record(PSP_STAGE_PILOT_READ, start);
+    if (rc==1)	{
+	/* The entry might have been replaced meanwhile: only use it when it
+	 * still is for the same unchanged file */
+	pthread_mutex_lock(&pilot_cache_mutex);
+	if ( (entry=pilot_cache_find(proxy)) &&
+	     same_file(&(entry->st), cached_st) &&
+	     (cached_sum==NULL || (entry->have_checksum &&
+		memcmp(entry->checksum, cached_sum, CERT_DIGEST_LEN)==0)) ) {
+	    psp_log(LOG_DEBUG,
+		    "%s: using cached chain for unchanged proxy %s\n",
+		    __func__, proxy);
+	    /* Once the trailer was found unchanged after the second of the
+	     * last change, any later change shows in the stat */
+	    if (cached_sum && entry->st.st_ctime < read_time)
+		entry->st_exact=1;
+	    entry->watch_gen=watch_gen;
+	    rc=pilot_cache_use(entry, req);
+	    pthread_mutex_unlock(&pilot_cache_mutex);
+	    psp_stats_count(PSP_COUNT_PILOT_CACHE_HIT);
+	    return rc;
+	}
+	pthread_mutex_unlock(&pilot_cache_mutex);
+	/* Read it again, without the cache */
+	read_time=time(NULL);
+	start=psp_stats_start();
+	if (read_method==READ_METHOD_MMAP)
+	    rc=map_proxy(proxy, lock_flags, watch_id, NULL, NULL, &chain, &st,
+			 seqlock ? checksum : NULL, &checksum_rc);
+	else
+	    rc=read_proxy(&(req->arena), proxy, lock_flags, watch_id, NULL,
+			  NULL, &pem_buf, &st);
+	psp_stats_record(PSP_STAGE_PILOT_READ, start);
     }
-    
-    /* Get public key from pilot cert */
-    if ( (pilot_key = X509_get_pubkey(pilot)) ==NULL ) {
-	lcmaps_log(LOG_WARNING, "%s: cannot get public key from pilot cert\n",
-		__func__);
+    if (rc!=0)	{
+	if (rc==-7)
+	    lcmaps_log(LOG_WARNING,
+		    "%s: cannot convert proxy to chain.\n", __func__);
 	return -1;
     }
 
-    /* Check that payload_cert is signed by the pilot */
-    result = X509_verify(payload, pilot_key);
+    /* Convert PEM buffer to certificate chain, unless already done */
+    if (pem_buf)    {
+	if (seqlock)
+	    checksum_rc=psp_pem_checksum_verify(pem_buf, (size_t)st.st_size,
+						checksum);
+	start=psp_stats_start();
+	rc= (checksum_rc<0 ? 0 : pem_string_to_x509_chain(&chain, pem_buf));
+	psp_stats_record(PSP_STAGE_PILOT_PARSE, start);
+	/* Don't leave the private key lying around until the arena is reset */
+	OPENSSL_cleanse(pem_buf, (size_t)st.st_size);
+    }
 
-    /* Free memory */
-    EVP_PKEY_free(pilot_key);
-    if (result!=1)  {
+    if (rc!=0)   {
 	lcmaps_log(LOG_WARNING,
-		"%s: payload cert is not signed by pilot cert\n",
-		__func__);
+                    "%s: cannot convert pemstring to chain.\n", __func__);
 	return -1;
     }
 
-    return 0;
+    /* Writers for seqlock only replace the file, so a mismatch means it is
+     * corrupt or being modified in place */
+    if (checksum_rc<0)	{
+	lcmaps_log(LOG_WARNING,
+		"%s: contents of proxy %s do not match its checksum\n",
+		__func__, proxy);
+	sk_X509_pop_free(chain, X509_free);
+	return -1;
+    }
+
+    /* Put chain in the cache, which takes ownership */
+    psp_stats_count(PSP_COUNT_PILOT_CACHE_MISS);
+    pthread_mutex_lock(&pilot_cache_mutex);
+    /* Since stat times have a resolution of seconds, a change within the
+     * same second as the read would go unnoticed. This holds as well when
+     * writers only replace the file, as filesystems such as ext4 and tmpfs
+     * reuse a freed inode right away for the replacement */
+    st_exact=(st.st_ctime < read_time);
+    if ( (entry=pilot_cache_store(proxy, &st, st_exact,
+				  checksum_rc==0 ? checksum : NULL,
+				  watch_gen, chain)) )
+	rc=pilot_cache_use(entry, req);
+    else
+	rc=-1;
+    pthread_mutex_unlock(&pilot_cache_mutex);
+
+    return rc;
 }
 
 /**
- * Checks whether given proxy certificate is an RFC proxy
- * \return 1 when proxy is RFC compliant, 0 when not
+ * Looks up the flight loading path. Needs pilot_cache_mutex.
+ * \return flight or NULL when path is not being loaded
  */
-int psp_proxy_is_rfc(X509 *proxy)    {
-    int ext_count, i, rfc=0;
-    X509_EXTENSION *ex;
-    char buffer[OBJ_BUF_SIZE];
+static pilot_flight_t *pilot_flight_find(const char *path)	{
+    int i;
 
-    /* Loop of all certificate extensions */
-    ext_count=X509_get_ext_count(proxy);
-    for (i = 0; i < ext_count; i++) {
-        ex = X509_get_ext(proxy, i);
-        if (X509_EXTENSION_get_object(ex)) {
-            OBJ_obj2txt(buffer, OBJ_BUF_SIZE, X509_EXTENSION_get_object(ex), 1);
-            /* Compare found extension if RFC_PROXY OID */
-            if (strcmp(buffer, OID_RFC_PROXY) == 0)     {
-                rfc=1;
-                break;
-            }
-        }
-    }
+    for (i=0; i<PILOT_FLIGHTS; i++)
+	if (pilot_flights[i].path && strcmp(pilot_flights[i].path, path)==0)
+	    return &(pilot_flights[i]);
 
-    return rfc;
+    return NULL;
 }
 
 /**
- * Checks whether given proxy certificate is an RFC Limited proxy
- * \return 1 when proxy is RFC Limited, 0 when not
+ * Claims a flight for loading path, which must stay valid until
+ * pilot_flight_finish(). Needs pilot_cache_mutex.
+ * \return flight or NULL when all are in use
  */
-int psp_proxy_is_limited(X509 *proxy)   {
-    char buffer[OBJ_BUF_SIZE];
-    int crit=0;
-    PROXY_CERT_INFO_EXTENSION *pci = NULL;
-    ASN1_OBJECT *policy_lang = NULL;
-    ASN1_OBJECT *obj=NULL;
-    int nid;
-    int rc=0;
-
-    /* Get NID for RFC proxy */
-    obj=OBJ_txt2obj(OID_RFC_PROXY,0);
-    nid=OBJ_obj2nid(obj);
-    ASN1_OBJECT_free(obj);
-
-    /* Get Proxy Certificate Information, its policy and its policyLanguage */
-    if ( (pci=X509_get_ext_d2i(proxy, nid, &crit, NULL)) )  {
-	if ( pci->proxyPolicy &&
-	     (policy_lang=pci->proxyPolicy->policyLanguage) )
-	{
-	    /* Convert policyLanguage to OID (1 -> always use numerical form) */
-	    OBJ_obj2txt(buffer, OBJ_BUF_SIZE, policy_lang, 1);
-	    lcmaps_log(LOG_DEBUG,
-		    "%s: found policy_lang %s\n", __func__, buffer);
-	    /* Check whether it's a LIMITED proxy */
-	    if (strcmp(buffer, OID_LIMITED_PROXY)==0)
-		rc=1;
+static pilot_flight_t *pilot_flight_claim(const char *path)	{
+    int i;
+
+    for (i=0; i<PILOT_FLIGHTS; i++)
+	if (pilot_flights[i].path==NULL && pilot_flights[i].waiters==0)	{
+	    pilot_flights[i].path=path;
+	    pilot_flights[i].rc=-1;
+	    return &(pilot_flights[i]);
 	}
-	/* Free up memory */
-	PROXY_CERT_INFO_EXTENSION_free(pci);
+
+    return NULL;
+}
+
+/**
+ * Waits at most PILOT_FLIGHT_WAIT_S for flight, loading path, to finish, and
+ * then makes the request use the chain it stored in the cache. The flight
+ * stays claimed until its last waiter is done with it. Needs
+ * pilot_cache_mutex, which is released while waiting.
+ * \return 0 on success, -1 on error, 1 when the caller should read the file
+ * itself: on timeout, or when the entry has been replaced meanwhile
+ */
+static int pilot_flight_wait(pilot_flight_t *flight, const char *path,
+			     psp_request_t *req)	{
+    struct timespec deadline;
+    pilot_cache_t *entry;
+    int done, rc=0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec+=PILOT_FLIGHT_WAIT_S;
+    flight->waiters++;
+    while (flight->path && rc!=ETIMEDOUT)
+	rc=pthread_cond_timedwait(&pilot_flight_cond, &pilot_cache_mutex,
+				  &deadline);
+    done=(flight->path==NULL);
+    rc=flight->rc;
+    flight->waiters--;
+
+    if (!done)	{
+	psp_log(LOG_INFO, "%s: timeout waiting for load of proxy %s\n",
+		__func__, path);
+	return 1;
     }
+    if (rc!=0)	{
+	lcmaps_log(LOG_WARNING, "%s: concurrent load of proxy %s failed\n",
+		__func__, path);
+	return -1;
+    }
+    if ( (entry=pilot_cache_find(path))==NULL )
+	return 1;
 
-    return rc;
+    psp_log(LOG_DEBUG, "%s: using chain for %s loaded concurrently\n",
+	    __func__, path);
+    return pilot_cache_use(entry, req);
+}
+
+/**
+ * Marks flight as done with result rc and wakes up its waiters. Needs
+ * pilot_cache_mutex.
+ */
+static void pilot_flight_finish(pilot_flight_t *flight, int rc)	{
+    flight->path=NULL;
+    flight->rc=rc;
+    if (flight->waiters>0)
+	pthread_cond_broadcast(&pilot_flight_cond);
 }
 
 /**
- * Checks whether one of the FQANs matches the given pattern
- * \return 1 when found, 0 when not.
+ * Looks up the pilot cache entry for given path.
+ * \return cache entry or NULL when not found
  */
-int psp_match_fqan(int nfqan, char **fqans, const char *pattern)    {
+static pilot_cache_t *pilot_cache_find(const char *path)	{
     int i;
 
-    for (i=0; i<nfqan; i++) {
-	if ( fnmatch(pattern, fqans[i], FNM_NOESCAPE)==0 )  {
-	    lcmaps_log(LOG_DEBUG, "%s: found FQAN matching %s: %s\n",
-		    __func__, pattern, fqans[i]);
-	    return 1;
-	}
+    for (i=0; i<PILOT_CACHE_SIZE; i++)	{
+	if (pilot_cache[i].path && strcmp(pilot_cache[i].path, path)==0)
+	    return &(pilot_cache[i]);
     }
-    return 0;
+
+    return NULL;
 }
 
 /**
- * Gets subjectDN of the payload proxy and stores it into the LCMAPS framework
- * as the user_dn
- * \return 0 on success, -1 on error
+ * Stores chain in the pilot cache for given path, stat, whether that stat
+ * identifies the contents, checksum trailer (or NULL) and watch change
+ * counter, replacing an existing entry for path or the least recently used
+ * one. The cache takes ownership of chain, also on error. Needs
+ * pilot_cache_mutex.
+ * \return the cache entry, or NULL on error
  */
-int psp_store_proxy_dn(X509 *payload)    {
-    X509_NAME *subject=NULL;
-    char *payload_dn=NULL;
-    int rc;
+static pilot_cache_t *pilot_cache_store(const char *path, const struct stat *st,
+			     int st_exact, const unsigned char *checksum,
+			     unsigned long watch_gen, STACK_OF(X509) *chain) {
+    pilot_cache_t *entry;
+    char *path_copy=NULL;
+    X509 *leaf;
+    unsigned int len;
+    int i;
 
-    if ( (subject=X509_get_subject_name(payload))==NULL ||
-	 (payload_dn=X509_NAME_oneline(subject, NULL, 0))==NULL )
-    {
-	lcmaps_log(LOG_WARNING, "%s: cannot obtain DN of payload certificate\n",
-		__func__);
-	return -1;
+    /* Reuse entry for this path, otherwise take an empty or the least
+     * recently used one */
+    if ( (entry=pilot_cache_find(path))==NULL )	{
+	entry=&(pilot_cache[0]);
+	for (i=0; i<PILOT_CACHE_SIZE && entry->path; i++)    {
+	    if (pilot_cache[i].path==NULL ||
+		pilot_cache[i].last_used < entry->last_used)
+		entry=&(pilot_cache[i]);
+	}
+	if ( (path_copy=strdup(path))==NULL )	{
+	    lcmaps_log(LOG_ERR, "%s: out of memory\n", __func__);
+	    sk_X509_pop_free(chain, X509_free);
+	    return NULL;
+	}
+	/* Free the old contents of the entry */
+	pilot_cache_clear(entry);
+	entry->path=path_copy;
+    } else  {
+	sk_X509_pop_free(entry->chain, X509_free);
+	EVP_PKEY_free(entry->leaf_key);
     }
 
-    /* Add data, afterwards, we can cleanup payload_dn.
-     * Note that the SCAS client should look first at the getCredentialData
-     * (i.e. the 'run-time' data) and only then 'fallback' at the
-     * lcmaps_getArgValue (i.e. the initialize/introspect-time data). */
-    rc=addCredentialData(DN, &payload_dn);
-    if (rc==0)
-	lcmaps_log(LOG_DEBUG,
-		"%s: successfully added DN \"%s\" to credential data\n",
-		__func__, payload_dn);
+    entry->st=*st;
+    entry->st_exact=st_exact;
+    if ( (entry->have_checksum=(checksum!=NULL)) )
+	memcpy(entry->checksum, checksum, CERT_DIGEST_LEN);
+    entry->watch_gen=watch_gen;
+    entry->chain=chain;
+    entry->chain_valid_until=0;
+    entry->last_used=++pilot_cache_clock;
+
+    /* Keep public key and digest of the leaf for signature verification and
+     * its properties for psp_classify_proxy() */
+    leaf=sk_X509_value(chain, 0);
+    entry->leaf_key=X509_get_pubkey(leaf);
+    entry->have_digest=
+	(X509_digest(leaf, EVP_sha256(), entry->leaf_digest, &len)==1);
+    entry->have_info=(psp_core_classify(leaf, &(entry->leaf_info))==0);
+
+    /* Without its validity, the entry is only dropped when replaced */
+    if (entry->have_info)
+	psp_heap_set(&pilot_cache_expiry, (int)(entry-pilot_cache),
+		     entry->leaf_info.not_after);
     else
-	lcmaps_log(LOG_WARNING,
-		"%s: failed to add DN \"%s\" to credential data\n",
-		__func__, payload_dn);
+	psp_heap_remove(&pilot_cache_expiry, (int)(entry-pilot_cache));
 
-    free(payload_dn);
-
-    return rc;
+    return entry;
 }
 
 /**
- * Stores the FQANs in the 'run-time' credential data, such that they can be
- * retrieved using getCredentialData
- * \return 0 on success, -1 on error
+ * Drops the pilot cache entries whose leaf expired at now, which can no
+ * longer be used by any request, instead of keeping their chains until they
+ * happen to be replaced. Needs pilot_cache_mutex.
  */
-int psp_store_fqans(int nfqans, char **fqans) {
-    int i;
+static void pilot_cache_expire(time_t now)	{
+    int id;
 
-    /* Store all the FQANs in the framework */
-    for (i=0; i<nfqans; i++)    {
-	if (addCredentialData(LCMAPS_VO_CRED_STRING, &(fqans[i]))) {
-	    lcmaps_log(LOG_WARNING,
-		"%s: failed to add FQAN \"%s\" to credential data\n",
-		__func__, fqans[i]);
-	    return -1;
-	}
+    while ( (id=psp_heap_pop_expired(&pilot_cache_expiry, now)) >= 0 )	{
+	psp_log(LOG_DEBUG, "%s: dropping expired chain for %s\n",
+		__func__, pilot_cache[id].path);
+	pilot_cache_clear(&(pilot_cache[id]));
     }
-    lcmaps_log(LOG_DEBUG,
-	    "%s: successfully added %d FQANs to credential data\n",
-	    __func__, nfqans);
-
-    return 0;
 }
 
 /**
- * Clean memory in pilot and/or payload chains
+ * Frees what a pilot cache entry holds, after which it is unused, also
+ * removing it from pilot_cache_expiry. Needs pilot_cache_mutex.
  */
-void psp_cleanup_chains(STACK_OF(X509) *pilot, STACK_OF(X509) *payload)  {
-    if (pilot)
-	sk_X509_pop_free(pilot, X509_free);
-
-    if (payload_chain_needs_cleaning && payload)
-	sk_X509_pop_free(payload, X509_free);
+static void pilot_cache_clear(pilot_cache_t *entry)	{
+    psp_heap_remove(&pilot_cache_expiry, (int)(entry-pilot_cache));
+    if (entry->path==NULL)
+	return;
+    free(entry->path);
+    sk_X509_pop_free(entry->chain, X509_free);
+    EVP_PKEY_free(entry->leaf_key);
+    memset(entry, 0, sizeof(pilot_cache_t));
 }
 
+/**
+ * Looks up a valid reject cache entry for given fingerprint. Needs
+ * reject_cache_mutex.
+ * \return reject cache entry or NULL when not found
+ */
+static reject_cache_t *reject_cache_find(const unsigned char *fingerprint,
+					 time_t now)	{
+    int i;
 
-/************************************************************************
- * Private functions
- ************************************************************************/
+    for (i=0; i<REJECT_CACHE_SIZE; i++)	{
+	if (reject_cache[i].expiry > now &&
+	    memcmp(reject_cache[i].fingerprint, fingerprint,
+		   CERT_DIGEST_LEN)==0)
+	{
+	    reject_cache[i].last_used=++reject_cache_clock;
+	    return &(reject_cache[i]);
+	}
+    }
+
+    return NULL;
+}
 
 /**
- * Convert PEM string to stack of X509 certificates. Stack needs to be cleaned
- * up afterwards.
+ * Convert PEM string to stack of X509 certificates, skipping other PEM blocks
+ * such as private keys. Stack needs to be cleaned up afterwards.
  * \return 0 on success or -1 on error
  */
 static int pem_string_to_x509_chain(STACK_OF(X509) **certstack, char *certstring)
 {
-    STACK_OF(X509) *mystack=NULL;
-    BIO *certbio = NULL;
-    STACK_OF(X509_INFO) *sk=NULL;
-    X509_INFO *xi;
+    int rc;
 
     /* protect input */
     if (certstack==NULL || certstring==NULL)    {
@@ -438,45 +1838,47 @@ static int pem_string_to_x509_chain(STACK_OF(X509) **certstack, char *certstring
         return -1;
     }
 
-    /* initialize new X509 chain and memory BIO */
-    if ( (mystack = sk_X509_new_null()) == NULL ||
-         (certbio = BIO_new_mem_buf(certstring, -1)) == NULL)
-    {
+    /* Convert only the certificate blocks */
+    rc=psp_pem_to_chain(certstring, strlen(certstring), certstack);
+    if (rc==-2)
         lcmaps_log(LOG_ERR,"%s: out of memory\n", __func__);
-        return -1;
-    }
 
-    /* Convert PEM via memory BIO to stack of X509_INFO */
-    sk=PEM_X509_INFO_read_bio(certbio, NULL, NULL, NULL);
-    BIO_free(certbio);
-    if (!sk)
-        goto err;
+    return (rc==0 ? 0 : -1);
+}
 
-    /* Loop over the stack and convert */
-    while (sk_X509_INFO_num(sk)) {
-        xi=sk_X509_INFO_shift(sk);
-	if (xi->x509 != NULL) {
-            sk_X509_push(mystack, xi->x509);
-            xi->x509=NULL;
-        }
-        X509_INFO_free(xi);
-    }
-    sk_X509_INFO_free(sk);
+/**
+ * Frees a certificate chain owned by the request arena
+ */
+static void release_chain(void *chain)	{
+    sk_X509_pop_free((STACK_OF(X509) *)chain, X509_free);
+}
 
-    /* Check there is at least one certificate */
-    if (!sk_X509_num(mystack))
-        goto err;
+/**
+ * Frees a public key owned by the request arena
+ */
+static void release_pkey(void *pkey)	{
+    EVP_PKEY_free((EVP_PKEY *)pkey);
+}
 
-    /* Cleanup and return success */
-    *certstack=mystack;
+#if defined(HAVE_SYS_FSUID_H) && defined(HAVE_SETFSUID)
+/**
+ * Sets the filesystem uid and gid of the calling thread, without changing
+ * the credentials of the process, such that other threads are not affected.
+ * \return 0 on success, -1 when the ids could not be set
+ */
+static int set_fsids(uid_t fsuid, gid_t fsgid)	{
+    /* setfsuid() and setfsgid() always return the previous value: checking
+     * needs a second call with an invalid id */
+    setfsgid(fsgid);
+    if ((gid_t)setfsgid((gid_t)-1)!=fsgid)
+	return -1;
+    setfsuid(fsuid);
+    if ((uid_t)setfsuid((uid_t)-1)!=fsuid)
+	return -1;
 
     return 0;
-
-err:
-    /* Cleanup and error out */
-    sk_X509_pop_free(mystack, X509_free);
-    return 1;
 }
+#else
 
 /**
  * Drops privilege to an unprivileged account. 
@@ -533,6 +1935,7 @@ static int raise_priv(uid_t euid, gid_t egid)	{
     }
     return -1;
 }
+#endif
 
 /**
  * NOTE: This is effectively cgul_filelock, see
@@ -600,74 +2003,189 @@ static int filelock(int fd, int lock_type, int action) {
 
 
 /**
- * NOTE: this is effectively cgul_read_proxy with some extra logging inserted in
- * here. See https://ndpfsvn.nikhef.nl/viewvc/mwsec/trunk/cgul/fileutil/
- * Reads proxy from *path using given lock_type (see cgul_filelock). It tries to
- * drop privilege to real-uid/real-gid when euid==0 and uid!=0.
- * Space needed will be malloc-ed.
- * Upon successful completion proxy contains the contents of path.
+ * Opens proxy at path and sets a read lock using given lock_type (see
+ * cgul_filelock). It tries to drop privilege to real-uid/real-gid when euid==0
+ * and uid!=0 for opening the file, and raises it again afterwards. Where
+ * available only the filesystem ids of the calling thread are changed,
+ * otherwise the effective ids of the whole process. The file
+ * must be owned by the real uid and may not be readable or writeable for
+ * anyone else.
+ * Upon successful completion fd is the opened and locked file and st its stat
+ * information.
  * Return values:
  * 0: success
  * -1: I/O error
  * -2: privilege-drop error
  * -3: permissions error
- * -4: memory error
- * -5: too many retries needed during reading
  * -6: locking failed
+ * -8: file larger than PROXY_MAX_SIZE
  */
-static int read_proxy(const char *path, int lock_type, char **proxy)  {
-    const int tries=10; /* max number of retries for reading a changing file */
-    int i,fd,rc=0;
-    struct stat st1,st2,*sptr1,*sptr2,*sptr3;
+static int open_proxy(const char *path, int lock_type, int *fd,
+		      struct stat *st)	{
     uid_t uid=getuid(),euid=geteuid();
     gid_t gid=getgid(),egid=getegid();
-    char *buf,*buf_new; /* *proxy will be updated when everything is ok */
-    ssize_t size=0; /* initialize to silence the compiler */
-
+    uint64_t start;
+    int save_errno, rc;
+
+#if defined(HAVE_SYS_FSUID_H) && defined(HAVE_SETFSUID)
+    /* Access the file as real uid and real gid, only when we can and are
+     * not-root. This only affects the calling thread. */
+    if ( euid==0 && uid!=0 && set_fsids(uid,gid) )  {
+	set_fsids(euid,egid);
+	lcmaps_log(LOG_WARNING, "%s: cannot drop privilege\n", __func__);
+	return -2;
+    }
+    /* Open file, and reset the filesystem ids, ignoring the exit value */
+    *fd=open(path,O_RDONLY);
+    save_errno=errno;
+    if ( euid==0 && uid!=0 )
+	set_fsids(euid,egid);
+#else
     /* Drop privilege to real uid and real gid, only when we can and are
-     * not-root */
+     * not-root. Note that this changes the effective ids of the process. */
     if ( euid==0 && uid!=0 && priv_drop(uid,gid) )  {
 	lcmaps_log(LOG_WARNING, "%s: cannot drop privilege\n", __func__);
 	return -2;
     }
-    /* Open file */
-    if ((fd=open(path,O_RDONLY))==-1)	{
+    /* Open file, can reset euid/egid if it was (effective) root afterwards.
+     * Ignore exit value. */
+    *fd=open(path,O_RDONLY);
+    save_errno=errno;
+    raise_priv(euid,egid);
+#endif
+    if (*fd==-1)	{
 	lcmaps_log(LOG_WARNING, "%s: cannot open proxy %s: %s\n",
-		__func__, path, strerror(errno));
-	raise_priv(euid,egid);
+		__func__, path, strerror(save_errno));
 	return -1;
     }
     /* Lock file */
-    if (filelock(fd,lock_type,LCK_READ))    {
-	close(fd);
-	raise_priv(euid,egid);
+    start=psp_stats_start();
+    rc=filelock(*fd,lock_type,LCK_READ);
+    psp_stats_record(PSP_STAGE_PILOT_LOCK, start);
+    if (rc)    {
+	close(*fd);
 	return -6;
     }
     /* Stat the file before reading:
      * Need ownership and mode for allowed values, size for malloc */
-    if (fstat(fd,&st1))	{
+    if (fstat(*fd,st))	{
 	lcmaps_log(LOG_WARNING, "%s: cannot stat proxy %s: %s\n",
 		__func__, path, strerror(errno));
-	close(fd);
-	raise_priv(euid,egid);
+	filelock(*fd,lock_type,LCK_UNLOCK);
+	close(*fd);
 	return -1;
     }
     /* Check we own it (only uid) and it is unreadable/unwriteable for anyone
      * else */ 
-    if ( st1.st_uid!=uid || 
-	 st1.st_mode & S_IRGRP || st1.st_mode & S_IWGRP ||
-	 st1.st_mode & S_IROTH || st1.st_mode & S_IWOTH )   {
+    if ( st->st_uid!=uid || 
+	 st->st_mode & S_IRGRP || st->st_mode & S_IWGRP ||
+	 st->st_mode & S_IROTH || st->st_mode & S_IWOTH )   {
 	lcmaps_log(LOG_WARNING, "%s: unsafe permissions on proxy %s\n",
 		__func__, path);
-	close(fd);
-	raise_priv(euid,egid);
+	filelock(*fd,lock_type,LCK_UNLOCK);
+	close(*fd);
 	return -3;
     }
-    /* Get expected space: need 1 extra for trailing '\0' */
-    if ( (buf=(char *)malloc((size_t)st1.st_size+sizeof(char)))==NULL)   {
+    if ( st->st_size > PROXY_MAX_SIZE )	{
+	lcmaps_log(LOG_WARNING, "%s: proxy %s is too large\n",
+		__func__, path);
+	filelock(*fd,lock_type,LCK_UNLOCK);
+	close(*fd);
+	return -8;
+    }
+
+    return 0;
+}
+
+/**
+ * Checks whether stat information st1 refers to the same unmodified file as
+ * st2, based on device, inode, size, mtime and ctime.
+ * \return 1 when it does, 0 otherwise
+ */
+static int same_file(const struct stat *st1, const struct stat *st2)	{
+    return ( st1->st_dev  ==st2->st_dev &&	/* same device */
+	     st1->st_ino  ==st2->st_ino &&	/* same inode */
+	     st1->st_size ==st2->st_size &&	/* size equal */
+	     st1->st_mtime==st2->st_mtime &&	/* mtime equal */
+	     st1->st_ctime==st2->st_ctime );	/* ctime equal */
+}
+
+/**
+ * Checks whether the opened file fd with stat st ends with the checksum
+ * trailer sum, reading only the trailer and the newline before it. The
+ * trailer is not secret, hence the buffer is not cleansed.
+ * \return 1 when it does, 0 otherwise
+ */
+static int same_checksum(int fd, const struct stat *st,
+			 const unsigned char *sum)	{
+    char tail[PSP_PEM_CHECKSUM_LINE_LEN+1];
+    unsigned char digest[CERT_DIGEST_LEN];
+    size_t len=PSP_PEM_CHECKSUM_LINE_LEN+1;
+
+    if ( st->st_size < (off_t)PSP_PEM_CHECKSUM_LINE_LEN )
+	return 0;
+    if ( st->st_size == (off_t)PSP_PEM_CHECKSUM_LINE_LEN )
+	len=PSP_PEM_CHECKSUM_LINE_LEN;
+
+    return ( pread(fd, tail, len, st->st_size-(off_t)len)==(ssize_t)len &&
+	     psp_pem_checksum_get(tail, len, digest)==0 &&
+	     memcmp(digest, sum, CERT_DIGEST_LEN)==0 );
+}
+
+/**
+ * NOTE: this is effectively cgul_read_proxy with some extra logging inserted in
+ * here. See https://ndpfsvn.nikhef.nl/viewvc/mwsec/trunk/cgul/fileutil/
+ * Reads proxy from *path using given lock_type (see cgul_filelock and
+ * open_proxy()).
+ * Space needed will be allocated from arena.
+ * When the file changes during reading, it is read again, after waiting for
+ * the writer to finish when watch_id is a valid watch (see psp_watch_add()),
+ * or a short fixed time otherwise.
+ * When cached_st is non-NULL and the opened file has the same device, inode,
+ * size, mtime and ctime, and when cached_sum is non-NULL also ends with that
+ * checksum trailer, the file is not read and 1 is returned.
+ * Upon successful completion proxy contains the contents of path and st the
+ * corresponding stat information.
+ * Return values:
+ * 0: success
+ * 1: file is unchanged with respect to cached_st
+ * -1: I/O error
+ * -2: privilege-drop error
+ * -3: permissions error
+ * -4: memory error
+ * -5: too many retries needed during reading
+ * -6: locking failed
+ * -8: file larger than PROXY_MAX_SIZE
+ */
+static int read_proxy(psp_arena_t *arena, const char *path, int lock_type,
+		      int watch_id, const struct stat *cached_st,
+		      const unsigned char *cached_sum, char **proxy,
+		      struct stat *st)	{
+    const int tries=10; /* max number of retries for reading a changing file */
+    int i,fd,rc=0;
+    struct stat st1,st2,*sptr1,*sptr2,*sptr3;
+    char *buf, *newbuf; /* *proxy will be updated when everything is ok */
+    size_t buf_len;
+    ssize_t size=0; /* initialize to silence the compiler */
+
+    /* Open, lock and check the file */
+    if ( (rc=open_proxy(path, lock_type, &fd, &st1))!=0 )
+	return rc;
+    /* When it's the same file as was cached, we don't need to read it */
+    if ( cached_st && same_file(&st1, cached_st) &&
+	 (cached_sum==NULL || same_checksum(fd, &st1, cached_sum)) )  {
+	filelock(fd,lock_type,LCK_UNLOCK);
+	close(fd);
+	return 1;
+    }
+    /* Get expected space: need 1 extra for trailing '\0'. The buffer holds
+     * the private key, and the arena does not scrub memory it gives back, so
+     * every buffer not returned in *proxy is cleansed here */
+    buf_len=(size_t)st1.st_size+sizeof(char);
+    if ( (buf=(char *)psp_arena_alloc(arena, buf_len))==NULL)   {
 	lcmaps_log(LOG_WARNING, "%s: out of memory\n", __func__);
+	filelock(fd,lock_type,LCK_UNLOCK);
 	close(fd);
-	raise_priv(euid,egid);
 	return -4;
     }
     /* use pointers to the two so that we can swap them easily */
@@ -682,9 +2200,7 @@ static int read_proxy(const char *path, int lock_type, char **proxy)  {
 	}
 	/* Size, mtime and ctime should have stayed the same, especially ctime
 	 * is good as we can't change it with touch ! */
-	if ( sptr2->st_size == sptr1->st_size &&	/* size equal */
-	     sptr2->st_mtime== sptr1->st_mtime &&	/* mtime equal */
-	     sptr2->st_ctime== sptr1->st_ctime)   {	/* ctime equal */
+	if ( same_file(sptr2, sptr1) )   {
 	    /* Just check the return of the read, we might have an I/O error */
 	    rc= (size==(ssize_t)sptr1->st_size ? 0 : -1);
 	    break;
@@ -692,15 +2208,24 @@ static int read_proxy(const char *path, int lock_type, char **proxy)  {
 
 	/* File has changed during reading: retry */
 	if (i<tries-1)	{ /* will be doing a retry */
-	    buf_new=(char *)realloc(buf,(size_t)sptr2->st_size+sizeof(char));
-	    if ( buf_new==NULL )    {
-		rc=-4; break;
+	    if ( sptr2->st_size > PROXY_MAX_SIZE )	{
+		rc=-8; break;
+	    }
+	    /* previous buffer is given back upon reset of the arena */
+	    if ( sptr2->st_size > sptr1->st_size )  {
+		if ( (newbuf=(char *)psp_arena_alloc(arena,
+				(size_t)sptr2->st_size+sizeof(char)))==NULL ) {
+		    rc=-4; break;
+		}
+		OPENSSL_cleanse(buf, buf_len);
+		buf=newbuf;
+		buf_len=(size_t)sptr2->st_size+sizeof(char);
 	    }
-	    buf=buf_new;
 	    /* swap struct pointers */
 	    sptr3=sptr2; sptr2=sptr1; sptr1=sptr3;
-	    /* wait */
-	    usleep(500);
+	    /* wait for the writer to finish, or just a bit when not watched */
+	    if (psp_watch_wait(watch_id, READ_WAIT_MS)<0)
+		usleep(500);
 	    /* About to read again, make sure we're (again) at the start */
 	    if (lseek(fd,(off_t)0,SEEK_SET)!=0)	{ /* I/O error */
 		rc=-1; break;
@@ -712,15 +2237,108 @@ static int read_proxy(const char *path, int lock_type, char **proxy)  {
     /* unlock and close the file, ignore exitval: we have read already */
     filelock(fd,lock_type,LCK_UNLOCK);
     close(fd);
-    /* reset euid/egid if it was (effective) root. Ignore exit value. */
-    raise_priv(euid,egid);
     /* finalize */
     if (rc!=0)	{
-	free(buf);
+	OPENSSL_cleanse(buf, buf_len);
 	return rc;
     }
-    /* Only now put buf in *proxy */
+    /* Only now put buf in *proxy, without what an earlier, longer read left
+     * behind its end: the caller only cleanses the contents */
     buf[size]='\0'; /* Important: read doesn't add the '\0' */
+    OPENSSL_cleanse(buf+size+1, buf_len-(size_t)size-1);
     *proxy=buf;
+    *st=*sptr2;
+    return 0;
+}
+
+/**
+ * Maps the proxy at path read-only into memory and converts the certificates
+ * in it directly into certstack, without copying the file into a buffer.
+ * Opening, locking, waiting and cached_st are as for read_proxy(). The file
+ * must not be truncated while it is mapped, i.e. writers should replace it
+ * using a rename, as SIGBUS would kill the process: the plugin therefore
+ * does not map the files of a pilot proxy directory, nor in threaded hosts.
+ * Upon successful completion certstack contains the certificates in path and
+ * st the corresponding stat information. When checksum is non-NULL, the
+ * checksum trailer of the mapped contents is checked and set in it, with
+ * *checksum_rc as for psp_pem_checksum_verify().
+ * Return values: as for read_proxy(), and
+ * -7: conversion to certificates failed
+ */
+static int map_proxy(const char *path, int lock_type, int watch_id,
+		     const struct stat *cached_st,
+		     const unsigned char *cached_sum,
+		     STACK_OF(X509) **certstack, struct stat *st,
+		     unsigned char *checksum, int *checksum_rc)	{
+    const int tries=10; /* max number of retries for reading a changing file */
+    int i,fd,rc=0;
+    struct stat st1,st2;
+    void *map;
+    STACK_OF(X509) *chain=NULL;
+    uint64_t start;
+
+    /* Open, lock and check the file */
+    if ( (rc=open_proxy(path, lock_type, &fd, &st1))!=0 )
+	return rc;
+    /* When it's the same file as was cached, we don't need to read it */
+    if ( cached_st && same_file(&st1, cached_st) &&
+	 (cached_sum==NULL || same_checksum(fd, &st1, cached_sum)) )  {
+	filelock(fd,lock_type,LCK_UNLOCK);
+	close(fd);
+	return 1;
+    }
+    /* mapping retry loop */
+    for (i=0; i<tries; i++)   {
+	if (st1.st_size<=0)	{ /* cannot map an empty file */
+	    rc=-7; break;
+	}
+	map=mmap(NULL, (size_t)st1.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map==MAP_FAILED)	{
+	    lcmaps_log(LOG_WARNING, "%s: cannot map proxy %s: %s\n",
+		    __func__, path, strerror(errno));
+	    rc=-1; break;
+	}
+	start=psp_stats_start();
+	rc=psp_pem_to_chain((const char *)map, (size_t)st1.st_size, &chain);
+	psp_stats_record(PSP_STAGE_PILOT_PARSE, start);
+	if (checksum)
+	    *checksum_rc=psp_pem_checksum_verify((const char *)map,
+						 (size_t)st1.st_size, checksum);
+	munmap(map, (size_t)st1.st_size);
+	/* Stat the file */
+	if (fstat(fd,&st2)==-1)    { /* cannot even stat: I/O error */
+	    rc=-1; break;
+	}
+	/* File should not have changed during reading */
+	if ( same_file(&st2, &st1) )   {
+	    rc= (rc==0 ? 0 : -7);
+	    break;
+	}
+	if (rc==0)  {
+	    sk_X509_pop_free(chain, X509_free);
+	    chain=NULL;
+	}
+
+	/* File has changed during reading: retry */
+	if (i<tries-1)	{ /* will be doing a retry */
+	    if ( st2.st_size > PROXY_MAX_SIZE )	{
+		rc=-8; break;
+	    }
+	    st1=st2;
+	    /* wait for the writer to finish, or just a bit when not watched */
+	    if (psp_watch_wait(watch_id, READ_WAIT_MS)<0)
+		usleep(500);
+	} else /* failed too many times */
+	    rc=-5;
+    }
+
+    /* unlock and close the file, ignore exitval: we have read already */
+    filelock(fd,lock_type,LCK_UNLOCK);
+    close(fd);
+    if (rc!=0)
+	return rc;
+
+    *certstack=chain;
+    *st=st2;
     return 0;
 }
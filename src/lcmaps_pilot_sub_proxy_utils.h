@@ -26,8 +26,17 @@
 #define LCMAPS_PILOT_ROBOT_UTILS_H
 
 #include <openssl/x509.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <lcmaps/lcmaps_arguments.h>
 
+#include "lcmaps_pilot_sub_proxy_core.h"
+#include "lcmaps_pilot_sub_proxy_arena.h"
+#include "lcmaps_pilot_sub_proxy_fqan.h"
+#include "lcmaps_pilot_sub_proxy_stats.h"
+
 
 /************************************************************************
  * Typedefs
@@ -36,26 +45,128 @@
 typedef enum lock_type_e    {
     LOCK_NOLOCK	= 0,
     LOCK_FLOCK	= 1,
-    LOCK_FCNTL	= 2
+    LOCK_FCNTL	= 2,
+    LOCK_SEQLOCK = 3	/* no locking: writers only replace the file using a
+			   rename, and its checksum trailer, when present,
+			   identifies its contents */
 } lock_type_t;
 
+typedef enum read_method_e  {
+    READ_METHOD_READ	= 0,	/* read() into a buffer */
+    READ_METHOD_MMAP	= 1	/* mmap() the file */
+} read_method_t;
+
+/** State of a single run or verify call. Everything referenced from it is
+ * owned by the request (i.e. its arena) or by the LCMAPS framework, such that
+ * concurrent requests only share the internally locked caches. */
+typedef struct psp_request_s	{
+    psp_arena_t arena;		    /* owns all memory of the request */
+    char *payload_pem;		    /* payload PEM string when no chain is
+				       given, owned by the framework */
+    unsigned char payload_fingerprint[PSP_DIGEST_LEN]; /* SHA-256 of
+				       payload_pem or of the whole
+				       payload_chain */
+    int have_payload_fingerprint;   /* whether payload_fingerprint is set */
+    STACK_OF(X509) *payload_chain;  /* payload proxy chain */
+    const char *pilot_path;	    /* file holding the pilot proxy, NULL for
+				       the X509_USER_PROXY */
+    const char *log_pilot;	    /* pilot proxy file as known before the
+				       payload is parsed, for rate limiting
+				       warnings, NULL when not known */
+    STACK_OF(X509) *pilot_chain;    /* X509_USER_PROXY chain */
+    X509 *payload_cert;		    /* leaf of payload_chain */
+    X509 *pilot_cert;		    /* leaf of pilot_chain */
+    EVP_PKEY *pilot_key;	    /* cached public key of pilot_cert or NULL */
+    psp_proxy_info_t payload_info;  /* properties of payload_cert */
+    int have_payload_info;	    /* whether payload_info is set */
+    unsigned char payload_digest[PSP_DIGEST_LEN]; /* SHA-256 of payload_cert */
+    int have_payload_digest;	    /* whether payload_digest is set */
+    psp_proxy_info_t pilot_info;    /* properties of pilot_cert */
+    int have_pilot_info;	    /* whether pilot_info is set */
+    unsigned char pilot_digest[PSP_DIGEST_LEN]; /* SHA-256 of pilot_cert */
+    int have_pilot_digest;	    /* whether pilot_digest is set */
+    time_t pilot_chain_valid_until; /* pilot_chain validated until, 0 when
+				       not validated */
+    struct stat pilot_st;	    /* stat of X509_USER_PROXY when read */
+    int pilot_st_exact;		    /* whether pilot_st identifies the
+				       contents that were read */
+    int have_pilot_st;		    /* whether pilot_st is set */
+    char *payload_dn;		    /* one-line DN of payload_cert or NULL,
+				       owned by arena */
+    int nfqans;			    /* number of FQANs, -1 when not obtained */
+    char **fqans;		    /* FQANs, owned by the framework */
+    psp_fqan_result_t fqan_result;  /* FQANs matching the FQAN patterns */
+} psp_request_t;
+
 
 /************************************************************************
  * Function prototypes
  ************************************************************************/
 
 /**
- * Retrieves the X509_USER_PROXY certificate stack.
+ * Initializes an empty request context
+ */
+void psp_request_init(psp_request_t *req);
+
+/**
+ * Releases everything owned by the request context, after which it can be
+ * reused as if just initialized.
+ */
+void psp_request_cleanup(psp_request_t *req);
+
+/**
+ * Retrieves the certificate stack of the pilot proxy in req->pilot_path, set
+ * to the X509_USER_PROXY when NULL, into req->pilot_chain, and its leaf into
+ * req->pilot_cert, together with the cached public key, digest and
+ * properties of the leaf. The request holds its own references, such that
+ * the cache can be updated concurrently.
+ * When use_payload_chain is set and req->payload_chain consists of one
+ * certificate followed by the cached chain for X509_USER_PROXY, the cached
+ * chain is used without reading the file, provided the file still passes
+ * the ownership and mode checks and its stat still identifies the cached
+ * contents. read_method specifies how the
+ * file is read, any temporary buffers are allocated from the request arena.
+ * The stat of the file only identifies the contents when it was not changed
+ * within the second it was read (see req->pilot_st_exact), as inodes can be
+ * reused. With LOCK_SEQLOCK the file is not locked, as writers only replace
+ * it, and when it ends with a checksum trailer (see PSP_PEM_CHECKSUM_TAG),
+ * the read contents must match it, and a file with the same stat and
+ * trailer is taken to be unchanged even when its stat alone does not tell.
  * \return 0 on success, -1 on error.
  */
-int psp_get_pilot_proxy(STACK_OF(X509) **certstack, lock_type_t lock_type);
+int psp_get_pilot_proxy(psp_request_t *req, lock_type_t lock_type,
+			read_method_t read_method, int use_payload_chain);
 
 /**
- * Gets payload PEM or cert chain from LCMAPS framework
+ * Opens the pilot proxy file at path like it is done for reading it, i.e. as
+ * the real uid and requiring it to be owned by the real uid and inaccessible
+ * for anyone else, and obtains its stat information into st without reading
+ * it.
  * \return 0 on success, -1 on error
  */
-int psp_get_payload_proxy(STACK_OF(X509) **certstack,
-                      int argc, lcmaps_argument_t *argv);
+int psp_stat_pilot_proxy(const char *path, struct stat *st);
+
+/**
+ * Gets the payload cert chain, or otherwise the PEM string, from the LCMAPS
+ * framework into req->payload_chain or req->payload_pem, without converting
+ * the PEM string, and sets req->payload_fingerprint for
+ * psp_reject_cache_lookup() and psp_shm_lookup(): the SHA-256 digest of the
+ * PEM string, or of the digests of all certs of the chain, such that it
+ * covers the whole chain. For a chain, the digest of its leaf is also set as
+ * req->payload_digest.
+ * \return 0 on success, -1 on error
+ */
+int psp_get_payload_input(psp_request_t *req, int argc,
+			  lcmaps_argument_t *argv);
+
+/**
+ * Sets req->payload_chain and req->payload_cert, converting the PEM string
+ * obtained by psp_get_payload_input() when there is no chain. A chain
+ * converted from the PEM string is owned by the request, one from the
+ * framework by the framework.
+ * \return 0 on success, -1 on error
+ */
+int psp_get_payload_proxy(psp_request_t *req);
 
 /**
  * Obtains the FQANs from the plugin arguments
@@ -64,10 +175,90 @@ int psp_get_payload_proxy(STACK_OF(X509) **certstack,
 int psp_get_fqans(int *nfqans, char ***fqans, int argc, lcmaps_argument_t *argv);
 
 /**
- * Verifies that payload proxy is signed by pilot proxy
+ * Verifies that req->payload_cert is signed by req->pilot_cert. Results are
+ * cached based on the SHA-256 digests of both certificates until the first of
+ * them expires. A public key that is not cached is owned by the request.
+ * For valid proxies, the one-line DN of the payload is cached along with the
+ * result and set in req->payload_dn.
+ * \return 0 on success, -1 on error
+ */
+int psp_verify_proxy_signature(psp_request_t *req);
+
+/**
+ * Checks that the public key of cert is of one of the allowed_types
+ * (bitmask of PSP_KEY_*) and, for RSA, has at least min_rsa_bits bits. what
+ * names the certificate in the log message on failure.
+ * \return 0 when the key is allowed, -1 when not
+ */
+int psp_check_key_policy(X509 *cert, const char *what,
+			 unsigned int allowed_types, int min_rsa_bits);
+
+/**
+ * Checks that the subject of req->payload_cert is its issuer plus a CN in a
+ * new RDN, as for every proxy. Only compares the names, hence it is cheap
+ * enough to be done before anything else about the payload.
+ * \return 0 on success, -1 on error
+ */
+int psp_check_payload_subject(psp_request_t *req);
+
+/**
+ * Checks that the issuer of req->payload_cert is the subject of
+ * req->pilot_cert, such that a payload issued by another proxy is rejected
+ * without verifying its signature.
+ * \return 0 on success, -1 on error
+ */
+int psp_check_payload_issuer(psp_request_t *req);
+
+/**
+ * Checks that req->payload_chain consists of exactly one new proxy followed
+ * by req->pilot_chain, by comparing the certificates, and that the new proxy
+ * is a valid delegation of the pilot: currently valid, with a subject
+ * extending that of the pilot by one CN, and allowed by the proxy path length
+ * constraints in the pilot chain. Its signature is checked separately by
+ * psp_verify_proxy_signature().
+ * \return 0 on success, -1 on error
+ */
+int psp_verify_payload_link(psp_request_t *req);
+
+/**
+ * Validates req->pilot_chain against the CAs in store, allowing proxy
+ * certificates. Successful results are cached with the pilot chain until the
+ * first certificate in the validated chain expires, or earlier as the CRLs
+ * need to be read again (see psp_core_verify_chain()).
+ * \return 0 on success, -1 on error
+ */
+int psp_verify_pilot_chain(psp_request_t *req, X509_STORE *store);
+
+/**
+ * Creates a certificate store for psp_verify_pilot_chain() for the CA
+ * certificates and CRLs in the hashed directory certdir.
+ * \return new store or NULL on error
+ */
+X509_STORE *psp_cert_store_new(const char *certdir);
+
+/**
+ * Sets up the OpenSSL state that is otherwise initialized lazily by the first
+ * request: error strings, digest implementations, the ASN.1 method of the
+ * proxyCertInfo extension and the tables used for subject names. Needs
+ * psp_oid_init().
+ * \return 0 on success, -1 on error
+ */
+int psp_warmup(void);
+
+/**
+ * Obtains the properties of given proxy certificate, decoding its extensions
+ * only once.
  * \return 0 on success, -1 on error
  */
-int psp_verify_proxy_signature(X509 *payload, X509 *pilot);
+int psp_classify_proxy(X509 *proxy, psp_proxy_info_t *info);
+
+/**
+ * Obtains the properties of both leaf proxies of the request into
+ * req->pilot_info and req->payload_info, using the cached properties for the
+ * pilot proxy when available and skipping those that are already set.
+ * \return 0 on success, -1 on error
+ */
+int psp_classify_request(psp_request_t *req);
 
 /**
  * Checks whether given proxy certificate is an RFC proxy
@@ -82,17 +273,12 @@ int psp_proxy_is_rfc(X509 *proxy);
 int psp_proxy_is_limited(X509 *proxy);
 
 /**
- * Checks whether one of the FQANs matches the given pattern
- * \return 1 when found, 0 when not.
- */
-int psp_match_fqan(int nfqan, char **fqans, const char *pattern);
-
-/**
- * Gets subjectDN of the payload proxy and stores it into the LCMAPS framework
- * as the user_dn
+ * Gets subjectDN of the payload proxy, from req->payload_dn when already set
+ * by psp_verify_proxy_signature(), and stores it into the LCMAPS framework as
+ * the user_dn. The DN string is owned by the request arena.
  * \return 0 on success, -1 on error
  */
-int psp_store_proxy_dn(X509 *payload);
+int psp_store_proxy_dn(psp_request_t *req);
 
 /**
  * Stores the FQANs in the 'run-time' credential data, such that they can be
@@ -102,8 +288,45 @@ int psp_store_proxy_dn(X509 *payload);
 int psp_store_fqans(int nfqans, char **fqans);
 
 /**
- * Clean memory in pilot and/or payload chains
+ * Stores all credential data of the request in one step: the DN of the
+ * payload proxy and, when add_fqans is set, the FQANs. When add_vo_data is set
+ * as well, the FQANs are also stored as parsed LCMAPS_VO_CRED structures, such
+ * that downstream plugins do not need to parse the strings again. Scratch
+ * memory is sized from the number of FQANs and owned by the request arena.
+ * \return 0 on success, -1 on error
+ */
+int psp_store_credentials(psp_request_t *req, int add_fqans, int add_vo_data);
+
+/**
+ * Frees all the pilot chains in the pilot cache
+ */
+void psp_cleanup_pilot_cache(void);
+
+/**
+ * Empties the cache of signature verification results
+ */
+void psp_cleanup_verdict_cache(void);
+
+/**
+ * Looks up req->payload_fingerprint in the cache of recently rejected
+ * payloads. Rejections that depended on the pilot proxy are only found
+ * while its file is the same unchanged file.
+ * \return 1 when found, with reason set to the failure counter of the
+ * rejection, 0 when not found
+ */
+int psp_reject_cache_lookup(psp_request_t *req, psp_counter_t *reason);
+
+/**
+ * Remembers the rejection of the payload in req for a short while, for
+ * given failure counter. When req->pilot_cert is set, the rejection is taken
+ * to depend on the pilot proxy and is bound to the path and stat of its file,
+ * and it is not remembered when that might not match its contents.
+ */
+void psp_reject_cache_store(psp_request_t *req, psp_counter_t reason);
+
+/**
+ * Empties the cache of recently rejected payloads
  */
-void psp_cleanup_chains(STACK_OF(X509) *pilot, STACK_OF(X509) *payload);
+void psp_cleanup_reject_cache(void);
 
 #endif /* LCMAPS_PILOT_ROBOT_UTILS_H */
@@ -0,0 +1,522 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+/**
+ * NOTES: change detector for the pilot proxy files. The parent directory of
+ * each file, or in directory mode the directory of pilot proxies, is watched
+ * using inotify, such that changes are noticed without having to stat the
+ * file, and such that readers can wait for a writer to finish instead of
+ * polling. Events are processed by the caller whenever it
+ * asks for the state of a watch, hence there is no background thread. All
+ * state is protected by a mutex; of the threads waiting for a writer only one
+ * polls the inotify descriptor, the others wait for it on a condition. */
+
+/* needed for e.g. strdup and clock_gettime */
+#define _XOPEN_SOURCE	600
+
+#include "lcmaps_plugins_pilot_sub_proxy_config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#   include <sys/inotify.h>
+#   include <sys/types.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#   include <fcntl.h>
+#   include <poll.h>
+#   include <time.h>
+#   include <pthread.h>
+#endif
+
+#include <lcmaps/lcmaps_log.h>
+
+#include "lcmaps_pilot_sub_proxy_watch.h"
+
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/** Maximum number of watched files */
+#define WATCH_MAX	    16
+
+/** Events on the watched directory that are relevant for its files */
+#define WATCH_DIR_EVENTS    (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+			     IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE | \
+			     IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/** Events on a file meaning a writer has finished */
+#define WATCH_WRITTEN	    (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
+
+/** Events meaning the watch itself is no longer usable */
+#define WATCH_GONE	    (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | \
+			     IN_UNMOUNT)
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** A watched file or directory */
+typedef struct watch_s	{
+    char *path;			/* full path, NULL when unused */
+    const char *base;		/* basename, points into path, NULL when
+				   watching the directory path itself */
+    int wd;			/* inotify watch descriptor, -1 when gone */
+    unsigned long generation;	/* change counter, starts at 1 */
+    unsigned long writes;	/* number of times a writer finished */
+} watch_t;
+
+
+/************************************************************************
+ * Global variables
+ ************************************************************************/
+
+/** inotify file descriptor, -1 when not watching */
+static int inotify_fd=-1;
+
+/** The watched files */
+static watch_t watches[WATCH_MAX];
+
+/** Protects inotify_fd, watches and polling */
+static pthread_mutex_t watch_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+/** Signalled when the polling thread has processed new events */
+static pthread_cond_t watch_cond;
+
+/** Whether a thread is polling inotify_fd */
+static int polling=0;
+
+
+/************************************************************************
+ * Static prototypes
+ ************************************************************************/
+
+/* Processes all pending inotify events without blocking. Needs watch_mutex.
+ * \return 0 on success, -1 on error */
+static int watch_drain(void);
+
+#endif /* HAVE_SYS_INOTIFY_H */
+
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/**
+ * Starts the change detector for proxy files. Without inotify support this
+ * is a no-op and all other functions report that nothing is watched.
+ * \return 0 on success, -1 on error
+ */
+int psp_watch_init(void)    {
+#ifdef HAVE_SYS_INOTIFY_H
+    pthread_condattr_t attr;
+    int i, rc=0;
+
+    pthread_mutex_lock(&watch_mutex);
+    if (inotify_fd!=-1)
+	goto end;
+
+    /* Waiting uses the monotonic clock, as for the deadline */
+    if ( pthread_condattr_init(&attr)!=0 )  {
+	lcmaps_log(LOG_ERR, "%s: cannot initialize condition\n", __func__);
+	rc=-1;
+	goto end;
+    }
+    if ( pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)!=0 ||
+	 pthread_cond_init(&watch_cond, &attr)!=0 )   {
+	lcmaps_log(LOG_ERR, "%s: cannot initialize condition\n", __func__);
+	pthread_condattr_destroy(&attr);
+	rc=-1;
+	goto end;
+    }
+    pthread_condattr_destroy(&attr);
+
+    if ( (inotify_fd=inotify_init())==-1 ||
+	 fcntl(inotify_fd, F_SETFL, O_NONBLOCK)==-1 ||
+	 fcntl(inotify_fd, F_SETFD, FD_CLOEXEC)==-1 )	{
+	lcmaps_log(LOG_ERR, "%s: cannot initialize inotify: %s\n",
+		__func__, strerror(errno));
+	if (inotify_fd!=-1)
+	    close(inotify_fd);
+	inotify_fd=-1;
+	pthread_cond_destroy(&watch_cond);
+	rc=-1;
+	goto end;
+    }
+    for (i=0; i<WATCH_MAX; i++)	{
+	watches[i].path=NULL;
+	watches[i].wd=-1;
+    }
+    polling=0;
+
+end:
+    pthread_mutex_unlock(&watch_mutex);
+    return rc;
+#else
+    lcmaps_log(LOG_INFO,
+	    "%s: no inotify support, will stat proxy files instead\n",
+	    __func__);
+
+    return 0;
+#endif
+}
+
+/**
+ * Stops the change detector and removes all watches
+ */
+void psp_watch_cleanup(void)	{
+#ifdef HAVE_SYS_INOTIFY_H
+    int i;
+
+    pthread_mutex_lock(&watch_mutex);
+    if (inotify_fd==-1)	{
+	pthread_mutex_unlock(&watch_mutex);
+	return;
+    }
+
+    /* Closing the descriptor removes all the watches */
+    close(inotify_fd);
+    inotify_fd=-1;
+    for (i=0; i<WATCH_MAX; i++)	{
+	free(watches[i].path);
+	watches[i].path=NULL;
+	watches[i].wd=-1;
+    }
+    pthread_cond_destroy(&watch_cond);
+    pthread_mutex_unlock(&watch_mutex);
+#endif
+}
+
+/**
+ * Starts watching path, by watching its parent directory. Paths that are
+ * symbolic links are not watched, and neither is anything when
+ * psp_watch_init() has not been called.
+ * \return watch id (>=0) on success, -1 when path cannot be watched
+ */
+int psp_watch_add(const char *path) {
+#ifdef HAVE_SYS_INOTIFY_H
+    struct stat st;
+    char *copy, *slash;
+    int i, free_slot=-1, wd;
+
+    if (path==NULL)
+	return -1;
+
+    pthread_mutex_lock(&watch_mutex);
+    if (inotify_fd==-1)
+	goto fail;
+
+    /* Already watched? */
+    for (i=0; i<WATCH_MAX; i++)	{
+	if (watches[i].path && watches[i].base &&
+	    strcmp(watches[i].path, path)==0)  {
+	    if (watches[i].wd!=-1)  {
+		pthread_mutex_unlock(&watch_mutex);
+		return i;
+	    }
+	    /* Watch is gone, e.g. directory was moved: try again */
+	    free(watches[i].path);
+	    watches[i].path=NULL;
+	}
+	if (watches[i].path==NULL && free_slot==-1)
+	    free_slot=i;
+    }
+    if (free_slot==-1)
+	goto fail;
+
+    /* Changes to the target of a symlink would go unnoticed */
+    if (lstat(path, &st)==-1 || !S_ISREG(st.st_mode))
+	goto fail;
+
+    if ( (copy=strdup(path))==NULL )
+	goto fail;
+    /* Watch the directory: files are typically replaced by a rename */
+    if ( (slash=strrchr(copy, '/'))==NULL )
+	wd=inotify_add_watch(inotify_fd, ".", WATCH_DIR_EVENTS);
+    else if (slash==copy)
+	wd=inotify_add_watch(inotify_fd, "/", WATCH_DIR_EVENTS);
+    else    {
+	*slash='\0';
+	wd=inotify_add_watch(inotify_fd, copy, WATCH_DIR_EVENTS);
+	*slash='/';
+    }
+    if (wd==-1)	{
+	lcmaps_log(LOG_INFO, "%s: cannot watch directory of %s: %s\n",
+		__func__, path, strerror(errno));
+	free(copy);
+	goto fail;
+    }
+
+    watches[free_slot].path=copy;
+    watches[free_slot].base=(slash ? slash+1 : copy);
+    watches[free_slot].wd=wd;
+    watches[free_slot].generation=1;
+    watches[free_slot].writes=0;
+    pthread_mutex_unlock(&watch_mutex);
+
+    return free_slot;
+
+fail:
+    pthread_mutex_unlock(&watch_mutex);
+    return -1;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Starts watching directory dir itself: any change to the directory or to a
+ * file in it increases the change counter of the watch. Directories that are
+ * symbolic links are not watched, and neither is anything when
+ * psp_watch_init() has not been called.
+ * \return watch id (>=0) on success, -1 when dir cannot be watched
+ */
+int psp_watch_add_dir(const char *dir) {
+#ifdef HAVE_SYS_INOTIFY_H
+    struct stat st;
+    char *copy;
+    int i, free_slot=-1, wd;
+
+    if (dir==NULL)
+	return -1;
+
+    pthread_mutex_lock(&watch_mutex);
+    if (inotify_fd==-1)
+	goto fail;
+
+    /* Already watched? */
+    for (i=0; i<WATCH_MAX; i++)	{
+	if (watches[i].path && watches[i].base==NULL &&
+	    strcmp(watches[i].path, dir)==0)  {
+	    if (watches[i].wd!=-1)  {
+		pthread_mutex_unlock(&watch_mutex);
+		return i;
+	    }
+	    /* Watch is gone, e.g. directory was moved: try again */
+	    free(watches[i].path);
+	    watches[i].path=NULL;
+	}
+	if (watches[i].path==NULL && free_slot==-1)
+	    free_slot=i;
+    }
+    if (free_slot==-1)
+	goto fail;
+
+    if (lstat(dir, &st)==-1 || !S_ISDIR(st.st_mode))
+	goto fail;
+
+    if ( (copy=strdup(dir))==NULL )
+	goto fail;
+    if ( (wd=inotify_add_watch(inotify_fd, copy, WATCH_DIR_EVENTS))==-1 )  {
+	lcmaps_log(LOG_INFO, "%s: cannot watch directory %s: %s\n",
+		__func__, dir, strerror(errno));
+	free(copy);
+	goto fail;
+    }
+
+    watches[free_slot].path=copy;
+    watches[free_slot].base=NULL;
+    watches[free_slot].wd=wd;
+    watches[free_slot].generation=1;
+    watches[free_slot].writes=0;
+    pthread_mutex_unlock(&watch_mutex);
+
+    return free_slot;
+
+fail:
+    pthread_mutex_unlock(&watch_mutex);
+    return -1;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Obtains the change counter of the watch with given id, after processing
+ * all pending events. Any change to the watched file increases the counter.
+ * \return change counter, 0 when id is not (or no longer) a valid watch
+ */
+unsigned long psp_watch_generation(int id)  {
+#ifdef HAVE_SYS_INOTIFY_H
+    unsigned long generation=0;
+
+    if (id<0 || id>=WATCH_MAX)
+	return 0;
+
+    pthread_mutex_lock(&watch_mutex);
+    if (watches[id].path && watch_drain()==0 && watches[id].wd!=-1)
+	generation=watches[id].generation;
+    pthread_mutex_unlock(&watch_mutex);
+
+    return generation;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Waits at most timeout_ms milliseconds for a writer of the watched file to
+ * close or replace it.
+ * \return 0 when the file was written, 1 on timeout, -1 on error or when id
+ * is not a valid watch.
+ */
+int psp_watch_wait(int id, int timeout_ms)  {
+#ifdef HAVE_SYS_INOTIFY_H
+    struct pollfd pfd;
+    struct timespec now, end;
+    unsigned long writes;
+    long remain;
+    int rc, save_errno;
+
+    if (id<0 || id>=WATCH_MAX)
+	return -1;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &end)==-1)
+	return -1;
+    end.tv_sec += timeout_ms/1000;
+    end.tv_nsec += (long)(timeout_ms%1000)*1000000L;
+    if (end.tv_nsec >= 1000000000L) {
+	end.tv_sec++;
+	end.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&watch_mutex);
+    if (watches[id].path==NULL || watches[id].wd==-1)  {
+	pthread_mutex_unlock(&watch_mutex);
+	return -1;
+    }
+    /* Events that are already pending count as well */
+    writes=watches[id].writes;
+    pfd.fd=inotify_fd;
+    pfd.events=POLLIN;
+    for (;;)	{
+	/* Process the events and check whether our file was written */
+	if (watch_drain()!=0 || watches[id].wd==-1)	{
+	    rc=-1; break;
+	}
+	if (watches[id].writes!=writes)	{
+	    rc=0; break;
+	}
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now)==-1)	{
+	    rc=-1; break;
+	}
+	remain=(long)(end.tv_sec-now.tv_sec)*1000L +
+	       (end.tv_nsec-now.tv_nsec)/1000000L;
+	if (remain<=0)	{
+	    rc=1; break;
+	}
+
+	if (!polling)	{
+	    /* Poll without holding the lock, then tell the others */
+	    polling=1;
+	    pthread_mutex_unlock(&watch_mutex);
+	    rc=poll(&pfd, 1, (int)remain);
+	    save_errno=errno;
+	    pthread_mutex_lock(&watch_mutex);
+	    polling=0;
+	    pthread_cond_broadcast(&watch_cond);
+	    if (rc==-1 && save_errno!=EINTR)
+		break;
+	} else
+	    pthread_cond_timedwait(&watch_cond, &watch_mutex, &end);
+    }
+    pthread_mutex_unlock(&watch_mutex);
+
+    return rc;
+#else
+    return -1;
+#endif
+}
+
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Processes all pending inotify events without blocking. Needs watch_mutex.
+ * \return 0 on success, -1 on error
+ */
+static int watch_drain(void)	{
+    char buf[4096]
+	__attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t len;
+    char *ptr;
+    int i;
+
+    for (;;)	{
+	len=read(inotify_fd, buf, sizeof(buf));
+	if (len==-1)	{
+	    if (errno==EAGAIN || errno==EWOULDBLOCK)
+		return 0;
+	    if (errno==EINTR)
+		continue;
+	    return -1;
+	}
+	if (len==0)
+	    return 0;
+
+	for (ptr=buf; ptr<buf+len; ptr+=sizeof(struct inotify_event)+ev->len)
+	{
+	    ev=(const struct inotify_event *)ptr;
+
+	    /* Lost events: everything might have changed */
+	    if (ev->mask & IN_Q_OVERFLOW)	{
+		for (i=0; i<WATCH_MAX; i++)
+		    watches[i].generation++;
+		continue;
+	    }
+
+	    for (i=0; i<WATCH_MAX; i++)	{
+		if (watches[i].path==NULL || watches[i].wd!=ev->wd)
+		    continue;
+		if (ev->mask & WATCH_GONE)  {
+		    /* Directory itself is gone or moved */
+		    watches[i].generation++;
+		    watches[i].wd=-1;
+		} else if (watches[i].base==NULL)   {
+		    /* Watching the directory itself */
+		    watches[i].generation++;
+		} else if (ev->len>0 &&
+			   strcmp(ev->name, watches[i].base)==0)  {
+		    watches[i].generation++;
+		    if (ev->mask & WATCH_WRITTEN)
+			watches[i].writes++;
+		}
+	    }
+	}
+    }
+}
+
+#endif /* HAVE_SYS_INOTIFY_H */
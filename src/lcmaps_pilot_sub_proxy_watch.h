@@ -0,0 +1,77 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+#ifndef LCMAPS_PILOT_SUB_PROXY_WATCH_H
+#define LCMAPS_PILOT_SUB_PROXY_WATCH_H
+
+
+/************************************************************************
+ * Function prototypes
+ ************************************************************************/
+
+/**
+ * Starts the change detector for proxy files. Without inotify support this
+ * is a no-op and all other functions report that nothing is watched.
+ * \return 0 on success, -1 on error
+ */
+int psp_watch_init(void);
+
+/**
+ * Stops the change detector and removes all watches
+ */
+void psp_watch_cleanup(void);
+
+/**
+ * Starts watching path, by watching its parent directory. Paths that are
+ * symbolic links are not watched, and neither is anything when
+ * psp_watch_init() has not been called.
+ * \return watch id (>=0) on success, -1 when path cannot be watched
+ */
+int psp_watch_add(const char *path);
+
+/**
+ * Starts watching directory dir itself: any change to the directory or to a
+ * file in it increases the change counter of the watch. Directories that are
+ * symbolic links are not watched, and neither is anything when
+ * psp_watch_init() has not been called.
+ * \return watch id (>=0) on success, -1 when dir cannot be watched
+ */
+int psp_watch_add_dir(const char *dir);
+
+/**
+ * Obtains the change counter of the watch with given id, after processing
+ * all pending events. Any change to the watched file increases the counter.
+ * \return change counter, 0 when id is not (or no longer) a valid watch
+ */
+unsigned long psp_watch_generation(int id);
+
+/**
+ * Waits at most timeout_ms milliseconds for a writer of the watched file to
+ * close or replace it.
+ * \return 0 when the file was written, 1 on timeout, -1 on error or when id
+ * is not a valid watch.
+ */
+int psp_watch_wait(int id, int timeout_ms);
+
+#endif /* LCMAPS_PILOT_SUB_PROXY_WATCH_H */
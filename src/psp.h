@@ -0,0 +1,220 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+/**
+ * NOTES: libpsp, the pilot sub-proxy checks of the LCMAPS plugin as a library
+ * that can be used without LCMAPS. A context holds the configuration, the
+ * cache of verification results, the cache of pilot chains loaded from files
+ * and statistics, and can be used by multiple threads at once. Nothing is
+ * logged, the result of each check is its status. Hosts running an event
+ * loop can load pilot proxies without blocking using psp_load_pilot().
+ */
+
+#ifndef PSP_H
+#define PSP_H
+
+#include <stddef.h>
+#include <openssl/x509.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+/* Public key types, as bitmask for psp_config_t.key_types */
+#define PSP_KEY_RSA	(1<<0)	/* RSA, including RSA-PSS keys */
+#define PSP_KEY_EC	(1<<1)	/* ECDSA on any named curve */
+#define PSP_KEY_ED25519	(1<<2)	/* Ed25519 */
+#define PSP_KEY_ALL	(PSP_KEY_RSA|PSP_KEY_EC|PSP_KEY_ED25519)
+
+
+/************************************************************************
+ * Typedefs
+ ************************************************************************/
+
+/** Result of checking a payload and pilot proxy pair, in the order in which
+ * the checks are done */
+typedef enum psp_status_e   {
+    PSP_OK = 0,			/* payload is a valid sub-proxy of the pilot */
+    PSP_ERR_INPUT,		/* payload or pilot is missing or unparsable */
+    PSP_ERR_FILE,		/* pilot proxy file cannot be read or has
+				   unsafe permissions */
+    PSP_ERR_MEMORY,		/* out of memory */
+    PSP_ERR_ISSUER,		/* payload subject does not extend its issuer,
+				   or its issuer is not the pilot subject */
+    PSP_ERR_PAYLOAD,		/* payload cannot be classified */
+    PSP_ERR_NOT_RFC,		/* payload or pilot is not an RFC proxy */
+    PSP_ERR_NOT_LIMITED,	/* payload or pilot is not a limited proxy */
+    PSP_ERR_EXPIRED,		/* payload or pilot is not valid now */
+    PSP_ERR_KEY,		/* public key not allowed by the key policy */
+    PSP_ERR_PILOT,		/* pilot cannot be classified */
+    PSP_ERR_CHAIN,		/* pilot chain or its link with the payload
+				   is invalid, only with a certdir */
+    PSP_ERR_SIGNATURE,		/* payload is not signed by the pilot */
+    PSP_NSTATUS			/* number of status values */
+} psp_status_t;
+
+/** Configuration of a context, see psp_config_init() for the defaults */
+typedef struct psp_config_s {
+    int require_limited;	/* payload and pilot must be limited proxies,
+				   default yes */
+    unsigned int key_types;	/* allowed public key types (PSP_KEY_*),
+				   default all */
+    int min_rsa_bits;		/* minimum size of RSA keys, default 0 */
+    const char *certdir;	/* when set, validate the pilot chain against
+				   the CAs in this directory, default NULL */
+    int nthreads;		/* threads used by psp_verify_many(), including
+				   the calling one: the others form a pool
+				   started by psp_ctx_new(), default 1 */
+} psp_config_t;
+
+/** A payload proxy and the pilot proxy it should be a sub-proxy of. The
+ * payload is given either as chain, starting with its leaf, or as PEM data.
+ * The pilot chain starts with the pilot proxy, and is only needed in full
+ * when using a certdir. It can also be given as the path of its proxy file,
+ * which is then loaded through the pilot cache of the context, see
+ * psp_load_pilot(). Everything is owned by the caller. */
+typedef struct psp_pair_s   {
+    STACK_OF(X509) *payload_chain;  /* payload chain, or NULL */
+    const char *payload_pem;	    /* PEM data when payload_chain is NULL */
+    size_t payload_pem_len;	    /* length of payload_pem */
+    STACK_OF(X509) *pilot_chain;    /* pilot chain, or NULL */
+    const char *pilot_path;	    /* pilot proxy file when pilot_chain is
+				       NULL */
+} psp_pair_t;
+
+/** Result for a psp_pair_t, to be cleaned up using psp_result_cleanup() */
+typedef struct psp_result_s {
+    psp_status_t status;	/* result of the checks */
+    char *payload_dn;		/* one-line subject DN of the payload for
+				   PSP_OK, NULL otherwise */
+} psp_result_t;
+
+/** Statistics of a context, as obtained by psp_ctx_stats() */
+typedef struct psp_stats_s  {
+    unsigned long checked;		/* pairs checked */
+    unsigned long status[PSP_NSTATUS];	/* pairs per status */
+    unsigned long verdict_cache_hit;	/* signatures found in the cache */
+    unsigned long verdict_cache_miss;	/* signatures verified */
+    unsigned long batch_duplicates;	/* pairs of psp_verify_many() equal to
+					   an earlier pair in the batch */
+    unsigned long pilot_cache_hit;	/* pilot chains used without I/O */
+    unsigned long pilot_loads;		/* pilot proxy files opened */
+    unsigned long pilot_coalesced;	/* psp_load_pilot() calls joining a
+					   load in progress */
+} psp_stats_t;
+
+/** Context, see psp_ctx_new() */
+typedef struct psp_ctx_s psp_ctx_t;
+
+/** Callback of psp_load_pilot(), called with the arg given to it. On PSP_OK,
+ * pilot_chain is a new reference owned by the callback, to be freed using
+ * sk_X509_pop_free(pilot_chain, X509_free), otherwise it is NULL. */
+typedef void (*psp_load_cb_t)(void *arg, psp_status_t status,
+			      STACK_OF(X509) *pilot_chain);
+
+
+/************************************************************************
+ * Function prototypes
+ ************************************************************************/
+
+/**
+ * Sets cfg to the defaults, which match those of the LCMAPS plugin
+ */
+void psp_config_init(psp_config_t *cfg);
+
+/**
+ * Creates a context using a copy of cfg, or the defaults when cfg is NULL.
+ * \return new context or NULL when the configuration is invalid (e.g. an
+ * unusable certdir) or on memory error
+ */
+psp_ctx_t *psp_ctx_new(const psp_config_t *cfg);
+
+/**
+ * Frees ctx and everything it holds. Callbacks of pilot loads still queued
+ * are called with PSP_ERR_FILE. Must not be called from such a callback.
+ */
+void psp_ctx_free(psp_ctx_t *ctx);
+
+/**
+ * Loads the pilot proxy in path without blocking on file I/O, for use as
+ * pilot_chain of a psp_pair_t, or for warming the pilot cache of ctx that
+ * pilot_path uses. When the chain was cached and its file checked less than a
+ * second ago, cb is called before returning. Otherwise the file is checked,
+ * and read when changed, by the loader thread of ctx, which then calls cb:
+ * concurrent loads of the same path share that one read. The loader thread
+ * is the only thread calling cb, so callbacks should not block.
+ * \return 0 when cb has been called already, 1 when it will be called by
+ * the loader thread, -1 on error, in which case cb is never called
+ */
+int psp_load_pilot(psp_ctx_t *ctx, const char *path, psp_load_cb_t cb,
+		   void *arg);
+
+/**
+ * Checks that the payload of pair is a valid sub-proxy of its pilot, like
+ * the LCMAPS plugin does, and fills in result. Signature verification
+ * results are cached in ctx until the first of the two proxies expires.
+ * \return result->status
+ */
+psp_status_t psp_verify(psp_ctx_t *ctx, const psp_pair_t *pair,
+			psp_result_t *result);
+
+/**
+ * Checks the n pairs as psp_verify() does, into the corresponding results,
+ * i.e. in input order. Pairs equal to an earlier one in the batch, with the
+ * same payload and the same pilot chain, are only checked once. The others
+ * are spread over the calling thread and the worker pool of ctx, which serves
+ * one batch at a time: a batch given while the pool is busy is checked by
+ * its calling thread alone.
+ * \return number of pairs with status PSP_OK
+ */
+size_t psp_verify_many(psp_ctx_t *ctx, const psp_pair_t *pairs, size_t n,
+		       psp_result_t *results);
+
+/**
+ * Frees what result holds, after which it can be reused
+ */
+void psp_result_cleanup(psp_result_t *result);
+
+/**
+ * Obtains the statistics of ctx into stats
+ */
+void psp_ctx_stats(psp_ctx_t *ctx, psp_stats_t *stats);
+
+/**
+ * Describes status
+ * \return static string
+ */
+const char *psp_status_string(psp_status_t status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PSP_H */
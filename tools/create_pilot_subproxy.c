@@ -0,0 +1,217 @@
+/**
+ * Copyright (c) FOM-Nikhef 2015-
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ *  Authors:
+ *  2015-
+ *     Mischa Sall\'e <msalle@nikhef.nl>
+ *     NIKHEF Amsterdam, the Netherlands
+ *     <grid-mw-security@nikhef.nl>
+ *
+ */
+
+
+/**
+ * NOTES: creates a limited proxy delegation of the X509_USER_PROXY with an
+ * extra CN, like create_pilot_subproxy.sh, but without running openssl and
+ * optionally using keys generated in advance.
+ * Usage: create_pilot_subproxy [options] <CN value> [payload proxyfile]
+ *	  create_pilot_subproxy -p pooldir -n count [-k keytype] */
+
+/* needed for getopt */
+#define _XOPEN_SOURCE	600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+
+#include "lcmaps_pilot_sub_proxy_mint.h"
+
+
+/************************************************************************
+ * Defines
+ ************************************************************************/
+
+#define DEFAULT_KEY_TYPE    "rsa:1024"
+#define DEFAULT_HOURS	    24
+
+/** Suffix of the default payload proxyfile */
+#define PAYLOAD_SUFFIX	    "_payload"
+
+
+/************************************************************************
+ * Private functions
+ ************************************************************************/
+
+/**
+ * Prints the usage
+ */
+static void usage(const char *prog)	{
+    fprintf(stderr,
+	"Usage: %s [options] <CN value> [payload proxyfile]\n"
+	"       %s -p pooldir -n count [-k keytype]\n"
+	"  -k keytype   rsa:<bits> (default %s), ec[:<curve>] or ed25519\n"
+	"  -p pooldir   take the key from the pool of keys in pooldir\n"
+	"  -n count     add count keys to the pool instead\n"
+	"  -l hours     lifetime, limited by that of the X509_USER_PROXY\n"
+	"               (default %d)\n",
+	prog, prog, DEFAULT_KEY_TYPE, DEFAULT_HOURS);
+}
+
+/**
+ * Prints msg and the OpenSSL errors
+ * \return 1
+ */
+static int fail(const char *msg)	{
+    fprintf(stderr, "%s\n", msg);
+    ERR_print_errors_fp(stderr);
+    return 1;
+}
+
+/**
+ * Adds count keys of type key_type to the pool in pooldir
+ * \return exit code
+ */
+static int fill_pool(const char *pooldir, const char *key_type, long count) {
+    EVP_PKEY *key;
+    long i;
+
+    for (i=0; i<count; i++) {
+	if ( (key=psp_mint_keygen(key_type))==NULL )
+	    return fail("Generating key failed");
+	if (psp_mint_pool_add(pooldir, key))   {
+	    EVP_PKEY_free(key);
+	    return fail("Adding key to pool failed");
+	}
+	EVP_PKEY_free(key);
+    }
+    printf("Added %ld keys to %s\n", count, pooldir);
+
+    return 0;
+}
+
+
+/************************************************************************
+ * Main
+ ************************************************************************/
+
+int main(int argc, char *argv[])    {
+    const char *key_type=DEFAULT_KEY_TYPE, *pooldir=NULL, *input;
+    char *output=NULL, *end, uid_proxy[32];
+    psp_mint_issuer_t issuer;
+    EVP_PKEY *key=NULL;
+    X509 *proxy=NULL;
+    long count=-1, hours=DEFAULT_HOURS;
+    int opt, rc=1;
+
+    while ( (opt=getopt(argc, argv, "k:p:n:l:"))!=-1 )	{
+	switch (opt)	{
+	    case 'k':
+		key_type=optarg;
+		break;
+	    case 'p':
+		pooldir=optarg;
+		break;
+	    case 'n':
+		count=strtol(optarg, &end, 10);
+		if (optarg[0]=='\0' || *end!='\0' || count<0)	{
+		    usage(argv[0]);
+		    return 1;
+		}
+		break;
+	    case 'l':
+		hours=strtol(optarg, &end, 10);
+		if (optarg[0]=='\0' || *end!='\0' || hours<=0)	{
+		    usage(argv[0]);
+		    return 1;
+		}
+		break;
+	    default:
+		usage(argv[0]);
+		return 1;
+	}
+    }
+
+    /* Pool mode */
+    if (count>=0)   {
+	if (pooldir==NULL || optind!=argc)  {
+	    usage(argv[0]);
+	    return 1;
+	}
+	return fill_pool(pooldir, key_type, count);
+    }
+
+    if (optind>=argc || argc-optind>2)	{
+	usage(argv[0]);
+	return 1;
+    }
+
+    /* Input proxy, by default that of the current user */
+    if ( (input=getenv("X509_USER_PROXY"))==NULL )	{
+	snprintf(uid_proxy, sizeof(uid_proxy), "/tmp/x509up_u%lu",
+		 (unsigned long)getuid());
+	input=uid_proxy;
+    }
+    if (psp_mint_read_issuer(input, &issuer))	{
+	fprintf(stderr, "Reading %s failed\n", input);
+	ERR_print_errors_fp(stderr);
+	return 1;
+    }
+
+    /* Output filename */
+    if (argc-optind==2)
+	output=strdup(argv[optind+1]);
+    else if ( (output=malloc(strlen(input)+sizeof(PAYLOAD_SUFFIX))) )	{
+	strcpy(output, input);
+	strcat(output, PAYLOAD_SUFFIX);
+    }
+    if (output==NULL)	{
+	fprintf(stderr, "Out of memory\n");
+	goto end;
+    }
+
+    /* Key from the pool, when there is one left */
+    if (pooldir && psp_mint_pool_take(pooldir, &key)<0)	{
+	fail("Taking key from pool failed");
+	goto end;
+    }
+    if (key==NULL && (key=psp_mint_keygen(key_type))==NULL)    {
+	fail("Generating key failed");
+	goto end;
+    }
+
+    if (psp_mint_subproxy(&issuer, argv[optind], key, hours*3600L, &proxy))  {
+	fail("Creating proxy failed");
+	goto end;
+    }
+    if (psp_mint_write_proxy(output, proxy, key, issuer.chain))	{
+	fprintf(stderr, "Writing %s failed\n", output);
+	goto end;
+    }
+
+    printf("Proxy is left in %s\n", output);
+    rc=0;
+
+end:
+    X509_free(proxy);
+    EVP_PKEY_free(key);
+    psp_mint_issuer_free(&issuer);
+    free(output);
+
+    return rc;
+}
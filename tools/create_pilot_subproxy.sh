@@ -1,12 +1,45 @@
 #!/bin/sh
-BITS=rsa:1024
+DEFAULT_KEY_TYPE=rsa:1024
+KEY_TYPE=$DEFAULT_KEY_TYPE
 HASH=sha256
 
-if [ $# -lt 1 ];then
-    echo "Usage: $(basename $0) <CN value> [payload proxyfile]" >&2
+usage()	{
+    echo "Usage: $(basename $0) [-k keytype] <CN value> [payload proxyfile]" >&2
+    echo "  keytype: rsa:<bits> (default $DEFAULT_KEY_TYPE), ec[:<curve>] or ed25519" >&2
     exit 1
+}
+
+while getopts k: opt;do
+    case $opt in
+	k) KEY_TYPE=$OPTARG ;;
+	*) usage ;;
+    esac
+done
+shift `expr $OPTIND - 1`
+
+if [ $# -lt 1 ];then
+    usage
 fi
 
+# Key options for openssl req and the matching key usage
+case $KEY_TYPE in
+    rsa:*)
+	NEWKEY="-newkey $KEY_TYPE"
+	KEY_USAGE=digitalSignature,keyEncipherment ;;
+    ec)
+	NEWKEY="-newkey ec -pkeyopt ec_paramgen_curve:P-256"
+	KEY_USAGE=digitalSignature ;;
+    ec:*)
+	NEWKEY="-newkey ec -pkeyopt ec_paramgen_curve:${KEY_TYPE#ec:}"
+	KEY_USAGE=digitalSignature ;;
+    ed25519)
+	NEWKEY="-newkey ed25519"
+	KEY_USAGE=digitalSignature ;;
+    *)
+	echo "Unknown key type $KEY_TYPE" >&2
+	usage ;;
+esac
+
 # Input proxy
 X509_USER_PROXY=${X509_USER_PROXY:-/tmp/x509up_u$(id -u)}
 
@@ -49,7 +82,7 @@ cat > $OPENSSL_CONF << EOF
 extensions = rfc3820_proxy
 
 [ rfc3820_proxy ]
-keyUsage = critical,digitalSignature,keyEncipherment
+keyUsage = critical,$KEY_USAGE
 1.3.6.1.5.5.7.1.14 = critical,ASN1:SEQUENCE:rfc3820_seq_sect
 
 [ rfc3820_seq_sect ]
@@ -60,6 +93,12 @@ field2 = SEQUENCE:limited_policy
 p1 = OID:1.3.6.1.4.1.3536.1.1.1.9
 EOF
 
+# An Ed25519 input proxy signs without separate digest
+if openssl pkey -in $X509_USER_PROXY -noout -text 2>/dev/null |\
+	head -1 | grep -q ED25519;then
+    HASH=
+fi
+
 # Get subject from input proxy
 SUBJ=$(openssl x509 -in $X509_USER_PROXY -noout -subject -nameopt $NAMEOPTS|\
        sed '1d;s:^ *:/:'|tr -d '\n')
@@ -70,7 +109,7 @@ if [ -z "$SUBJ" ];then
 fi
 
 openssl req \
-    -new -nodes -newkey $BITS -subj "${SUBJ}${PROXY_CN}" \
+    -new -nodes $NEWKEY -subj "${SUBJ}${PROXY_CN}" \
     -keyout $PROXYKEY -out $PROXYREQ 2> $LOGFILE || {
 	echo "Creating request failed" >&2
 	cat $LOGFILE >&2
@@ -82,7 +121,7 @@ openssl req \
 openssl x509 \
     -req -CAkeyform pem -in $PROXYREQ -out $PROXYCERT \
     -CA $X509_USER_PROXY -CAkey $X509_USER_PROXY \
-    -set_serial $SERIAL -days 1 -$HASH \
+    -set_serial $SERIAL -days 1 ${HASH:+-$HASH} \
     -extfile $OPENSSL_CONF 2> $LOGFILE || {
 	echo "Signing request failed" >&2
 	cat $LOGFILE >&2